@@ -1,12 +1,78 @@
+#include <algorithm>
+#include <array>
+
 #include "common.h"
 
+namespace {
+
+// Byte and nibble sums over a whole word at once (SWAR), no loop per byte.
+inline unsigned int byte_sum(uint64_t d) {
+  d = (d & 0x00FF00FF00FF00FFULL) + ((d >> 8) & 0x00FF00FF00FF00FFULL);
+  return (d * 0x0001000100010001ULL) >> 48;
+}
+
+inline unsigned int nibble_sum(uint64_t d) {
+  return byte_sum((d & 0x0F0F0F0F0F0F0F0FULL) + ((d >> 4) & 0x0F0F0F0F0F0F0F0FULL));
+}
+
+// The checksums below work on the first 8 bytes of the frame as one word. CAN FD
+// frames pass their full length, so it is clamped here: shifting by 64 or more is undefined.
+inline int word_len(int l) {
+  return std::min(std::max(l, 0), 8);
+}
+
+// drops the bytes past the first l of a big endian word
+inline uint64_t remove_padding(uint64_t d, int l) {
+  return l == 0 ? 0 : d >> ((8 - l) * 8);
+}
+
+// CRC8 lookup tables, generated at compile time
+constexpr std::array<uint8_t, 256> gen_crc_lookup_table(uint8_t poly) {
+  std::array<uint8_t, 256> crc_lut = {};
+  for (int i = 0; i < 256; i++) {
+    uint8_t crc = i;
+    for (int j = 0; j < 8; j++) {
+      if ((crc & 0x80) != 0)
+        crc = (uint8_t)((crc << 1) ^ poly);
+      else
+        crc <<= 1;
+    }
+    crc_lut[i] = crc;
+  }
+  return crc_lut;
+}
+
+constexpr std::array<uint8_t, 256> crc8_lut_1d = gen_crc_lookup_table(0x1D);  // CRC-8 SAE J1850 for Chrysler
+constexpr std::array<uint8_t, 256> crc8_lut_2f = gen_crc_lookup_table(0x2F);  // CRC-8 8H2F/AUTOSAR for Volkswagen
+constexpr std::array<uint8_t, 256> crc8_lut_d5 = gen_crc_lookup_table(0xD5);  // standard CRC8 for the pedal
+
+// Volkswagen magic padding bytes, indexed by the message counter
+const uint8_t vw_magic_86[16] = {0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86};
+const uint8_t vw_magic_9f[16] = {0xF5,0xF5,0xF5,0xF5,0xF5,0xF5,0xF5,0xF5,0xF5,0xF5,0xF5,0xF5,0xF5,0xF5,0xF5,0xF5};
+const uint8_t vw_magic_ad[16] = {0x3F,0x69,0x39,0xDC,0x94,0xF9,0x14,0x64,0xD8,0x6A,0x34,0xCE,0xA2,0x55,0xB5,0x2C};
+const uint8_t vw_magic_fd[16] = {0xB4,0xEF,0xF8,0x49,0x1E,0xE5,0xC2,0xC0,0x97,0x19,0x3C,0xC9,0xF1,0x98,0xD6,0x61};
+const uint8_t vw_magic_106[16] = {0x07,0x07,0x07,0x07,0x07,0x07,0x07,0x07,0x07,0x07,0x07,0x07,0x07,0x07,0x07,0x07};
+const uint8_t vw_magic_117[16] = {0xAC,0xAC,0xAC,0xAC,0xAC,0xAC,0xAC,0xAC,0xAC,0xAC,0xAC,0xAC,0xAC,0xAC,0xAC,0xAC};
+const uint8_t vw_magic_120[16] = {0xC4,0xE2,0x4F,0xE4,0xF8,0x2F,0x56,0x81,0x9F,0xE5,0x83,0x44,0x05,0x3F,0x97,0xDF};
+const uint8_t vw_magic_121[16] = {0xE9,0x65,0xAE,0x6B,0x7B,0x35,0xE5,0x5F,0x4E,0xC7,0x86,0xA2,0xBB,0xDD,0xEB,0xB4};
+const uint8_t vw_magic_122[16] = {0x37,0x7D,0xF3,0xA9,0x18,0x46,0x6D,0x4D,0x3D,0x71,0x92,0x9C,0xE5,0x32,0x10,0xB9};
+const uint8_t vw_magic_126[16] = {0xDA,0xDA,0xDA,0xDA,0xDA,0xDA,0xDA,0xDA,0xDA,0xDA,0xDA,0xDA,0xDA,0xDA,0xDA,0xDA};
+const uint8_t vw_magic_12b[16] = {0x6A,0x38,0xB4,0x27,0x22,0xEF,0xE1,0xBB,0xF8,0x80,0x84,0x49,0xC7,0x9E,0x1E,0x2B};
+const uint8_t vw_magic_187[16] = {0x7F,0xED,0x17,0xC2,0x7C,0xEB,0x44,0x21,0x01,0xFA,0xDB,0x15,0x4A,0x6B,0x23,0x05};
+const uint8_t vw_magic_30c[16] = {0x0F,0x0F,0x0F,0x0F,0x0F,0x0F,0x0F,0x0F,0x0F,0x0F,0x0F,0x0F,0x0F,0x0F,0x0F,0x0F};
+const uint8_t vw_magic_30f[16] = {0x0C,0x0C,0x0C,0x0C,0x0C,0x0C,0x0C,0x0C,0x0C,0x0C,0x0C,0x0C,0x0C,0x0C,0x0C,0x0C};
+const uint8_t vw_magic_3c0[16] = {0xC3,0xC3,0xC3,0xC3,0xC3,0xC3,0xC3,0xC3,0xC3,0xC3,0xC3,0xC3,0xC3,0xC3,0xC3,0xC3};
+const uint8_t vw_magic_65d[16] = {0xAC,0xB3,0xAB,0xEB,0x7A,0xE1,0x3B,0xF7,0x73,0xBA,0x7C,0x9E,0x06,0x5F,0x02,0xD9};
+const uint8_t vw_magic_undefined[16] = {0};
+
+}
+
 unsigned int honda_checksum(unsigned int address, uint64_t d, int l) {
-  d >>= ((8-l)*8); // remove padding
-  d >>= 4; // remove checksum
+  l = word_len(l);
+  d = remove_padding(d, l);
 
-  int s = 0;
-  while (address) { s += (address & 0xF); address >>= 4; }
-  while (d) { s += (d & 0xF); d >>= 4; }
+  // sum all nibbles except the checksum
+  int s = nibble_sum(address) + nibble_sum(d) - (d & 0xF);
   s = 8-s;
   s &= 0xF;
 
@@ -14,178 +80,91 @@ unsigned int honda_checksum(unsigned int address, uint64_t d, int l) {
 }
 
 unsigned int toyota_checksum(unsigned int address, uint64_t d, int l) {
-  d >>= ((8-l)*8); // remove padding
-  d >>= 8; // remove checksum
+  l = word_len(l);
+  d = remove_padding(d, l);
 
-  unsigned int s = l;
-  while (address) { s += address & 0xFF; address >>= 8; }
-  while (d) { s += d & 0xFF; d >>= 8; }
+  // sum all bytes except the checksum
+  unsigned int s = l + byte_sum(address) + byte_sum(d) - (d & 0xFF);
 
   return s & 0xFF;
 }
 
 unsigned int subaru_checksum(unsigned int address, uint64_t d, int l) {
-  d >>= ((8-l)*8); // remove padding
+  l = word_len(l);
+  d = remove_padding(d, l);
 
-  unsigned int s = 0;
-  while (address) { s += address & 0xFF; address >>= 8; }
-  l -= 1; // checksum is first byte
-  while (l) { s += d & 0xFF; d >>= 8; l -= 1; }
+  // checksum is first byte
+  unsigned int s = byte_sum(address) + byte_sum(d) - (l > 0 ? ((d >> ((l-1)*8)) & 0xFF) : 0);
 
   return s & 0xFF;
 }
 
 unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l) {
   /* This function does not want the checksum byte in the input data.
-  jeep chrysler canbus checksum from http://illmatics.com/Remote%20Car%20Hacking.pdf */
+  jeep chrysler canbus checksum from http://illmatics.com/Remote%20Car%20Hacking.pdf
+  this is CRC-8 SAE J1850: poly 0x1D, init 0xFF, final xor 0xFF */
+  l = word_len(l);
   uint8_t checksum = 0xFF;
   for (int j = 0; j < (l - 1); j++) {
-    uint8_t shift = 0x80;
-    uint8_t curr = (d >> 8*j) & 0xFF;
-    for (int i=0; i<8; i++) {
-      uint8_t bit_sum = curr & shift;
-      uint8_t temp_chk = checksum & 0x80U;
-      if (bit_sum != 0U) {
-        bit_sum = 0x1C;
-        if (temp_chk != 0U) {
-          bit_sum = 1;
-        }
-        checksum = checksum << 1;
-        temp_chk = checksum | 1U;
-        bit_sum ^= temp_chk;
-      } else {
-        if (temp_chk != 0U) {
-          bit_sum = 0x1D;
-        }
-        checksum = checksum << 1;
-        bit_sum ^= checksum;
-      }
-      checksum = bit_sum;
-      shift = shift >> 1;
-    }
+    checksum = crc8_lut_1d[checksum ^ ((d >> 8*j) & 0xFF)];
   }
   return ~checksum & 0xFF;
 }
 
-// Static lookup table for fast computation of CRC8 poly 0x2F, aka 8H2F/AUTOSAR
-uint8_t crc8_lut_8h2f[256];
-
-void gen_crc_lookup_table(uint8_t poly, uint8_t crc_lut[]) {
-  uint8_t crc;
-  int i, j;
-
-   for (i = 0; i < 256; i++) {
-    crc = i;
-    for (j = 0; j < 8; j++) {
-      if ((crc & 0x80) != 0)
-        crc = (uint8_t)((crc << 1) ^ poly);
-      else
-        crc <<= 1;
-    }
-    crc_lut[i] = crc;
+const uint8_t* volkswagen_crc_magic(unsigned int address) {
+  // The magic final CRC padding byte permutes by CAN address, and additionally
+  // (for SOME addresses) by the message counter.
+  switch(address) {
+    case 0x86: return vw_magic_86;    // LWI_01 Steering Angle
+    case 0x9F: return vw_magic_9f;    // EPS_01 Electric Power Steering
+    case 0xAD: return vw_magic_ad;    // Getriebe_11 Automatic Gearbox
+    case 0xFD: return vw_magic_fd;    // ESP_21 Electronic Stability Program
+    case 0x106: return vw_magic_106;  // ESP_05 Electronic Stability Program
+    case 0x117: return vw_magic_117;  // ACC_10 Automatic Cruise Control
+    case 0x120: return vw_magic_120;  // TSK_06 Drivetrain Coordinator
+    case 0x121: return vw_magic_121;  // Motor_20 Driver Throttle Inputs
+    case 0x122: return vw_magic_122;  // ACC_06 Automatic Cruise Control
+    case 0x126: return vw_magic_126;  // HCA_01 Heading Control Assist
+    case 0x12B: return vw_magic_12b;  // GRA_ACC_01 Steering wheel controls for ACC
+    case 0x187: return vw_magic_187;  // EV_Gearshift "Gear" selection data for EVs with no gearbox
+    case 0x30C: return vw_magic_30c;  // ACC_02 Automatic Cruise Control
+    case 0x30F: return vw_magic_30f;  // SWA_01 Lane Change Assist (SpurWechselAssistent)
+    case 0x3C0: return vw_magic_3c0;  // Klemmen_Status_01 ignition and starting status
+    case 0x65D: return vw_magic_65d;  // ESP_20 Electronic Stability Program
+    default:    // As-yet undefined CAN message, CRC check expected to fail
+      printf("Attempt to CRC check undefined Volkswagen message 0x%02X\n", address);
+      return vw_magic_undefined;
   }
 }
 
-void init_crc_lookup_tables() {
-  // At init time, set up static lookup tables for fast CRC computation.
-
-  gen_crc_lookup_table(0x2F, crc8_lut_8h2f);    // CRC-8 8H2F/AUTOSAR for Volkswagen
-}
-
-unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l) {
+unsigned int volkswagen_crc(const uint8_t *magic, uint64_t d, int l) {
   // Volkswagen uses standard CRC8 8H2F/AUTOSAR, but they compute it with
   // a magic variable padding byte tacked onto the end of the payload.
   // https://www.autosar.org/fileadmin/user_upload/standards/classic/4-3/AUTOSAR_SWS_CRCLibrary.pdf
 
+  l = word_len(l);
   uint8_t crc = 0xFF; // Standard init value for CRC8 8H2F/AUTOSAR
 
   // CRC the payload first, skipping over the first byte where the CRC lives.
   for (int i = 1; i < l; i++) {
-    crc ^= (d >> (i*8)) & 0xFF;
-    crc = crc8_lut_8h2f[crc];
+    crc = crc8_lut_2f[crc ^ ((d >> (i*8)) & 0xFF)];
   }
 
-  // Look up and apply the magic final CRC padding byte, which permutes by CAN
-  // address, and additionally (for SOME addresses) by the message counter.
   uint8_t counter = ((d >> 8) & 0xFF) & 0x0F;
-  switch(address) {
-    case 0x86:  // LWI_01 Steering Angle
-      crc ^= (uint8_t[]){0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86,0x86}[counter];
-      break;
-    case 0x9F:  // EPS_01 Electric Power Steering
-      crc ^= (uint8_t[]){0xF5,0xF5,0xF5,0xF5,0xF5,0xF5,0xF5,0xF5,0xF5,0xF5,0xF5,0xF5,0xF5,0xF5,0xF5,0xF5}[counter];
-      break;
-    case 0xAD:  // Getriebe_11 Automatic Gearbox
-      crc ^= (uint8_t[]){0x3F,0x69,0x39,0xDC,0x94,0xF9,0x14,0x64,0xD8,0x6A,0x34,0xCE,0xA2,0x55,0xB5,0x2C}[counter];
-      break;
-    case 0xFD:  // ESP_21 Electronic Stability Program
-      crc ^= (uint8_t[]){0xB4,0xEF,0xF8,0x49,0x1E,0xE5,0xC2,0xC0,0x97,0x19,0x3C,0xC9,0xF1,0x98,0xD6,0x61}[counter];
-      break;
-    case 0x106: // ESP_05 Electronic Stability Program
-      crc ^= (uint8_t[]){0x07,0x07,0x07,0x07,0x07,0x07,0x07,0x07,0x07,0x07,0x07,0x07,0x07,0x07,0x07,0x07}[counter];
-      break;
-    case 0x117: // ACC_10 Automatic Cruise Control
-      crc ^= (uint8_t[]){0xAC,0xAC,0xAC,0xAC,0xAC,0xAC,0xAC,0xAC,0xAC,0xAC,0xAC,0xAC,0xAC,0xAC,0xAC,0xAC}[counter];
-      break;
-    case 0x120: // TSK_06 Drivetrain Coordinator
-      crc ^= (uint8_t[]){0xC4,0xE2,0x4F,0xE4,0xF8,0x2F,0x56,0x81,0x9F,0xE5,0x83,0x44,0x05,0x3F,0x97,0xDF}[counter];
-      break;
-    case 0x121: // Motor_20 Driver Throttle Inputs
-      crc ^= (uint8_t[]){0xE9,0x65,0xAE,0x6B,0x7B,0x35,0xE5,0x5F,0x4E,0xC7,0x86,0xA2,0xBB,0xDD,0xEB,0xB4}[counter];
-      break;
-    case 0x122: // ACC_06 Automatic Cruise Control
-      crc ^= (uint8_t[]){0x37,0x7D,0xF3,0xA9,0x18,0x46,0x6D,0x4D,0x3D,0x71,0x92,0x9C,0xE5,0x32,0x10,0xB9}[counter];
-      break;
-    case 0x126: // HCA_01 Heading Control Assist
-      crc ^= (uint8_t[]){0xDA,0xDA,0xDA,0xDA,0xDA,0xDA,0xDA,0xDA,0xDA,0xDA,0xDA,0xDA,0xDA,0xDA,0xDA,0xDA}[counter];
-      break;
-    case 0x12B: // GRA_ACC_01 Steering wheel controls for ACC
-      crc ^= (uint8_t[]){0x6A,0x38,0xB4,0x27,0x22,0xEF,0xE1,0xBB,0xF8,0x80,0x84,0x49,0xC7,0x9E,0x1E,0x2B}[counter];
-      break;
-    case 0x187: // EV_Gearshift "Gear" selection data for EVs with no gearbox
-      crc ^= (uint8_t[]){0x7F,0xED,0x17,0xC2,0x7C,0xEB,0x44,0x21,0x01,0xFA,0xDB,0x15,0x4A,0x6B,0x23,0x05}[counter];
-      break;
-    case 0x30C: // ACC_02 Automatic Cruise Control
-      crc ^= (uint8_t[]){0x0F,0x0F,0x0F,0x0F,0x0F,0x0F,0x0F,0x0F,0x0F,0x0F,0x0F,0x0F,0x0F,0x0F,0x0F,0x0F}[counter];
-      break;
-    case 0x30F: // SWA_01 Lane Change Assist (SpurWechselAssistent)
-      crc ^= (uint8_t[]){0x0C,0x0C,0x0C,0x0C,0x0C,0x0C,0x0C,0x0C,0x0C,0x0C,0x0C,0x0C,0x0C,0x0C,0x0C,0x0C}[counter];
-      break;
-    case 0x3C0: // Klemmen_Status_01 ignition and starting status
-      crc ^= (uint8_t[]){0xC3,0xC3,0xC3,0xC3,0xC3,0xC3,0xC3,0xC3,0xC3,0xC3,0xC3,0xC3,0xC3,0xC3,0xC3,0xC3}[counter];
-      break;
-    case 0x65D: // ESP_20 Electronic Stability Program
-      crc ^= (uint8_t[]){0xAC,0xB3,0xAB,0xEB,0x7A,0xE1,0x3B,0xF7,0x73,0xBA,0x7C,0x9E,0x06,0x5F,0x02,0xD9}[counter];
-      break;
-    default:    // As-yet undefined CAN message, CRC check expected to fail
-      printf("Attempt to CRC check undefined Volkswagen message 0x%02X\n", address);
-      crc ^= (uint8_t[]){0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00}[counter];
-      break;
-  }
-  crc = crc8_lut_8h2f[crc];
+  crc = crc8_lut_2f[crc ^ magic[counter]];
 
   return crc ^ 0xFF; // Return after standard final XOR for CRC8 8H2F/AUTOSAR
 }
 
-
 unsigned int pedal_checksum(uint64_t d, int l) {
   uint8_t crc = 0xFF;
-  uint8_t poly = 0xD5; // standard crc8
 
-  d >>= ((8-l)*8); // remove padding
+  l = word_len(l);
+  d = remove_padding(d, l);
   d >>= 8; // remove checksum
 
-  int i, j;
-  for (i = 0; i < l - 1; i++) {
-    crc ^= (d >> (i*8)) & 0xFF;
-    for (j = 0; j < 8; j++) {
-      if ((crc & 0x80) != 0) {
-        crc = (uint8_t)((crc << 1) ^ poly);
-      }
-      else {
-        crc <<= 1;
-      }
-    }
+  for (int i = 0; i < l - 1; i++) {
+    crc = crc8_lut_d5[crc ^ ((d >> (i*8)) & 0xFF)];
   }
   return crc;
 }
@@ -212,3 +191,44 @@ uint64_t read_u64_le(const uint8_t* v) {
           | ((uint64_t)v[6] << 48)
           | ((uint64_t)v[7] << 56));
 }
+
+// Signal extraction for frames of any length (CAN FD payloads are up to 64 bytes).
+// Bit positions are relative to the start of the frame: b1 is the LSB for little
+// endian signals, and the MSB in big endian bit order for big endian signals.
+// Classic frames use the faster single word path in MessageState::parse.
+
+int64_t get_raw_value(const uint8_t* dat, const Signal& sig) {
+  int first_byte = sig.b1 / 8;
+  int last_byte = (sig.b1 + sig.b2 - 1) / 8;
+
+  // a 64 bit signal that isn't byte aligned spans 9 bytes
+  unsigned __int128 ret = 0;
+  if (sig.is_little_endian) {
+    for (int i = last_byte; i >= first_byte; i--) {
+      ret = (ret << 8) | dat[i];
+    }
+    ret >>= sig.b1 % 8;
+  } else {
+    for (int i = first_byte; i <= last_byte; i++) {
+      ret = (ret << 8) | dat[i];
+    }
+    ret >>= 7 - ((sig.b1 + sig.b2 - 1) % 8);
+  }
+  return (uint64_t)ret & signal_mask(sig.b2);
+}
+
+void set_raw_value(uint8_t* dat, const Signal& sig, int64_t ival) {
+  int first_byte = sig.b1 / 8;
+  int last_byte = (sig.b1 + sig.b2 - 1) / 8;
+  int shift = sig.is_little_endian ? sig.b1 % 8 : 7 - ((sig.b1 + sig.b2 - 1) % 8);
+
+  unsigned __int128 mask = (unsigned __int128)signal_mask(sig.b2) << shift;
+  unsigned __int128 val = (unsigned __int128)((uint64_t)ival & signal_mask(sig.b2)) << shift;
+
+  for (int i = first_byte; i <= last_byte; i++) {
+    // little endian starts at the least significant byte, big endian ends there
+    int k = sig.is_little_endian ? i - first_byte : last_byte - i;
+    uint8_t byte_mask = (uint8_t)(mask >> (8 * k));
+    dat[i] = (dat[i] & ~byte_mask) | ((uint8_t)(val >> (8 * k)) & byte_mask);
+  }
+}
@@ -2,6 +2,7 @@
 
 #include <vector>
 #include <map>
+#include <queue>
 #include <unordered_map>
 
 #include "common_dbc.h"
@@ -9,17 +10,25 @@
 #include "cereal/gen/cpp/log.capnp.h"
 
 #define MAX_BAD_COUNTER 5
+#define ARRIVAL_RING_SIZE 16
 
 // Helper functions
 unsigned int honda_checksum(unsigned int address, uint64_t d, int l);
 unsigned int toyota_checksum(unsigned int address, uint64_t d, int l);
 unsigned int subaru_checksum(unsigned int address, uint64_t d, int l);
 unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l);
-void init_crc_lookup_tables();
-unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l);
+const uint8_t* volkswagen_crc_magic(unsigned int address);
+unsigned int volkswagen_crc(const uint8_t *magic, uint64_t d, int l);
 unsigned int pedal_checksum(uint64_t d, int l);
 uint64_t read_u64_be(const uint8_t* v);
 uint64_t read_u64_le(const uint8_t* v);
+int64_t get_raw_value(const uint8_t* dat, const Signal& sig);
+void set_raw_value(uint8_t* dat, const Signal& sig, int64_t ival);
+
+// 1ULL << 64 is undefined, signals can be a full 64 bits wide
+inline uint64_t signal_mask(int size) {
+  return size >= 64 ? ~0ULL : (1ULL << size) - 1;
+}
 
 class MessageState {
 public:
@@ -36,8 +45,29 @@ public:
   uint8_t counter;
   uint8_t counter_fail;
 
+  // Volkswagen CRC padding bytes for this address, resolved once at init
+  const uint8_t *crc_magic = NULL;
+
+  // health statistics, see CANParser::query_health. Times are in ns.
+  uint64_t frames = 0;
+  uint64_t checksum_fails = 0;
+  uint64_t counter_fails = 0;
+  uint64_t timeouts = 0;
+  bool timed_out = false;
+  uint64_t last_arrival = 0;
+  double interval_mean = 0;
+  double interval_jitter = 0;
+
+  // recent arrival times for the measured rate
+  uint64_t arrivals[ARRIVAL_RING_SIZE] = {};
+  uint64_t arrival_count = 0;
+
+  // last time a tracked signal changed value, to spot stuck senders
+  uint64_t last_change = 0;
+
   bool parse(uint64_t sec, uint16_t ts_, uint8_t * dat);
   bool update_counter_generic(int64_t v, int cnt_size);
+  double measured_rate() const;
 };
 
 class CANParser {
@@ -47,6 +77,12 @@ private:
   const DBC *dbc = NULL;
   std::unordered_map<uint32_t, MessageState> message_states;
 
+  // checked messages by the time they go invalid, see UpdateValid
+  std::priority_queue<std::pair<uint64_t, MessageState*>,
+                      std::vector<std::pair<uint64_t, MessageState*>>,
+                      std::greater<std::pair<uint64_t, MessageState*>>> deadlines;
+  int expired = 0;
+
 public:
   bool can_valid = false;
   uint64_t last_sec = 0;
@@ -58,15 +94,32 @@ public:
   void UpdateValid(uint64_t sec);
   void update_string(std::string data, bool sendcan);
   std::vector<SignalValue> query_latest();
+  std::vector<MessageHealth> query_health();
 };
 
 class CANPacker {
 private:
   const DBC *dbc = NULL;
   std::map<std::pair<uint32_t, std::string>, Signal> signal_lookup;
+  std::map<std::pair<uint32_t, std::string>, int> handle_lookup;
   std::map<uint32_t, Msg> message_lookup;
+  std::vector<Signal> signals;
+  // Volkswagen CRC padding bytes, resolved the first time an address is packed
+  std::map<uint32_t, const uint8_t*> crc_magic_lookup;
+
+  // reused across pack_sendcan calls so a control cycle doesn't allocate
+  kj::Array<capnp::word> sendcan_segment;
+  std::string sendcan_buf;
+  std::vector<const Msg*> sendcan_lookup;  // DBC message of each one packed, NULL if undefined
+
+  uint64_t finish_pack(uint32_t address, uint64_t ret, int counter);
+  void pack_fd(uint32_t address, const std::vector<SignalPackHandle> &signals, int counter, uint8_t *dat, size_t size);
 
 public:
   CANPacker(const std::string& dbc_name);
+  int lookup_signal(uint32_t address, const std::string& name);
   uint64_t pack(uint32_t address, const std::vector<SignalPackValue> &signals, int counter);
+  uint64_t pack(uint32_t address, const std::vector<SignalPackHandle> &signals, int counter);
+  std::vector<uint8_t> pack_bytes(uint32_t address, const std::vector<SignalPackValue> &signals, int counter);
+  const std::string& pack_sendcan(const std::vector<CanPackMessage> &msgs, bool valid);
 };
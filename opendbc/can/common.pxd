@@ -1,7 +1,7 @@
 # distutils: language = c++
 #cython: language_level=3
 
-from libc.stdint cimport uint32_t, uint64_t, uint16_t
+from libc.stdint cimport uint8_t, uint32_t, uint64_t, uint16_t
 from libcpp.vector cimport vector
 from libcpp.map cimport map
 from libcpp.string cimport string
@@ -65,10 +65,31 @@ cdef extern from "common_dbc.h":
     const char* name
     double value
 
+  cdef struct MessageHealth:
+    uint32_t address
+    uint64_t frames
+    uint64_t checksum_fails
+    uint64_t counter_fails
+    uint64_t timeouts
+    double interval_mean_ms
+    double interval_jitter_ms
+    double rate_hz
+    double unchanged_ms
+
   cdef struct SignalPackValue:
     const char * name
     double value
 
+  cdef struct SignalPackHandle:
+    int handle
+    double value
+
+  cdef struct CanPackMessage:
+    uint32_t address
+    int bus
+    int counter
+    vector[SignalPackHandle] signals
+
 
 cdef extern from "common.h":
   cdef const DBC* dbc_lookup(const string);
@@ -78,7 +99,11 @@ cdef extern from "common.h":
     CANParser(int, string, vector[MessageParseOptions], vector[SignalParseOptions])
     void update_string(string, bool)
     vector[SignalValue] query_latest()
+    vector[MessageHealth] query_health()
 
   cdef cppclass CANPacker:
    CANPacker(string)
    uint64_t pack(uint32_t, vector[SignalPackValue], int counter)
+   vector[uint8_t] pack_bytes(uint32_t, vector[SignalPackValue], int counter)
+   int lookup_signal(uint32_t, string)
+   string pack_sendcan(vector[CanPackMessage], bool)
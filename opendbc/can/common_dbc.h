@@ -3,14 +3,30 @@
 #include <cstddef>
 #include <cstdint>
 #include <string>
+#include <vector>
 
 #define ARRAYSIZE(x) (sizeof(x)/sizeof(x[0]))
 
+// largest CAN FD payload, classic frames stop at 8 bytes. boardd uses it too
+#define CANFD_MAX_DLEN 64
+
 struct SignalPackValue {
   const char* name;
   double value;
 };
 
+struct SignalPackHandle {
+  int handle;
+  double value;
+};
+
+struct CanPackMessage {
+  uint32_t address;
+  int bus;
+  int counter;
+  std::vector<SignalPackHandle> signals;
+};
+
 struct SignalParseOptions {
   uint32_t address;
   const char* name;
@@ -29,6 +45,18 @@ struct SignalValue {
   double value;
 };
 
+struct MessageHealth {
+  uint32_t address;
+  uint64_t frames;
+  uint64_t checksum_fails;
+  uint64_t counter_fails;
+  uint64_t timeouts;
+  double interval_mean_ms;
+  double interval_jitter_ms;  // smoothed deviation from the mean interval
+  double rate_hz;             // over the last ARRIVAL_RING_SIZE frames
+  double unchanged_ms;        // how long the signal values have stayed the same while frames kept arriving
+};
+
 enum SignalType {
   DEFAULT,
   HONDA_CHECKSUM,
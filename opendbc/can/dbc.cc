@@ -1,27 +1,656 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "common_dbc.h"
 
+// DBCs are parsed from the .dbc text at runtime the first time a process asks
+// for them. The parsed form is written to a binary cache holding the DBC, Msg,
+// Signal and Val structs in their in-memory layout, with every pointer stored as
+// an offset into the file. Later loads mmap the cache and relocate those pointers
+// in place, so the structs are used straight from the mapping.
+//
+// The cache is looked up by the size and mtime of the .dbc, so a hit is a stat
+// and an mmap. Only a miss reads and hashes the text, to find a cache built from
+// the same contents (e.g. after a checkout touched every mtime) before parsing.
+
+#define DBC_CACHE_MAGIC 0x43434244 // "DBCC"
+#define DBC_CACHE_VERSION 2
+#define DEFAULT_DBC_CACHE_PATH "/tmp/opendbc_cache"
+
 namespace {
 
-std::vector<const DBC*>& get_dbcs() {
-  static std::vector<const DBC*> vec;
-  return vec;
+// followed by the DBC, its Msg, Signal and Val tables and the string table
+struct CacheHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t source_size;
+  uint64_t source_hash;
+  uint16_t ptr_size, msg_size, sig_size, val_size;  // the structs are stored in the layout of the build that wrote them
+  uint32_t num_msgs;
+  uint32_t num_sigs;
+  uint32_t num_vals;
+  uint32_t strtab_size;
+};
+static_assert(sizeof(CacheHeader) % alignof(Signal) == 0, "tables after the header must stay aligned");
+
+struct CacheLayout {
+  size_t msgs, sigs, vals, strtab, end;
+
+  CacheLayout(uint32_t num_msgs, uint32_t num_sigs, uint32_t num_vals, uint32_t strtab_size) {
+    msgs = sizeof(CacheHeader) + sizeof(DBC);
+    sigs = msgs + num_msgs * sizeof(Msg);
+    vals = sigs + num_sigs * sizeof(Signal);
+    strtab = vals + num_vals * sizeof(Val);
+    end = strtab + strtab_size;
+  }
+};
+
+template <class T>
+T* file_ptr(size_t offset) {
+  return (T*)(uintptr_t)offset;
 }
 
+uint64_t fnv1a_hash(const char *data, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (uint8_t)data[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
 }
 
-const DBC* dbc_lookup(const std::string& dbc_name) {
-  for (const auto& dbci : get_dbcs()) {
-    if (dbc_name == dbci->name) {
-      return dbci;
+bool read_file(const std::string &path, std::string &out) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f) return false;
+  char buf[16384];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    out.append(buf, n);
+  }
+  fclose(f);
+  return true;
+}
+
+std::string dbc_dir() {
+  const char *env = getenv("DBC_PATH");
+  if (env) return env;
+
+  // libdbc lives in opendbc/can, the .dbc files one directory up
+  Dl_info info;
+  if (dladdr((void*)&dbc_dir, &info) && info.dli_fname) {
+    std::string lib_path = info.dli_fname;
+    size_t slash = lib_path.rfind('/');
+    std::string lib_dir = slash == std::string::npos ? "." : lib_path.substr(0, slash);
+    return lib_dir + "/..";
+  }
+  return "..";
+}
+
+std::string cache_dir() {
+  const char *env = getenv("DBC_CACHE_PATH");
+  return env ? env : DEFAULT_DBC_CACHE_PATH;
+}
+
+// ***** text parser *****
+
+struct ParsedSignal {
+  std::string name;
+  int start_bit, size;
+  bool is_little_endian, is_signed;
+  double factor, offset;
+};
+
+struct ParsedMsg {
+  std::string name;
+  uint32_t size;
+  std::vector<ParsedSignal> sigs;
+};
+
+const char* skip_space(const char *p) {
+  while (*p == ' ' || *p == '\t') p++;
+  return p;
+}
+
+const char* read_word(const char *p, std::string &out) {
+  p = skip_space(p);
+  const char *start = p;
+  while (*p && *p != ' ' && *p != '\t' && *p != ':') p++;
+  out.assign(start, p - start);
+  return p;
+}
+
+// SG_ name [mux] : start|size@endian(+|-) (factor,offset) [min|max] "unit" receivers
+bool parse_signal(const char *p, ParsedSignal &sig) {
+  p = read_word(p + 3, sig.name);
+  p = strchr(p, ':');
+  if (!p || sig.name.empty()) return false;
+
+  char endian, sign;
+  if (sscanf(p + 1, " %d|%d@%c%c (%lf,%lf)", &sig.start_bit, &sig.size, &endian, &sign, &sig.factor, &sig.offset) != 6) {
+    return false;
+  }
+  sig.is_little_endian = endian == '1';
+  sig.is_signed = sign == '-';
+  return true;
+}
+
+// VAL_ address name 1 "on" 0 "off" ;
+bool parse_val(const char *p, uint32_t &address, std::string &name, std::string &def_val) {
+  char *end;
+  address = strtoul(p + 4, &end, 0);
+  if (end == p + 4) return false;
+  p = read_word(end, name);
+  if (name.empty()) return false;
+
+  // value/description pairs, descriptions converted to UPPER_CASE_WITH_UNDERSCORES
+  if (*p == ' ') p++;
+  def_val.clear();
+  while (true) {
+    const char *next = skip_space(p);
+    if (*next == ';' || *next == '\0') break;
+
+    const char *quote = strchr(p, '"');
+    if (!quote) return false;
+    const char *close = strchr(quote + 1, '"');
+    if (!close) return false;
+
+    def_val.append(p, quote - p);
+
+    std::string desc(quote + 1, close - quote - 1);
+    size_t b = desc.find_first_not_of(" \t");
+    size_t e = desc.find_last_not_of(" \t");
+    desc = b == std::string::npos ? "" : desc.substr(b, e - b + 1);
+    for (auto &c : desc) {
+      c = (c == ' ') ? '_' : toupper(c);
     }
+    def_val += desc;
+    p = close + 1;
+  }
+  return !def_val.empty();
+}
+
+SignalType signal_type(const std::string &dbc_name, uint32_t address, const std::string &sig_name) {
+  auto starts_with = [&](std::initializer_list<const char*> prefixes) {
+    for (auto prefix : prefixes) {
+      if (dbc_name.compare(0, strlen(prefix), prefix) == 0) return true;
+    }
+    return false;
+  };
+
+  if (starts_with({"honda_", "acura_"})) {
+    if (sig_name == "CHECKSUM") return SignalType::HONDA_CHECKSUM;
+    if (sig_name == "COUNTER") return SignalType::HONDA_COUNTER;
+  } else if (starts_with({"toyota_", "lexus_"})) {
+    if (sig_name == "CHECKSUM") return SignalType::TOYOTA_CHECKSUM;
+  } else if (starts_with({"vw_", "volkswagen_", "audi_", "seat_", "skoda_"})) {
+    if (sig_name == "CHECKSUM") return SignalType::VOLKSWAGEN_CHECKSUM;
+    if (sig_name == "COUNTER") return SignalType::VOLKSWAGEN_COUNTER;
+  } else if (starts_with({"subaru_global_"})) {
+    if (sig_name == "CHECKSUM") return SignalType::SUBARU_CHECKSUM;
+  } else if (starts_with({"chrysler_"})) {
+    if (sig_name == "CHECKSUM") return SignalType::CHRYSLER_CHECKSUM;
+  }
+
+  if (address == 512 || address == 513) {
+    if (sig_name == "CHECKSUM_PEDAL") return SignalType::PEDAL_CHECKSUM;
+    if (sig_name == "COUNTER_PEDAL") return SignalType::PEDAL_COUNTER;
+  }
+  return SignalType::DEFAULT;
+}
+
+// the packer and parser compute COUNTER and CHECKSUM themselves, so those have
+// to be where the checksum code for the car expects them
+bool check_msgs(const std::string &dbc_name, const std::map<uint32_t, ParsedMsg> &msgs) {
+  struct Rules {
+    int checksum_size, counter_size;  // -1 when not checked
+    int checksum_start_bit, counter_start_bit;
+    bool little_endian;
+  };
+  Rules rules;
+  bool has_rules = true;
+  switch (signal_type(dbc_name, 0, "CHECKSUM")) {
+    case SignalType::HONDA_CHECKSUM: rules = {4, 2, 3, 5, false}; break;
+    case SignalType::TOYOTA_CHECKSUM: rules = {8, -1, 7, -1, false}; break;
+    case SignalType::VOLKSWAGEN_CHECKSUM: rules = {8, 4, 0, 0, true}; break;
+    case SignalType::SUBARU_CHECKSUM: rules = {8, -1, 0, -1, true}; break;
+    case SignalType::CHRYSLER_CHECKSUM: rules = {8, -1, 7, -1, false}; break;
+    default: has_rules = false; break;
+  }
+
+  std::set<std::string> msg_names;
+  for (const auto &kv : msgs) {
+    const ParsedMsg &msg = kv.second;
+    if (msg.sigs.empty()) continue;
+    const char *name = msg.name.c_str();
+
+    if (!msg_names.insert(msg.name).second) {
+      fprintf(stderr, "%s: Duplicate message name in DBC file %s\n", dbc_name.c_str(), name);
+      return false;
+    }
+
+    for (const auto &sig : msg.sigs) {
+      if (has_rules && sig.name == "CHECKSUM") {
+        if (sig.size != rules.checksum_size) {
+          fprintf(stderr, "%s %s: CHECKSUM is not %d bits long\n", dbc_name.c_str(), name, rules.checksum_size);
+          return false;
+        }
+        if (sig.start_bit % 8 != rules.checksum_start_bit) {
+          fprintf(stderr, "%s %s: CHECKSUM starts at wrong bit\n", dbc_name.c_str(), name);
+          return false;
+        }
+        if (sig.is_little_endian != rules.little_endian) {
+          fprintf(stderr, "%s %s: CHECKSUM has wrong endianness\n", dbc_name.c_str(), name);
+          return false;
+        }
+      }
+      if (has_rules && sig.name == "COUNTER") {
+        if (rules.counter_size != -1 && sig.size != rules.counter_size) {
+          fprintf(stderr, "%s %s: COUNTER is not %d bits long\n", dbc_name.c_str(), name, rules.counter_size);
+          return false;
+        }
+        if (rules.counter_start_bit != -1 && sig.start_bit % 8 != rules.counter_start_bit) {
+          fprintf(stderr, "%s %s: COUNTER starts at wrong bit\n", dbc_name.c_str(), name);
+          return false;
+        }
+        if (sig.is_little_endian != rules.little_endian) {
+          fprintf(stderr, "%s %s: COUNTER has wrong endianness\n", dbc_name.c_str(), name);
+          return false;
+        }
+      }
+
+      if (kv.first == 0x200 || kv.first == 0x201) {
+        if (sig.name == "COUNTER_PEDAL" && sig.size != 4) {
+          fprintf(stderr, "%s %s: PEDAL COUNTER is not 4 bits long\n", dbc_name.c_str(), name);
+          return false;
+        }
+        if (sig.name == "CHECKSUM_PEDAL" && sig.size != 8) {
+          fprintf(stderr, "%s %s: PEDAL CHECKSUM is not 8 bits long\n", dbc_name.c_str(), name);
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+// parses the .dbc text and lays it out in the binary cache format
+bool build_cache(const std::string &dbc_name, const std::string &txt, uint64_t hash, std::string &out) {
+  std::map<uint32_t, ParsedMsg> msgs;
+  std::map<uint32_t, std::set<std::pair<std::string, std::string>>> def_vals;
+
+  ParsedMsg *cur_msg = NULL;
+  size_t pos = 0;
+  while (pos < txt.size()) {
+    size_t eol = txt.find('\n', pos);
+    if (eol == std::string::npos) eol = txt.size();
+    std::string line = txt.substr(pos, eol - pos);
+    pos = eol + 1;
+
+    size_t b = line.find_first_not_of(" \t\r");
+    if (b == std::string::npos) continue;
+    line.erase(0, b);
+    line.erase(line.find_last_not_of(" \t\r") + 1);
+    const char *l = line.c_str();
+
+    if (strncmp(l, "BO_ ", 4) == 0) {
+      char *end;
+      uint32_t address = strtoul(l + 4, &end, 0);
+      ParsedMsg msg;
+      const char *p = read_word(end, msg.name);
+      p = strchr(p, ':');
+      if (!p || msg.name.empty()) {
+        fprintf(stderr, "bad BO %s\n", l);
+        return false;
+      }
+      msg.size = strtoul(p + 1, NULL, 10);
+      if (msgs.find(address) != msgs.end()) {
+        fprintf(stderr, "Duplicate address detected %d %s\n", address, dbc_name.c_str());
+        return false;
+      }
+      cur_msg = &(msgs[address] = msg);
+    } else if (strncmp(l, "SG_ ", 4) == 0) {
+      ParsedSignal sig;
+      if (!cur_msg || !parse_signal(l, sig)) {
+        fprintf(stderr, "bad SG %s\n", l);
+        return false;
+      }
+      cur_msg->sigs.push_back(sig);
+    } else if (strncmp(l, "VAL_ ", 5) == 0) {
+      uint32_t address;
+      std::string name, def_val;
+      if (!parse_val(l, address, name, def_val)) {
+        fprintf(stderr, "bad VAL %s\n", l);
+        return false;
+      }
+      def_vals[address].insert(std::make_pair(name, def_val));
+    }
+  }
+
+  if (!check_msgs(dbc_name, msgs)) {
+    return false;
+  }
+
+  // the counts fix where each table starts, so pointers are written as file offsets directly
+  uint32_t num_msgs = 0, num_sigs = 0, num_vals = 0;
+  for (const auto &kv : msgs) {
+    if (kv.second.sigs.empty()) continue;
+    num_msgs++;
+    num_sigs += kv.second.sigs.size();
+  }
+  for (const auto &kv : def_vals) {
+    num_vals += kv.second.size();
+  }
+  const CacheLayout layout(num_msgs, num_sigs, num_vals, 0);
+
+  std::string strtab;
+  auto add_string = [&](const std::string &s) {
+    const char *p = file_ptr<const char>(layout.strtab + strtab.size());
+    strtab.append(s.c_str(), s.size() + 1);
+    return p;
+  };
+
+  // zero filled, so the struct padding written to the file is deterministic
+  out.assign(layout.strtab, '\0');
+  DBC *cdbc = (DBC*)&out[sizeof(CacheHeader)];
+  Msg *cmsgs = (Msg*)&out[layout.msgs];
+  Signal *csigs = (Signal*)&out[layout.sigs];
+  Val *cvals = (Val*)&out[layout.vals];
+
+  cdbc->name = add_string(dbc_name);
+  cdbc->num_msgs = num_msgs;
+  cdbc->msgs = file_ptr<const Msg>(layout.msgs);
+  cdbc->vals = file_ptr<const Val>(layout.vals);
+  cdbc->num_vals = num_vals;
+
+  std::map<uint32_t, const Signal*> msg_sigs;
+  size_t mi = 0, si = 0, vi = 0;
+  for (auto &kv : msgs) {
+    ParsedMsg &msg = kv.second;
+    if (msg.sigs.empty()) continue;
+
+    // counter and checksum first, then by start bit
+    std::stable_sort(msg.sigs.begin(), msg.sigs.end(), [](const ParsedSignal &a, const ParsedSignal &b) {
+      return a.start_bit < b.start_bit;
+    });
+    std::stable_sort(msg.sigs.begin(), msg.sigs.end(), [](const ParsedSignal &a, const ParsedSignal &b) {
+      bool a_special = a.name == "COUNTER" || a.name == "CHECKSUM";
+      bool b_special = b.name == "COUNTER" || b.name == "CHECKSUM";
+      return a_special && !b_special;
+    });
+
+    Msg &cm = cmsgs[mi++];
+    cm.name = add_string(msg.name);
+    cm.address = kv.first;
+    cm.size = msg.size;
+    cm.num_sigs = msg.sigs.size();
+    cm.sigs = msg_sigs[kv.first] = file_ptr<const Signal>(layout.sigs + si * sizeof(Signal));
+
+    for (const auto &sig : msg.sigs) {
+      int b1 = sig.is_little_endian ? sig.start_bit : (sig.start_bit / 8) * 8 + (((-sig.start_bit - 1) % 8) + 8) % 8;
+      Signal &cs = csigs[si++];
+      cs.name = add_string(sig.name);
+      cs.b1 = b1;
+      cs.b2 = sig.size;
+      cs.bo = 64 - (b1 + sig.size);
+      cs.is_signed = sig.is_signed;
+      cs.factor = sig.factor;
+      cs.offset = sig.offset;
+      cs.is_little_endian = sig.is_little_endian;
+      cs.type = signal_type(dbc_name, kv.first, sig.name);
+    }
+  }
+
+  for (const auto &kv : def_vals) {
+    auto it = msg_sigs.find(kv.first);
+    for (const auto &val : kv.second) {
+      Val &cv = cvals[vi++];
+      cv.name = add_string(val.first);
+      cv.address = kv.first;
+      cv.def_val = add_string(val.second);
+      cv.sigs = it == msg_sigs.end() ? NULL : it->second;
+    }
+  }
+
+  CacheHeader header = {
+    .magic = DBC_CACHE_MAGIC,
+    .version = DBC_CACHE_VERSION,
+    .source_size = txt.size(),
+    .source_hash = hash,
+    .ptr_size = sizeof(void*),
+    .msg_size = sizeof(Msg),
+    .sig_size = sizeof(Signal),
+    .val_size = sizeof(Val),
+    .num_msgs = num_msgs,
+    .num_sigs = num_sigs,
+    .num_vals = num_vals,
+    .strtab_size = (uint32_t)strtab.size(),
+  };
+  memcpy(&out[0], &header, sizeof(header));
+  out.append(strtab);
+  return true;
+}
+
+// ***** binary cache *****
+
+// checks the cache data and relocates its pointers in place, returning the DBC
+// inside it. The data must be writable and outlive the DBC. A source_hash of 0
+// accepts a cache built from any text of the right size.
+const DBC* load_cache(char *data, size_t len, uint64_t source_size, uint64_t source_hash) {
+  if (len < sizeof(CacheHeader) || (uintptr_t)data % alignof(Signal) != 0) return NULL;
+
+  CacheHeader header;
+  memcpy(&header, data, sizeof(header));
+  if (header.magic != DBC_CACHE_MAGIC || header.version != DBC_CACHE_VERSION ||
+      header.ptr_size != sizeof(void*) || header.msg_size != sizeof(Msg) ||
+      header.sig_size != sizeof(Signal) || header.val_size != sizeof(Val) ||
+      header.source_size != source_size || (source_hash != 0 && header.source_hash != source_hash)) {
+    return NULL;
+  }
+
+  const CacheLayout layout(header.num_msgs, header.num_sigs, header.num_vals, header.strtab_size);
+  if (len != layout.end || header.strtab_size == 0 || data[len - 1] != '\0') {
+    return NULL;
+  }
+
+  const uintptr_t base = (uintptr_t)data;
+  auto is_string = [&](const char *p) {
+    return (uintptr_t)p >= layout.strtab && (uintptr_t)p < layout.end;
+  };
+  auto is_sigs = [&](const Signal *p, size_t n) {
+    uintptr_t off = (uintptr_t)p;
+    return off >= layout.sigs && (off - layout.sigs) % sizeof(Signal) == 0 &&
+           (off - layout.sigs) / sizeof(Signal) + n <= header.num_sigs;
+  };
+  auto relocate = [&](auto &p) {
+    p = (std::remove_reference_t<decltype(p)>)(base + (uintptr_t)p);
+  };
+
+  DBC *dbc = (DBC*)(data + sizeof(CacheHeader));
+  Msg *msgs = (Msg*)(data + layout.msgs);
+  Signal *sigs = (Signal*)(data + layout.sigs);
+  Val *vals = (Val*)(data + layout.vals);
+
+  if (!is_string(dbc->name) || dbc->num_msgs != header.num_msgs || dbc->num_vals != header.num_vals ||
+      (uintptr_t)dbc->msgs != layout.msgs || (uintptr_t)dbc->vals != layout.vals) {
+    return NULL;
+  }
+  for (size_t i = 0; i < header.num_msgs; i++) {
+    if (!is_string(msgs[i].name) || !is_sigs(msgs[i].sigs, msgs[i].num_sigs)) return NULL;
+  }
+  for (size_t i = 0; i < header.num_sigs; i++) {
+    if (!is_string(sigs[i].name)) return NULL;
+  }
+  for (size_t i = 0; i < header.num_vals; i++) {
+    if (!is_string(vals[i].name) || !is_string(vals[i].def_val) ||
+        (vals[i].sigs != NULL && !is_sigs(vals[i].sigs, 0))) {
+      return NULL;
+    }
+  }
+
+  relocate(dbc->name);
+  relocate(dbc->msgs);
+  relocate(dbc->vals);
+  for (size_t i = 0; i < header.num_msgs; i++) {
+    relocate(msgs[i].name);
+    relocate(msgs[i].sigs);
+  }
+  for (size_t i = 0; i < header.num_sigs; i++) {
+    relocate(sigs[i].name);
+  }
+  for (size_t i = 0; i < header.num_vals; i++) {
+    relocate(vals[i].name);
+    relocate(vals[i].def_val);
+    if (vals[i].sigs != NULL) relocate(vals[i].sigs);
+  }
+  return dbc;
+}
+
+// a private writable mapping: relocating copies the table pages, the strings stay shared with the page cache
+const DBC* mmap_cache(const std::string &path, uint64_t source_size, uint64_t source_hash) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+
+  void *mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) return NULL;
+
+  const DBC *dbc = load_cache((char*)mem, st.st_size, source_size, source_hash);
+  if (!dbc) {
+    munmap(mem, st.st_size);
+  }
+  return dbc;
+}
+
+void write_cache(const std::string &path, const std::string &data) {
+  mkdir(cache_dir().c_str(), 0755);
+
+  // write to a temp file and rename, so concurrent loaders never see a partial cache
+  std::string tmp_path = path + "." + std::to_string(getpid()) + ".tmp";
+  FILE *f = fopen(tmp_path.c_str(), "wb");
+  if (!f) return;
+  bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+  }
+}
+
+// points the stat keyed name at the content keyed cache, both in the cache dir
+void link_cache(const std::string &target, const std::string &path) {
+  std::string tmp_path = path + "." + std::to_string(getpid()) + ".tmp";
+  if (symlink(target.substr(target.rfind('/') + 1).c_str(), tmp_path.c_str()) != 0) return;
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+  }
+}
+
+uint64_t mtime_ns(const struct stat &st) {
+#ifdef __APPLE__
+  return st.st_mtimespec.tv_sec * 1000000000ULL + st.st_mtimespec.tv_nsec;
+#else
+  return st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+#endif
+}
+
+const DBC* dbc_load(const std::string &dbc_name) {
+  std::string dbc_path = dbc_dir() + "/" + dbc_name + ".dbc";
+  struct stat st;
+  if (stat(dbc_path.c_str(), &st) != 0) {
+    return NULL;
+  }
+
+  char key[64];
+  snprintf(key, sizeof(key), "_%llx_%llx", (unsigned long long)st.st_size, (unsigned long long)mtime_ns(st));
+  std::string stat_path = cache_dir() + "/" + dbc_name + key + ".bin";
+
+  const DBC *dbc = mmap_cache(stat_path, st.st_size, 0);
+  if (dbc) return dbc;
+
+  std::string txt;
+  if (!read_file(dbc_path, txt)) {
+    return NULL;
+  }
+
+  uint64_t hash = fnv1a_hash(txt.data(), txt.size());
+  snprintf(key, sizeof(key), "_%016llx", (unsigned long long)hash);
+  std::string hash_path = cache_dir() + "/" + dbc_name + key + ".bin";
+
+  dbc = mmap_cache(hash_path, txt.size(), hash);
+  if (!dbc) {
+    std::string *data = new std::string;
+    if (!build_cache(dbc_name, txt, hash, *data)) {
+      delete data;
+      return NULL;
+    }
+    write_cache(hash_path, *data);
+
+    // the cache may not be writable, so load from memory rather than re-reading it
+    dbc = load_cache(&(*data)[0], data->size(), txt.size(), hash);
+    assert(dbc);
+  }
+
+  // only if the .dbc did not change while it was read, or the stat key would name other contents
+  struct stat st_after;
+  if (stat(dbc_path.c_str(), &st_after) == 0 && st_after.st_size == st.st_size && mtime_ns(st_after) == mtime_ns(st) &&
+      (uint64_t)st.st_size == txt.size()) {
+    link_cache(hash_path, stat_path);
+  }
+  return dbc;
+}
+
+std::mutex& get_lock() {
+  static std::mutex lock;
+  return lock;
+}
+
+std::unordered_map<std::string, const DBC*>& get_dbcs() {
+  static std::unordered_map<std::string, const DBC*> dbcs;
+  return dbcs;
+}
+
+}
+
+const DBC* dbc_lookup(const std::string& dbc_name) {
+  std::lock_guard<std::mutex> lk(get_lock());
+
+  auto &dbcs = get_dbcs();
+  auto it = dbcs.find(dbc_name);
+  if (it != dbcs.end()) {
+    return it->second;
+  }
+
+  const DBC *dbc = dbc_load(dbc_name);
+  if (dbc) {
+    dbcs[dbc_name] = dbc;
   }
-  return NULL;
+  return dbc;
 }
 
 void dbc_register(const DBC* dbc) {
-  get_dbcs().push_back(dbc);
+  std::lock_guard<std::mutex> lk(get_lock());
+  get_dbcs()[dbc->name] = dbc;
 }
 
 extern "C" {
@@ -1,8 +1,10 @@
 #include <cassert>
+#include <cstring>
 #include <utility>
 #include <algorithm>
 #include <map>
 #include <cmath>
+#include <ctime>
 
 #include "common.h"
 
@@ -22,8 +24,8 @@ uint64_t ReverseBytes(uint64_t x) {
 
 uint64_t set_value(uint64_t ret, Signal sig, int64_t ival){
   int shift = sig.is_little_endian? sig.b1 : sig.bo;
-  uint64_t mask = ((1ULL << sig.b2)-1) << shift;
-  uint64_t dat = (ival & ((1ULL << sig.b2)-1)) << shift;
+  uint64_t mask = signal_mask(sig.b2) << shift;
+  uint64_t dat = (ival & signal_mask(sig.b2)) << shift;
   if (sig.is_little_endian) {
     dat = ReverseBytes(dat);
     mask = ReverseBytes(mask);
@@ -43,9 +45,28 @@ CANPacker::CANPacker(const std::string& dbc_name) {
     for (int j=0; j<msg->num_sigs; j++) {
       const Signal* sig = &msg->sigs[j];
       signal_lookup[std::make_pair(msg->address, std::string(sig->name))] = *sig;
+      handle_lookup[std::make_pair(msg->address, std::string(sig->name))] = signals.size();
+      signals.push_back(*sig);
+
+      // pack_fd leaves these zero, say so once instead of every frame
+      if (msg->size > 8 && strcmp(sig->name, "CHECKSUM") == 0 && sig->type != SignalType::DEFAULT) {
+        WARN("CHECKSUM not supported for CAN FD message %d\n", msg->address);
+      }
     }
   }
-  init_crc_lookup_tables();
+
+  // largest sendcan seen in practice is ~20 messages, start with room for that
+  sendcan_segment = kj::heapArray<capnp::word>(1024);
+  memset(sendcan_segment.begin(), 0, sendcan_segment.size() * sizeof(capnp::word));
+}
+
+int CANPacker::lookup_signal(uint32_t address, const std::string& name) {
+  auto it = handle_lookup.find(std::make_pair(address, name));
+  if (it == handle_lookup.end()) {
+    WARN("undefined signal %s - %d\n", name.c_str(), address);
+    return -1;
+  }
+  return it->second;
 }
 
 uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &signals, int counter) {
@@ -62,13 +83,80 @@ uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &s
     auto sig = sig_it->second;
 
     int64_t ival = (int64_t)(round((value - sig.offset) / sig.factor));
-    if (ival < 0) {
+    if (ival < 0 && sig.b2 < 64) {
+      ival = (1ULL << sig.b2) + ival;
+    }
+
+    ret = set_value(ret, sig, ival);
+  }
+
+  return finish_pack(address, ret, counter);
+}
+
+uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackHandle> &signals, int counter) {
+  uint64_t ret = 0;
+  for (const auto& sigval : signals) {
+    if (sigval.handle < 0 || sigval.handle >= (int)this->signals.size()) continue;
+    const Signal &sig = this->signals[sigval.handle];
+
+    int64_t ival = (int64_t)(round((sigval.value - sig.offset) / sig.factor));
+    if (ival < 0 && sig.b2 < 64) {
       ival = (1ULL << sig.b2) + ival;
     }
 
     ret = set_value(ret, sig, ival);
   }
 
+  return finish_pack(address, ret, counter);
+}
+
+void CANPacker::pack_fd(uint32_t address, const std::vector<SignalPackHandle> &signals, int counter, uint8_t *dat, size_t size) {
+  memset(dat, 0, size);
+  for (const auto& sigval : signals) {
+    if (sigval.handle < 0 || sigval.handle >= (int)this->signals.size()) continue;
+    const Signal &sig = this->signals[sigval.handle];
+
+    int64_t ival = (int64_t)(round((sigval.value - sig.offset) / sig.factor));
+    set_raw_value(dat, sig, ival);
+  }
+
+  if (counter >= 0) {
+    auto sig_it = signal_lookup.find(std::make_pair(address, "COUNTER"));
+    if (sig_it == signal_lookup.end()) {
+      WARN("COUNTER not defined\n");
+    } else {
+      set_raw_value(dat, sig_it->second, counter);
+    }
+  }
+}
+
+std::vector<uint8_t> CANPacker::pack_bytes(uint32_t address, const std::vector<SignalPackValue> &signals, int counter) {
+  auto msg_it = message_lookup.find(address);
+  if (msg_it == message_lookup.end()) {
+    WARN("undefined message %d\n", address);
+    return {};
+  }
+  size_t size = msg_it->second.size;
+
+  if (size <= 8) {
+    uint64_t dat = ReverseBytes(pack(address, signals, counter));
+    return std::vector<uint8_t>((uint8_t*)&dat, (uint8_t*)&dat + size);
+  }
+
+  std::vector<SignalPackHandle> handles;
+  for (const auto& sigval : signals) {
+    handles.push_back((SignalPackHandle){
+      .handle = lookup_signal(address, sigval.name),
+      .value = sigval.value,
+    });
+  }
+
+  std::vector<uint8_t> ret(size);
+  pack_fd(address, handles, counter, ret.data(), size);
+  return ret;
+}
+
+uint64_t CANPacker::finish_pack(uint32_t address, uint64_t ret, int counter) {
   if (counter >= 0){
     auto sig_it = signal_lookup.find(std::make_pair(address, "COUNTER"));
     if (sig_it == signal_lookup.end()) {
@@ -97,7 +185,11 @@ uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &s
       // FIXME: Hackish fix for an endianness issue. The message is in reverse byte order
       // until later in the pack process. Checksums can be run backwards, CRCs not so much.
       // The correct fix is unclear but this works for the moment.
-      unsigned int chksm = volkswagen_crc(address, ReverseBytes(ret), message_lookup[address].size);
+      auto magic_it = crc_magic_lookup.find(address);
+      if (magic_it == crc_magic_lookup.end()) {
+        magic_it = crc_magic_lookup.emplace(address, volkswagen_crc_magic(address)).first;
+      }
+      unsigned int chksm = volkswagen_crc(magic_it->second, ReverseBytes(ret), message_lookup[address].size);
       ret = set_value(ret, sig, chksm);
     } else if (sig.type == SignalType::SUBARU_CHECKSUM) {
       unsigned int chksm = subaru_checksum(address, ret, message_lookup[address].size);
@@ -112,3 +204,61 @@ uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &s
 
   return ret;
 }
+
+const std::string& CANPacker::pack_sendcan(const std::vector<CanPackMessage> &msgs, bool valid) {
+  {
+    // builder writes into the preallocated first segment and zeroes it again on destruction
+    capnp::MallocMessageBuilder msg(sendcan_segment);
+    cereal::Event::Builder event = msg.initRoot<cereal::Event>();
+
+    struct timespec t;
+    clock_gettime(CLOCK_BOOTTIME, &t);
+    event.setLogMonoTime(t.tv_sec * 1000000000ULL + t.tv_nsec);
+    event.setValid(valid);
+
+    // an undefined message is left out rather than sent as an empty frame to address 0
+    sendcan_lookup.clear();
+    size_t num_valid = 0;
+    for (const auto &m : msgs) {
+      auto msg_it = message_lookup.find(m.address);
+      if (msg_it == message_lookup.end()) {
+        WARN("undefined message %d\n", m.address);
+        sendcan_lookup.push_back(NULL);
+        continue;
+      }
+      sendcan_lookup.push_back(&msg_it->second);
+      num_valid++;
+    }
+
+    auto can_data = event.initSendcan(num_valid);
+    size_t i = 0;
+    for (size_t j = 0; j < msgs.size(); j++) {
+      const CanPackMessage &m = msgs[j];
+      const Msg *dbc_msg = sendcan_lookup[j];
+      if (dbc_msg == NULL) continue;
+
+      auto c = can_data[i++];
+      c.setAddress(m.address);
+      c.setBusTime(0);
+      c.setSrc(m.bus);
+
+      size_t size = std::min((size_t)dbc_msg->size, (size_t)CANFD_MAX_DLEN);
+      if (size > 8) {
+        uint8_t dat[CANFD_MAX_DLEN];
+        pack_fd(m.address, m.signals, m.counter, dat, size);
+        c.setDat(kj::arrayPtr(dat, size));
+      } else {
+        // same byte order as the python make_can_msg
+        uint64_t dat = ReverseBytes(pack(m.address, m.signals, m.counter));
+        c.setDat(kj::arrayPtr((uint8_t*)&dat, size));
+      }
+    }
+
+    size_t size = capnp::computeSerializedSizeInWords(msg) * sizeof(capnp::word);
+    sendcan_buf.resize(size);
+    kj::ArrayOutputStream stream(kj::arrayPtr((kj::byte*)&sendcan_buf[0], size));
+    capnp::writeMessage(stream, msg);
+  }
+
+  return sendcan_buf;
+}
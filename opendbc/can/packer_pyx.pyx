@@ -1,7 +1,7 @@
 # distutils: language = c++
 # cython: c_string_encoding=ascii, language_level=3
 
-from libc.stdint cimport uint32_t, uint64_t
+from libc.stdint cimport uint8_t, uint32_t, uint64_t
 from libcpp.vector cimport vector
 from libcpp.map cimport map
 from libcpp.string cimport string
@@ -9,7 +9,7 @@ from libcpp cimport bool
 from posix.dlfcn cimport dlopen, dlsym, RTLD_LAZY
 
 from common cimport CANPacker as cpp_CANPacker
-from common cimport dbc_lookup, SignalPackValue, DBC
+from common cimport dbc_lookup, SignalPackValue, SignalPackHandle, CanPackMessage, DBC
 
 
 cdef class CANPacker:
@@ -18,6 +18,8 @@ cdef class CANPacker:
     const DBC *dbc
     map[string, (int, int)] name_to_address_and_size
     map[int, int] address_to_size
+    vector[CanPackMessage] sendcan_msgs
+    dict signal_handles
 
   def __init__(self, dbc_name):
     self.dbc = dbc_lookup(dbc_name)
@@ -25,6 +27,7 @@ cdef class CANPacker:
       raise RuntimeError("Can't lookup" + dbc_name)
       
     self.packer = new cpp_CANPacker(dbc_name)
+    self.signal_handles = {}
     num_msgs = self.dbc[0].num_msgs
     for i in range(num_msgs):
       msg = self.dbc[0].msgs[i]
@@ -47,6 +50,22 @@ cdef class CANPacker:
 
     return self.packer.pack(addr, values_thing, counter)
 
+  cdef bytes pack_fd(self, addr, values, counter):
+    cdef vector[SignalPackValue] values_thing
+    cdef SignalPackValue spv
+
+    names = []
+
+    for name, value in values.items():
+      n = name.encode('utf8')
+      names.append(n)
+
+      spv.name = n
+      spv.value = value
+      values_thing.push_back(spv)
+
+    return bytes(self.packer.pack_bytes(addr, values_thing, counter))
+
   cdef inline uint64_t ReverseBytes(self, uint64_t x):
     return (((x & 0xff00000000000000ull) >> 56) |
            ((x & 0x00ff000000000000ull) >> 40) |
@@ -64,6 +83,46 @@ cdef class CANPacker:
       size = self.address_to_size[name_or_addr]
     else:
       addr, size = self.name_to_address_and_size[name_or_addr.encode('utf8')]
+    if size > 8:
+      # CAN FD
+      return [addr, 0, self.pack_fd(addr, values, counter), bus]
     cdef uint64_t val = self.pack(addr, values, counter)
     val = self.ReverseBytes(val)
     return [addr, 0, (<char *>&val)[:size], bus]
+
+  cdef int signal_handle(self, int addr, name):
+    key = (addr, name)
+    handle = self.signal_handles.get(key)
+    if handle is None:
+      handle = self.packer.lookup_signal(addr, name.encode('utf8'))
+      self.signal_handles[key] = handle
+    return handle
+
+  cpdef make_sendcan(self, msgs, valid=True):
+    """Pack a whole control cycle and serialize it as a sendcan event.
+
+    msgs is a list of (name_or_addr, bus, values, counter). Returns the
+    serialized event, ready for PubMaster.send('sendcan', ...).
+    """
+    cdef int addr
+    cdef size_t i = 0
+    cdef SignalPackHandle sph
+
+    self.sendcan_msgs.resize(len(msgs))
+    for name_or_addr, bus, values, counter in msgs:
+      if type(name_or_addr) == int:
+        addr = name_or_addr
+      else:
+        addr = self.name_to_address_and_size[name_or_addr.encode('utf8')][0]
+
+      self.sendcan_msgs[i].address = addr
+      self.sendcan_msgs[i].bus = bus
+      self.sendcan_msgs[i].counter = counter
+      self.sendcan_msgs[i].signals.clear()
+      for name, value in values.items():
+        sph.handle = self.signal_handle(addr, name)
+        sph.value = value
+        self.sendcan_msgs[i].signals.push_back(sph)
+      i += 1
+
+    return self.packer.pack_sendcan(self.sendcan_msgs, valid)
@@ -6,15 +6,28 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <algorithm>
+#include <cmath>
 
 #include "common.h"
 
-// #define DEBUG(...)
-#define DEBUG printf
-#define INFO printf
-
-
 bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
+  // arrival statistics count every frame, including ones that fail checks
+  frames++;
+  if (last_arrival > 0) {
+    double interval = sec - last_arrival;
+    if (interval_mean == 0) {
+      interval_mean = interval;
+    } else {
+      // smoothed like RTP interarrival jitter (RFC 3550)
+      interval_jitter += (fabs(interval - interval_mean) - interval_jitter) / 16;
+      interval_mean += (interval - interval_mean) / 16;
+    }
+  }
+  last_arrival = sec;
+  arrivals[arrival_count % ARRIVAL_RING_SIZE] = sec;
+  arrival_count++;
+
+  bool changed = false;
   uint64_t dat_le = read_u64_le(dat);
   uint64_t dat_be = read_u64_be(dat);
 
@@ -22,13 +35,16 @@ bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
     auto& sig = parse_sigs[i];
     int64_t tmp;
 
-    if (sig.is_little_endian){
-      tmp = (dat_le >> sig.b1) & ((1ULL << sig.b2)-1);
+    if (size > 8) {
+      // CAN FD, signals can be anywhere in the 64 byte payload
+      tmp = get_raw_value(dat, sig);
+    } else if (sig.is_little_endian){
+      tmp = (dat_le >> sig.b1) & signal_mask(sig.b2);
     } else {
-      tmp = (dat_be >> sig.bo) & ((1ULL << sig.b2)-1);
+      tmp = (dat_be >> sig.bo) & signal_mask(sig.b2);
     }
 
-    if (sig.is_signed) {
+    if (sig.is_signed && sig.b2 < 64) {
       tmp -= (tmp >> (sig.b2-1)) ? (1ULL << sig.b2) : 0; //signed
     }
 
@@ -36,7 +52,7 @@ bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
 
     if (sig.type == SignalType::HONDA_CHECKSUM) {
       if (honda_checksum(address, dat_be, size) != tmp) {
-        INFO("0x%X CHECKSUM FAIL\n", address);
+        checksum_fails++;
         return false;
       }
     } else if (sig.type == SignalType::HONDA_COUNTER) {
@@ -45,12 +61,12 @@ bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
       }
     } else if (sig.type == SignalType::TOYOTA_CHECKSUM) {
       if (toyota_checksum(address, dat_be, size) != tmp) {
-        INFO("0x%X CHECKSUM FAIL\n", address);
+        checksum_fails++;
         return false;
       }
     } else if (sig.type == SignalType::VOLKSWAGEN_CHECKSUM) {
-      if (volkswagen_crc(address, dat_le, size) != tmp) {
-        INFO("0x%X CRC FAIL\n", address);
+      if (volkswagen_crc(crc_magic, dat_le, size) != tmp) {
+        checksum_fails++;
         return false;
       }
     } else if (sig.type == SignalType::VOLKSWAGEN_COUNTER) {
@@ -59,17 +75,17 @@ bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
       }
     } else if (sig.type == SignalType::SUBARU_CHECKSUM) {
       if (subaru_checksum(address, dat_be, size) != tmp) {
-        INFO("0x%X CHECKSUM FAIL\n", address);
+        checksum_fails++;
         return false;
       }
     } else if (sig.type == SignalType::CHRYSLER_CHECKSUM) {
       if (chrysler_checksum(address, dat_le, size) != tmp) {
-        INFO("0x%X CHECKSUM FAIL\n", address);
+        checksum_fails++;
         return false;
       }
     } else if (sig.type == SignalType::PEDAL_CHECKSUM) {
       if (pedal_checksum(dat_be, size) != tmp) {
-        INFO("0x%X PEDAL CHECKSUM FAIL\n", address);
+        checksum_fails++;
         return false;
       }
     } else if (sig.type == SignalType::PEDAL_COUNTER) {
@@ -78,10 +94,17 @@ bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
       }
     }
 
-    vals[i] = tmp * sig.factor + sig.offset;
+    double val = tmp * sig.factor + sig.offset;
+    if (sig.type == SignalType::DEFAULT && val != vals[i]) {
+      changed = true;
+    }
+    vals[i] = val;
   }
   ts = ts_;
   seen = sec;
+  if (changed || last_change == 0) {
+    last_change = sec;
+  }
 
   return true;
 }
@@ -92,9 +115,7 @@ bool MessageState::update_counter_generic(int64_t v, int cnt_size) {
   counter = v;
   if (((old_counter+1) & ((1 << cnt_size) -1)) != v) {
     counter_fail += 1;
-    if (counter_fail > 1) {
-      INFO("0x%X COUNTER FAIL %d -- %d vs %d\n", address, counter_fail, old_counter, (int)v);
-    }
+    counter_fails++;
     if (counter_fail >= MAX_BAD_COUNTER) {
       return false;
     }
@@ -112,7 +133,6 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
 
   dbc = dbc_lookup(dbc_name);
   assert(dbc);
-  init_crc_lookup_tables();
 
   for (const auto& op : options) {
     MessageState state = {
@@ -147,6 +167,9 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
         state.parse_sigs.push_back(*sig);
         state.vals.push_back(0);
       }
+      if (sig->type == SignalType::VOLKSWAGEN_CHECKSUM) {
+        state.crc_magic = volkswagen_crc_magic(state.address);
+      }
     }
 
     // track requested signals for this message
@@ -167,6 +190,14 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
 
     message_states[state.address] = state;
   }
+
+  // checked messages are invalid until they first arrive
+  for (auto& kv : message_states) {
+    if (kv.second.check_threshold > 0) {
+      kv.second.timed_out = true;
+      expired++;
+    }
+  }
 }
 
 void CANParser::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans) {
@@ -187,25 +218,45 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Rea
         continue;
       }
 
-      if (cmsg.getDat().size() > 8) continue; //shouldn't ever happen
-      uint8_t dat[8] = {0};
-      memcpy(dat, cmsg.getDat().begin(), cmsg.getDat().size());
-
-      state_it->second.parse(sec, cmsg.getBusTime(), dat);
+      // classic frames are up to 8 bytes, CAN FD up to 64
+      size_t len = cmsg.getDat().size();
+      if (len > CANFD_MAX_DLEN) continue; //shouldn't ever happen
+
+      // parse always reads at least 8 bytes, pad short frames up to that or the DBC size
+      uint8_t dat[CANFD_MAX_DLEN];
+      size_t padded = std::max(std::max(len, (size_t)8), std::min((size_t)state_it->second.size, (size_t)CANFD_MAX_DLEN));
+      memcpy(dat, cmsg.getDat().begin(), len);
+      memset(dat + len, 0, padded - len);
+
+      MessageState &state = state_it->second;
+      if (state.parse(sec, cmsg.getBusTime(), dat) && state.timed_out) {
+        // valid again, schedule its next deadline
+        state.timed_out = false;
+        expired--;
+        deadlines.push(std::make_pair(sec + state.check_threshold, &state));
+      }
     }
 }
 
 void CANParser::UpdateValid(uint64_t sec) {
-  can_valid = true;
-  for (const auto& kv : message_states) {
-    const auto& state = kv.second;
-    if (state.check_threshold > 0 && (sec - state.seen) > state.check_threshold) {
-      if (state.seen > 0) {
-        DEBUG("0x%X TIMEOUT\n", state.address);
-      }
-      can_valid = false;
+  // Each checked message has one entry in the heap, keyed on a deadline that
+  // is at most its real one (seen + check_threshold). Only entries that are
+  // due get looked at: either the message arrived since and is pushed back
+  // with its new deadline, or it really did time out.
+  while (!deadlines.empty() && deadlines.top().first < sec) {
+    MessageState *state = deadlines.top().second;
+    deadlines.pop();
+
+    uint64_t deadline = state->seen + state->check_threshold;
+    if (deadline < sec) {
+      state->timed_out = true;
+      state->timeouts++;
+      expired++;
+    } else {
+      deadlines.push(std::make_pair(deadline, state));
     }
   }
+  can_valid = expired == 0;
 }
 
 void CANParser::update_string(std::string data, bool sendcan) {
@@ -246,3 +297,36 @@ std::vector<SignalValue> CANParser::query_latest() {
 
   return ret;
 }
+
+double MessageState::measured_rate() const {
+  // over the frames still in the arrival ring
+  int n = std::min(arrival_count, (uint64_t)ARRIVAL_RING_SIZE);
+  if (n < 2) return 0;
+
+  uint64_t newest = arrivals[(arrival_count - 1) % ARRIVAL_RING_SIZE];
+  uint64_t oldest = arrivals[(arrival_count - n) % ARRIVAL_RING_SIZE];
+  if (newest <= oldest) return 0;
+  return (n - 1) * 1e9 / (newest - oldest);
+}
+
+std::vector<MessageHealth> CANParser::query_health() {
+  std::vector<MessageHealth> ret;
+  ret.reserve(message_states.size());
+
+  for (const auto& kv : message_states) {
+    const auto& state = kv.second;
+    ret.push_back((MessageHealth){
+      .address = state.address,
+      .frames = state.frames,
+      .checksum_fails = state.checksum_fails,
+      .counter_fails = state.counter_fails,
+      .timeouts = state.timeouts,
+      .interval_mean_ms = state.interval_mean / 1e6,
+      .interval_jitter_ms = state.interval_jitter / 1e6,
+      .rate_hz = state.measured_rate(),
+      .unchanged_ms = (state.seen - state.last_change) / 1e6,
+    });
+  }
+
+  return ret;
+}
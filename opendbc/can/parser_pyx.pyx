@@ -137,6 +137,23 @@ cdef class CANParser:
 
     return updated_vals
 
+  def query_health(self):
+    health = {}
+    for h in self.can.query_health():
+      name = <unicode>self.address_to_msg_name[h.address].c_str()
+      health[name] = {
+        'address': h.address,
+        'frames': h.frames,
+        'checksum_fails': h.checksum_fails,
+        'counter_fails': h.counter_fails,
+        'timeouts': h.timeouts,
+        'interval_mean_ms': h.interval_mean_ms,
+        'interval_jitter_ms': h.interval_jitter_ms,
+        'rate_hz': h.rate_hz,
+        'unchanged_ms': h.unchanged_ms,
+      }
+    return health
+
 cdef class CANDefine():
   cdef:
     const DBC *dbc
@@ -0,0 +1,65 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+
+#include "common/timing.h"
+#include "opendbc/can/common_dbc.h"
+
+// Measures the time and memory it takes to look up DBCs.
+// Run once with an empty DBC_CACHE_PATH for the parse cost, then again for the cached (mmap) cost.
+// usage: bench_dbc_load [dbc_name ...], defaults to every .dbc in DBC_PATH
+
+static long rss_kb() {
+  FILE *f = fopen("/proc/self/status", "r");
+  if (!f) return -1;
+  char line[256];
+  long rss = -1;
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, "VmRSS:", 6) == 0) {
+      rss = strtol(line + 6, NULL, 10);
+      break;
+    }
+  }
+  fclose(f);
+  return rss;
+}
+
+int main(int argc, char** argv) {
+  std::vector<std::string> names;
+  for (int i = 1; i < argc; i++) {
+    names.push_back(argv[i]);
+  }
+
+  if (names.empty()) {
+    const char *dbc_path = getenv("DBC_PATH") ? getenv("DBC_PATH") : "opendbc";
+    DIR *dir = opendir(dbc_path);
+    if (!dir) {
+      fprintf(stderr, "can't open %s, set DBC_PATH\n", dbc_path);
+      return 1;
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+      std::string fn = de->d_name;
+      if (fn.size() > 4 && fn.compare(fn.size() - 4, 4, ".dbc") == 0) {
+        names.push_back(fn.substr(0, fn.size() - 4));
+      }
+    }
+    closedir(dir);
+  }
+
+  long rss_start = rss_kb();
+  double total_ms = 0;
+  for (const auto &name : names) {
+    double t1 = millis_since_boot();
+    const DBC *dbc = dbc_lookup(name);
+    double t2 = millis_since_boot();
+    total_ms += t2 - t1;
+    printf("%-60s %8.3f ms %s\n", name.c_str(), t2 - t1, dbc ? "" : "FAILED");
+  }
+
+  printf("%zu dbcs in %.3f ms, rss %ld kB -> %ld kB\n", names.size(), total_ms, rss_start, rss_kb());
+  return 0;
+}
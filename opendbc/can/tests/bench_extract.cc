@@ -0,0 +1,65 @@
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "common/timing.h"
+#include "opendbc/can/common.h"
+
+// Compares the single word signal extraction used for classic frames against
+// the byte wise path CAN FD frames go through.
+
+#define ITERATIONS 2000000
+
+int main(int argc, char** argv) {
+  std::mt19937 gen(0);
+
+  // random signals that fit in a classic frame, so both paths can extract them
+  std::vector<Signal> sigs;
+  for (int i = 0; i < 64; i++) {
+    Signal sig = {};
+    sig.is_little_endian = gen() % 2;
+    sig.b2 = 1 + gen() % 32;
+    sig.b1 = gen() % (64 - sig.b2 + 1);
+    sig.bo = 64 - (sig.b1 + sig.b2);
+    sigs.push_back(sig);
+  }
+
+  uint8_t dat[CANFD_MAX_DLEN];
+  for (auto &b : dat) b = gen();
+
+  uint64_t sum_word = 0, sum_bytes = 0;
+
+  double t1 = millis_since_boot();
+  for (int i = 0; i < ITERATIONS; i++) {
+    dat[0] = i;
+    uint64_t dat_le = read_u64_le(dat);
+    uint64_t dat_be = read_u64_be(dat);
+    const Signal &sig = sigs[i % sigs.size()];
+    if (sig.is_little_endian) {
+      sum_word += (dat_le >> sig.b1) & ((1ULL << sig.b2) - 1);
+    } else {
+      sum_word += (dat_be >> sig.bo) & ((1ULL << sig.b2) - 1);
+    }
+  }
+  double t2 = millis_since_boot();
+  for (int i = 0; i < ITERATIONS; i++) {
+    dat[0] = i;
+    sum_bytes += get_raw_value(dat, sigs[i % sigs.size()]);
+  }
+  double t3 = millis_since_boot();
+
+  // same signals placed at the end of a 64 byte FD payload
+  for (auto &sig : sigs) sig.b1 += 448;
+  for (int i = 0; i < ITERATIONS; i++) {
+    dat[56] = i;
+    sum_bytes += get_raw_value(dat, sigs[i % sigs.size()]);
+  }
+  double t4 = millis_since_boot();
+
+  printf("classic word path: %.2f ns/signal\n", (t2 - t1) * 1e6 / ITERATIONS);
+  printf("byte path, classic offsets: %.2f ns/signal\n", (t3 - t2) * 1e6 / ITERATIONS);
+  printf("byte path, FD offsets: %.2f ns/signal\n", (t4 - t3) * 1e6 / ITERATIONS);
+  printf("checksum %llu %llu\n", (unsigned long long)sum_word, (unsigned long long)sum_bytes);
+  return 0;
+}
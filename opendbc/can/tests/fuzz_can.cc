@@ -0,0 +1,326 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+
+#include <capnp/serialize.h>
+#include "cereal/gen/cpp/log.capnp.h"
+#include "common/timing.h"
+#include "opendbc/can/common.h"
+
+// Round trips random signal values through CANPacker and CANParser for every
+// message in every DBC and checks they come back unchanged, then flips single
+// bits in messages that carry a checksum and checks the parser rejects them.
+// Reports frames/sec and heap allocations per cycle for both directions.
+// usage: fuzz_can [dbc_name ...], defaults to every .dbc in DBC_PATH
+
+#define CYCLES 500
+#define BUS 0
+
+// count every operator new the packer and parser make
+static uint64_t allocs = 0;
+
+void* operator new(size_t size) {
+  allocs++;
+  void *p = malloc(size);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t size) noexcept { free(p); }
+
+struct SigPlan {
+  const Signal *sig;
+  int handle;   // index into CanPackMessage::signals, -1 if the packer fills it in
+  bool check;   // compare the parsed value
+  double expected;
+};
+
+struct MsgPlan {
+  const Msg *msg;
+  bool checksum;
+  int counter_bits;  // counter the packer fills in and the parser tracks, 0 if none
+  std::vector<SigPlan> sigs;
+};
+
+static bool is_checksum(SignalType type) {
+  return type == SignalType::HONDA_CHECKSUM || type == SignalType::TOYOTA_CHECKSUM ||
+         type == SignalType::VOLKSWAGEN_CHECKSUM || type == SignalType::SUBARU_CHECKSUM ||
+         type == SignalType::CHRYSLER_CHECKSUM;
+}
+
+// Works out which messages and signals can be round tripped. Returns false for
+// messages the packer can't produce a valid frame for.
+static bool plan_message(CANPacker &packer, const Msg *msg, MsgPlan &plan) {
+  plan.msg = msg;
+  plan.checksum = false;
+  plan.counter_bits = 0;
+  if (msg->size > CANFD_MAX_DLEN) return false;
+
+  // multiplexed signals share bits, only the first signal over any bit is checked
+  uint8_t used[CANFD_MAX_DLEN] = {0};
+
+  for (int i = 0; i < msg->num_sigs; i++) {
+    const Signal *sig = &msg->sigs[i];
+    // the packer doesn't compute the pedal checksum
+    if (sig->type == SignalType::PEDAL_CHECKSUM || sig->type == SignalType::PEDAL_COUNTER) return false;
+
+    uint8_t bits[CANFD_MAX_DLEN] = {0};
+    set_raw_value(bits, *sig, signal_mask(sig->b2));
+    bool overlaps = false;
+    for (int j = 0; j < CANFD_MAX_DLEN; j++) {
+      if ((bits[j] && j >= msg->size) || (bits[j] & used[j])) overlaps = true;
+      used[j] |= bits[j];
+    }
+
+    // the packer and parser pick different signals when a message repeats a name
+    bool duplicate = false;
+    for (int j = 0; j < msg->num_sigs; j++) {
+      if (j != i && strcmp(msg->sigs[j].name, sig->name) == 0) duplicate = true;
+    }
+
+    SigPlan sp = {.sig = sig, .handle = -1, .check = false, .expected = 0};
+    if (is_checksum(sig->type)) {
+      // CAN FD frames have no checksum support in the packer
+      if (msg->size > 8) return false;
+      // subaru_checksum() takes the checksum from byte 0, subaru_global's Steering (0x2)
+      // has it in byte 4. openpilot doesn't read that message, so it's left out for now.
+      if (sig->type == SignalType::SUBARU_CHECKSUM && sig->b1 != 0) return false;
+      plan.checksum = true;
+    } else if (sig->type == SignalType::HONDA_COUNTER || sig->type == SignalType::VOLKSWAGEN_COUNTER) {
+      plan.counter_bits = sig->b2;
+      sp.check = true;
+    } else if (!overlaps && !duplicate) {
+      sp.handle = packer.lookup_signal(msg->address, sig->name);
+      sp.check = sp.handle >= 0;
+    }
+    plan.sigs.push_back(sp);
+  }
+  return true;
+}
+
+static std::vector<std::string> list_dbcs() {
+  std::vector<std::string> names;
+  const char *dbc_path = getenv("DBC_PATH") ? getenv("DBC_PATH") : "opendbc";
+  DIR *dir = opendir(dbc_path);
+  if (!dir) {
+    fprintf(stderr, "can't open %s, set DBC_PATH\n", dbc_path);
+    return names;
+  }
+  struct dirent *de;
+  while ((de = readdir(dir)) != NULL) {
+    std::string fn = de->d_name;
+    if (fn.size() > 4 && fn.compare(fn.size() - 4, 4, ".dbc") == 0) {
+      names.push_back(fn.substr(0, fn.size() - 4));
+    }
+  }
+  closedir(dir);
+  return names;
+}
+
+// returns the number of failures
+static int fuzz_dbc(const std::string &name, std::mt19937_64 &gen) {
+  const DBC *dbc = dbc_lookup(name);
+  if (!dbc) {
+    printf("%-50s FAILED to load\n", name.c_str());
+    return 1;
+  }
+
+  CANPacker packer(name);
+
+  std::vector<MsgPlan> plans;
+  std::vector<MessageParseOptions> msg_opts;
+  std::vector<SignalParseOptions> sig_opts;
+  for (int i = 0; i < dbc->num_msgs; i++) {
+    MsgPlan plan;
+    if (!plan_message(packer, &dbc->msgs[i], plan)) continue;
+    msg_opts.push_back({.address = plan.msg->address, .check_frequency = 0});
+    for (const auto &sp : plan.sigs) {
+      sig_opts.push_back({.address = plan.msg->address, .name = sp.sig->name, .default_value = 0});
+    }
+    plans.push_back(plan);
+  }
+  if (plans.empty()) {
+    printf("%-50s no testable messages\n", name.c_str());
+    return 0;
+  }
+
+  CANParser parser(BUS, name, msg_opts, sig_opts);
+  CANParser corrupt_parser(BUS, name, msg_opts, sig_opts);
+
+  // parsed signals point at the same names as the DBC
+  std::map<std::pair<uint32_t, const char*>, SigPlan*> expected;
+  std::vector<CanPackMessage> sendcan;
+  for (auto &plan : plans) {
+    CanPackMessage m = {.address = plan.msg->address, .bus = BUS, .counter = -1};
+    for (auto &sp : plan.sigs) {
+      expected[std::make_pair(plan.msg->address, sp.sig->name)] = &sp;
+      if (sp.handle >= 0) {
+        int idx = m.signals.size();
+        m.signals.push_back({.handle = sp.handle, .value = 0});
+        sp.handle = idx;
+      }
+    }
+    sendcan.push_back(m);
+  }
+
+  int want = 0;
+  for (const auto &plan : plans) {
+    for (const auto &sp : plan.sigs) want += sp.check;
+  }
+
+  int frames = 0, mismatches = 0, corrupt_total = 0, corrupt_accepted = 0;
+  uint64_t pack_allocs = 0, parse_allocs = 0;
+  double pack_ms = 0, parse_ms = 0;
+
+  for (int cycle = 0; cycle < CYCLES; cycle++) {
+    // random values that fit each signal
+    for (int i = 0; i < plans.size(); i++) {
+      MsgPlan &plan = plans[i];
+      CanPackMessage &m = sendcan[i];
+      if (plan.counter_bits) m.counter = (cycle + 1) & signal_mask(plan.counter_bits);
+
+      for (auto &sp : plan.sigs) {
+        if (!sp.check) continue;
+        const Signal &sig = *sp.sig;
+        int64_t raw;
+        if (sp.handle < 0) {
+          raw = m.counter;
+        } else {
+          // keep values well inside double precision
+          int bits = std::min(sig.b2, 32);
+          raw = gen() & signal_mask(bits);
+          if (sig.is_signed && sig.b2 < 64 && (raw >> (bits - 1))) raw -= (int64_t)1 << bits;
+        }
+        sp.expected = raw * sig.factor + sig.offset;
+        if (sp.handle >= 0) m.signals[sp.handle].value = sp.expected;
+      }
+    }
+
+    uint64_t a = allocs;
+    double t = millis_since_boot();
+    const std::string &dat = packer.pack_sendcan(sendcan, true);
+    pack_ms += millis_since_boot() - t;
+    pack_allocs += allocs - a;
+
+    a = allocs;
+    t = millis_since_boot();
+    parser.update_string(dat, true);
+    std::vector<SignalValue> vals = parser.query_latest();
+    parse_ms += millis_since_boot() - t;
+    parse_allocs += allocs - a;
+    frames += sendcan.size();
+
+    // every message should have been accepted with the values we packed
+    int checked = 0;
+    for (const auto &v : vals) {
+      auto it = expected.find(std::make_pair(v.address, v.name));
+      if (it == expected.end() || !it->second->check) continue;
+      checked++;
+      double want_val = it->second->expected;
+      if (fabs(v.value - want_val) > 1e-9 * std::max(1.0, fabs(want_val))) {
+        if (mismatches < 10) {
+          printf("  mismatch 0x%X %s: got %f want %f\n", v.address, v.name, v.value, want_val);
+        }
+        mismatches++;
+      }
+    }
+    if (checked != want) {
+      if (mismatches < 10) printf("  cycle %d: %d of %d signals parsed\n", cycle, checked, want);
+      mismatches++;
+    }
+
+    // flip one bit in each checksummed frame, the parser must drop all of them
+    auto amsg = kj::heapArray<capnp::word>((dat.length() / sizeof(capnp::word)) + 1);
+    memcpy(amsg.begin(), dat.data(), dat.length());
+    capnp::FlatArrayMessageReader reader(amsg);
+    auto packed = reader.getRoot<cereal::Event>().getSendcan();
+
+    capnp::MallocMessageBuilder msg;
+    cereal::Event::Builder event = msg.initRoot<cereal::Event>();
+    event.setLogMonoTime(nanos_since_boot());
+    int n = 0;
+    for (int i = 0; i < plans.size(); i++) n += plans[i].checksum;
+    if (n == 0) continue;
+
+    auto corrupt = event.initSendcan(n);
+    n = 0;
+    for (int i = 0; i < plans.size(); i++) {
+      if (!plans[i].checksum) continue;
+      uint8_t frame[CANFD_MAX_DLEN];
+      auto src = packed[i].getDat();
+      memcpy(frame, src.begin(), src.size());
+      int bit = gen() % (src.size() * 8);
+      frame[bit / 8] ^= 1 << (bit % 8);
+
+      corrupt[n].setAddress(packed[i].getAddress());
+      corrupt[n].setBusTime(0);
+      corrupt[n].setSrc(BUS);
+      corrupt[n].setDat(kj::arrayPtr(frame, src.size()));
+      n++;
+    }
+    auto words = capnp::messageToFlatArray(msg);
+    auto bytes = words.asBytes();
+    corrupt_parser.update_string(std::string(bytes.begin(), bytes.end()), true);
+    std::vector<SignalValue> corrupt_vals = corrupt_parser.query_latest();
+
+    corrupt_total += n;
+    uint32_t last_address = 0xFFFFFFFF;
+    for (const auto &v : corrupt_vals) {
+      if (v.address == last_address) continue;
+      last_address = v.address;
+      if (corrupt_accepted < 10) printf("  corrupted frame 0x%X accepted\n", v.address);
+      corrupt_accepted++;
+    }
+  }
+
+  // every frame was counted, and the drops were counted as failures
+  for (const auto &h : parser.query_health()) {
+    if (h.frames != CYCLES) {
+      printf("  0x%X: health counted %d frames, sent %d\n", h.address, (int)h.frames, CYCLES);
+      mismatches++;
+    }
+  }
+  uint64_t corrupt_fails = 0;
+  for (const auto &h : corrupt_parser.query_health()) {
+    corrupt_fails += h.checksum_fails + h.counter_fails;
+  }
+  if (corrupt_fails < corrupt_total - corrupt_accepted) {
+    printf("  health counted %d failures for %d dropped frames\n", (int)corrupt_fails, corrupt_total - corrupt_accepted);
+    mismatches++;
+  }
+
+  printf("%-50s %3zu msgs %8.0f pack frames/s %8.0f parse frames/s %5.1f pack allocs/cycle %5.1f parse allocs/cycle, "
+         "%d mismatches, %d/%d corrupted frames rejected\n",
+         name.c_str(), plans.size(), frames / (pack_ms / 1000.), frames / (parse_ms / 1000.),
+         (double)pack_allocs / CYCLES, (double)parse_allocs / CYCLES,
+         mismatches, corrupt_total - corrupt_accepted, corrupt_total);
+  return mismatches + corrupt_accepted;
+}
+
+int main(int argc, char** argv) {
+  std::vector<std::string> names;
+  for (int i = 1; i < argc; i++) {
+    names.push_back(argv[i]);
+  }
+  if (names.empty()) {
+    names = list_dbcs();
+  }
+
+  std::mt19937_64 gen(0);
+  int failures = 0;
+  for (const auto &name : names) {
+    failures += fuzz_dbc(name, gen);
+  }
+
+  printf("%zu dbcs, %d failures\n", names.size(), failures);
+  return failures != 0;
+}
@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+import unittest
+
+from cereal import log
+from opendbc.can.packer import CANPacker
+from selfdrive.boardd.boardd import can_list_to_can_capnp
+
+DBC = "honda_civic_touring_2016_can_generated"
+
+
+class TestPackSendcan(unittest.TestCase):
+  def setUp(self):
+    self.packer = CANPacker(DBC)
+
+  def assertSameSendcan(self, native, python):
+    native = log.Event.from_bytes(native)
+    python = log.Event.from_bytes(python)
+    self.assertEqual(native.valid, python.valid)
+    self.assertEqual(len(native.sendcan), len(python.sendcan))
+    for n, p in zip(native.sendcan, python.sendcan):
+      self.assertEqual(n.address, p.address)
+      self.assertEqual(n.dat, p.dat)
+      self.assertEqual(n.src, p.src)
+
+  def test_matches_python_path(self):
+    for i in range(64):
+      msgs = [
+        ("STEERING_CONTROL", 0, {"STEER_TORQUE": i * 40 - 1280, "STEER_TORQUE_REQUEST": i % 2}, i % 4),
+        ("ACC_HUD", 0, {"PCM_SPEED": i, "PCM_GAS": i % 128}, i % 4),
+        (506, 2, {"COMPUTER_BRAKE": i * 3, "AEB_REQ_1": 1}, i % 4),
+      ]
+      valid = i % 3 != 0
+
+      python = [self.packer.make_can_msg(name, bus, values, counter) for name, bus, values, counter in msgs]
+      self.assertSameSendcan(self.packer.make_sendcan(msgs, valid),
+                             can_list_to_can_capnp(python, msgtype='sendcan', valid=valid))
+
+  def test_volkswagen_cycle(self):
+    packer = CANPacker("vw_mqb_2010")
+    for i in range(16):
+      msgs = [
+        ("HCA_01", 0, {"Assist_Torque": i * 20, "Assist_Requested": 1, "HCA_Available": 1}, i),
+        ("LDW_02", 0, {"Kombi_Lamp_Green": i % 2, "Right_Lane_Status": i % 4}, -1),
+        ("GRA_ACC_01", 0, {"GRA_Tip_Setzen": i % 2}, i),
+      ]
+      python = [packer.make_can_msg(name, bus, values, counter) for name, bus, values, counter in msgs]
+      self.assertSameSendcan(packer.make_sendcan(msgs, True),
+                             can_list_to_can_capnp(python, msgtype='sendcan', valid=True))
+
+  def test_undefined_message_is_dropped(self):
+    msgs = [
+      ("STEERING_CONTROL", 0, {"STEER_TORQUE": 100}, 1),
+      (0x7ff, 0, {}, -1),
+      ("ACC_HUD", 0, {"PCM_SPEED": 10}, 2),
+    ]
+    event = log.Event.from_bytes(self.packer.make_sendcan(msgs))
+    self.assertEqual([m.address for m in event.sendcan], [228, 780])
+
+    python = [self.packer.make_can_msg(name, bus, values, counter) for name, bus, values, counter in msgs if name != 0x7ff]
+    self.assertSameSendcan(self.packer.make_sendcan(msgs),
+                           can_list_to_can_capnp(python, msgtype='sendcan'))
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,153 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <capnp/serialize.h>
+#include "cereal/gen/cpp/log.capnp.h"
+#include "opendbc/can/common.h"
+
+// Checks CANParser::UpdateValid, which keeps the checked messages in a heap
+// keyed on their deadlines, against the scan over every message it replaced:
+// can_valid has to agree on every cycle and the timeouts in query_health on
+// every message. Frames come in runs of steady traffic, dropouts and silence,
+// on exact 10 ms steps, where a message can land right on its threshold, and
+// on jittered ones.
+// usage: test_update_valid [dbc_name ...]
+
+#define CYCLES 200000
+#define BUS 0
+
+struct RefState {
+  uint32_t address;
+  uint64_t check_threshold;
+  uint64_t seen;
+  bool timed_out;
+  uint64_t timeouts;
+};
+
+// the scan UpdateValid used to do
+static bool ref_update_valid(std::vector<RefState> &states, uint64_t sec) {
+  bool valid = true;
+  for (auto &state : states) {
+    bool missing = state.check_threshold > 0 && (sec - state.seen) > state.check_threshold;
+    if (missing) {
+      if (state.seen > 0 && !state.timed_out) {
+        state.timeouts++;
+      }
+      valid = false;
+    }
+    state.timed_out = missing;
+  }
+  return valid;
+}
+
+// returns the number of failures
+static int test_dbc(const std::string &name, std::mt19937 &gen) {
+  const DBC *dbc = dbc_lookup(name);
+  if (!dbc) {
+    printf("%s: can't load\n", name.c_str());
+    return 1;
+  }
+
+  // frames come from the packer, so checksums and counters are valid and only timing decides
+  std::vector<MessageParseOptions> options;
+  std::vector<RefState> states;
+  std::vector<int> counter_bits;
+  for (int i = 0; i < dbc->num_msgs; i++) {
+    const Msg &msg = dbc->msgs[i];
+    bool packable = msg.size <= 8;
+    int bits = 0;
+    for (int j = 0; j < msg.num_sigs; j++) {
+      const Signal &sig = msg.sigs[j];
+      // the packer doesn't compute the pedal checksum, or a subaru one outside byte 0
+      if (sig.type == SignalType::PEDAL_CHECKSUM || sig.type == SignalType::PEDAL_COUNTER) packable = false;
+      if (sig.type == SignalType::SUBARU_CHECKSUM && sig.b1 != 0) packable = false;
+      if (sig.type == SignalType::HONDA_COUNTER || sig.type == SignalType::VOLKSWAGEN_COUNTER) bits = sig.b2;
+    }
+    if (!packable) continue;
+
+    // a third are parsed but not checked, half of the rest have thresholds in whole 10 ms steps
+    static const int round_freqs[] = {1, 2, 5, 10, 20, 25, 50, 100};
+    int freq = gen() % 3 == 0 ? 0 : (gen() % 2 ? round_freqs[gen() % 8] : 1 + gen() % 100);
+    options.push_back({msg.address, freq});
+    states.push_back({msg.address, freq > 0 ? (1000000000ULL / freq) * 10 : 0, 0, false, 0});
+    counter_bits.push_back(bits);
+  }
+  if (states.empty()) {
+    printf("%s: no messages the packer can make, skipped\n", name.c_str());
+    return 0;
+  }
+
+  CANParser parser(BUS, name, options, {});
+  CANPacker packer(name);
+  std::vector<int> counters(states.size(), 0);
+
+  uint64_t sec = 1000000000000ULL;
+  int valid_cycles = 0, flips = 0;
+  bool last_valid = false;
+  for (int cycle = 0; cycle < CYCLES; cycle++) {
+    // jitter in every other run of 2000 cycles, the exact ones hit the thresholds on the dot
+    bool jitter = (cycle / 2000) % 2;
+    sec += 10000000 + (jitter ? gen() % 1000000 : 0);
+
+    // percent of messages sent this cycle: steady, lossy, bursty, then silent for a while
+    int mode = (cycle / 500) % 4;
+    unsigned int chance = mode == 0 ? 98 : (mode == 1 ? 50 : (mode == 2 ? 5 : 0));
+
+    std::vector<CanPackMessage> sendcan;
+    for (size_t i = 0; i < states.size(); i++) {
+      if (gen() % 100 >= chance) continue;
+      int counter = counter_bits[i] > 0 ? counters[i]++ & ((1 << counter_bits[i]) - 1) : -1;
+      sendcan.push_back({states[i].address, BUS, counter, {}});
+      states[i].seen = sec;
+    }
+
+    // straight to UpdateCans, the packer stamps the event with the wall clock rather than sec
+    std::string dat = packer.pack_sendcan(sendcan, true);
+    auto amsg = kj::heapArray<capnp::word>((dat.size() / sizeof(capnp::word)) + 1);
+    memcpy(amsg.begin(), dat.data(), dat.size());
+    capnp::FlatArrayMessageReader reader(amsg);
+    parser.UpdateCans(sec, reader.getRoot<cereal::Event>().getSendcan());
+    parser.UpdateValid(sec);
+
+    bool ref_valid = ref_update_valid(states, sec);
+    if (parser.can_valid != ref_valid) {
+      printf("%s: cycle %d can_valid %d, the scan says %d\n", name.c_str(), cycle, parser.can_valid, ref_valid);
+      return 1;
+    }
+    valid_cycles += ref_valid;
+    flips += cycle > 0 && ref_valid != last_valid;
+    last_valid = ref_valid;
+  }
+
+  int failures = 0;
+  for (const auto &h : parser.query_health()) {
+    for (const auto &state : states) {
+      if (state.address == h.address && state.timeouts != h.timeouts) {
+        printf("%s: 0x%X %d timeouts, the scan counted %d\n", name.c_str(), h.address, (int)h.timeouts, (int)state.timeouts);
+        failures++;
+      }
+    }
+  }
+
+  printf("%-48s %3zu messages, valid on %d of %d cycles, %d changes\n", name.c_str(), states.size(), valid_cycles, CYCLES, flips);
+  return failures;
+}
+
+int main(int argc, char** argv) {
+  std::vector<std::string> names = {"toyota_adas", "honda_civic_touring_2016_can_generated", "vw_mqb_2010"};
+  if (argc > 1) {
+    names.assign(argv + 1, argv + argc);
+  }
+
+  std::mt19937 gen(0);
+  int failures = 0;
+  for (const auto &name : names) {
+    failures += test_dbc(name, gen);
+  }
+  printf(failures ? "FAILED\n" : "UpdateValid matches the scan\n");
+  return failures != 0;
+}
@@ -96,30 +96,92 @@ uint32_t get_ts_elapsed(uint32_t ts, uint32_t ts_last) {
   return ts - ts_last;
 }
 
+AddrCheckLookup addr_check_lookup[ADDR_CHECK_LOOKUP_SIZE];
+AddrCheckStruct *addr_check_lookup_list = NULL;  // the list the lookup was built for, NULL if none
+
+static uint32_t addr_check_hash(int addr, int bus) {
+  // multiplicative hash, the top bits are the best mixed
+  uint32_t key = ((uint32_t)addr << 2) | ((uint32_t)bus & 3U);
+  return (key * 2654435761U) >> (32U - ADDR_CHECK_LOOKUP_BITS);
+}
+
+void addr_check_lookup_init(AddrCheckStruct addr_list[], const int len) {
+  addr_check_lookup_list = NULL;
+  for (uint32_t i = 0U; i < ADDR_CHECK_LOOKUP_SIZE; i++) {
+    addr_check_lookup[i].addr = 0U;
+  }
+
+  int entries = 0;
+  for (int i = 0; i < len; i++) {
+    for (uint8_t j = 0U; addr_list[i].msg[j].addr != 0; j++) {
+      entries++;
+    }
+  }
+
+  // lists that don't fit keep using the linear scan
+  if ((addr_list != NULL) && (entries > 0) && (entries <= (int)(ADDR_CHECK_LOOKUP_SIZE / 2U))) {
+    // inserted in list order, so messages with the same key are probed in the order the scan would see them
+    for (int i = 0; i < len; i++) {
+      for (uint8_t j = 0U; addr_list[i].msg[j].addr != 0; j++) {
+        const CanMsgCheck *m = &addr_list[i].msg[j];
+        uint32_t slot = addr_check_hash(m->addr, m->bus);
+        while (addr_check_lookup[slot].addr != 0U) {
+          slot = (slot + 1U) & (ADDR_CHECK_LOOKUP_SIZE - 1U);
+        }
+        addr_check_lookup[slot].addr = m->addr;
+        addr_check_lookup[slot].bus = m->bus;
+        addr_check_lookup[slot].len = m->len;
+        addr_check_lookup[slot].index = i;
+        addr_check_lookup[slot].msg = j;
+      }
+    }
+    addr_check_lookup_list = addr_list;
+  }
+}
+
 int get_addr_check_index(CAN_FIFOMailBox_TypeDef *to_push, AddrCheckStruct addr_list[], const int len) {
   int bus = GET_BUS(to_push);
   int addr = GET_ADDR(to_push);
   int length = GET_LEN(to_push);
 
   int index = -1;
-  for (int i = 0; i < len; i++) {
-    // if multiple msgs are allowed, determine which one is present on the bus
-    if (!addr_list[i].msg_seen) {
-      for (uint8_t j = 0U; addr_list[i].msg[j].addr != 0; j++) {
-        if ((addr == addr_list[i].msg[j].addr) && (bus == addr_list[i].msg[j].bus) &&
-              (length == addr_list[i].msg[j].len)) {
-          addr_list[i].index = j;
-          addr_list[i].msg_seen = true;
+  if ((addr_list == addr_check_lookup_list) && (addr_list != NULL)) {
+    uint32_t slot = addr_check_hash(addr, bus);
+    while (addr_check_lookup[slot].addr != 0U) {
+      AddrCheckLookup *l = &addr_check_lookup[slot];
+      if ((addr == (int)l->addr) && (bus == l->bus) && (length == l->len)) {
+        // if multiple msgs are allowed, the first one present on the bus is the one checked
+        if (!addr_list[l->index].msg_seen) {
+          addr_list[l->index].index = l->msg;
+          addr_list[l->index].msg_seen = true;
+        }
+        if (addr_list[l->index].index == l->msg) {
+          index = l->index;
           break;
         }
       }
+      slot = (slot + 1U) & (ADDR_CHECK_LOOKUP_SIZE - 1U);
     }
+  } else {
+    for (int i = 0; i < len; i++) {
+      // if multiple msgs are allowed, determine which one is present on the bus
+      if (!addr_list[i].msg_seen) {
+        for (uint8_t j = 0U; addr_list[i].msg[j].addr != 0; j++) {
+          if ((addr == addr_list[i].msg[j].addr) && (bus == addr_list[i].msg[j].bus) &&
+                (length == addr_list[i].msg[j].len)) {
+            addr_list[i].index = j;
+            addr_list[i].msg_seen = true;
+            break;
+          }
+        }
+      }
 
-    int idx = addr_list[i].index;
-    if ((addr == addr_list[i].msg[idx].addr) && (bus == addr_list[i].msg[idx].bus) &&
-        (length == addr_list[i].msg[idx].len)) {
-      index = i;
-      break;
+      int idx = addr_list[i].index;
+      if ((addr == addr_list[i].msg[idx].addr) && (bus == addr_list[i].msg[idx].bus) &&
+          (length == addr_list[i].msg[idx].len)) {
+        index = i;
+        break;
+      }
     }
   }
   return index;
@@ -309,6 +371,7 @@ int set_safety_hooks(uint16_t mode, int16_t param) {
       safety_hook_registry[i].hooks->addr_check[j].msg_seen = false;
     }
   }
+  addr_check_lookup_init(current_hooks->addr_check, current_hooks->addr_check_len);
   if ((set_status == 0) && (current_hooks->init != NULL)) {
     current_hooks->init(param);
   }
@@ -43,6 +43,20 @@ typedef struct {
   bool lagging;                      // true if and only if the time between updates is excessive
 } AddrCheckStruct;
 
+// Open addressed hash of every message in the current mode's rx checks, so
+// get_addr_check_index doesn't scan them for each received frame. Built by
+// set_safety_hooks, kept at most half full so misses end after a probe or two.
+#define ADDR_CHECK_LOOKUP_BITS 5U
+#define ADDR_CHECK_LOOKUP_SIZE (1U << ADDR_CHECK_LOOKUP_BITS)
+
+typedef struct {
+  uint32_t addr;  // 0 marks an empty slot, like it ends CanMsgCheck lists
+  uint8_t bus;
+  uint8_t len;
+  uint8_t index;  // into the addr_check list
+  uint8_t msg;    // into addr_check[index].msg
+} AddrCheckLookup;
+
 int safety_rx_hook(CAN_FIFOMailBox_TypeDef *to_push);
 int safety_tx_hook(CAN_FIFOMailBox_TypeDef *to_send);
 int safety_tx_lin_hook(int lin_num, uint8_t *data, int len);
@@ -59,6 +73,7 @@ bool rt_rate_limit_check(int val, int val_last, const int MAX_RT_DELTA);
 float interpolate(struct lookup_t xy, float x);
 void gen_crc_lookup_table(uint8_t poly, uint8_t crc_lut[]);
 bool msg_allowed(CAN_FIFOMailBox_TypeDef *to_send, const CanMsg msg_list[], int len);
+void addr_check_lookup_init(AddrCheckStruct addr_list[], const int len);
 int get_addr_check_index(CAN_FIFOMailBox_TypeDef *to_push, AddrCheckStruct addr_list[], const int len);
 void update_counter(AddrCheckStruct addr_list[], int index, uint8_t counter);
 void update_addr_timestamp(AddrCheckStruct addr_list[], int index);
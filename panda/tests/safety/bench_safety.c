@@ -0,0 +1,387 @@
+/*
+Replays CAN through the safety hooks on the host and reports what each safety
+mode costs per frame. Received frames go through safety_rx_hook and
+safety_fwd_hook like they do in the CAN interrupt, sent ones through
+safety_tx_hook.
+
+usage: bench_safety [--modes 2,8,24] [--param n] [--repeat n] [can.txt]
+
+can.txt is what can_dump.py writes. Without it every mode gets synthesized
+traffic: its own rx checked messages at their expected rate, with counters that
+count and checksums that check, on top of random frames that match nothing, and
+its tx messages at 100 Hz.
+
+Cycles come from the CPU cycle counter (perf_event_open) when the kernel lets
+us, ns are always reported.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "safety_host.h"
+
+#define SYNTH_FRAMES 200000
+#define SYNTH_INTERVAL_US 100U
+#define SYNTH_TX_INTERVAL_US 10000U
+#define SYNTH_SEARCH (1 << 20)  // random payloads tried for one with a valid checksum and counter
+
+typedef struct {
+  uint32_t ts;  // us
+  bool tx;
+  CAN_FIFOMailBox_TypeDef msg;
+} frame_t;
+
+static frame_t *frames = NULL;
+static int frames_len = 0;
+static int frames_cap = 0;
+
+static frame_t *frame_add(void) {
+  if (frames_len == frames_cap) {
+    frames_cap = frames_cap ? frames_cap * 2 : 0x10000;
+    frames = realloc(frames, frames_cap * sizeof(frame_t));
+    if (frames == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+  return &frames[frames_len++];
+}
+
+static int load_dump(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+
+  char line[256], dir[8], hex[64];
+  unsigned long long ts;
+  unsigned int bus, addr;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    hex[0] = '\0';
+    if (sscanf(line, "%llu %7s %u %x %63s", &ts, dir, &bus, &addr, hex) < 4) continue;
+
+    uint8_t dat[8] = {0};
+    int len = MIN((int)strlen(hex) / 2, 8);
+    for (int i = 0; i < len; i++) {
+      unsigned int b;
+      sscanf(&hex[i * 2], "%2x", &b);
+      dat[i] = b;
+    }
+
+    frame_t *fr = frame_add();
+    fr->ts = (uint32_t)ts;
+    fr->tx = strcmp(dir, "tx") == 0;
+    can_frame(&fr->msg, addr, bus, dat, len);
+  }
+  fclose(f);
+  return frames_len;
+}
+
+typedef uint8_t (*msg_field)(CAN_FIFOMailBox_TypeDef *msg);
+
+// what the synthesized traffic needs to know about a mode beyond its hooks:
+// the functions its rx hook passes to addr_safety_check and the messages its
+// tx hook allows
+typedef struct {
+  const safety_hooks *hooks;
+  msg_field get_checksum;
+  msg_field compute_checksum;
+  msg_field get_counter;
+  const CanMsg *tx_msgs;
+  int tx_msgs_len;
+} synth_mode;
+
+#define TX_MSGS(msgs) msgs, sizeof(msgs) / sizeof(msgs[0])
+
+static const synth_mode synth_modes[] = {
+  {&honda_nidec_hooks, honda_get_checksum, honda_compute_checksum, honda_get_counter, TX_MSGS(HONDA_N_TX_MSGS)},
+  {&honda_bosch_giraffe_hooks, honda_get_checksum, honda_compute_checksum, honda_get_counter, TX_MSGS(HONDA_BG_TX_MSGS)},
+  {&honda_bosch_harness_hooks, honda_get_checksum, honda_compute_checksum, honda_get_counter, TX_MSGS(HONDA_BH_TX_MSGS)},
+  {&toyota_hooks, toyota_get_checksum, toyota_compute_checksum, NULL, TX_MSGS(TOYOTA_TX_MSGS)},
+  {&gm_hooks, NULL, NULL, NULL, TX_MSGS(GM_TX_MSGS)},
+  {&hyundai_hooks, hyundai_get_checksum, hyundai_compute_checksum, hyundai_get_counter, TX_MSGS(HYUNDAI_TX_MSGS)},
+  {&hyundai_legacy_hooks, hyundai_get_checksum, hyundai_compute_checksum, hyundai_get_counter, TX_MSGS(HYUNDAI_TX_MSGS)},
+  {&hyundai_community_hooks, hyundai_get_checksum, hyundai_compute_checksum, hyundai_get_counter, TX_MSGS(HYUNDAI_COMMUNITY_TX_MSGS)},
+  {&chrysler_hooks, chrysler_get_checksum, chrysler_compute_checksum, chrysler_get_counter, TX_MSGS(CHRYSLER_TX_MSGS)},
+  {&subaru_hooks, subaru_get_checksum, subaru_compute_checksum, subaru_get_counter, TX_MSGS(SUBARU_TX_MSGS)},
+  {&subaru_legacy_hooks, NULL, NULL, NULL, TX_MSGS(SUBARU_L_TX_MSGS)},
+  {&volkswagen_mqb_hooks, volkswagen_get_checksum, volkswagen_mqb_compute_crc, volkswagen_mqb_get_counter, TX_MSGS(VOLKSWAGEN_MQB_TX_MSGS)},
+  {&volkswagen_pq_hooks, volkswagen_get_checksum, volkswagen_pq_compute_checksum, volkswagen_pq_get_counter, TX_MSGS(VOLKSWAGEN_PQ_TX_MSGS)},
+  {&nissan_hooks, NULL, NULL, NULL, TX_MSGS(NISSAN_TX_MSGS)},
+  {&mazda_hooks, NULL, NULL, NULL, TX_MSGS(MAZDA_TX_MSGS)},
+};
+
+static const synth_mode *get_synth_mode(const safety_hooks *hooks) {
+  for (unsigned int i = 0; i < sizeof(synth_modes) / sizeof(synth_modes[0]); i++) {
+    if (synth_modes[i].hooks == hooks) return &synth_modes[i];
+  }
+  return NULL;
+}
+
+// a payload the rx hook takes: the counter reads counter and the checksum
+// checks. Found by trying random ones against the mode's own functions, so
+// no signal layout is repeated here.
+static bool valid_payload(const synth_mode *sm, const CanMsgCheck *m, uint8_t counter, uint8_t dat[8]) {
+  bool check_counter = (sm != NULL) && (sm->get_counter != NULL) && (m->max_counter > 0U);
+  bool check_checksum = (sm != NULL) && (sm->get_checksum != NULL) && (sm->compute_checksum != NULL) && m->check_checksum;
+  for (int n = 0; n < SYNTH_SEARCH; n++) {
+    for (int i = 0; i < 8; i++) dat[i] = rand();
+    CAN_FIFOMailBox_TypeDef msg;
+    can_frame(&msg, m->addr, m->bus, dat, m->len);
+    if (check_counter && (sm->get_counter(&msg) != counter)) continue;
+    if (check_checksum && (sm->get_checksum(&msg) != sm->compute_checksum(&msg))) continue;
+    return true;
+  }
+  return false;
+}
+
+static bool is_checked(const safety_hooks *hooks, uint32_t addr, int bus) {
+  for (int i = 0; i < hooks->addr_check_len; i++) {
+    for (int j = 0; hooks->addr_check[i].msg[j].addr != 0; j++) {
+      const CanMsgCheck *m = &hooks->addr_check[i].msg[j];
+      if (((uint32_t)m->addr == addr) && (m->bus == bus)) return true;
+    }
+  }
+  return false;
+}
+
+// random frames with this mode's checked messages mixed in at their expected
+// rate, and its tx messages, all zero like the commands openpilot sends while
+// disengaged. Modes without a tx list send to a few random addresses.
+static void synthesize(const safety_hook_config *cfg, int16_t param) {
+  frames_len = 0;
+  srand(1);
+  const safety_hooks *hooks = cfg->hooks;
+  const synth_mode *sm = get_synth_mode(hooks);
+
+  // checksums can use tables the mode's init fills in
+  set_safety_hooks(cfg->id, param);
+
+  // one valid payload per counter value, sent in turn
+  static uint8_t payloads[64][16][8];
+  int payloads_len[64] = {0};
+  int sent[64] = {0};
+  uint32_t next[64] = {0};
+  int checks = MIN(hooks->addr_check_len, 64);
+  for (int i = 0; i < checks; i++) {
+    const CanMsgCheck *m = &hooks->addr_check[i].msg[0];
+    payloads_len[i] = MIN(m->max_counter + 1, 16);
+    for (int c = 0; c < payloads_len[i]; c++) {
+      if (!valid_payload(sm, m, c, payloads[i][c])) {
+        fprintf(stderr, "no valid payload for 0x%X on bus %d, it gets random ones\n", m->addr, m->bus);
+      }
+    }
+  }
+
+  CanMsg tx_random[4];
+  const CanMsg *tx_msgs = tx_random;
+  int tx_len = 4;
+  if (sm != NULL) {
+    tx_msgs = sm->tx_msgs;
+    tx_len = MIN(sm->tx_msgs_len, 32);
+  } else {
+    for (int i = 0; i < tx_len; i++) tx_random[i] = (CanMsg){rand() % 0x800, 0, 8};
+  }
+  uint32_t next_tx[32] = {0};
+  for (int i = 0; i < tx_len; i++) next_tx[i] = (i * SYNTH_TX_INTERVAL_US) / tx_len;
+
+  uint32_t ts = 0;
+  for (int n = 0; n < SYNTH_FRAMES; n++) {
+    ts += SYNTH_INTERVAL_US;
+    uint8_t dat[8];
+    for (int i = 0; i < 8; i++) dat[i] = rand();
+
+    // noise stays off the checked messages, or it would break their counters
+    uint32_t addr;
+    int bus;
+    do {
+      addr = rand() % 0x800;
+      bus = rand() % 3;
+    } while (is_checked(hooks, addr, bus));
+
+    frame_t *fr = frame_add();
+    fr->ts = ts;
+    fr->tx = false;
+    can_frame(&fr->msg, addr, bus, dat, 8);
+
+    for (int i = 0; i < checks; i++) {
+      const CanMsgCheck *m = &hooks->addr_check[i].msg[0];
+      uint32_t step = MAX(m->expected_timestep, 1000U);
+      if (ts >= next[i]) {
+        next[i] = ts + step;
+        fr = frame_add();
+        fr->ts = ts;
+        fr->tx = false;
+        can_frame(&fr->msg, m->addr, m->bus, payloads[i][sent[i]++ % payloads_len[i]], m->len);
+      }
+    }
+
+    for (int i = 0; i < tx_len; i++) {
+      if (ts >= next_tx[i]) {
+        next_tx[i] += SYNTH_TX_INTERVAL_US;
+        const uint8_t zeros[8] = {0};
+        fr = frame_add();
+        fr->ts = ts;
+        fr->tx = true;
+        can_frame(&fr->msg, tx_msgs[i].addr, tx_msgs[i].bus, zeros, tx_msgs[i].len);
+      }
+    }
+  }
+}
+
+static int perf_fd = -1;
+
+static void perf_open(void) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CPU_CYCLES;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  perf_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  if (perf_fd < 0) {
+    fprintf(stderr, "no cycle counter, only reporting ns\n");
+  }
+}
+
+static uint64_t nanos(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+typedef struct {
+  uint64_t ns;
+  uint64_t cycles;
+} cost_t;
+
+// one replay from a freshly set mode, so every run sees the same state
+static cost_t replay(uint16_t mode, int16_t param, bool with_tx) {
+  set_safety_hooks(mode, param);
+
+  cost_t ret = {0, 0};
+  if (perf_fd >= 0) {
+    ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  uint64_t start = nanos();
+
+  for (int i = 0; i < frames_len; i++) {
+    frame_t *fr = &frames[i];
+    TIM2->CNT = fr->ts;
+    if (!fr->tx) {
+      safety_rx_hook(&fr->msg);
+      safety_fwd_hook(GET_BUS(&fr->msg), &fr->msg);
+    } else if (with_tx) {
+      safety_tx_hook(&fr->msg);
+    }
+  }
+
+  ret.ns = nanos() - start;
+  if (perf_fd >= 0) {
+    ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+    long long cycles = 0;
+    if (read(perf_fd, &cycles, sizeof(cycles)) == sizeof(cycles)) ret.cycles = cycles;
+  }
+  return ret;
+}
+
+// best of repeat runs, the minimum is the least disturbed one. The rx only
+// and full replays take turns so drift hits both alike.
+static void measure(uint16_t mode, int16_t param, int repeat, cost_t *rx, cost_t *all) {
+  *rx = (cost_t){UINT64_MAX, UINT64_MAX};
+  *all = (cost_t){UINT64_MAX, UINT64_MAX};
+  for (int r = 0; r < repeat; r++) {
+    cost_t c = replay(mode, param, false);
+    rx->ns = MIN(rx->ns, c.ns);
+    rx->cycles = MIN(rx->cycles, c.cycles);
+    c = replay(mode, param, true);
+    all->ns = MIN(all->ns, c.ns);
+    all->cycles = MIN(all->cycles, c.cycles);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  const char *path = NULL;
+  bool all_modes = true;
+  bool selected[256] = {false};  // by safety mode id
+  int16_t param = 0;
+  int repeat = 5;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--modes") == 0 && i + 1 < argc) {
+      all_modes = false;
+      for (char *tok = strtok(argv[++i], ","); tok != NULL; tok = strtok(NULL, ",")) {
+        selected[atoi(tok) & 0xFF] = true;
+      }
+    } else if (strcmp(argv[i], "--param") == 0 && i + 1 < argc) {
+      param = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+      repeat = MAX(atoi(argv[++i]), 1);
+    } else if (argv[i][0] != '-' && path == NULL) {
+      path = argv[i];
+    } else {
+      fprintf(stderr, "usage: %s [--modes 2,8,24] [--param n] [--repeat n] [can.txt]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (path != NULL && load_dump(path) <= 0) {
+    fprintf(stderr, "no frames in %s\n", path);
+    return 1;
+  }
+  perf_open();
+
+  printf("%5s %8s %8s %12s %10s %12s %10s\n", "mode", "rx", "tx", "rx cyc/frm", "rx ns/frm", "tx cyc/frm", "tx ns/frm");
+
+  int hook_config_count = sizeof(safety_hook_registry) / sizeof(safety_hook_config);
+  for (int m = 0; m < hook_config_count; m++) {
+    const safety_hook_config *cfg = &safety_hook_registry[m];
+    if (!all_modes && !selected[cfg->id & 0xFFU]) continue;
+
+    if (path == NULL) synthesize(cfg, param);
+    int rx_frames = 0, tx_frames = 0;
+    for (int i = 0; i < frames_len; i++) {
+      if (frames[i].tx) {
+        tx_frames++;
+      } else {
+        rx_frames++;
+      }
+    }
+
+    // the tx cost is what the full replay costs on top of the rx only one
+    cost_t rx, all;
+    measure(cfg->id, param, repeat, &rx, &all);
+
+    printf("%5u %8d %8d", cfg->id, rx_frames, tx_frames);
+    if (perf_fd >= 0) {
+      printf(" %12.1f", (double)rx.cycles / MAX(rx_frames, 1));
+    } else {
+      printf(" %12s", "-");
+    }
+    printf(" %10.1f", (double)rx.ns / MAX(rx_frames, 1));
+    if (tx_frames > 0 && perf_fd >= 0) {
+      printf(" %12.1f", ((double)all.cycles - (double)rx.cycles) / tx_frames);
+    } else {
+      printf(" %12s", "-");
+    }
+    if (tx_frames > 0) {
+      printf(" %10.1f", ((double)all.ns - (double)rx.ns) / tx_frames);
+    } else {
+      printf(" %10s", "-");
+    }
+    printf("\n");
+  }
+
+  free(frames);
+  return 0;
+}
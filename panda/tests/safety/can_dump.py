@@ -0,0 +1,41 @@
+#!/usr/bin/env python3
+# Writes the CAN in an rlog as text for bench_safety, one frame per line:
+#   <time us> <rx|tx> <bus> <addr hex> <data hex>
+# can becomes rx and sendcan tx. Echoes of sent frames are left out.
+#
+# usage: can_dump.py rlog.bz2 > can.txt
+import bz2
+import sys
+
+from cereal import log
+
+
+def main(path):
+  with open(path, "rb") as f:
+    dat = f.read()
+  if path.endswith(".bz2"):
+    dat = bz2.decompress(dat)
+
+  start = None
+  out = sys.stdout
+  for event in log.Event.read_multiple_bytes(dat):
+    which = event.which()
+    if which not in ("can", "sendcan"):
+      continue
+    if start is None:
+      start = event.logMonoTime
+
+    ts = (event.logMonoTime - start) // 1000
+    direction = "rx" if which == "can" else "tx"
+    for c in getattr(event, which):
+      # 0x80 marks echoes, 0xc0 frames the panda refused to send
+      if c.src >= 4:
+        continue
+      out.write("%d %s %d %x %s\n" % (ts, direction, c.src, c.address, c.dat.hex()))
+
+
+if __name__ == "__main__":
+  if len(sys.argv) != 2:
+    print("usage: %s rlog[.bz2] > can.txt" % sys.argv[0], file=sys.stderr)
+    sys.exit(1)
+  main(sys.argv[1])
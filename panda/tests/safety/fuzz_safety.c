@@ -0,0 +1,85 @@
+/*
+libFuzzer target for the safety hooks, build with make fuzz_safety and run
+./fuzz_safety corpus/ to keep the corpus around between runs.
+
+The input picks a safety mode and its param, the rest is a list of
+operations: frames through the rx, tx and fwd hooks, the 1 Hz tick and
+time passing. Bugs show up as address or undefined behavior sanitizer
+reports, or as a failed check below.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "safety_host.h"
+
+#define OP_RX 0U
+#define OP_TX 1U
+#define OP_FWD 2U
+#define OP_TICK 3U
+#define OP_CNT 4U
+
+// op, time step in 100 us, bus, 4 bytes addr, len, 8 bytes data
+#define OP_SIZE 16
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "check failed: %s (mode %u)\n", #cond, current_safety_mode); \
+      abort(); \
+    } \
+  } while (0)
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  if (size < 3U) return 0;
+
+  int hook_config_count = sizeof(safety_hook_registry) / sizeof(safety_hook_config);
+  uint16_t mode = safety_hook_registry[data[0] % hook_config_count].id;
+  int16_t param = (int16_t)(data[1] | (data[2] << 8));
+  TIM2->CNT = 0U;
+  CHECK(set_safety_hooks(mode, param) == 0);
+  unsafe_mode = 0;
+
+  for (size_t pos = 3U; pos + OP_SIZE <= size; pos += OP_SIZE) {
+    const uint8_t *op = &data[pos];
+    TIM2->CNT += op[1] * 100U;
+
+    uint32_t addr = op[3] | (op[4] << 8) | (op[5] << 16) | ((uint32_t)(op[6] & 0x1FU) << 24);
+    // 11 bit addresses would be cut off at 0x800 otherwise
+    if ((op[0] & 0x80U) == 0U) addr &= 0x7FFU;
+    int bus = op[2] % 4U;
+    int len = op[7] % 9U;
+
+    CAN_FIFOMailBox_TypeDef msg;
+    can_frame(&msg, addr, bus, &op[8], len);
+
+    switch ((op[0] & 0x7FU) % OP_CNT) {
+      case OP_RX:
+        safety_rx_hook(&msg);
+        break;
+      case OP_TX: {
+        bool allowed = safety_tx_hook(&msg) != 0;
+        // nothing a car safety mode lets out once it saw the relay fail
+        if (relay_malfunction && (mode != SAFETY_ALLOUTPUT) && (mode != SAFETY_ELM327)) {
+          CHECK(!allowed);
+        }
+        break;
+      }
+      case OP_FWD: {
+        // two digits forward to two buses, see can_rx in board/drivers/can.h
+        int fwd = safety_fwd_hook(bus, &msg);
+        CHECK((fwd >= -1) && ((fwd < 4) || ((fwd > 9) && (fwd < 40) && ((fwd % 10) < 4))));
+        break;
+      }
+      case OP_TICK:
+        safety_mode_cnt++;
+        safety_tick(current_hooks);
+        break;
+      default:
+        break;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,93 @@
+// Stand-in for the parts of the firmware the safety code touches, so
+// board/safety.h builds for x86 and ARM Linux. Include this instead of safety.h.
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ALLOW_DEBUG
+
+typedef struct {
+  uint32_t RIR;
+  uint32_t RDTR;
+  uint32_t RDLR;
+  uint32_t RDHR;
+} CAN_FIFOMailBox_TypeDef;
+
+// only the free running us counter is read
+typedef struct {
+  uint32_t CNT;
+} TIM_TypeDef;
+
+TIM_TypeDef timer;
+TIM_TypeDef *TIM2 = &timer;
+
+// from board/config.h
+#define MIN(a,b) \
+ ({ __typeof__ (a) _a = (a); \
+     __typeof__ (b) _b = (b); \
+   (_a < _b) ? _a : _b; })
+
+#define MAX(a,b) \
+ ({ __typeof__ (a) _a = (a); \
+     __typeof__ (b) _b = (b); \
+   (_a > _b) ? _a : _b; })
+
+#define ABS(a) \
+ ({ __typeof__ (a) _a = (a); \
+   (_a > 0) ? _a : (-_a); })
+
+#define UNUSED(x) ((void)(x))
+
+// from board/drivers/llcan.h
+#define GET_BUS(msg) (((msg)->RDTR >> 4) & 0xFF)
+#define GET_LEN(msg) ((msg)->RDTR & 0xF)
+#define GET_ADDR(msg) ((((msg)->RIR & 4) != 0) ? ((msg)->RIR >> 3) : ((msg)->RIR >> 21))
+#define GET_BYTE(msg, b) (((int)(b) > 3) ? (((msg)->RDHR >> (8U * ((unsigned int)(b) % 4U))) & 0xFFU) : (((msg)->RDLR >> (8U * (unsigned int)(b))) & 0xFFU))
+#define GET_BYTES_04(msg) ((msg)->RDLR)
+#define GET_BYTES_48(msg) ((msg)->RDHR)
+#define GET_FLAG(value, mask) (((__typeof__(mask))param & mask) == mask)
+
+// from board/faults.h
+#define FAULT_RELAY_MALFUNCTION (1U << 0)
+void fault_occurred(uint32_t fault) { UNUSED(fault); }
+void fault_recovered(uint32_t fault) { UNUSED(fault); }
+
+// from board/board_declarations.h, the CAN mode is the only thing safety sets
+#define CAN_MODE_NORMAL 0U
+#define CAN_MODE_OBD_CAN2 3U
+struct board {
+  void (*set_can_mode)(uint8_t mode);
+};
+uint8_t can_mode = CAN_MODE_NORMAL;
+static void host_set_can_mode(uint8_t mode) { can_mode = mode; }
+const struct board host_board = {.set_can_mode = host_set_can_mode};
+const struct board *current_board = &host_board;
+bool board_has_obd(void) { return true; }
+
+// the firmware prints to the debug UART, nothing to see here. puts is
+// renamed so it doesn't clash with stdio.
+#define puts safety_puts
+void safety_puts(const char *a) { UNUSED(a); }
+void puth(unsigned int i) { UNUSED(i); }
+
+// gmlan switch used by tesla
+void set_gmlan_digital_output(int to_set) { UNUSED(to_set); }
+void reset_gmlan_switch_timeout(void) {}
+void gmlan_switch_init(int timeout_enable) { UNUSED(timeout_enable); }
+
+#include "safety.h"
+#undef puts
+
+static inline void can_frame(CAN_FIFOMailBox_TypeDef *msg, uint32_t addr, int bus, const uint8_t *dat, int len) {
+  msg->RIR = (addr >= 0x800U) ? ((addr << 3) | 4U) : (addr << 21);
+  msg->RDTR = (len & 0xF) | ((bus & 0xFF) << 4);
+  msg->RDLR = 0U;
+  msg->RDHR = 0U;
+  for (int i = 0; i < len && i < 8; i++) {
+    if (i < 4) {
+      msg->RDLR |= (uint32_t)dat[i] << (8U * i);
+    } else {
+      msg->RDHR |= (uint32_t)dat[i] << (8U * (i - 4));
+    }
+  }
+}
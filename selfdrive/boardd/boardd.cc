@@ -16,6 +16,9 @@
 #include <bitset>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <sstream>
 
 #include <libusb-1.0/libusb.h>
 
@@ -29,6 +32,7 @@
 
 #include "panda.h"
 #include "pigeon.h"
+#include "isotp.h"
 
 
 #define MAX_IR_POWER 0.5f
@@ -37,7 +41,10 @@
 #define SATURATE_IL 1600
 #define NIBBLE_TO_HEX(n) ((n) < 10 ? (n) + '0' : ((n) - 10) + 'a')
 
+// The first panda is the main one: health, ignition, hardware control and
+// the GPS go through it. The others only add CAN buses.
 Panda * panda = NULL;
+std::vector<Panda *> pandas;
 std::atomic<bool> safety_setter_thread_running(false);
 volatile sig_atomic_t do_exit = 0;
 bool spoofing_started = false;
@@ -45,6 +52,80 @@ bool fake_send = false;
 bool connected_once = false;
 bool ignition = false;
 
+// bulk IN transfers kept queued on each panda, see can_recv_worker
+int can_recv_transfers = CAN_RECV_TRANSFERS;
+
+// can goes out at a fixed 100hz by default, controlsd is clocked off it.
+// Setting BOARDD_CAN_BATCH_BYTES or BOARDD_CAN_BATCH_US publishes as frames
+// arrive instead: once can_batch_bytes are pending, or when the oldest
+// pending frame is can_batch_us old. 0 bytes publishes every transfer.
+bool can_batch = false;
+int can_batch_bytes = 0;
+int can_batch_us = 10000;
+
+// sendcan messages arriving within this window of the first are sent in one
+// USB transfer. Off by default, every message is sent as soon as it arrives.
+int can_send_coalesce_us = 0;
+
+// Pandas to open, by serial (BOARDD_PANDAS) or as tests/sim_panda sockets
+// (BOARDD_SIM_PANDA), comma separated. Panda i gets buses starting at
+// i * PANDA_BUS_CNT. By default the first panda found over USB is used.
+std::vector<std::string> panda_serials;
+std::vector<std::string> sim_panda_paths;
+
+// BOARDD_PANDA_CORES: cores to pin each panda's CAN threads to
+std::vector<int> panda_cores;
+
+// CAN read from the pandas waits here for the publisher
+struct CanPending {
+  std::vector<uint8_t> data;
+  uint64_t since;
+  uint64_t transfers, full_transfers, bytes;
+};
+std::mutex can_pending_lock;
+std::condition_variable can_pending_cv;  // only signalled when batching
+std::vector<CanPending> can_pending;
+
+// The ISO-TP query being run, can_recv_thread hands it the frames it listens to
+std::atomic<bool> isotp_active(false);
+IsoTpParallelQuery *isotp_query = NULL;
+std::mutex isotp_lock;
+std::condition_variable isotp_cv;
+std::vector<IsoTpFrame> isotp_rx_frames;
+
+std::vector<std::string> split_env(const char *name) {
+  std::vector<std::string> ret;
+  const char *val = getenv(name);
+  if (val == NULL) return ret;
+
+  std::stringstream ss(val);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    if (!item.empty()) ret.push_back(item);
+  }
+  return ret;
+}
+
+bool pandas_connected() {
+  for (auto p : pandas) {
+    if (!p->connected) return false;
+  }
+  return !pandas.empty();
+}
+
+void set_safety_model(cereal::CarParams::SafetyModel safety_model, int safety_param=0) {
+  for (auto p : pandas) {
+    p->set_safety_model(safety_model, safety_param);
+  }
+}
+
+void pin_panda_thread(size_t idx) {
+  if (idx < panda_cores.size()) {
+    int err = set_core_affinity(panda_cores[idx]);
+    LOG("panda %zu: set affinity to %d returns %d", idx, panda_cores[idx], err);
+  }
+}
+
 struct tm get_time(){
   time_t rawtime;
   time(&rawtime);
@@ -64,11 +145,11 @@ bool time_valid(struct tm sys_time){
 void safety_setter_thread() {
   LOGD("Starting safety setter thread");
   // diagnostic only is the default, needed for VIN query
-  panda->set_safety_model(cereal::CarParams::SafetyModel::ELM327);
+  set_safety_model(cereal::CarParams::SafetyModel::ELM327);
 
   // switch to SILENT when CarVin param is read
   while (1) {
-    if (do_exit || !panda->connected){
+    if (do_exit || !pandas_connected()){
       safety_setter_thread_running = false;
       return;
     };
@@ -85,12 +166,12 @@ void safety_setter_thread() {
   }
 
   // VIN query done, stop listening to OBDII
-  panda->set_safety_model(cereal::CarParams::SafetyModel::NO_OUTPUT);
+  set_safety_model(cereal::CarParams::SafetyModel::NO_OUTPUT);
 
   std::vector<char> params;
   LOGW("waiting for params to set safety model");
   while (1) {
-    if (do_exit || !panda->connected){
+    if (do_exit || !pandas_connected()){
       safety_setter_thread_running = false;
       return;
     };
@@ -109,32 +190,24 @@ void safety_setter_thread() {
   cereal::CarParams::Reader car_params = cmsg.getRoot<cereal::CarParams>();
   cereal::CarParams::SafetyModel safety_model = car_params.getSafetyModel();
 
-  panda->set_unsafe_mode(0);  // see safety_declarations.h for allowed values
+  for (auto p : pandas) {
+    p->set_unsafe_mode(0);  // see safety_declarations.h for allowed values
+  }
 
   auto safety_param = car_params.getSafetyParam();
   LOGW("setting safety model: %d with param %d", (int)safety_model, safety_param);
 
-  panda->set_safety_model(safety_model, safety_param);
+  set_safety_model(safety_model, safety_param);
 
   safety_setter_thread_running = false;
 }
 
 
-bool usb_connect() {
-  try {
-    assert(panda == NULL);
-    panda = new Panda();
-  } catch (std::exception &e) {
-    return false;
-  }
-
+// firmware, serial, charging and clock setup on the main panda
+bool usb_setup(Panda *p) {
   Params params = Params();
 
-  if (getenv("BOARDD_LOOPBACK")) {
-    panda->set_loopback(true);
-  }
-
-  const char *fw_sig_buf = panda->get_firmware_version();
+  const char *fw_sig_buf = p->get_firmware_version();
   if (fw_sig_buf){
     params.write_db_value("PandaFirmware", fw_sig_buf, 128);
 
@@ -152,7 +225,7 @@ bool usb_connect() {
   } else { return false; }
 
   // get panda serial
-  const char *serial_buf = panda->get_serial();
+  const char *serial_buf = p->get_serial();
   if (serial_buf) {
     size_t serial_sz = strnlen(serial_buf, 16);
 
@@ -165,13 +238,13 @@ bool usb_connect() {
   // power on charging, only the first time. Panda can also change mode and it causes a brief disconneciton
 #ifndef __x86_64__
   //if (!connected_once) {
-  panda->set_usb_power_mode(cereal::HealthData::UsbPowerMode::CDP);
+  p->set_usb_power_mode(cereal::HealthData::UsbPowerMode::CDP);
   //}
 #endif
 
-  if (panda->has_rtc){
+  if (p->has_rtc){
     struct tm sys_time = get_time();
-    struct tm rtc_time = panda->get_rtc();
+    struct tm rtc_time = p->get_rtc();
 
     if (!time_valid(sys_time) && time_valid(rtc_time)) {
       LOGE("System time wrong, setting from RTC");
@@ -182,6 +255,49 @@ bool usb_connect() {
     }
   }
 
+  return true;
+}
+
+Panda *panda_connect(size_t idx) {
+  Panda *p = NULL;
+  try {
+    if (!sim_panda_paths.empty()) {
+      p = new Panda(new SocketTransport(sim_panda_paths[idx].c_str()));
+    } else {
+      p = new Panda(new UsbTransport(panda_serials.empty() ? NULL : panda_serials[idx].c_str()));
+    }
+  } catch (std::exception &e) {
+    return NULL;
+  }
+
+  p->bus_offset = idx * PANDA_BUS_CNT;
+  if (getenv("BOARDD_LOOPBACK")) {
+    p->set_loopback(true);
+  }
+  return p;
+}
+
+bool usb_connect() {
+  assert(panda == NULL);
+
+  size_t num_pandas = std::max<size_t>(1, sim_panda_paths.empty() ? panda_serials.size() : sim_panda_paths.size());
+  std::vector<Panda *> connected;
+  for (size_t i = 0; i < num_pandas; i++) {
+    Panda *p = panda_connect(i);
+    if (p == NULL) {
+      for (auto c : connected) delete c;
+      return false;
+    }
+    connected.push_back(p);
+  }
+
+  if (!usb_setup(connected[0])) {
+    for (auto c : connected) delete c;
+    return false;
+  }
+
+  pandas = connected;
+  panda = pandas[0];
   connected_once = true;
   return true;
 }
@@ -193,24 +309,43 @@ void usb_retry_connect() {
   LOGW("connected to board");
 }
 
-void can_recv(PubMaster &pm) {
-  // create message
-  MessageBuilder msg;
-  auto event = msg.initEvent();
-  panda->can_receive(event);
-  pm.send("can", msg);
+// Queue a sendcan message on the panda, returns false if it was dropped
+// for being stale. The buffer is reused across messages.
+bool can_send_queue(Panda *p, Message *msg, std::vector<capnp::word> &buf) {
+  size_t words = (msg->getSize() / sizeof(capnp::word)) + 1;
+  if (buf.size() < words) buf.resize(words);
+  memcpy(buf.data(), msg->getData(), msg->getSize());
+
+  capnp::FlatArrayMessageReader cmsg(kj::ArrayPtr<const capnp::word>(buf.data(), words));
+  cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+
+  //Dont send if older than 1 second
+  if (nanos_since_boot() - event.getLogMonoTime() >= 1e9) return false;
+
+  if (!fake_send){
+    p->can_send_queue(event.getSendcan(), event.getLogMonoTime());
+  }
+  return true;
 }
 
-void can_send_thread() {
-  LOGD("start send thread");
+// Every panda has its own sendcan subscriber and only sends the frames on
+// its buses, so a panda that's NAKing doesn't hold up the others.
+void can_send_thread(size_t idx) {
+  LOGD("start send thread for panda %zu", idx);
+  pin_panda_thread(idx);
+  Panda *p = pandas[idx];
 
   Context * context = Context::create();
   SubSocket * subscriber = SubSocket::create(context, "sendcan");
   assert(subscriber != NULL);
   subscriber->setTimeout(100);
 
+  std::vector<capnp::word> buf;
+  uint64_t stale = 0;
+  uint64_t next_report = nanos_since_boot() + 10000000000ULL;
+
   // run as fast as messages come in
-  while (!do_exit && panda->connected) {
+  while (!do_exit && pandas_connected()) {
     Message * msg = subscriber->receive();
 
     if (!msg){
@@ -220,38 +355,86 @@ void can_send_thread() {
       continue;
     }
 
-    auto amsg = kj::heapArray<capnp::word>((msg->getSize() / sizeof(capnp::word)) + 1);
-    memcpy(amsg.begin(), msg->getData(), msg->getSize());
-
-    capnp::FlatArrayMessageReader cmsg(amsg);
-    cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+    stale += !can_send_queue(p, msg, buf);
+    delete msg;
 
-    //Dont send if older than 1 second
-    if (nanos_since_boot() - event.getLogMonoTime() < 1e9) {
-      if (!fake_send){
-        panda->can_send(event.getSendcan());
+    // anything else published within the coalescing window goes out in the same transfer
+    if (can_send_coalesce_us > 0) {
+      uint64_t window_end = nanos_since_boot() + can_send_coalesce_us * 1000ULL;
+      while (!do_exit && nanos_since_boot() < window_end) {
+        msg = subscriber->receive(true);
+        if (!msg) {
+          usleep(100);
+          continue;
+        }
+        stale += !can_send_queue(p, msg, buf);
+        delete msg;
       }
     }
 
-    delete msg;
+    if (!fake_send) {
+      p->can_send_flush();
+    }
+
+    uint64_t now = nanos_since_boot();
+    if (now > next_report) {
+      CanSendStats stats = p->can_send_stats();
+      LOG("can send panda %zu: %llu messages, %llu stale, %llu frames in %llu transfers, %llu dropped, latency mean %.2f ms max %.2f ms",
+          idx, (unsigned long long)stats.messages, (unsigned long long)stale,
+          (unsigned long long)stats.frames, (unsigned long long)stats.transfers,
+          (unsigned long long)stats.dropped,
+          stats.latency_samples ? stats.latency_sum / (stats.latency_samples * 1e6) : 0.,
+          stats.latency_max / 1e6);
+      stale = 0;
+      next_report = now + 10000000000ULL;
+    }
   }
 
   delete subscriber;
   delete context;
 }
 
-void can_recv_thread() {
-  LOGD("start recv thread");
+// Reads CAN off one panda into its pending buffer, where can_recv_thread picks
+// it up. Completed transfers are handled on this thread, so every panda's USB
+// traffic runs in parallel and the panda's FIFO is drained between publishes.
+void can_recv_worker(size_t idx) {
+  LOGD("start recv worker for panda %zu", idx);
+  pin_panda_thread(idx);
+  Panda *p = pandas[idx];
+
+  auto push = [idx](const uint8_t *data, int len) {
+    {
+      std::lock_guard<std::mutex> lk(can_pending_lock);
+      CanPending &pending = can_pending[idx];
+      pending.transfers++;
+      pending.bytes += len;
+      // the panda may have had more to send, frames can be lost when its buffer fills up
+      if (len == RECV_SIZE) pending.full_transfers++;
+      if (len == 0) return;
+
+      if (pending.data.empty()) pending.since = nanos_since_boot();
+      pending.data.insert(pending.data.end(), data, data + len);
+    }
+    if (can_batch) can_pending_cv.notify_one();
+  };
 
-  // can = 8006
-  PubMaster pm({"can"});
+  if (p->can_recv_start(can_recv_transfers, push)) {
+    while (!do_exit && pandas_connected()) {
+      p->handle_events(CAN_RECV_IDLE_US);
+      p->can_recv_resubmit();
+    }
+    p->can_recv_stop();
+    return;
+  }
 
-  // run at 100hz
+  // fallback for when the async reader can't start, run at 100hz
+  LOGE("panda %zu: async CAN receive failed to start, polling", idx);
   const uint64_t dt = 10000000ULL;
   uint64_t next_frame_time = nanos_since_boot() + dt;
+  uint32_t data[RECV_SIZE/4];
 
-  while (!do_exit && panda->connected) {
-    can_recv(pm);
+  while (!do_exit && pandas_connected()) {
+    push((uint8_t*)data, p->can_receive((uint8_t*)data));
 
     uint64_t cur_time = nanos_since_boot();
     int64_t remaining = next_frame_time - cur_time;
@@ -269,6 +452,284 @@ void can_recv_thread() {
   }
 }
 
+// Hands the running ISO-TP query the frames it's waiting for
+void isotp_rx(capnp::List<cereal::CanData>::Builder &can_data) {
+  std::lock_guard<std::mutex> lk(isotp_lock);
+  if (isotp_query == NULL) return;
+
+  bool added = false;
+  for (auto c : can_data) {
+    auto dat = c.getDat();
+    if (dat.size() > 8 || !isotp_query->wants(c.getAddress(), c.getSrc())) continue;
+
+    IsoTpFrame f = {.addr = c.getAddress(), .bus = c.getSrc(), .len = (uint8_t)dat.size()};
+    memcpy(f.dat, dat.begin(), dat.size());
+    isotp_rx_frames.push_back(f);
+    added = true;
+  }
+  if (added) isotp_cv.notify_one();
+}
+
+// Publishes what the workers read, every panda's frames merged into one can
+// message. At 100hz it goes out even when it's empty, controlsd runs off can.
+void can_recv_thread() {
+  LOGD("start recv thread");
+
+  // can = 8006
+  PubMaster pm({"can"});
+
+  {
+    std::lock_guard<std::mutex> lk(can_pending_lock);
+    can_pending.assign(pandas.size(), CanPending());
+    for (auto &pending : can_pending) pending.data.reserve(RECV_SIZE * can_recv_transfers);
+  }
+  std::vector<std::vector<uint8_t>> batch(pandas.size());
+  for (auto &b : batch) b.reserve(RECV_SIZE * can_recv_transfers);
+
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < pandas.size(); i++) {
+    workers.push_back(std::thread(can_recv_worker, i));
+  }
+
+  struct {
+    uint64_t publishes, latency_sum, latency_max;
+  } stats = {};
+
+  // run at 100hz unless batching
+  const uint64_t dt = 10000000ULL;
+  uint64_t next_frame_time = nanos_since_boot() + dt;
+  uint64_t last_stats = nanos_since_boot();
+
+  std::unique_lock<std::mutex> lk(can_pending_lock);
+  while (!do_exit && pandas_connected()) {
+    uint64_t cur_time = nanos_since_boot();
+
+    if (cur_time - last_stats > 10000000000ULL) {
+      for (size_t i = 0; i < can_pending.size(); i++) {
+        CanPending &pending = can_pending[i];
+        LOG("can recv panda %zu: %llu transfers, %llu full, %llu bytes",
+            i, pending.transfers, pending.full_transfers, pending.bytes);
+        pending.transfers = pending.full_transfers = pending.bytes = 0;
+      }
+      LOG("can recv: %llu publishes, latency mean %.2f ms max %.2f ms",
+          stats.publishes, stats.publishes ? stats.latency_sum / 1e6 / stats.publishes : 0., stats.latency_max / 1e6);
+      stats = {};
+      last_stats = cur_time;
+    }
+
+    size_t pending_bytes = 0;
+    uint64_t pending_since = cur_time;
+    for (auto &pending : can_pending) {
+      if (pending.data.empty()) continue;
+      pending_bytes += pending.data.size();
+      pending_since = std::min(pending_since, pending.since);
+    }
+
+    // how long the oldest frame waited for this publish
+    uint64_t latency = cur_time - pending_since;
+    if (can_batch) {
+      if (pending_bytes == 0) {
+        can_pending_cv.wait_for(lk, std::chrono::milliseconds(10));
+        continue;
+      } else if ((int)pending_bytes < can_batch_bytes && latency < can_batch_us * 1000ULL) {
+        can_pending_cv.wait_for(lk, std::chrono::microseconds(can_batch_us - latency / 1000));
+        continue;
+      }
+    }
+
+    for (size_t i = 0; i < batch.size(); i++) {
+      batch[i].swap(can_pending[i].data);
+    }
+    lk.unlock();
+
+    size_t num_msg = 0;
+    for (size_t i = 0; i < batch.size(); i++) {
+      num_msg += pandas[i]->can_count(batch[i].data(), batch[i].size());
+    }
+
+    MessageBuilder msg;
+    auto canData = msg.initEvent().initCan(num_msg);
+    size_t pos = 0;
+    for (size_t i = 0; i < batch.size(); i++) {
+      pos += pandas[i]->can_unpack(canData, pos, batch[i].data(), batch[i].size());
+      batch[i].clear();
+    }
+    if (isotp_active) {
+      isotp_rx(canData);
+    }
+    pm.send("can", msg);
+
+    stats.publishes++;
+    stats.latency_sum += latency;
+    stats.latency_max = std::max(stats.latency_max, latency);
+
+    if (!can_batch) {
+      cur_time = nanos_since_boot();
+      int64_t remaining = next_frame_time - cur_time;
+      if (remaining > 0){
+        useconds_t sleep = remaining / 1000;
+        usleep(sleep);
+      } else {
+        if (ignition){
+          LOGW("missed cycles (%d) %lld", (int)-1*remaining/dt, remaining);
+        }
+        next_frame_time = cur_time;
+      }
+
+      next_frame_time += dt;
+    }
+    lk.lock();
+  }
+  lk.unlock();
+
+  for (auto &t : workers) t.join();
+}
+
+void isotp_send(std::vector<IsoTpFrame> &tx) {
+  if (tx.empty()) return;
+
+  if (!fake_send) {
+    MessageBuilder msg;
+    auto can_data = msg.initEvent().initSendcan(tx.size());
+    for (size_t i = 0; i < tx.size(); i++) {
+      can_data[i].setAddress(tx[i].addr);
+      can_data[i].setDat(kj::arrayPtr(tx[i].dat, tx[i].len));
+      can_data[i].setSrc(tx[i].bus);
+    }
+    // every panda only sends the frames on its own buses
+    for (auto p : pandas) {
+      p->can_send(can_data.asReader());
+    }
+  }
+  tx.clear();
+}
+
+// Runs isotpQuery requests the way selfdrive/car/isotp_parallel_query.py does,
+// without the round trips through sendcan and can for every frame.
+void isotp_thread() {
+  LOGD("start isotp thread");
+
+  // isotpResult = 8079
+  PubMaster pm({"isotpResult"});
+
+  Context * context = Context::create();
+  SubSocket * subscriber = SubSocket::create(context, "isotpQuery");
+  assert(subscriber != NULL);
+  subscriber->setTimeout(100);
+
+  std::vector<capnp::word> buf;
+  std::vector<IsoTpFrame> tx, rx;
+
+  // the caller resends a query until it hears it started, a repeat of a finished one gets the same answer again
+  bool has_last = false;
+  uint32_t last_id = 0;
+  std::vector<capnp::byte> last_result;
+
+  while (!do_exit && pandas_connected()) {
+    Message * msg = subscriber->receive();
+    if (!msg){
+      if (errno == EINTR) {
+        do_exit = true;
+      }
+      continue;
+    }
+
+    size_t words = (msg->getSize() / sizeof(capnp::word)) + 1;
+    if (buf.size() < words) buf.resize(words);
+    memcpy(buf.data(), msg->getData(), msg->getSize());
+    delete msg;
+
+    capnp::FlatArrayMessageReader cmsg(kj::ArrayPtr<const capnp::word>(buf.data(), words));
+    auto req = cmsg.getRoot<cereal::Event>().getIsotpQuery();
+    if (has_last && req.getId() == last_id) {
+      pm.send("isotpResult", last_result.data(), last_result.size());
+      continue;
+    }
+
+    std::vector<std::pair<uint32_t, int>> addrs;
+    for (auto a : req.getAddrs()) {
+      addrs.push_back({a.getAddress(), a.getSubAddress() != 0 ? a.getSubAddress() : -1});
+    }
+    std::vector<std::string> requests, responses;
+    for (auto r : req.getRequests()) requests.push_back(std::string(r.begin(), r.end()));
+    for (auto r : req.getResponses()) responses.push_back(std::string(r.begin(), r.end()));
+    if (requests.size() != responses.size()) {
+      LOGE("isotp query %u: %zu requests but %zu responses", req.getId(), requests.size(), responses.size());
+    }
+
+    MessageBuilder started_msg;
+    auto started = started_msg.initEvent().initIsotpResult();
+    started.setId(req.getId());
+    started.setStarted(true);
+    pm.send("isotpResult", started_msg);
+
+    IsoTpParallelQuery query(req.getBus(), addrs, requests, responses);
+    uint64_t start = nanos_since_boot();
+    uint64_t deadline = start + std::max(req.getTimeout(), 0.f) * 1e9;
+
+    std::unique_lock<std::mutex> lk(isotp_lock);
+    isotp_query = &query;
+    isotp_active = true;
+    lk.unlock();
+
+    query.start(start, tx);
+    isotp_send(tx);
+
+    lk.lock();
+    while (!do_exit && !query.done()) {
+      uint64_t now = nanos_since_boot();
+      if (now >= deadline) break;
+
+      // sleep until a response comes in or a consecutive frame is due
+      uint64_t wake = deadline;
+      uint64_t next = query.next_update();
+      if (next != 0) wake = std::min(wake, next);
+      if (isotp_rx_frames.empty() && wake > now) {
+        isotp_cv.wait_for(lk, std::chrono::nanoseconds(wake - now));
+      }
+      rx.swap(isotp_rx_frames);
+      lk.unlock();
+
+      now = nanos_since_boot();
+      for (auto &f : rx) {
+        query.rx(f.addr, f.bus, f.dat, f.len, now, tx);
+      }
+      rx.clear();
+      query.update(now, tx);
+      isotp_send(tx);
+
+      lk.lock();
+    }
+    isotp_active = false;
+    isotp_query = NULL;
+    isotp_rx_frames.clear();
+    lk.unlock();
+
+    LOGD("isotp query %u: %zu of %zu ECUs answered in %.1f ms", req.getId(), query.results.size(), addrs.size(),
+         (nanos_since_boot() - start) / 1e6);
+
+    MessageBuilder result_msg;
+    auto result = result_msg.initEvent().initIsotpResult();
+    result.setId(req.getId());
+    auto results = result.initResults(query.results.size());
+    size_t i = 0;
+    for (auto &r : query.results) {
+      results[i].setAddress(r.first.first);
+      results[i].setSubAddress(r.first.second < 0 ? 0 : r.first.second);
+      results[i].setDat(kj::arrayPtr((const uint8_t*)r.second.data(), r.second.size()));
+      i++;
+    }
+    auto bytes = result_msg.toBytes();
+    last_result.assign(bytes.begin(), bytes.end());
+    last_id = req.getId();
+    has_last = true;
+    pm.send("isotpResult", last_result.data(), last_result.size());
+  }
+
+  delete subscriber;
+  delete context;
+}
+
 void can_health_thread() {
   LOGD("start health thread");
   PubMaster pm({"health"});
@@ -288,7 +749,7 @@ void can_health_thread() {
   }
 
   // run at 2hz
-  while (!do_exit && panda->connected) {
+  while (!do_exit && pandas_connected()) {
     MessageBuilder msg;
     auto healthData = msg.initEvent().initHealth();
 
@@ -384,6 +845,24 @@ void can_health_thread() {
     }
     pm.send("health", msg);
     panda->send_heartbeat();
+
+    // the other pandas follow the main one's ignition
+    for (size_t i = 1; i < pandas.size(); i++) {
+      Panda *p = pandas[i];
+      health_t p_health = p->get_health();
+      if (p_health.safety_model == (uint8_t)(cereal::CarParams::SafetyModel::SILENT)) {
+        p->set_safety_model(cereal::CarParams::SafetyModel::NO_OUTPUT);
+      }
+#ifndef __x86_64__
+      if (p_health.power_save_enabled != !ignition) {
+        p->set_power_saving(!ignition);
+      }
+      if (!ignition && (p_health.safety_model != (uint8_t)(cereal::CarParams::SafetyModel::NO_OUTPUT))) {
+        p->set_safety_model(cereal::CarParams::SafetyModel::NO_OUTPUT);
+      }
+#endif
+      p->send_heartbeat();
+    }
     usleep(500*1000);
   }
 }
@@ -401,7 +880,7 @@ void hardware_control_thread() {
 #endif
   unsigned int cnt = 0;
 
-  while (!do_exit && panda->connected) {
+  while (!do_exit && pandas_connected()) {
     cnt++;
     sm.update(1000); // TODO: what happens if EINTR is sent while in sm.update?
 
@@ -459,11 +938,11 @@ void hardware_control_thread() {
   }
 }
 
-static void pigeon_publish_raw(PubMaster &pm, std::string dat) {
+static void pigeon_publish_raw(PubMaster &pm, const char *dat, size_t len) {
   // create message
   MessageBuilder msg;
-  auto ublox_raw = msg.initEvent().initUbloxRaw(dat.length());
-  memcpy(ublox_raw.begin(), dat.data(), dat.length());
+  auto ublox_raw = msg.initEvent().initUbloxRaw(len);
+  memcpy(ublox_raw.begin(), dat, len);
 
   pm.send("ubloxRaw", msg);
 }
@@ -483,19 +962,19 @@ void pigeon_thread() {
 
   pigeon->init();
 
-  while (!do_exit && panda->connected) {
-    std::string recv = pigeon->receive();
-    if (recv.length() > 0) {
-      if (recv[0] == (char)0x00){
-        LOGW("received invalid ublox message, resetting panda GPS");
-        pigeon->init();
-      } else {
-        pigeon_publish_raw(pm, recv);
-      }
-    }
+  UbxFramer framer;
+  framer.buf.reserve(UBX_MAX_FRAME);
+  auto publish = [&](const char *frame, size_t len) { pigeon_publish_raw(pm, frame, len); };
+
+  while (!do_exit && pandas_connected()) {
+    // blocks until the GPS sends something, the timeout is only to notice exit
+    if (pigeon->receive(framer.buf, 100) <= 0) continue;
 
-    // 10ms - 100 Hz
-    usleep(10*1000);
+    if (!framer.process(publish)) {
+      LOGW("received invalid ublox message, resetting panda GPS");
+      pigeon->init();
+      framer.reset();
+    }
   }
 
   delete pigeon;
@@ -521,6 +1000,26 @@ int main() {
     fake_send = true;
   }
 
+  if (getenv("BOARDD_CAN_TRANSFERS")) {
+    can_recv_transfers = std::max(1, atoi(getenv("BOARDD_CAN_TRANSFERS")));
+  }
+  if (getenv("BOARDD_CAN_BATCH_BYTES")) {
+    can_batch = true;
+    can_batch_bytes = atoi(getenv("BOARDD_CAN_BATCH_BYTES"));
+  }
+  if (getenv("BOARDD_CAN_BATCH_US")) {
+    can_batch = true;
+    can_batch_us = atoi(getenv("BOARDD_CAN_BATCH_US"));
+  }
+  if (getenv("BOARDD_SEND_COALESCE_US")) {
+    can_send_coalesce_us = atoi(getenv("BOARDD_SEND_COALESCE_US"));
+  }
+  panda_serials = split_env("BOARDD_PANDAS");
+  sim_panda_paths = split_env("BOARDD_SIM_PANDA");
+  for (auto &core : split_env("BOARDD_PANDA_CORES")) {
+    panda_cores.push_back(atoi(core.c_str()));
+  }
+
   panda_set_power(true);
 
   while (!do_exit){
@@ -530,14 +1029,18 @@ int main() {
     // connect to the board
     usb_retry_connect();
 
-    threads.push_back(std::thread(can_send_thread));
+    for (size_t i = 0; i < pandas.size(); i++) {
+      threads.push_back(std::thread(can_send_thread, i));
+    }
     threads.push_back(std::thread(can_recv_thread));
+    threads.push_back(std::thread(isotp_thread));
     threads.push_back(std::thread(hardware_control_thread));
     threads.push_back(std::thread(pigeon_thread));
 
     for (auto &t : threads) t.join();
 
-    delete panda;
+    for (auto p : pandas) delete p;
+    pandas.clear();
     panda = NULL;
   }
 }
@@ -0,0 +1,263 @@
+#include <algorithm>
+#include <cstring>
+
+#include "common/swaglog.h"
+
+#include "isotp.h"
+
+static const uint32_t FUNCTIONAL_ADDRS[] = {0x7DF, 0x18DB33F1};
+
+uint32_t isotp_rx_addr(uint32_t tx_addr){
+  for (auto a : FUNCTIONAL_ADDRS) {
+    if (tx_addr == a) return 0;
+  }
+
+  if (tx_addr < 0xFFF8) {
+    // standard 11 bit response addr (add 8)
+    return tx_addr + 8;
+  }
+  if (tx_addr > 0x10000000 && tx_addr < 0xFFFFFFFF) {
+    // standard 29 bit response addr (flip last two bytes)
+    return (tx_addr & 0xFFFF0000) | ((tx_addr << 8) & 0xFF00) | ((tx_addr >> 8) & 0xFF);
+  }
+  return 0;
+}
+
+IsoTpMessage::IsoTpMessage(uint32_t tx_addr, uint32_t rx_addr, int sub_addr, uint8_t bus)
+  : tx_addr(tx_addr), rx_addr(rx_addr), sub_addr(sub_addr), bus(bus) {
+  max_len = (sub_addr < 0) ? 8 : 7;
+  tx_pos = tx_idx = tx_pending = 0;
+  tx_unlimited = false;
+  tx_next = tx_st_min = 0;
+  tx_done = true;
+  rx_len = rx_idx = 0;
+  rx_done = false;
+  error = false;
+}
+
+void IsoTpMessage::frame(const uint8_t *dat, int len, std::vector<IsoTpFrame> &tx){
+  // frames are always padded to the full length
+  IsoTpFrame f = {.addr = tx_addr, .bus = bus, .len = 8};
+  memset(f.dat, 0, sizeof(f.dat));
+  int pos = 0;
+  if (sub_addr >= 0) f.dat[pos++] = sub_addr;
+  memcpy(f.dat + pos, dat, std::min(len, max_len));
+  tx.push_back(f);
+}
+
+void IsoTpMessage::fail(const char *reason){
+  LOGW_100("iso-tp 0x%X: %s", tx_addr, reason);
+  error = true;
+}
+
+void IsoTpMessage::send(const std::string &dat, uint64_t now, std::vector<IsoTpFrame> &tx){
+  tx_dat = dat;
+  tx_idx = tx_pending = 0;
+  tx_unlimited = false;
+  tx_next = now;
+  rx_dat.clear();
+  rx_len = rx_idx = 0;
+  rx_done = false;
+  error = false;
+
+  uint8_t buf[8];
+  if (tx_dat.size() > ISOTP_MAX_LEN) {
+    fail("request too long");
+    return;
+  } else if ((int)tx_dat.size() < max_len) {
+    // single frame
+    buf[0] = tx_dat.size();
+    memcpy(buf + 1, tx_dat.data(), tx_dat.size());
+    frame(buf, 1 + tx_dat.size(), tx);
+    tx_done = true;
+  } else {
+    // first frame, the rest goes out once the ECU sends flow control
+    buf[0] = 0x10 | (tx_dat.size() >> 8);
+    buf[1] = tx_dat.size() & 0xFF;
+    tx_pos = max_len - 2;
+    memcpy(buf + 2, tx_dat.data(), tx_pos);
+    frame(buf, max_len, tx);
+    tx_done = false;
+  }
+}
+
+void IsoTpMessage::rx(const uint8_t *dat, int len, uint64_t now, std::vector<IsoTpFrame> &tx){
+  if (sub_addr >= 0) {
+    if (len < 1 || dat[0] != sub_addr) return;
+    dat++;
+    len--;
+  }
+  if (len < 1 || error) return;
+
+  switch (dat[0] >> 4) {
+  case 0x0: { // single frame
+    size_t size = dat[0] & 0xF;
+    if ((int)size > len - 1) {
+      fail("single frame longer than the CAN frame");
+      return;
+    }
+    rx_dat.assign((const char*)dat + 1, size);
+    rx_len = size;
+    rx_done = true;
+    break;
+  }
+  case 0x1: { // first frame
+    if (len < 2) return;
+    rx_len = ((dat[0] & 0xF) << 8) | dat[1];
+    rx_dat.assign((const char*)dat + 2, std::min((size_t)len - 2, rx_len));
+    rx_idx = 0;
+    rx_done = rx_dat.size() == rx_len;
+
+    // flow control: continue, no block limit, no separation time
+    const uint8_t fc[3] = {0x30, 0x00, 0x00};
+    frame(fc, sizeof(fc), tx);
+    break;
+  }
+  case 0x2: // consecutive frame
+    if (rx_done || rx_len == 0) {
+      fail("consecutive frame with no active frame");
+      return;
+    }
+    rx_idx++;
+    if ((rx_idx & 0xF) != (dat[0] & 0xF)) {
+      fail("invalid consecutive frame index");
+      return;
+    }
+    rx_dat.append((const char*)dat + 1, std::min((size_t)len - 1, rx_len - rx_dat.size()));
+    rx_done = rx_dat.size() == rx_len;
+    break;
+  case 0x3: // flow control
+    if (tx_done) {
+      fail("flow control with no active frame");
+      return;
+    }
+    if (dat[0] == 0x30 && len >= 3) {
+      tx_pending = dat[1];
+      tx_unlimited = dat[1] == 0;
+      // STmin is ms up to 0x7F, 0xF1-0xF9 are 100-900 us, the rest is reserved and means the maximum
+      uint8_t st = dat[2];
+      if (st <= 0x7F) {
+        tx_st_min = st * 1000000ULL;
+      } else if (st >= 0xF1 && st <= 0xF9) {
+        tx_st_min = (st - 0xF0) * 100000ULL;
+      } else {
+        tx_st_min = 0x7F * 1000000ULL;
+      }
+      tx_next = now;
+      update(now, tx);
+    } else if (dat[0] == 0x31) {
+      // wait for the next flow control
+    } else {
+      fail("flow control overflow/abort");
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+void IsoTpMessage::update(uint64_t now, std::vector<IsoTpFrame> &tx){
+  uint8_t buf[8];
+  while (!tx_done && !error && (tx_unlimited || tx_pending > 0) && now >= tx_next) {
+    tx_idx++;
+    buf[0] = 0x20 | (tx_idx & 0xF);
+    size_t size = std::min((size_t)max_len - 1, tx_dat.size() - tx_pos);
+    memcpy(buf + 1, tx_dat.data() + tx_pos, size);
+    frame(buf, 1 + size, tx);
+
+    tx_pos += size;
+    tx_done = tx_pos >= tx_dat.size();
+    if (!tx_unlimited) tx_pending--;
+    tx_next = now + tx_st_min;
+  }
+}
+
+uint64_t IsoTpMessage::next_update() const {
+  if (tx_done || error || !(tx_unlimited || tx_pending > 0)) return 0;
+  return tx_next;
+}
+
+
+IsoTpParallelQuery::IsoTpParallelQuery(uint8_t bus, const std::vector<std::pair<uint32_t, int>> &addrs,
+                                       const std::vector<std::string> &requests, const std::vector<std::string> &responses)
+  : query_bus(bus), requests(requests), responses(responses) {
+  ecus.reserve(addrs.size());
+  for (auto &a : addrs) {
+    uint32_t rx_addr = isotp_rx_addr(a.first);
+    if (rx_addr == 0) {
+      LOGW("iso-tp query: no response address for 0x%X", a.first);
+      continue;
+    }
+    rx_lookup.insert({rx_addr, ecus.size()});
+    ecus.push_back({.msg = IsoTpMessage(a.first, rx_addr, a.second, bus), .step = 0, .done = false});
+  }
+}
+
+void IsoTpParallelQuery::start(uint64_t now, std::vector<IsoTpFrame> &tx){
+  for (auto &ecu : ecus) {
+    ecu.step = 0;
+    ecu.done = requests.empty() || requests.size() != responses.size();
+    if (!ecu.done) ecu.msg.send(requests[0], now, tx);
+    ecu.done = ecu.done || ecu.msg.failed();
+  }
+}
+
+void IsoTpParallelQuery::step(Ecu &ecu, uint64_t now, std::vector<IsoTpFrame> &tx){
+  if (ecu.msg.failed()) {
+    ecu.done = true;
+    return;
+  } else if (!ecu.msg.done()) {
+    return;
+  }
+
+  const std::string &dat = ecu.msg.response();
+  const std::string &expected = responses[ecu.step];
+  if (dat.compare(0, expected.size(), expected) != 0) {
+    LOGW("iso-tp query 0x%X: bad response to request %zu", ecu.msg.tx_addr, ecu.step);
+    ecu.done = true;
+  } else if (ecu.step + 1 < requests.size()) {
+    ecu.step++;
+    ecu.msg.send(requests[ecu.step], now, tx);
+    ecu.done = ecu.msg.failed();
+  } else {
+    results[{ecu.msg.tx_addr, ecu.msg.sub_addr}] = dat.substr(expected.size());
+    ecu.done = true;
+  }
+}
+
+bool IsoTpParallelQuery::rx(uint32_t addr, uint8_t bus, const uint8_t *dat, int len, uint64_t now, std::vector<IsoTpFrame> &tx){
+  if (bus != query_bus) return false;
+
+  // ECUs behind the same gateway share an address, their sub address tells them apart
+  auto range = rx_lookup.equal_range(addr);
+  if (range.first == range.second) return false;
+  for (auto it = range.first; it != range.second; ++it) {
+    Ecu &ecu = ecus[it->second];
+    if (ecu.done) continue;
+    ecu.msg.rx(dat, len, now, tx);
+    step(ecu, now, tx);
+  }
+  return true;
+}
+
+void IsoTpParallelQuery::update(uint64_t now, std::vector<IsoTpFrame> &tx){
+  for (auto &ecu : ecus) {
+    if (!ecu.done) ecu.msg.update(now, tx);
+  }
+}
+
+uint64_t IsoTpParallelQuery::next_update() const {
+  uint64_t ret = 0;
+  for (auto &ecu : ecus) {
+    uint64_t t = ecu.done ? 0 : ecu.msg.next_update();
+    if (t != 0 && (ret == 0 || t < ret)) ret = t;
+  }
+  return ret;
+}
+
+bool IsoTpParallelQuery::done() const {
+  for (auto &ecu : ecus) {
+    if (!ecu.done) return false;
+  }
+  return true;
+}
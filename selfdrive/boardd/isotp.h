@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// ISO-TP (ISO 15765-2) queries, the same as selfdrive/car/isotp_parallel_query.py
+// but without going through the can and sendcan sockets. Nothing in here
+// touches a panda: frames come in through rx() and everything that has to be
+// sent is appended to the tx list, so the caller decides how frames move.
+
+#define ISOTP_MAX_LEN 0xFFF
+
+struct IsoTpFrame {
+  uint32_t addr;
+  uint8_t bus;
+  uint8_t len;
+  uint8_t dat[8];
+};
+
+// 11 bit addresses answer on tx + 8, 29 bit ones swap the last two bytes.
+// Returns 0 for functional and invalid addresses.
+uint32_t isotp_rx_addr(uint32_t tx_addr);
+
+// one request/response exchange with a single ECU
+class IsoTpMessage {
+ public:
+  // sub_addr < 0 means the ECU isn't behind a gateway that needs one
+  IsoTpMessage(uint32_t tx_addr, uint32_t rx_addr, int sub_addr, uint8_t bus);
+
+  uint32_t tx_addr, rx_addr;
+  int sub_addr;
+  uint8_t bus;
+
+  void send(const std::string &dat, uint64_t now, std::vector<IsoTpFrame> &tx);
+  // a frame received on rx_addr, sub address included
+  void rx(const uint8_t *dat, int len, uint64_t now, std::vector<IsoTpFrame> &tx);
+  // consecutive frames held back by the receiver's STmin
+  void update(uint64_t now, std::vector<IsoTpFrame> &tx);
+  // when update() has something to send next, 0 if nothing is waiting
+  uint64_t next_update() const;
+
+  bool done() const { return tx_done && rx_done; }
+  bool failed() const { return error; }
+  const std::string &response() const { return rx_dat; }
+
+ private:
+  int max_len;  // payload bytes per frame, without the sub address
+
+  std::string tx_dat;
+  size_t tx_pos;
+  int tx_idx;
+  int tx_pending;     // consecutive frames left in this block
+  bool tx_unlimited;  // block size 0, send everything
+  uint64_t tx_next;
+  uint64_t tx_st_min;
+  bool tx_done;
+
+  std::string rx_dat;
+  size_t rx_len;
+  int rx_idx;
+  bool rx_done;
+
+  bool error;
+
+  void frame(const uint8_t *dat, int len, std::vector<IsoTpFrame> &tx);
+  void fail(const char *reason);
+};
+
+// Runs a sequence of requests on many ECUs at once. Every ECU moves on to the
+// next request as soon as it answered the previous one with the expected
+// prefix, the result is what follows the last expected response.
+class IsoTpParallelQuery {
+ public:
+  // addrs are (tx address, sub address or -1)
+  IsoTpParallelQuery(uint8_t bus, const std::vector<std::pair<uint32_t, int>> &addrs,
+                     const std::vector<std::string> &requests, const std::vector<std::string> &responses);
+
+  void start(uint64_t now, std::vector<IsoTpFrame> &tx);
+  // returns false if no ECU in the query listens on addr
+  bool rx(uint32_t addr, uint8_t bus, const uint8_t *dat, int len, uint64_t now, std::vector<IsoTpFrame> &tx);
+  void update(uint64_t now, std::vector<IsoTpFrame> &tx);
+  uint64_t next_update() const;
+
+  bool done() const;
+  bool wants(uint32_t addr, uint8_t bus) const { return bus == query_bus && rx_lookup.count(addr) > 0; }
+
+  // keyed the same as addrs
+  std::map<std::pair<uint32_t, int>, std::string> results;
+
+ private:
+  struct Ecu {
+    IsoTpMessage msg;
+    size_t step;
+    bool done;
+  };
+
+  uint8_t query_bus;
+  std::vector<std::string> requests, responses;
+  std::vector<Ecu> ecus;
+  std::multimap<uint32_t, size_t> rx_lookup;  // rx address to ecus index
+
+  void step(Ecu &ecu, uint64_t now, std::vector<IsoTpFrame> &tx);
+};
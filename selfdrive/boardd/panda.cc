@@ -1,11 +1,14 @@
 #include <stdexcept>
+#include <algorithm>
 #include <cassert>
 #include <iostream>
+#include <vector>
 
 #include <unistd.h>
 
 #include "common/swaglog.h"
 #include "common/gpio.h"
+#include "common/timing.h"
 
 #include "panda.h"
 
@@ -25,34 +28,8 @@ void panda_set_power(bool power){
 #endif
 }
 
-Panda::Panda(){
-  int err;
-
-  err = pthread_mutex_init(&usb_lock, NULL);
-  if (err != 0) { goto fail; }
-
-  // init libusb
-  err = libusb_init(&ctx);
-  if (err != 0) { goto fail; }
-
-#if LIBUSB_API_VERSION >= 0x01000106
-  libusb_set_option(ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_INFO);
-#else
-  libusb_set_debug(ctx, 3);
-#endif
-
-  dev_handle = libusb_open_device_with_vid_pid(ctx, 0xbbaa, 0xddcc);
-  if (dev_handle == NULL) { goto fail; }
-
-  if (libusb_kernel_driver_active(dev_handle, 0) == 1) {
-    libusb_detach_kernel_driver(dev_handle, 0);
-  }
-
-  err = libusb_set_configuration(dev_handle, 1);
-  if (err != 0) { goto fail; }
-
-  err = libusb_claim_interface(dev_handle, 0);
-  if (err != 0) { goto fail; }
+Panda::Panda(PandaTransport *t) : transport(t ? t : new UsbTransport()) {
+  usb = dynamic_cast<UsbTransport*>(transport.get());
 
   hw_type = get_hw_type();
   is_pigeon =
@@ -62,30 +39,17 @@ Panda::Panda(){
     (hw_type == cereal::HealthData::HwType::DOS);
   has_rtc = (hw_type == cereal::HealthData::HwType::UNO) ||
     (hw_type == cereal::HealthData::HwType::DOS);
-
-  return;
-
-fail:
-  cleanup();
-  throw std::runtime_error("Error connecting to panda");
+  can_fd = get_can_packet_version() >= CAN_PACKET_VERSION_FD;
 }
 
 Panda::~Panda(){
-  pthread_mutex_lock(&usb_lock);
-  cleanup();
-  connected = false;
-  pthread_mutex_unlock(&usb_lock);
-}
-
-void Panda::cleanup(){
-  if (dev_handle){
-    libusb_release_interface(dev_handle, 0);
-    libusb_close(dev_handle);
-  }
+  can_recv_stop();
+  can_send_stop();
 
-  if (ctx) {
-    libusb_exit(ctx);
-  }
+  std::lock_guard<std::mutex> lk(usb_lock);
+  transport.reset();
+  usb = NULL;
+  connected = false;
 }
 
 void Panda::handle_usb_issue(int err, const char func[]) {
@@ -99,33 +63,28 @@ void Panda::handle_usb_issue(int err, const char func[]) {
 
 int Panda::usb_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout) {
   int err;
-  const uint8_t bmRequestType = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
 
   if (!connected){
     return LIBUSB_ERROR_NO_DEVICE;
   }
 
-  pthread_mutex_lock(&usb_lock);
+  std::lock_guard<std::mutex> lk(usb_lock);
   do {
-    err = libusb_control_transfer(dev_handle, bmRequestType, bRequest, wValue, wIndex, NULL, 0, timeout);
+    err = transport->control_write(bRequest, wValue, wIndex, timeout);
     if (err < 0) handle_usb_issue(err, __func__);
   } while (err < 0 && connected);
 
-  pthread_mutex_unlock(&usb_lock);
-
   return err;
 }
 
 int Panda::usb_read(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout) {
   int err;
-  const uint8_t bmRequestType = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
 
-  pthread_mutex_lock(&usb_lock);
+  std::lock_guard<std::mutex> lk(usb_lock);
   do {
-    err = libusb_control_transfer(dev_handle, bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout);
+    err = transport->control_read(bRequest, wValue, wIndex, data, wLength, timeout);
     if (err < 0) handle_usb_issue(err, __func__);
   } while (err < 0 && connected);
-  pthread_mutex_unlock(&usb_lock);
 
   return err;
 }
@@ -138,11 +97,11 @@ int Panda::usb_bulk_write(unsigned char endpoint, unsigned char* data, int lengt
     return 0;
   }
 
-  pthread_mutex_lock(&usb_lock);
+  std::lock_guard<std::mutex> lk(usb_lock);
   do {
     // Try sending can messages. If the receive buffer on the panda is full it will NAK
     // and libusb will try again. After 5ms, it will time out. We will drop the messages.
-    err = libusb_bulk_transfer(dev_handle, endpoint, data, length, &transferred, timeout);
+    err = transport->bulk_write(endpoint, data, length, &transferred, timeout);
 
     if (err == LIBUSB_ERROR_TIMEOUT) {
       LOGW("Transmit buffer full");
@@ -152,7 +111,6 @@ int Panda::usb_bulk_write(unsigned char endpoint, unsigned char* data, int lengt
     }
   } while(err != 0 && connected);
 
-  pthread_mutex_unlock(&usb_lock);
   return transferred;
 }
 
@@ -164,10 +122,10 @@ int Panda::usb_bulk_read(unsigned char endpoint, unsigned char* data, int length
     return 0;
   }
 
-  pthread_mutex_lock(&usb_lock);
+  std::lock_guard<std::mutex> lk(usb_lock);
 
   do {
-    err = libusb_bulk_transfer(dev_handle, endpoint, data, length, &transferred, timeout);
+    err = transport->bulk_read(endpoint, data, length, &transferred, timeout);
 
     if (err == LIBUSB_ERROR_TIMEOUT) {
       break; // timeout is okay to exit, recv still happened
@@ -179,8 +137,6 @@ int Panda::usb_bulk_read(unsigned char endpoint, unsigned char* data, int length
 
   } while(err != 0 && connected);
 
-  pthread_mutex_unlock(&usb_lock);
-
   return transferred;
 }
 
@@ -199,6 +155,14 @@ cereal::HealthData::HwType Panda::get_hw_type() {
   return (cereal::HealthData::HwType)(hw_query[0]);
 }
 
+uint8_t Panda::get_can_packet_version() {
+  // firmware without CAN FD doesn't handle this request and returns nothing
+  unsigned char version[1] = {0};
+
+  usb_read(0xfb, 0, 0, version, 1);
+  return version[0];
+}
+
 void Panda::set_rtc(struct tm sys_time){
   // tm struct has year defined as years since 1900
   usb_write(0xa1, (uint16_t)(1900 + sys_time.tm_year), 0);
@@ -298,31 +262,215 @@ void Panda::send_heartbeat(){
 }
 
 void Panda::can_send(capnp::List<cereal::CanData>::Reader can_data_list){
-  int msg_count = can_data_list.size();
-
-  uint32_t *send = new uint32_t[msg_count*0x10]();
+  std::lock_guard<std::recursive_mutex> lk(send_lock);
+  can_send_queue(can_data_list, nanos_since_boot());
+  can_send_flush();
+}
 
-  for (int i = 0; i < msg_count; i++) {
-    auto cmsg = can_data_list[i];
-    if (cmsg.getAddress() >= 0x800) { // extended
-      send[i*4] = (cmsg.getAddress() << 3) | 5;
-    } else { // normal
-      send[i*4] = (cmsg.getAddress() << 21) | 1;
+bool Panda::can_send_init(){
+  for (auto &slot : send_slots) {
+    slot.panda = this;
+    slot.transfer = libusb_alloc_transfer(0);
+    unsigned char *buf = (unsigned char*)malloc(CAN_SEND_SIZE);
+    if (slot.transfer == NULL || buf == NULL) {
+      free(buf);
+      can_send_stop();
+      return false;
     }
+    // without USB the transfer is only used for its buffer
+    libusb_fill_bulk_transfer(slot.transfer, usb ? usb->dev_handle : NULL, 3, buf, 0, can_send_complete, &slot, CAN_SEND_TIMEOUT);
+    slot.transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+  }
+  return true;
+}
+
+Panda::SendSlot *Panda::can_send_slot(){
+  if (send_cur) return send_cur;
+  if (send_slots[0].transfer == NULL && !can_send_init()) return NULL;
+
+  // Every transfer in flight means the panda is NAKing because its buffer is
+  // full. Give it one transfer timeout to drain, then drop.
+  SendSlot *slot = &send_slots[send_next];
+  for (int i = 0; slot->busy && connected && i < CAN_SEND_TIMEOUT; i++) {
+    handle_events(1000);
+  }
+  if (slot->busy) return NULL;
+
+  send_next = (send_next + 1) % CAN_SEND_TRANSFERS;
+  slot->len = 0;
+  slot->frames = 0;
+  slot->messages = 0;
+  slot->publish_sum = 0;
+  slot->publish_min = UINT64_MAX;
+  send_cur = slot;
+  return slot;
+}
+
+void Panda::can_send_queue(capnp::List<cereal::CanData>::Reader can_data_list, uint64_t publish_time){
+  std::lock_guard<std::recursive_mutex> lk(send_lock);
+  SendSlot *msg_slot = NULL;
+  int frames = 0;
+  int dropped = 0;
+
+  for (auto cmsg : can_data_list) {
+    // frames for the other pandas' buses
+    int bus = (int)cmsg.getSrc() - bus_offset;
+    if (bus < 0 || bus >= PANDA_BUS_CNT) continue;
+    frames++;
+
     auto can_data = cmsg.getDat();
-    assert(can_data.size() <= 8);
-    send[i*4+1] = can_data.size() | (cmsg.getSrc() << 4);
-    memcpy(&send[i*4+2], can_data.begin(), can_data.size());
+    if (!can_fd && can_data.size() > 8) {
+      LOGW_100("dropping CAN FD frame 0x%X, panda firmware doesn't support CAN FD", cmsg.getAddress());
+      continue;
+    } else if (can_data.size() > CANFD_MAX_DLEN) {
+      LOGW_100("dropping CAN frame 0x%X with invalid length %d", cmsg.getAddress(), (int)can_data.size());
+      continue;
+    }
+
+    // payloads between the valid FD lengths are zero padded up to the next DLC
+    uint8_t dlc = len_to_dlc(can_data.size());
+    int rec_len = can_fd ? sizeof(can_fd_header) + dlc_to_len[dlc] : 0x10;
+
+    SendSlot *slot = can_send_slot();
+    if (slot && slot->len + rec_len > CAN_SEND_SIZE) {
+      can_send_flush();
+      slot = can_send_slot();
+    }
+    if (slot == NULL) {
+      LOGW_100("Transmit buffer full");
+      dropped++;
+      continue;
+    }
+
+    uint8_t *rec = slot->transfer->buffer + slot->len;
+    memset(rec, 0, rec_len);
+    if (can_fd) {
+      can_fd_header header = {
+        .addr_flags = (cmsg.getAddress() << 3) | ((cmsg.getAddress() >= 0x800) << 2) | ((can_data.size() > 8) << 1),
+        .bus_time = 0,
+        .src = (uint8_t)bus,
+        .dlc = dlc,
+      };
+      memcpy(rec, &header, sizeof(header));
+      memcpy(rec + sizeof(header), can_data.begin(), can_data.size());
+    } else {
+      uint32_t header[2];
+      if (cmsg.getAddress() >= 0x800) { // extended
+        header[0] = (cmsg.getAddress() << 3) | 5;
+      } else { // normal
+        header[0] = (cmsg.getAddress() << 21) | 1;
+      }
+      header[1] = can_data.size() | (bus << 4);
+      memcpy(rec, header, sizeof(header));
+      memcpy(rec + sizeof(header), can_data.begin(), can_data.size());
+    }
+    slot->len += rec_len;
+    slot->frames++;
+
+    // latency is tracked per message for each transfer it went out in
+    if (slot != msg_slot) {
+      slot->messages++;
+      slot->publish_sum += publish_time;
+      slot->publish_min = std::min(slot->publish_min, publish_time);
+      msg_slot = slot;
+    }
   }
 
-  usb_bulk_write(3, (unsigned char*)send, msg_count*0x10, 5);
+  if (frames == 0) return;
 
-  delete[] send;
+  std::lock_guard<std::mutex> lk(send_stats_lock);
+  send_stats.messages++;
+  send_stats.frames += frames;
+  send_stats.dropped += dropped;
 }
 
-int Panda::can_receive(cereal::Event::Builder &event){
-  uint32_t data[RECV_SIZE/4];
-  int recv = usb_bulk_read(0x81, (unsigned char*)data, RECV_SIZE);
+void Panda::can_send_flush(){
+  std::lock_guard<std::recursive_mutex> lk(send_lock);
+  SendSlot *slot = send_cur;
+  send_cur = NULL;
+  if (slot == NULL || slot->len == 0 || !connected) return;
+
+  if (usb == NULL) {
+    int sent = usb_bulk_write(3, slot->transfer->buffer, slot->len, CAN_SEND_TIMEOUT);
+    can_send_done(slot, sent == slot->len);
+    return;
+  }
+
+  slot->transfer->length = slot->len;
+  slot->busy = true;
+  int err = libusb_submit_transfer(slot->transfer);
+  if (err != 0) {
+    slot->busy = false;
+    handle_usb_issue(err, __func__);
+
+    std::lock_guard<std::mutex> lk(send_stats_lock);
+    send_stats.dropped += slot->frames;
+  }
+}
+
+void LIBUSB_CALL Panda::can_send_complete(libusb_transfer *transfer){
+  SendSlot *slot = (SendSlot*)transfer->user_data;
+  Panda *panda = slot->panda;
+
+  if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+    // If the receive buffer on the panda is full it will NAK until the
+    // transfer times out, the frames are dropped.
+    LOGW_100("Transmit buffer full");
+  } else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+    panda->handle_usb_issue(LIBUSB_ERROR_NO_DEVICE, __func__);
+  } else if (transfer->status != LIBUSB_TRANSFER_COMPLETED && transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+    LOGE_100("CAN send transfer failed with status %d", transfer->status);
+  }
+
+  panda->can_send_done(slot, transfer->status == LIBUSB_TRANSFER_COMPLETED && transfer->actual_length == transfer->length);
+  slot->busy = false;
+}
+
+void Panda::can_send_done(SendSlot *slot, bool ok){
+  uint64_t now = nanos_since_boot();
+
+  std::lock_guard<std::mutex> lk(send_stats_lock);
+  send_stats.transfers++;
+  if (ok) {
+    if (slot->publish_min <= now) {
+      send_stats.latency_samples += slot->messages;
+      send_stats.latency_sum += slot->messages * now - slot->publish_sum;
+      send_stats.latency_max = std::max(send_stats.latency_max, now - slot->publish_min);
+    }
+  } else {
+    send_stats.dropped += slot->frames;
+  }
+}
+
+void Panda::can_send_stop(){
+  send_cur = NULL;
+  for (auto &slot : send_slots) {
+    if (slot.busy) libusb_cancel_transfer(slot.transfer);
+  }
+
+  // transfers can only be freed once their callback has run
+  for (auto &slot : send_slots) {
+    for (int i = 0; slot.busy && i < 100; i++) {
+      handle_events(10000);
+    }
+    if (slot.busy) {
+      LOGE("CAN send transfer didn't finish, leaking it");
+    } else if (slot.transfer) {
+      libusb_free_transfer(slot.transfer);
+    }
+    slot.transfer = NULL;
+  }
+}
+
+CanSendStats Panda::can_send_stats(){
+  std::lock_guard<std::mutex> lk(send_stats_lock);
+  CanSendStats ret = send_stats;
+  send_stats = {};
+  return ret;
+}
+
+int Panda::can_receive(uint8_t *data){
+  int recv = usb_bulk_read(0x81, data, RECV_SIZE);
 
   // Not sure if this can happen
   if (recv < 0) recv = 0;
@@ -331,24 +479,213 @@ int Panda::can_receive(cereal::Event::Builder &event){
     LOGW("Receive buffer full");
   }
 
+  return recv;
+}
+
+void Panda::can_parse(cereal::Event::Builder &event, const uint8_t *data, int recv){
+  auto canData = event.initCan(can_count(data, recv));
+  can_unpack(canData, 0, data, recv);
+}
+
+uint8_t Panda::can_src(uint8_t src){
+  // keep the returned/rejected flags, move the bus into this panda's range
+  return (src & 0xC0) | ((src & 0x3F) + bus_offset);
+}
+
+size_t Panda::can_count(const uint8_t *data, int recv){
+  if (!can_fd) return recv / 0x10;
+
+  // records are variable length, walk them to count
+  size_t num_msg = 0;
+  int pos = 0;
+  while (pos + (int)sizeof(can_fd_header) <= recv) {
+    uint8_t dlc = ((can_fd_header*)&data[pos])->dlc & 0xF;
+    if (pos + (int)sizeof(can_fd_header) + dlc_to_len[dlc] > recv) break;
+    pos += sizeof(can_fd_header) + dlc_to_len[dlc];
+    num_msg++;
+  }
+  if (pos != recv) {
+    LOGE_100("malformed CAN FD transfer, %d trailing bytes", recv - pos);
+  }
+  return num_msg;
+}
+
+size_t Panda::can_unpack(capnp::List<cereal::CanData>::Builder &canData, size_t start, const uint8_t *dat, int recv){
+  if (can_fd) {
+    // stops at the same record can_count does
+    size_t i = start;
+    int pos = 0;
+    while (pos + (int)sizeof(can_fd_header) <= recv) {
+      can_fd_header header;
+      memcpy(&header, &dat[pos], sizeof(header));
+      uint8_t len = dlc_to_len[header.dlc & 0xF];
+      if (pos + (int)sizeof(header) + len > recv) break;
+
+      canData[i].setAddress(header.addr_flags >> 3);
+      canData[i].setBusTime(header.bus_time);
+      canData[i].setDat(kj::arrayPtr(&dat[pos + sizeof(header)], len));
+      canData[i].setSrc(can_src(header.src));
+      pos += sizeof(header) + len;
+      i++;
+    }
+    return i - start;
+  }
+
+  const uint32_t *data = (const uint32_t*)dat;
   size_t num_msg = recv / 0x10;
-  auto canData = event.initCan(num_msg);
 
   // populate message
-  for (int i = 0; i < num_msg; i++) {
-    if (data[i*4] & 4) {
+  for (size_t j = 0; j < num_msg; j++) {
+    size_t i = start + j;
+    if (data[j*4] & 4) {
       // extended
-      canData[i].setAddress(data[i*4] >> 3);
-      //printf("got extended: %x\n", data[i*4] >> 3);
+      canData[i].setAddress(data[j*4] >> 3);
+      //printf("got extended: %x\n", data[j*4] >> 3);
     } else {
       // normal
-      canData[i].setAddress(data[i*4] >> 21);
+      canData[i].setAddress(data[j*4] >> 21);
     }
-    canData[i].setBusTime(data[i*4+1] >> 16);
-    int len = data[i*4+1]&0xF;
-    canData[i].setDat(kj::arrayPtr((uint8_t*)&data[i*4+2], len));
-    canData[i].setSrc((data[i*4+1] >> 4) & 0xff);
+    canData[i].setBusTime(data[j*4+1] >> 16);
+    int len = data[j*4+1]&0xF;
+    canData[i].setDat(kj::arrayPtr((const uint8_t*)&data[j*4+2], len));
+    canData[i].setSrc(can_src((data[j*4+1] >> 4) & 0xff));
   }
+  return num_msg;
+}
 
-  return recv;
+bool Panda::can_recv_start(int num_transfers, std::function<void(const uint8_t *data, int len)> callback){
+  assert(!recv_running);
+  // async reads need libusb, other transports get polled
+  if (usb == NULL) return false;
+
+  recv_callback = callback;
+  recv_running = true;
+
+  for (int i = 0; i < num_transfers; i++) {
+    libusb_transfer *transfer = libusb_alloc_transfer(0);
+    unsigned char *buf = (unsigned char*)malloc(RECV_SIZE);
+    if (transfer == NULL || buf == NULL) {
+      libusb_free_transfer(transfer);
+      free(buf);
+      break;
+    }
+    libusb_fill_bulk_transfer(transfer, usb->dev_handle, 0x81, buf, RECV_SIZE, can_recv_complete, this, TIMEOUT);
+    transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+    recv_transfers.push_back(transfer);
+
+    recv_in_flight++;
+    int err = libusb_submit_transfer(transfer);
+    if (err != 0) {
+      recv_in_flight--;
+      handle_usb_issue(err, __func__);
+      break;
+    }
+  }
+
+  if (recv_in_flight == 0) {
+    can_recv_stop();
+    return false;
+  }
+  return true;
+}
+
+void LIBUSB_CALL Panda::can_recv_complete(libusb_transfer *transfer){
+  Panda *panda = (Panda*)transfer->user_data;
+
+  switch (transfer->status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    if (transfer->actual_length == 0 && panda->recv_running) {
+      // nothing on the panda, resubmitting now would just spin on ZLPs
+      std::lock_guard<std::mutex> lk(panda->recv_idle_lock);
+      if (panda->recv_idle.empty()) panda->recv_idle_since = nanos_since_boot();
+      panda->recv_idle.push_back(transfer);
+      panda->recv_in_flight--;
+      return;
+    }
+    panda->recv_callback(transfer->buffer, transfer->actual_length);
+    break;
+  case LIBUSB_TRANSFER_CANCELLED:
+    panda->recv_in_flight--;
+    return;
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    panda->handle_usb_issue(LIBUSB_ERROR_NO_DEVICE, __func__);
+    panda->recv_in_flight--;
+    return;
+  case LIBUSB_TRANSFER_OVERFLOW:
+    LOGE_100("overflow got 0x%x", transfer->actual_length);
+    break;
+  default:
+    LOGE_100("CAN receive transfer failed with status %d", transfer->status);
+    break;
+  }
+
+  // resubmit right away so there's always a transfer waiting on the panda
+  if (panda->recv_running && panda->connected) {
+    int err = libusb_submit_transfer(transfer);
+    if (err == 0) return;
+    panda->handle_usb_issue(err, __func__);
+  }
+  panda->recv_in_flight--;
+}
+
+void Panda::can_recv_resubmit(){
+  std::vector<libusb_transfer*> idle;
+  {
+    std::lock_guard<std::mutex> lk(recv_idle_lock);
+    if (recv_idle.empty() || nanos_since_boot() - recv_idle_since < CAN_RECV_IDLE_US * 1000ULL) return;
+    idle.swap(recv_idle);
+  }
+
+  for (auto transfer : idle) {
+    if (!recv_running || !connected) break;
+    recv_in_flight++;
+    int err = libusb_submit_transfer(transfer);
+    if (err != 0) {
+      recv_in_flight--;
+      handle_usb_issue(err, __func__);
+      break;
+    }
+  }
+}
+
+void Panda::can_recv_stop(){
+  {
+    std::lock_guard<std::mutex> lk(recv_idle_lock);
+    recv_idle.clear();
+  }
+  if (recv_transfers.empty()) {
+    recv_running = false;
+    return;
+  }
+
+  recv_running = false;
+  for (auto transfer : recv_transfers) {
+    libusb_cancel_transfer(transfer);
+  }
+
+  // transfers can only be freed once their callback has run
+  for (int i = 0; i < 100 && recv_in_flight > 0; i++) {
+    handle_events(10000);
+  }
+  if (recv_in_flight > 0) {
+    LOGE("%d CAN receive transfers didn't finish, leaking them", (int)recv_in_flight);
+  } else {
+    for (auto transfer : recv_transfers) {
+      libusb_free_transfer(transfer);
+    }
+  }
+  recv_transfers.clear();
+}
+
+void Panda::handle_events(int timeout_us){
+  if (usb == NULL) {
+    usleep(timeout_us);
+    return;
+  }
+
+  struct timeval tv = {.tv_sec = timeout_us / 1000000, .tv_usec = timeout_us % 1000000};
+  int err = libusb_handle_events_timeout_completed(usb->ctx, &tv, NULL);
+  if (err != 0 && err != LIBUSB_ERROR_INTERRUPTED) {
+    handle_usb_issue(err, __func__);
+  }
 }
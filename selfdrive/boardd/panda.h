@@ -2,17 +2,60 @@
 
 #include <ctime>
 #include <cstdint>
-#include <pthread.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 #include <libusb-1.0/libusb.h>
 
 #include "cereal/gen/cpp/car.capnp.h"
 #include "cereal/gen/cpp/log.capnp.h"
+#include "opendbc/can/common_dbc.h"
+
+#include "panda_transport.h"
 
 // double the FIFO size
 #define RECV_SIZE (0x1000)
 #define TIMEOUT 0
 
+// bulk IN transfers the async reader keeps queued on the CAN endpoint
+#define CAN_RECV_TRANSFERS 4
+// the panda answers an IN transfer right away, with a zero length packet when it
+// has nothing buffered. Those transfers wait this long before asking again.
+#define CAN_RECV_IDLE_US 1000
+
+// ring of preallocated bulk OUT transfers for sending CAN
+#define CAN_SEND_TRANSFERS 4
+#define CAN_SEND_SIZE 0x1000
+#define CAN_SEND_TIMEOUT 5
+
+// buses per panda, including GMLAN
+#define PANDA_BUS_CNT 4
+
+#define CAN_PACKET_VERSION_FD 1
+
+// CAN FD payload lengths by DLC, classic frames stop at 8
+static const uint8_t dlc_to_len[] = {0U, 1U, 2U, 3U, 4U, 5U, 6U, 7U, 8U, 12U, 16U, 20U, 24U, 32U, 48U, 64U};
+
+static inline uint8_t len_to_dlc(size_t len) {
+  if (len <= 8) return len;
+  uint8_t dlc = 9;
+  while (dlc < 15 && dlc_to_len[dlc] < len) dlc++;
+  return dlc;
+}
+
+// USB record used by CAN FD capable firmware. Records are packed back to back,
+// each one is this header followed by dlc_to_len[dlc] bytes of payload.
+// A bulk transfer never splits a record.
+struct __attribute__((packed)) can_fd_header {
+  uint32_t addr_flags; // addr << 3 | extended << 2 | fd << 1
+  uint16_t bus_time;
+  uint8_t src;
+  uint8_t dlc;
+};
+
 // copied from panda/board/main.c
 struct __attribute__((packed)) health_t {
   uint32_t uptime;
@@ -35,24 +78,76 @@ struct __attribute__((packed)) health_t {
 };
 
 
+struct CanSendStats {
+  uint64_t messages;  // sendcan messages
+  uint64_t frames;
+  uint64_t transfers;
+  uint64_t dropped;   // frames that never made it to the panda
+  // ns from sendcan publish to USB completion, one sample per message and transfer it went out in
+  uint64_t latency_samples;
+  uint64_t latency_sum;
+  uint64_t latency_max;
+};
+
 void panda_set_power(bool power);
 
 class Panda {
  private:
-  libusb_context *ctx = NULL;
-  libusb_device_handle *dev_handle = NULL;
-  pthread_mutex_t usb_lock;
+  std::unique_ptr<PandaTransport> transport;
+  UsbTransport *usb = NULL; // same object as transport when talking to a real panda
+  std::mutex usb_lock;
   void handle_usb_issue(int err, const char func[]);
-  void cleanup();
+
+  // async CAN receive
+  std::vector<libusb_transfer*> recv_transfers;
+  std::function<void(const uint8_t *data, int len)> recv_callback;
+  std::atomic<bool> recv_running{false};
+  std::atomic<int> recv_in_flight{0};
+  // came back empty, see can_recv_resubmit. Any thread handling events can
+  // complete a transfer, recv_idle_lock guards both.
+  std::mutex recv_idle_lock;
+  std::vector<libusb_transfer*> recv_idle;
+  uint64_t recv_idle_since = 0;
+  static void LIBUSB_CALL can_recv_complete(libusb_transfer *transfer);
+
+  // async CAN send, frames are written straight into the transfer buffers.
+  // sendcan and the ISO-TP queries both send, send_lock keeps them apart.
+  std::recursive_mutex send_lock;
+  struct SendSlot {
+    Panda *panda;
+    libusb_transfer *transfer;
+    std::atomic<bool> busy;
+    int len;
+    int frames;
+    int messages;
+    uint64_t publish_sum;  // summed publish times of the messages in this transfer
+    uint64_t publish_min;
+  };
+  SendSlot send_slots[CAN_SEND_TRANSFERS] = {};
+  SendSlot *send_cur = NULL;
+  int send_next = 0;
+  std::mutex send_stats_lock;
+  CanSendStats send_stats = {};
+  bool can_send_init();
+  SendSlot *can_send_slot();
+  void can_send_stop();
+  void can_send_done(SendSlot *slot, bool ok);
+  static void LIBUSB_CALL can_send_complete(libusb_transfer *transfer);
 
  public:
-  Panda();
+  // Takes ownership of the transport, the default opens the first USB panda
+  Panda(PandaTransport *transport = NULL);
   ~Panda();
 
   bool connected = true;
   cereal::HealthData::HwType hw_type = cereal::HealthData::HwType::UNKNOWN;
   bool is_pigeon = false;
   bool has_rtc = false;
+  bool can_fd = false;
+
+  // This panda's buses show up as bus_offset to bus_offset + PANDA_BUS_CNT - 1
+  // in can and sendcan, so several pandas can share them.
+  int bus_offset = 0;
 
   // HW communication
   int usb_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout=TIMEOUT);
@@ -62,6 +157,7 @@ class Panda {
 
   // Panda functionality
   cereal::HealthData::HwType get_hw_type();
+  uint8_t get_can_packet_version();
   void set_safety_model(cereal::CarParams::SafetyModel safety_model, int safety_param=0);
   void set_unsafe_mode(uint16_t unsafe_mode);
   void set_rtc(struct tm sys_time);
@@ -77,6 +173,30 @@ class Panda {
   void set_usb_power_mode(cereal::HealthData::UsbPowerMode power_mode);
   void send_heartbeat();
   void can_send(capnp::List<cereal::CanData>::Reader can_data_list);
-  int can_receive(cereal::Event::Builder &event);
+  // can_send_queue packs frames into the current transfer, can_send_flush submits it.
+  // Back to back sendcan messages can be queued together to share one transfer.
+  void can_send_queue(capnp::List<cereal::CanData>::Reader can_data_list, uint64_t publish_time);
+  void can_send_flush();
+  CanSendStats can_send_stats();
+  // synchronous read of up to RECV_SIZE bytes of CAN records into data
+  int can_receive(uint8_t *data);
+  void can_parse(cereal::Event::Builder &event, const uint8_t *data, int recv);
+  // Frames in a receive buffer, and unpacking them into a list at start so
+  // several pandas' buffers can go into one can message.
+  size_t can_count(const uint8_t *data, int recv);
+  size_t can_unpack(capnp::List<cereal::CanData>::Builder &list, size_t start, const uint8_t *data, int recv);
+
+  // Keeps num_transfers bulk reads queued so the panda always has somewhere to
+  // put frames. The callback gets the data of every completed transfer, on
+  // whichever thread is handling libusb events at the time.
+  bool can_recv_start(int num_transfers, std::function<void(const uint8_t *data, int len)> callback);
+  void can_recv_stop();
+  // queues the transfers that came back empty again once they've idled CAN_RECV_IDLE_US,
+  // call it on the thread that handles the events
+  void can_recv_resubmit();
+  void handle_events(int timeout_us);
+
+ private:
+  uint8_t can_src(uint8_t src);
 
 };
@@ -0,0 +1,185 @@
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "panda_transport.h"
+
+static libusb_device_handle *open_panda(libusb_context *ctx, const char *serial){
+  if (serial == NULL) {
+    return libusb_open_device_with_vid_pid(ctx, 0xbbaa, 0xddcc);
+  }
+
+  libusb_device **list = NULL;
+  ssize_t num = libusb_get_device_list(ctx, &list);
+  libusb_device_handle *ret = NULL;
+  for (ssize_t i = 0; i < num && ret == NULL; i++) {
+    libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(list[i], &desc) != 0) continue;
+    if (desc.idVendor != 0xbbaa || desc.idProduct != 0xddcc) continue;
+
+    libusb_device_handle *handle = NULL;
+    if (libusb_open(list[i], &handle) != 0) continue;
+
+    unsigned char dev_serial[64] = {0};
+    int len = libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, dev_serial, sizeof(dev_serial) - 1);
+    if (len > 0 && strcmp((const char*)dev_serial, serial) == 0) {
+      ret = handle;
+    } else {
+      libusb_close(handle);
+    }
+  }
+  if (num >= 0) libusb_free_device_list(list, 1);
+  return ret;
+}
+
+UsbTransport::UsbTransport(const char *serial){
+  int err;
+
+  // init libusb
+  err = libusb_init(&ctx);
+  if (err != 0) { goto fail; }
+
+#if LIBUSB_API_VERSION >= 0x01000106
+  libusb_set_option(ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_INFO);
+#else
+  libusb_set_debug(ctx, 3);
+#endif
+
+  dev_handle = open_panda(ctx, serial);
+  if (dev_handle == NULL) { goto fail; }
+
+  if (libusb_kernel_driver_active(dev_handle, 0) == 1) {
+    libusb_detach_kernel_driver(dev_handle, 0);
+  }
+
+  err = libusb_set_configuration(dev_handle, 1);
+  if (err != 0) { goto fail; }
+
+  err = libusb_claim_interface(dev_handle, 0);
+  if (err != 0) { goto fail; }
+
+  return;
+
+fail:
+  cleanup();
+  throw std::runtime_error("Error connecting to panda");
+}
+
+UsbTransport::~UsbTransport(){
+  cleanup();
+}
+
+void UsbTransport::cleanup(){
+  if (dev_handle){
+    libusb_release_interface(dev_handle, 0);
+    libusb_close(dev_handle);
+    dev_handle = NULL;
+  }
+
+  if (ctx) {
+    libusb_exit(ctx);
+    ctx = NULL;
+  }
+}
+
+int UsbTransport::control_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout){
+  const uint8_t bmRequestType = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+  return libusb_control_transfer(dev_handle, bmRequestType, bRequest, wValue, wIndex, NULL, 0, timeout);
+}
+
+int UsbTransport::control_read(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout){
+  const uint8_t bmRequestType = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+  return libusb_control_transfer(dev_handle, bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout);
+}
+
+int UsbTransport::bulk_write(unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout){
+  return libusb_bulk_transfer(dev_handle, endpoint, data, length, transferred, timeout);
+}
+
+int UsbTransport::bulk_read(unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout){
+  return libusb_bulk_transfer(dev_handle, endpoint, data, length, transferred, timeout);
+}
+
+
+SocketTransport::SocketTransport(const char *path){
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    throw std::runtime_error("Simulated panda socket path too long");
+  }
+  strcpy(addr.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    if (fd >= 0) close(fd);
+    throw std::runtime_error("Error connecting to simulated panda");
+  }
+}
+
+SocketTransport::~SocketTransport(){
+  close(fd);
+}
+
+int SocketTransport::request(sim_panda_request req, const unsigned char *out, unsigned char *in, unsigned int timeout){
+  // Replies to requests that timed out earlier are still queued, drop them
+  // so they don't get mistaken for this one's.
+  while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {}
+
+  int out_len = (req.type == SIM_PANDA_BULK_OUT) ? req.length : 0;
+  if (sizeof(req) + out_len > sizeof(buf)) return LIBUSB_ERROR_OVERFLOW;
+  memcpy(buf, &req, sizeof(req));
+  if (out_len > 0) memcpy(buf + sizeof(req), out, out_len);
+
+  if (send(fd, buf, sizeof(req) + out_len, MSG_NOSIGNAL) < 0) {
+    return (errno == EPIPE || errno == ECONNRESET) ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_IO;
+  }
+
+  // same as libusb, a timeout of 0 waits forever
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  int err = poll(&pfd, 1, timeout == 0 ? -1 : timeout);
+  if (err == 0) return LIBUSB_ERROR_TIMEOUT;
+  if (err < 0) return (errno == EINTR) ? LIBUSB_ERROR_INTERRUPTED : LIBUSB_ERROR_IO;
+
+  ssize_t len = recv(fd, buf, sizeof(buf), 0);
+  if (len == 0 || (len < 0 && errno == ECONNRESET)) return LIBUSB_ERROR_NO_DEVICE;
+  if (len < (ssize_t)sizeof(sim_panda_reply)) return LIBUSB_ERROR_IO;
+
+  sim_panda_reply reply;
+  memcpy(&reply, buf, sizeof(reply));
+  int in_len = len - sizeof(reply);
+  if (in_len > req.length) return LIBUSB_ERROR_OVERFLOW;
+  if (in && in_len > 0) memcpy(in, buf + sizeof(reply), in_len);
+  return reply.result;
+}
+
+int SocketTransport::control_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout){
+  sim_panda_request req = {.type = SIM_PANDA_CONTROL_OUT, .request = bRequest, .value = wValue, .index = wIndex, .length = 0};
+  return request(req, NULL, NULL, timeout);
+}
+
+int SocketTransport::control_read(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout){
+  sim_panda_request req = {.type = SIM_PANDA_CONTROL_IN, .request = bRequest, .value = wValue, .index = wIndex, .length = wLength};
+  return request(req, NULL, data, timeout);
+}
+
+int SocketTransport::bulk_write(unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout){
+  *transferred = 0;
+  sim_panda_request req = {.type = SIM_PANDA_BULK_OUT, .request = endpoint, .value = 0, .index = 0, .length = (uint16_t)length};
+  int ret = request(req, data, NULL, timeout);
+  if (ret < 0) return ret;
+  *transferred = ret;
+  return 0;
+}
+
+int SocketTransport::bulk_read(unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout){
+  *transferred = 0;
+  sim_panda_request req = {.type = SIM_PANDA_BULK_IN, .request = endpoint, .value = 0, .index = 0, .length = (uint16_t)length};
+  int ret = request(req, NULL, data, timeout);
+  if (ret < 0) return ret;
+  *transferred = ret;
+  return 0;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+
+#include <libusb-1.0/libusb.h>
+
+// What Panda sends its control and bulk requests over. Return values follow
+// libusb: bytes transferred or 0 on success, a LIBUSB_ERROR_* code on failure.
+class PandaTransport {
+ public:
+  virtual ~PandaTransport(){};
+
+  virtual int control_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout) = 0;
+  virtual int control_read(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout) = 0;
+  virtual int bulk_write(unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout) = 0;
+  virtual int bulk_read(unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout) = 0;
+};
+
+class UsbTransport : public PandaTransport {
+ public:
+  // opens the panda with this serial, or the first one found if NULL
+  UsbTransport(const char *serial = NULL);
+  ~UsbTransport();
+
+  // Panda submits its async CAN transfers on these directly
+  libusb_context *ctx = NULL;
+  libusb_device_handle *dev_handle = NULL;
+
+  int control_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout);
+  int control_read(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout);
+  int bulk_write(unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout);
+  int bulk_read(unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout);
+
+ private:
+  void cleanup();
+};
+
+// Talks to a software panda (selfdrive/boardd/tests/sim_panda) over a unix
+// seqpacket socket. Every request is one packet and gets exactly one reply
+// packet, so no framing is needed. Payloads are the same bytes that would go
+// over USB, CAN included.
+#define SIM_PANDA_CONTROL_OUT 0
+#define SIM_PANDA_CONTROL_IN 1
+#define SIM_PANDA_BULK_OUT 2
+#define SIM_PANDA_BULK_IN 3
+
+// large enough for a full CAN receive buffer plus the header
+#define SIM_PANDA_MAX_PACKET 0x2000
+
+struct __attribute__((packed)) sim_panda_request {
+  uint8_t type;
+  uint8_t request; // bRequest for control, endpoint for bulk
+  uint16_t value;
+  uint16_t index;
+  uint16_t length; // bytes wanted for IN, payload size for OUT
+};
+
+struct __attribute__((packed)) sim_panda_reply {
+  int32_t result; // what the libusb call would have returned
+};
+
+class SocketTransport : public PandaTransport {
+ public:
+  SocketTransport(const char *path);
+  ~SocketTransport();
+
+  int control_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout);
+  int control_read(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout);
+  int bulk_write(unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout);
+  int bulk_read(unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout);
+
+ private:
+  int fd = -1;
+  uint8_t buf[SIM_PANDA_MAX_PACKET];
+  int request(sim_panda_request req, const unsigned char *out, unsigned char *in, unsigned int timeout);
+};
@@ -2,7 +2,9 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 #include <termios.h>
+#include <sys/ioctl.h>
 
 #include "common/swaglog.h"
 #include "common/gpio.h"
@@ -14,6 +16,9 @@
 #define   B460800 0010004
 #endif
 
+// longest the panda is left unpolled while the GPS is quiet
+#define PIGEON_MAX_BACKOFF_MS 10
+
 using namespace std::string_literals;
 
 
@@ -79,6 +84,62 @@ void Pigeon::init() {
   LOGW("panda GPS on");
 }
 
+bool UbxFramer::process(std::function<void(const char *frame, size_t len)> publish) {
+  bool valid = true;
+  size_t pos = 0;
+  while (pos < buf.size()) {
+    const uint8_t *d = (const uint8_t *)buf.data() + pos;
+    size_t avail = buf.size() - pos;
+
+    if (d[0] != UBX_SYNC_1) {
+      if (synced && d[0] == 0x00) valid = false;
+      synced = false;
+      pos++;
+      continue;
+    }
+    if (avail < 2) break;
+    if (d[1] != UBX_SYNC_2) {
+      synced = false;
+      pos++;
+      continue;
+    }
+    if (avail < UBX_HEADER_SIZE) break;
+
+    size_t frame_len = UBX_HEADER_SIZE + (d[4] | (d[5] << 8)) + 2;
+    if (frame_len > UBX_MAX_FRAME) {
+      synced = false;
+      pos++;
+      continue;
+    }
+    if (avail < frame_len) break;
+
+    // 8 bit Fletcher over class, id, length and payload
+    uint8_t ck_a = 0, ck_b = 0;
+    for (size_t i = 2; i < frame_len - 2; i++) {
+      ck_a += d[i];
+      ck_b += ck_a;
+    }
+    if (ck_a != d[frame_len - 2] || ck_b != d[frame_len - 1]) {
+      LOGW_100("dropping ublox frame with bad checksum");
+      synced = false;
+      pos++;
+      continue;
+    }
+
+    publish((const char *)d, frame_len);
+    synced = true;
+    pos += frame_len;
+  }
+
+  buf.erase(0, pos);
+  return valid;
+}
+
+void UbxFramer::reset() {
+  buf.clear();
+  synced = true;
+}
+
 void PandaPigeon::connect(Panda * p) {
   panda = p;
 }
@@ -102,17 +163,30 @@ void PandaPigeon::send(std::string s) {
   }
 }
 
-std::string PandaPigeon::receive() {
-  std::string r;
+int PandaPigeon::receive(std::string &buf, int timeout_ms) {
+  int waited = 0;
+  while (true) {
+    int r = 0;
+    while (r <= 0x1000){
+      unsigned char dat[0x40];
+      int len = panda->usb_read(0xe0, 1, 0, dat, sizeof(dat));
+      if (len <= 0) break;
+      buf.append((char*)dat, len);
+      r += len;
+    }
 
-  while (true){
-    unsigned char dat[0x40];
-    int len = panda->usb_read(0xe0, 1, 0, dat, sizeof(dat));
-    if (len <= 0 || r.length() > 0x1000) break;
-    r.append((char*)dat, len);
-  }
+    // data comes in bursts, poll right away again while one is going on
+    if (r > 0) {
+      backoff_ms = 1;
+      return r;
+    }
+    if (waited >= timeout_ms) return 0;
 
-  return r;
+    int sleep_ms = std::min(backoff_ms, timeout_ms - waited);
+    usleep(sleep_ms * 1000);
+    waited += sleep_ms;
+    backoff_ms = std::min(backoff_ms * 2, PIGEON_MAX_BACKOFF_MS);
+  }
 }
 
 void PandaPigeon::set_power(bool power) {
@@ -189,22 +263,26 @@ void TTYPigeon::send(std::string s) {
   if(err < 0) { handle_tty_issue(err, __func__); }
 }
 
-std::string TTYPigeon::receive() {
-  std::string r;
-
-  while (true){
-    char dat[0x40];
-    int len = read(pigeon_tty_fd, dat, sizeof(dat));
-    if(len < 0) {
-      handle_tty_issue(len, __func__);
-    } else if (len == 0 || r.length() > 0x1000){
-      break;
-    } else {
-      r.append(dat, len);
-    }
-
+int TTYPigeon::receive(std::string &buf, int timeout_ms) {
+  struct pollfd pfd = {.fd = pigeon_tty_fd, .events = POLLIN};
+  int err = poll(&pfd, 1, timeout_ms);
+  if (err < 0 && errno != EINTR) handle_tty_issue(errno, __func__);
+  if (err <= 0) return 0;
+
+  // read everything the driver has in one go
+  int avail = 0;
+  if (ioctl(pigeon_tty_fd, FIONREAD, &avail) < 0 || avail <= 0) avail = 0x40;
+  avail = std::min(avail, 0x1000);
+
+  size_t pos = buf.size();
+  buf.resize(pos + avail);
+  int len = read(pigeon_tty_fd, &buf[pos], avail);
+  if (len < 0) {
+    handle_tty_issue(errno, __func__);
+    len = 0;
   }
-  return r;
+  buf.resize(pos + len);
+  return len;
 }
 
 void TTYPigeon::set_power(bool power){
@@ -1,5 +1,6 @@
 #pragma once
 #include <string>
+#include <functional>
 #include <termios.h>
 
 
@@ -14,10 +15,33 @@ class Pigeon {
   void init();
   virtual void set_baud(int baud) = 0;
   virtual void send(std::string s) = 0;
-  virtual std::string receive() = 0;
+  // Waits up to timeout_ms for data and appends everything available to
+  // buf, returns the number of bytes read.
+  virtual int receive(std::string &buf, int timeout_ms) = 0;
   virtual void set_power(bool power) = 0;
 };
 
+#define UBX_SYNC_1 0xB5
+#define UBX_SYNC_2 0x62
+#define UBX_HEADER_SIZE 6 // sync, class, id, little endian payload length
+#define UBX_MAX_FRAME 0x4000
+
+// Splits the pigeon's byte stream into UBX frames, so every ubloxRaw holds
+// exactly one. Partial frames stay in buf until the rest arrives.
+class UbxFramer {
+ public:
+  std::string buf;
+
+  // Hands every complete frame with a valid checksum to publish and drops
+  // anything that isn't one. Returns false if a frame boundary held a zero,
+  // which is what a pigeon that needs a reset sends.
+  bool process(std::function<void(const char *frame, size_t len)> publish);
+  void reset();
+
+ private:
+  bool synced = true;
+};
+
 class PandaPigeon : public Pigeon {
   Panda * panda = NULL;
 public:
@@ -25,8 +49,11 @@ public:
   void connect(Panda * p);
   void set_baud(int baud);
   void send(std::string s);
-  std::string receive();
+  int receive(std::string &buf, int timeout_ms);
   void set_power(bool power);
+private:
+  // the panda has no way to signal GPS data, so poll it and back off while it's quiet
+  int backoff_ms = 1;
 };
 
 
@@ -38,6 +65,6 @@ public:
   void connect(const char* tty);
   void set_baud(int baud);
   void send(std::string s);
-  std::string receive();
+  int receive(std::string &buf, int timeout_ms);
   void set_power(bool power);
 };
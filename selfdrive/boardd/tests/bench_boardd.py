@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+# Benchmarks boardd against tests/sim_panda, no hardware needed.
+#
+# For every bus load boardd is started on a fresh simulated panda. CAN latency
+# is measured from when a synthesized frame arrived on the simulated bus to
+# when it shows up on the can socket, sendcan latency from publish to when the
+# simulated panda got the frame over the socket transport.
+#
+# usage: bench_boardd.py [--loads 10,30,60,90] [--duration 10] [--log rlog.bz2]
+import argparse
+import os
+import signal
+import struct
+import subprocess
+import time
+
+import cereal.messaging as messaging
+from common.realtime import sec_since_boot
+from selfdrive.boardd.boardd import can_list_to_can_capnp
+
+BOARDD_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+SOCKET_PATH = "/tmp/sim_panda.sock"
+PROBE_ADDR = 0x7ff
+SENDCAN_HZ = 100
+
+
+def nanos():
+  return int(sec_since_boot() * 1e9)
+
+
+def run(load, duration, log):
+  sim_cmd = [os.path.join(BOARDD_DIR, "tests", "sim_panda"), SOCKET_PATH, "--load", str(load), "--ignition"]
+  if log is not None:
+    sim_cmd += ["--log", log]
+  sim = subprocess.Popen(sim_cmd, stdout=subprocess.PIPE, universal_newlines=True)
+  time.sleep(0.5)
+
+  env = dict(os.environ, BOARDD_SIM_PANDA=SOCKET_PATH, STARTED="1")
+  boardd = subprocess.Popen([os.path.join(BOARDD_DIR, "boardd")], env=env)
+
+  can_sock = messaging.sub_sock('can', timeout=100)
+  sendcan = messaging.pub_sock('sendcan')
+
+  # let boardd connect and settle before measuring
+  time.sleep(2)
+  messaging.drain_sock(can_sock)
+
+  frames, latencies = 0, []
+  start = sec_since_boot()
+  next_send = start
+  while sec_since_boot() - start < duration:
+    if sec_since_boot() >= next_send:
+      sendcan.send(can_list_to_can_capnp([[PROBE_ADDR, 0, struct.pack("<Q", nanos()), 0]], msgtype='sendcan').to_bytes())
+      next_send += 1. / SENDCAN_HZ
+
+    for msg in messaging.drain_sock(can_sock):
+      now = nanos()
+      for c in msg.can:
+        if c.src >= 128 or len(c.dat) != 8:
+          continue
+        frames += 1
+        # without a log every frame carries the time it was put on the bus
+        if log is None:
+          latencies.append((now - struct.unpack("<Q", c.dat)[0]) / 1e6)
+    time.sleep(0.001)
+
+  boardd.send_signal(signal.SIGINT)
+  boardd.wait()
+  sim.send_signal(signal.SIGINT)
+  sim_out = sim.communicate()[0].strip().splitlines()
+
+  line = "load %3d%%: %7.0f frames/s" % (load, frames / duration)
+  if latencies:
+    latencies.sort()
+    line += ", can latency mean %.2f ms p99 %.2f ms max %.2f ms" % (
+      sum(latencies) / len(latencies), latencies[int(len(latencies) * 0.99)], latencies[-1])
+  print(line)
+  if sim_out:
+    print("  sim_panda: " + sim_out[-1])
+
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser(description="Benchmark boardd against a simulated panda")
+  parser.add_argument("--loads", default="10,30,60,90", help="comma separated bus loads in percent")
+  parser.add_argument("--duration", type=float, default=10, help="seconds per load")
+  parser.add_argument("--log", help="replay the CAN from this rlog instead of synthesizing it")
+  args = parser.parse_args()
+
+  for l in args.loads.split(","):
+    run(int(l), args.duration, args.log)
@@ -0,0 +1,476 @@
+// Software panda for running boardd without hardware.
+//
+// Listens on a unix seqpacket socket and answers the same control and bulk
+// requests the panda firmware does (see SocketTransport in panda_transport.h).
+// CAN is produced at a fixed bus load, either replayed from the can events of
+// a log or synthesized, and handed out in the 16 byte USB record format.
+//
+// Synthesized frames carry the time they "arrived on the bus" in their data,
+// and sendcan frames to SIM_PANDA_PROBE_ADDR are expected to carry their
+// publish time, so both directions of boardd's latency can be measured.
+// tests/bench_boardd.py drives this together with boardd.
+//
+// usage: sim_panda <socket path> [--log rlog[.bz2]] [--load percent]
+//                  [--bitrate bps] [--buses n] [--ignition]
+
+#include <cassert>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <bzlib.h>
+#include <capnp/serialize.h>
+
+#include "common/timing.h"
+#include "cereal/gen/cpp/log.capnp.h"
+
+#include "../panda.h"
+#include "../panda_transport.h"
+
+// matches can_rx_q in the panda firmware
+#define RX_QUEUE_SIZE 0x1000
+#define SIM_PANDA_PROBE_ADDR 0x7ff
+
+struct CanFrame {
+  uint32_t address;
+  uint8_t src;
+  uint8_t len;
+  uint8_t dat[8];
+};
+
+struct SimStats {
+  uint64_t rx_frames;     // put on the bus
+  uint64_t rx_delivered;  // read by boardd
+  uint64_t rx_overflow;   // dropped because boardd didn't read fast enough
+  uint64_t rx_reads;
+  uint64_t tx_frames;
+  uint64_t tx_transfers;
+  uint64_t probes;
+  uint64_t probe_latency_sum;
+  uint64_t probe_latency_max;
+};
+
+static volatile sig_atomic_t do_exit = 0;
+static void set_do_exit(int sig) {
+  do_exit = 1;
+}
+
+class SimPanda {
+ public:
+  SimPanda(std::vector<CanFrame> frames, double load, int bitrate, int buses, bool ignition)
+    : frames(frames), ignition(ignition), start(nanos_since_boot()) {
+    // all buses run at the same load, the log's frames are spread over them in order
+    bits_per_ns = load * bitrate * buses / 1e9;
+    next_frame = start;
+  }
+
+  // fills reply with the result followed by any IN data, returns its size
+  int handle(const uint8_t *pkt, int len, uint8_t *reply);
+  void print_stats();
+  SimStats stats = {};
+
+ private:
+  std::vector<CanFrame> frames;
+  size_t frame_idx = 0;
+  uint32_t synth_counter = 0;
+  double bits_per_ns;
+  uint64_t next_frame;
+  std::deque<CanFrame> rx_queue;
+
+  bool ignition;
+  bool loopback = false;
+  uint16_t safety_model = 0;
+  uint8_t usb_power_mode = 0;
+  uint8_t power_save = 0;
+  const uint64_t start;
+
+  CanFrame next_bus_frame(uint64_t bus_time);
+  void run_bus(uint64_t now);
+  void push_rx(const CanFrame &f);
+  int control_in(const sim_panda_request &req, uint8_t *data);
+  int bulk_in(const sim_panda_request &req, uint8_t *data);
+  int bulk_out(const sim_panda_request &req, const uint8_t *data, int len);
+};
+
+// Nominal classic frame with an 11 bit id: 47 bits of framing plus the data,
+// and about 10% on top for bit stuffing.
+static double frame_bits(int len) {
+  return (47 + 8 * len) * 1.1;
+}
+
+CanFrame SimPanda::next_bus_frame(uint64_t bus_time) {
+  if (!frames.empty()) {
+    CanFrame f = frames[frame_idx];
+    frame_idx = (frame_idx + 1) % frames.size();
+    return f;
+  }
+
+  // round robin over a set of addresses, like a car's periodic messages
+  CanFrame f = {.address = 0x100 + (synth_counter % 64), .src = (uint8_t)(synth_counter % 3), .len = 8};
+  memcpy(f.dat, &bus_time, sizeof(bus_time));
+  synth_counter++;
+  return f;
+}
+
+void SimPanda::run_bus(uint64_t now) {
+  while (next_frame <= now) {
+    CanFrame f = next_bus_frame(next_frame);
+    next_frame += frame_bits(f.len) / bits_per_ns;
+    stats.rx_frames++;
+    push_rx(f);
+  }
+}
+
+void SimPanda::push_rx(const CanFrame &f) {
+  if (rx_queue.size() >= RX_QUEUE_SIZE) {
+    stats.rx_overflow++;
+    return;
+  }
+  rx_queue.push_back(f);
+}
+
+int SimPanda::handle(const uint8_t *pkt, int len, uint8_t *reply) {
+  sim_panda_reply r = {.result = 0};
+  uint8_t *data = reply + sizeof(r);
+
+  sim_panda_request req;
+  if (len < (int)sizeof(req)) {
+    r.result = LIBUSB_ERROR_INVALID_PARAM;
+    memcpy(reply, &r, sizeof(r));
+    return sizeof(r);
+  }
+  memcpy(&req, pkt, sizeof(req));
+  req.length = std::min<int>(req.length, SIM_PANDA_MAX_PACKET - sizeof(r));
+
+  run_bus(nanos_since_boot());
+
+  switch (req.type) {
+  case SIM_PANDA_CONTROL_OUT:
+    switch (req.request) {
+    case 0xdc:
+      safety_model = req.value;
+      break;
+    case 0xe5:
+      loopback = req.value;
+      break;
+    case 0xe6:
+      usb_power_mode = req.value;
+      break;
+    case 0xe7:
+      power_save = req.value;
+      break;
+    default:
+      // heartbeat, fan, ir, rtc, unsafe mode: nothing to simulate
+      break;
+    }
+    break;
+  case SIM_PANDA_CONTROL_IN:
+    r.result = control_in(req, data);
+    break;
+  case SIM_PANDA_BULK_IN:
+    r.result = bulk_in(req, data);
+    break;
+  case SIM_PANDA_BULK_OUT:
+    r.result = bulk_out(req, pkt + sizeof(req), len - sizeof(req));
+    break;
+  default:
+    r.result = LIBUSB_ERROR_NOT_SUPPORTED;
+    break;
+  }
+
+  memcpy(reply, &r, sizeof(r));
+  return sizeof(r) + std::max(0, (req.type == SIM_PANDA_CONTROL_IN || req.type == SIM_PANDA_BULK_IN) ? (int)r.result : 0);
+}
+
+int SimPanda::control_in(const sim_panda_request &req, uint8_t *data) {
+  int len = 0;
+  switch (req.request) {
+  case 0xc1: // hw type
+    data[0] = (uint8_t)cereal::HealthData::HwType::WHITE_PANDA;
+    len = 1;
+    break;
+  case 0xd0: { // serial
+    const char serial[16] = "simpanda0000000";
+    len = std::min<int>(req.length, sizeof(serial));
+    memcpy(data, serial, len);
+    break;
+  }
+  case 0xd2: { // health
+    health_t health = {0};
+    health.uptime = (nanos_since_boot() - start) / 1000000000ULL;
+    health.voltage = 12000;
+    health.can_rx_errs = stats.rx_overflow;
+    health.ignition_line = ignition;
+    health.car_harness_status = 1;
+    health.usb_power_mode = usb_power_mode;
+    health.safety_model = safety_model;
+    health.power_save_enabled = power_save;
+    len = std::min<int>(req.length, sizeof(health));
+    memcpy(data, &health, len);
+    break;
+  }
+  case 0xd3: // firmware signature, two halves
+  case 0xd4:
+    len = std::min<int>(req.length, 64);
+    memset(data, req.request, len);
+    break;
+  default:
+    // unhandled requests return nothing, e.g. 0xfb on pre CAN FD firmware
+    break;
+  }
+  return len;
+}
+
+int SimPanda::bulk_in(const sim_panda_request &req, uint8_t *data) {
+  if (req.request != 0x81) return 0;
+
+  stats.rx_reads++;
+  int num = std::min<int>(req.length / 0x10, rx_queue.size());
+  for (int i = 0; i < num; i++) {
+    const CanFrame &f = rx_queue.front();
+    uint32_t rec[4] = {0};
+    if (f.address >= 0x800) {
+      rec[0] = (f.address << 3) | 4;
+    } else {
+      rec[0] = f.address << 21;
+    }
+    uint16_t bus_time = (nanos_since_boot() / 1000) & 0xffff;
+    rec[1] = (bus_time << 16) | (f.src << 4) | f.len;
+    memcpy(&rec[2], f.dat, f.len);
+    memcpy(data + i * sizeof(rec), rec, sizeof(rec));
+    rx_queue.pop_front();
+  }
+  stats.rx_delivered += num;
+  return num * 0x10;
+}
+
+int SimPanda::bulk_out(const sim_panda_request &req, const uint8_t *data, int len) {
+  if (req.request != 3) return len;
+
+  uint64_t now = nanos_since_boot();
+  stats.tx_transfers++;
+  for (int pos = 0; pos + 0x10 <= len; pos += 0x10) {
+    uint32_t rec[4];
+    memcpy(rec, data + pos, sizeof(rec));
+
+    CanFrame f = {};
+    f.address = (rec[0] & 4) ? (rec[0] >> 3) : (rec[0] >> 21);
+    f.len = std::min<uint8_t>(rec[1] & 0xf, 8);
+    f.src = (rec[1] >> 4) & 0xff;
+    memcpy(f.dat, &rec[2], f.len);
+    stats.tx_frames++;
+
+    if (f.address == SIM_PANDA_PROBE_ADDR && f.len == 8) {
+      uint64_t sent;
+      memcpy(&sent, f.dat, sizeof(sent));
+      if (sent <= now) {
+        stats.probes++;
+        stats.probe_latency_sum += now - sent;
+        stats.probe_latency_max = std::max(stats.probe_latency_max, now - sent);
+      }
+    }
+
+    // the firmware echoes every frame it puts on the bus back with the 0x80 bit set
+    if (loopback) push_rx(f);
+    f.src |= 0x80;
+    push_rx(f);
+  }
+  return len;
+}
+
+void SimPanda::print_stats() {
+  printf("rx %llu frames, %llu delivered in %llu reads, %llu overflow; tx %llu frames in %llu transfers; probe latency mean %.3f ms max %.3f ms\n",
+         (unsigned long long)stats.rx_frames, (unsigned long long)stats.rx_delivered, (unsigned long long)stats.rx_reads,
+         (unsigned long long)stats.rx_overflow, (unsigned long long)stats.tx_frames, (unsigned long long)stats.tx_transfers,
+         stats.probes ? stats.probe_latency_sum / (stats.probes * 1e6) : 0., stats.probe_latency_max / 1e6);
+  fflush(stdout);
+  stats = {};
+}
+
+static bool at_eof(FILE *f) {
+  int c = fgetc(f);
+  if (c == EOF) return true;
+  ungetc(c, f);
+  return false;
+}
+
+static bool read_file(const char *path, std::string &out) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) return false;
+
+  char chunk[1 << 16];
+  size_t len = strlen(path);
+  if (len > 4 && strcmp(path + len - 4, ".bz2") == 0) {
+    // loggerd can write a stream per block, keep reading until the file runs out
+    char unused[BZ_MAX_UNUSED];
+    int n_unused = 0;
+    while (n_unused > 0 || !at_eof(f)) {
+      int bzerror, closeerror;
+      BZFILE *bz = BZ2_bzReadOpen(&bzerror, f, 0, 0, unused, n_unused);
+      while (bzerror == BZ_OK) {
+        int n = BZ2_bzRead(&bzerror, bz, chunk, sizeof(chunk));
+        if (n > 0) out.append(chunk, n);
+      }
+      if (bzerror == BZ_STREAM_END) {
+        // what bzlib read past the end of this stream starts the next one
+        void *rest;
+        BZ2_bzReadGetUnused(&bzerror, bz, &rest, &n_unused);
+        memcpy(unused, rest, n_unused);
+      }
+      BZ2_bzReadClose(&closeerror, bz);
+      if (bzerror != BZ_OK) {
+        fclose(f);
+        return false;
+      }
+    }
+  } else {
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) out.append(chunk, n);
+  }
+  fclose(f);
+  return true;
+}
+
+static std::vector<CanFrame> load_log(const char *path) {
+  std::vector<CanFrame> frames;
+  std::string raw;
+  if (!read_file(path, raw)) {
+    fprintf(stderr, "failed to read %s\n", path);
+    exit(1);
+  }
+
+  std::vector<capnp::word> buf(raw.size() / sizeof(capnp::word));
+  memcpy(buf.data(), raw.data(), buf.size() * sizeof(capnp::word));
+
+  kj::ArrayPtr<const capnp::word> words(buf.data(), buf.size());
+  while (words.size() > 0) {
+    capnp::FlatArrayMessageReader reader(words);
+    cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+    if (event.which() == cereal::Event::CAN) {
+      for (auto msg : event.getCan()) {
+        // skip the panda's echoes of sent frames, the sim makes its own
+        if (msg.getSrc() >= 0x80 || msg.getDat().size() > 8) continue;
+
+        CanFrame f = {.address = msg.getAddress(), .src = (uint8_t)msg.getSrc(), .len = (uint8_t)msg.getDat().size()};
+        memcpy(f.dat, msg.getDat().begin(), f.len);
+        frames.push_back(f);
+      }
+    }
+    words = kj::arrayPtr(reader.getEnd(), words.end());
+  }
+  return frames;
+}
+
+int main(int argc, char *argv[]) {
+  const char *log_path = NULL;
+  double load = 0.3;
+  int bitrate = 500000;
+  int buses = 3;
+  bool ignition = false;
+
+  static struct option long_options[] = {
+    {"log", required_argument, 0, 'l'},
+    {"load", required_argument, 0, 'p'},
+    {"bitrate", required_argument, 0, 'b'},
+    {"buses", required_argument, 0, 'n'},
+    {"ignition", no_argument, 0, 'i'},
+    {0, 0, 0, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'l': log_path = optarg; break;
+    case 'p': load = atof(optarg) / 100.; break;
+    case 'b': bitrate = atoi(optarg); break;
+    case 'n': buses = std::max(1, atoi(optarg)); break;
+    case 'i': ignition = true; break;
+    default:
+      fprintf(stderr, "usage: %s <socket path> [--log rlog[.bz2]] [--load percent] [--bitrate bps] [--buses n] [--ignition]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind >= argc || load <= 0 || bitrate <= 0) {
+    fprintf(stderr, "usage: %s <socket path> [--log rlog[.bz2]] [--load percent] [--bitrate bps] [--buses n] [--ignition]\n", argv[0]);
+    return 1;
+  }
+  const char *path = argv[optind];
+
+  std::vector<CanFrame> frames;
+  if (log_path) {
+    frames = load_log(log_path);
+    if (frames.empty()) {
+      fprintf(stderr, "no CAN in %s\n", log_path);
+      return 1;
+    }
+    uint32_t bus_mask = 0;
+    for (auto &f : frames) bus_mask |= 1 << (f.src & 0x1f);
+    buses = __builtin_popcount(bus_mask);
+    printf("replaying %zu frames on %d buses\n", frames.size(), buses);
+  }
+
+  signal(SIGINT, set_do_exit);
+  signal(SIGTERM, set_do_exit);
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  assert(strlen(path) < sizeof(addr.sun_path));
+  strcpy(addr.sun_path, path);
+  unlink(path);
+
+  int server = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (server < 0 || bind(server, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(server, 1) != 0) {
+    perror("sim_panda");
+    return 1;
+  }
+
+  static uint8_t pkt[SIM_PANDA_MAX_PACKET];
+  static uint8_t reply[SIM_PANDA_MAX_PACKET];
+  SimPanda *panda = NULL;
+  int client = -1;
+  uint64_t next_report = nanos_since_boot() + 1000000000ULL;
+
+  while (!do_exit) {
+    struct pollfd pfd = {.fd = client >= 0 ? client : server, .events = POLLIN};
+    int err = poll(&pfd, 1, 100);
+
+    if (err > 0 && client < 0) {
+      client = accept(server, NULL, NULL);
+      // a reconnect is a fresh panda, the bus starts now
+      delete panda;
+      panda = new SimPanda(frames, load, bitrate, buses, ignition);
+      printf("boardd connected\n");
+    } else if (err > 0) {
+      ssize_t len = recv(client, pkt, sizeof(pkt), 0);
+      if (len <= 0) {
+        close(client);
+        client = -1;
+        printf("boardd disconnected\n");
+        continue;
+      }
+      int reply_len = panda->handle(pkt, len, reply);
+      send(client, reply, reply_len, MSG_NOSIGNAL);
+    }
+
+    if (panda && nanos_since_boot() > next_report) {
+      panda->print_stats();
+      next_report += 1000000000ULL;
+    }
+  }
+
+  if (panda) panda->print_stats();
+  if (client >= 0) close(client);
+  close(server);
+  unlink(path);
+  delete panda;
+  return 0;
+}
@@ -0,0 +1,296 @@
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../isotp.h"
+
+using namespace std::string_literals;
+
+// Runs isotp.cc against mock ECUs on a simulated bus: single frame and
+// multi-frame requests and responses, flow control with block sizes and
+// STmin, sub addresses and request sequences. Time is simulated, so the
+// STmin checks are exact.
+
+#define STEP_NS 100000ULL     // bus time per loop
+#define TIMEOUT_NS 2000000000ULL
+
+static int failures = 0;
+
+#define CHECK(cond, ...) \
+  if (!(cond)) { \
+    printf("FAIL %s:%d: ", __func__, __LINE__); \
+    printf(__VA_ARGS__); \
+    printf("\n"); \
+    failures++; \
+  }
+
+// An ECU that answers requests with canned responses, and sends the flow
+// control it's told to when a request comes in over several frames.
+struct MockEcu {
+  uint32_t addr;
+  int sub_addr;
+  uint8_t bus = 0;
+  std::map<std::string, std::string> answers;
+
+  // flow control sent for multi-frame requests
+  uint8_t block_size = 0;
+  uint8_t st_min = 0;
+
+  std::vector<IsoTpFrame> out;
+  std::string last_request;
+  int flow_controls_sent = 0;
+  std::vector<uint64_t> cf_times;  // when each consecutive frame of the request came in
+
+  MockEcu(uint32_t addr, int sub_addr = -1) : addr(addr), sub_addr(sub_addr) {}
+
+  int max_len() const { return sub_addr < 0 ? 8 : 7; }
+
+  void frame(const uint8_t *dat, int len) {
+    IsoTpFrame f = {.addr = isotp_rx_addr(addr), .bus = bus, .len = 8};
+    memset(f.dat, 0, sizeof(f.dat));
+    int pos = 0;
+    if (sub_addr >= 0) f.dat[pos++] = sub_addr;
+    memcpy(f.dat + pos, dat, len);
+    out.push_back(f);
+  }
+
+  void flow_control() {
+    const uint8_t fc[3] = {0x30, block_size, st_min};
+    frame(fc, sizeof(fc));
+    flow_controls_sent++;
+    block_left = block_size;
+  }
+
+  void respond() {
+    last_request = req;
+    auto it = answers.find(req);
+    if (it == answers.end()) return;
+    resp = it->second;
+
+    uint8_t buf[8];
+    if ((int)resp.size() < max_len()) {
+      buf[0] = resp.size();
+      memcpy(buf + 1, resp.data(), resp.size());
+      frame(buf, 1 + resp.size());
+      resp_pos = resp.size();
+    } else {
+      buf[0] = 0x10 | (resp.size() >> 8);
+      buf[1] = resp.size() & 0xFF;
+      resp_pos = max_len() - 2;
+      memcpy(buf + 2, resp.data(), resp_pos);
+      frame(buf, max_len());
+      resp_idx = 0;
+    }
+  }
+
+  void rx(const IsoTpFrame &f, uint64_t now) {
+    if (f.addr != addr || f.bus != bus) return;
+    const uint8_t *dat = f.dat;
+    int len = f.len;
+    if (sub_addr >= 0) {
+      if (dat[0] != sub_addr) return;
+      dat++;
+      len--;
+    }
+
+    switch (dat[0] >> 4) {
+    case 0x0:
+      req.assign((const char*)dat + 1, dat[0] & 0xF);
+      respond();
+      break;
+    case 0x1:
+      req_len = ((dat[0] & 0xF) << 8) | dat[1];
+      req.assign((const char*)dat + 2, len - 2);
+      req_idx = 0;
+      flow_control();
+      break;
+    case 0x2:
+      req_idx++;
+      if ((req_idx & 0xF) != (dat[0] & 0xF)) {
+        printf("FAIL ecu 0x%X: consecutive frame %d, expected %d\n", addr, dat[0] & 0xF, req_idx & 0xF);
+        failures++;
+      }
+      cf_times.push_back(now);
+      req.append((const char*)dat + 1, std::min((size_t)len - 1, req_len - req.size()));
+      if (req.size() == req_len) {
+        respond();
+      } else if (block_size > 0 && --block_left == 0) {
+        flow_control();
+      }
+      break;
+    case 0x3:
+      // the query asks for everything at once, no STmin
+      while (resp_pos < resp.size()) {
+        uint8_t buf[8];
+        buf[0] = 0x20 | (++resp_idx & 0xF);
+        size_t size = std::min((size_t)max_len() - 1, resp.size() - resp_pos);
+        memcpy(buf + 1, resp.data() + resp_pos, size);
+        frame(buf, 1 + size);
+        resp_pos += size;
+      }
+      break;
+    }
+  }
+
+ private:
+  std::string req, resp;
+  size_t req_len = 0, resp_pos = 0;
+  int req_idx = 0, resp_idx = 0;
+  int block_left = 0;
+};
+
+// moves frames between the query and the ECUs until the query is done, returns the time it took
+static uint64_t run(IsoTpParallelQuery &q, std::vector<MockEcu*> ecus) {
+  std::vector<IsoTpFrame> tx;
+  uint64_t now = 0;
+  q.start(now, tx);
+  while (!q.done() && now < TIMEOUT_NS) {
+    for (auto &f : tx) {
+      for (auto ecu : ecus) ecu->rx(f, now);
+    }
+    tx.clear();
+
+    for (auto ecu : ecus) {
+      for (auto &f : ecu->out) q.rx(f.addr, f.bus, f.dat, f.len, now, tx);
+      ecu->out.clear();
+    }
+    // frames arrive the moment they're sent, time only moves on once the bus is quiet
+    if (!tx.empty()) continue;
+
+    now += STEP_NS;
+    q.update(now, tx);
+  }
+  return now;
+}
+
+static std::string result(IsoTpParallelQuery &q, uint32_t addr, int sub_addr = -1) {
+  auto it = q.results.find({addr, sub_addr});
+  return it == q.results.end() ? "<none>" : it->second;
+}
+
+static std::string pattern(size_t len) {
+  std::string s;
+  for (size_t i = 0; i < len; i++) s += (char)('A' + i % 26);
+  return s;
+}
+
+static void test_rx_addr() {
+  CHECK(isotp_rx_addr(0x7E0) == 0x7E8, "11 bit");
+  CHECK(isotp_rx_addr(0x18DA10F1) == 0x18DAF110, "29 bit");
+  CHECK(isotp_rx_addr(0x7DF) == 0, "functional 11 bit");
+  CHECK(isotp_rx_addr(0x18DB33F1) == 0, "functional 29 bit");
+}
+
+static void test_single_frame() {
+  MockEcu ecu(0x7E0);
+  ecu.answers["\x3E\x00"s] = "\x7E\x00\x01"s;
+
+  IsoTpParallelQuery q(0, {{0x7E0, -1}}, {"\x3E\x00"s}, {"\x7E\x00"s});
+  uint64_t t = run(q, {&ecu});
+  CHECK(q.done() && t < TIMEOUT_NS, "query didn't finish");
+  CHECK(result(q, 0x7E0) == "\x01"s, "got %s", result(q, 0x7E0).c_str());
+  CHECK(ecu.flow_controls_sent == 0, "flow control for a single frame");
+}
+
+static void test_multi_frame_response() {
+  // a VIN read, 3 + 17 bytes comes back in a first frame and three consecutive frames
+  const std::string vin = "1HGCV1F30JA000000";
+  MockEcu ecu(0x7E0);
+  ecu.answers["\x22\xF1\x90"s] = "\x62\xF1\x90"s + vin;
+
+  IsoTpParallelQuery q(0, {{0x7E0, -1}}, {"\x22\xF1\x90"s}, {"\x62\xF1\x90"s});
+  run(q, {&ecu});
+  CHECK(result(q, 0x7E0) == vin, "got %s", result(q, 0x7E0).c_str());
+
+  // long enough for the consecutive frame index to wrap
+  MockEcu big(0x18DA10F1);
+  big.answers["\x22\xF1\x00"s] = "\x62\xF1\x00"s + pattern(300);
+  IsoTpParallelQuery q2(0, {{0x18DA10F1, -1}}, {"\x22\xF1\x00"s}, {"\x62\xF1\x00"s});
+  run(q2, {&big});
+  CHECK(result(q2, 0x18DA10F1) == pattern(300), "29 bit, 300 bytes");
+}
+
+static void test_multi_frame_request(uint8_t block_size, uint8_t st_min, uint64_t st_min_ns) {
+  // 40 byte request: first frame with 6 bytes, then 5 consecutive frames of 7
+  const std::string request = "\x2E\xF1\x90"s + pattern(37);
+  MockEcu ecu(0x7E0);
+  ecu.block_size = block_size;
+  ecu.st_min = st_min;
+  ecu.answers[request] = "\x6E\xF1\x90"s;
+
+  IsoTpParallelQuery q(0, {{0x7E0, -1}}, {request}, {"\x6E\xF1\x90"s});
+  run(q, {&ecu});
+  CHECK(ecu.last_request == request, "bs %d stmin 0x%02X: request didn't arrive whole", block_size, st_min);
+  CHECK(result(q, 0x7E0) == "", "bs %d stmin 0x%02X: no result", block_size, st_min);
+  CHECK(ecu.cf_times.size() == 5, "bs %d: %zu consecutive frames", block_size, ecu.cf_times.size());
+
+  int expected_fcs = block_size == 0 ? 1 : 1 + (5 - 1) / block_size;
+  CHECK(ecu.flow_controls_sent == expected_fcs, "bs %d: %d flow controls, expected %d",
+        block_size, ecu.flow_controls_sent, expected_fcs);
+
+  for (size_t i = 1; i < ecu.cf_times.size(); i++) {
+    // a new block starts on the flow control, STmin only applies inside a block
+    bool block_start = block_size > 0 && i % block_size == 0;
+    uint64_t gap = ecu.cf_times[i] - ecu.cf_times[i - 1];
+    CHECK(block_start || gap >= st_min_ns, "bs %d stmin 0x%02X: frames %zu and %zu only %llu ns apart",
+          block_size, st_min, i - 1, i, (unsigned long long)gap);
+  }
+}
+
+static void test_sub_addresses() {
+  // two ECUs behind a gateway on the same address
+  MockEcu a(0x750, 0x0F), b(0x750, 0x10);
+  a.answers["\x22\xF1\x88"s] = "\x62\xF1\x88"s + pattern(10);
+  b.answers["\x22\xF1\x88"s] = "\x62\xF1\x88"s + "ECU B";
+
+  IsoTpParallelQuery q(0, {{0x750, 0x0F}, {0x750, 0x10}}, {"\x22\xF1\x88"s}, {"\x62\xF1\x88"s});
+  run(q, {&a, &b});
+  CHECK(result(q, 0x750, 0x0F) == pattern(10), "sub 0x0F got %s", result(q, 0x750, 0x0F).c_str());
+  CHECK(result(q, 0x750, 0x10) == "ECU B", "sub 0x10 got %s", result(q, 0x750, 0x10).c_str());
+}
+
+static void test_sequence() {
+  // extended session first, then the read, only the ECU that answers both gives a result
+  MockEcu good(0x7E0), bad(0x7E1), silent(0x7E2);
+  good.answers["\x10\x03"s] = "\x50\x03\x00\x32\x01\xF4"s;
+  good.answers["\x22\xF1\x81"s] = "\x62\xF1\x81"s + pattern(12);
+  bad.answers["\x10\x03"s] = "\x7F\x10\x22"s;
+  silent.answers.clear();
+
+  IsoTpParallelQuery q(0, {{0x7E0, -1}, {0x7E1, -1}, {0x7E2, -1}},
+                       {"\x10\x03"s, "\x22\xF1\x81"s}, {"\x50\x03"s, "\x62\xF1\x81"s});
+  uint64_t t = run(q, {&good, &bad, &silent});
+  CHECK(result(q, 0x7E0) == pattern(12), "got %s", result(q, 0x7E0).c_str());
+  CHECK(q.results.size() == 1, "%zu results", q.results.size());
+  CHECK(bad.last_request == "\x10\x03"s, "negative response moved on to the next request");
+  // the silent ECU keeps the query open, the caller's timeout ends it
+  CHECK(!q.done() && t >= TIMEOUT_NS, "query finished without an answer from 0x7E2");
+}
+
+static void test_other_bus() {
+  MockEcu ecu(0x7E0);
+  ecu.bus = 1;
+  ecu.answers["\x3E\x00"s] = "\x7E\x00"s;
+
+  IsoTpParallelQuery q(0, {{0x7E0, -1}}, {"\x3E\x00"s}, {"\x7E\x00"s});
+  CHECK(!q.wants(0x7E8, 1) && q.wants(0x7E8, 0), "wants() ignores the bus");
+  run(q, {&ecu});
+  CHECK(q.results.empty(), "answer from another bus was taken");
+}
+
+int main(int argc, char** argv) {
+  test_rx_addr();
+  test_single_frame();
+  test_multi_frame_response();
+  test_multi_frame_request(0, 0x00, 0);
+  test_multi_frame_request(2, 0x05, 5000000);
+  test_multi_frame_request(3, 0xF3, 300000);
+  test_sub_addresses();
+  test_sequence();
+  test_other_bus();
+
+  if (failures == 0) printf("all iso-tp tests passed\n");
+  return failures > 0;
+}
@@ -1,4 +1,5 @@
 #include <thread>
+#include <algorithm>
 #include <stdio.h>
 #include <signal.h>
 #include <poll.h>
@@ -26,6 +27,8 @@
 #include "common/visionipc.h"
 
 #define MAX_CLIENTS 6
+// buffers a client can hold on top of the two it normally has out
+#define MAX_HOLD_BUFS 16
 
 volatile sig_atomic_t do_exit = 0;
 
@@ -45,9 +48,11 @@ struct VisionClientState {
 struct VisionClientStreamState {
   bool subscribed;
   int bufs_outstanding;
+  int max_outstanding;
   bool tb;
   TBuffer* tbuffer;
   PoolQueue* queue;
+  VisionRingState ring;  // v2 clients, ring.ring is NULL otherwise
 };
 
 struct VisionState {
@@ -69,6 +74,23 @@ static CameraBuf *get_camerabuf_by_type(VisionState *s, VisionStreamType type) {
   assert(0);
 }
 
+static void stream_release(VisionClientStreamState *stream, int idx) {
+  if (stream->tb) {
+    tbuffer_release(stream->tbuffer, idx);
+  } else {
+    poolq_release(stream->queue, idx);
+  }
+  stream->bufs_outstanding--;
+}
+
+// takes back everything the client put on its ring
+static void stream_release_ring(VisionClientStreamState *stream) {
+  int idx;
+  while ((idx = vipc_ring_pop_release(&stream->ring)) >= 0) {
+    stream_release(stream, idx);
+  }
+}
+
 // visionserver
 void* visionserver_client_thread(void* arg) {
   int err;
@@ -88,11 +110,27 @@ void* visionserver_client_thread(void* arg) {
     polls[0].events = POLLIN;
 
     int poll_to_stream[1+VISION_STREAM_MAX] = {0};
+    bool poll_is_release[1+VISION_STREAM_MAX] = {0};
     int num_polls = 1;
     for (int i=0; i<VISION_STREAM_MAX; i++) {
       if (!streams[i].subscribed) continue;
       polls[num_polls].events = POLLIN;
-      if (streams[i].bufs_outstanding >= 2) {
+      if (streams[i].ring.ring) {
+        stream_release_ring(&streams[i]);
+        if (streams[i].bufs_outstanding >= streams[i].max_outstanding) {
+          // ask for a wakeup on the next release, unless it came in meanwhile
+          vipc_ring_want_release(&streams[i].ring);
+          stream_release_ring(&streams[i]);
+        }
+        if (streams[i].bufs_outstanding >= streams[i].max_outstanding) {
+          polls[num_polls].fd = streams[i].ring.rel_efd;
+          poll_to_stream[num_polls] = i;
+          poll_is_release[num_polls] = true;
+          num_polls++;
+          continue;
+        }
+      }
+      if (streams[i].bufs_outstanding >= streams[i].max_outstanding) {
         continue;
       }
       if (streams[i].tb) {
@@ -124,6 +162,7 @@ void* visionserver_client_thread(void* arg) {
 
         VisionClientStreamState *stream = &streams[stream_type];
         stream->tb = p.d.stream_sub.tbuffer;
+        stream->max_outstanding = 2 + std::min(std::max(p.d.stream_sub.hold_bufs, 0), MAX_HOLD_BUFS);
 
         VisionStreamBufs *stream_bufs = &rep.d.stream_bufs;
         CameraBuf *b = get_camerabuf_by_type(s, stream_type);
@@ -159,16 +198,24 @@ void* visionserver_client_thread(void* arg) {
           }
         }
         vipc_send(fd, &rep);
+
+        if (p.d.stream_sub.ring) {
+          VisionPacket ring_rep = {
+            .type = VIPC_STREAM_RING,
+          };
+          if (!stream->ring.ring && vipc_ring_create(&stream->ring) == 0) {
+            ring_rep.num_fds = VIPC_RING_FDS;
+            ring_rep.fds[0] = stream->ring.shm_fd;
+            ring_rep.fds[1] = stream->ring.acq_efd;
+            ring_rep.fds[2] = stream->ring.rel_efd;
+          }
+          vipc_send(fd, &ring_rep);
+        }
         streams[stream_type].subscribed = true;
       } else if (p.type == VIPC_STREAM_RELEASE) {
         int si = p.d.stream_rel.type;
         assert(si < VISION_STREAM_MAX);
-        if (streams[si].tb) {
-          tbuffer_release(streams[si].tbuffer, p.d.stream_rel.idx);
-        } else {
-          poolq_release(streams[si].queue, p.d.stream_rel.idx);
-        }
-        streams[p.d.stream_rel.type].bufs_outstanding--;
+        stream_release(&streams[si], p.d.stream_rel.idx);
       } else {
         assert(false);
       }
@@ -177,9 +224,13 @@ void* visionserver_client_thread(void* arg) {
       for (int i=1; i<num_polls; i++) {
         int si = poll_to_stream[i];
         if (!streams[si].subscribed) continue;
-        if (polls[i].revents) {
+        if (polls[i].revents && poll_is_release[i]) {
+          // the releases are taken off the ring at the top of the loop
+          uint64_t cnt;
+          ssize_t n = read(polls[i].fd, &cnt, sizeof(cnt));
+          assert(n == sizeof(cnt));
+        } else if (polls[i].revents && stream_i == VISION_STREAM_MAX) {
           stream_i = si;
-          break;
         }
       }
       if (stream_i < VISION_STREAM_MAX) {
@@ -208,7 +259,11 @@ void* visionserver_client_thread(void* arg) {
           rep.d.stream_acq.extra.timestamp_sof = b->yuv_metas[idx].timestamp_sof;
           rep.d.stream_acq.extra.timestamp_eof = b->yuv_metas[idx].timestamp_eof;
         }
-        vipc_send(fd, &rep);
+        if (streams[stream_i].ring.ring) {
+          vipc_ring_push_acquire(&streams[stream_i].ring, idx, &rep.d.stream_acq.extra);
+        } else {
+          vipc_send(fd, &rep);
+        }
       }
     }
   }
@@ -222,6 +277,9 @@ void* visionserver_client_thread(void* arg) {
     } else {
       pool_release_queue(streams[i].queue);
     }
+    if (streams[i].ring.ring) {
+      vipc_ring_destroy(&streams[i].ring);
+    }
   }
 
   close(fd);
@@ -49,6 +49,12 @@ typedef struct VIPCBufExtra {
   uint64_t timestamp_eof;
 } VIPCBufExtra;
 
+typedef struct VisionRingState {
+  void *ring;
+  int shm_fd, acq_efd, rel_efd;
+  int push_lock;
+} VisionRingState;
+
 typedef struct VisionStream {
   int ipc_fd;
   int last_idx;
@@ -56,6 +62,7 @@ typedef struct VisionStream {
   int num_bufs;
   VisionStreamBufs bufs_info;
   VIPCBuf *bufs;
+  VisionRingState ring;
 } VisionStream;
 
 int visionstream_init(VisionStream *s, VisionStreamType type, bool tbuffer, VisionStreamBufs *out_bufs_info);
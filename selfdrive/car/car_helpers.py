@@ -1,4 +1,5 @@
 import os
+import time
 from common.params import Params
 from common.basedir import BASEDIR
 from selfdrive.version import comma_remote, tested_branch
@@ -101,8 +102,12 @@ def fingerprint(logcan, sendcan):
       car_fw = list(cached_params.carFw)
     else:
       cloudlog.warning("Getting VIN & FW versions")
+      t = time.monotonic()
       _, vin = get_vin(logcan, sendcan, bus)
+      vin_time = time.monotonic() - t
       car_fw = get_fw_versions(logcan, sendcan, bus)
+      # the queries are most of the time from ignition to a fingerprint
+      cloudlog.event("fw_query_timing", vin_s=vin_time, fw_s=time.monotonic() - t - vin_time, ecus=len(car_fw))
 
     fw_candidates = match_fw_to_car(car_fw)
   else:
@@ -142,7 +142,7 @@ def match_fw_to_car(fw_versions):
   return set(candidates.keys()) - set(invalid)
 
 
-def get_fw_versions(logcan, sendcan, bus, extra=None, timeout=0.1, debug=False, progress=False):
+def get_fw_versions(logcan, sendcan, bus, extra=None, timeout=0.1, debug=False, progress=False, native=True):
   ecu_types = {}
 
   # Extract ECU adresses to query from fingerprints
@@ -178,7 +178,7 @@ def get_fw_versions(logcan, sendcan, bus, extra=None, timeout=0.1, debug=False,
           addrs = [(a, s) for (b, a, s) in addr_chunk if b in (brand, 'any')]
 
           if addrs:
-            query = IsoTpParallelQuery(sendcan, logcan, bus, addrs, request, response, debug=debug)
+            query = IsoTpParallelQuery(sendcan, logcan, bus, addrs, request, response, debug=debug, native=native)
             t = 2 * timeout if i == 0 else timeout
             fw_versions.update(query.get_data(t))
         except Exception:
@@ -210,6 +210,7 @@ if __name__ == "__main__":
   parser = argparse.ArgumentParser(description='Get firmware version of ECUs')
   parser.add_argument('--scan', action='store_true')
   parser.add_argument('--debug', action='store_true')
+  parser.add_argument('--no-native', action='store_true', help="run the queries in python, not in boardd")
   args = parser.parse_args()
 
   logcan = messaging.sub_sock('can')
@@ -235,7 +236,7 @@ if __name__ == "__main__":
   print()
 
   t = time.time()
-  fw_vers = get_fw_versions(logcan, sendcan, 1, extra=extra, debug=args.debug, progress=True)
+  fw_vers = get_fw_versions(logcan, sendcan, 1, extra=extra, debug=args.debug, progress=True, native=not args.no_native)
   candidates = match_fw_to_car(fw_vers)
 
   print()
@@ -5,6 +5,7 @@ from typing import Dict
 from cereal import car
 from common.kalman.simple_kalman import KF1D
 from common.realtime import DT_CTRL
+from selfdrive.boardd.boardd import can_list_to_can_capnp
 from selfdrive.car import gen_empty_fingerprint
 from selfdrive.config import Conversions as CV
 from selfdrive.controls.lib.events import Events
@@ -35,6 +36,20 @@ class CarInterfaceBase():
     if CarController is not None:
       self.CC = CarController(self.cp.dbc_name, CP, self.VM)
 
+  # the serialized sendcan event of one control cycle. A port can pack the
+  # whole cycle natively with CANPacker.make_sendcan instead, see volkswagen.
+  def apply_sendcan(self, c, valid):
+    return can_list_to_can_capnp(self.apply(c), msgtype='sendcan', valid=valid)
+
+  # per message statistics of the car's CAN parsers, see CANParser.query_health
+  def get_can_health(self):
+    health = {}
+    for name in ["cp", "cp_cam", "cp_body"]:
+      parser = getattr(self, name, None)
+      if parser is not None:
+        health[name] = parser.query_health()
+    return health
+
   @staticmethod
   def calc_accel_override(a_ego, a_target, v_ego, v_target):
     return 1.
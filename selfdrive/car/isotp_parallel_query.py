@@ -1,15 +1,38 @@
+import random
 import time
 from collections import defaultdict
 from functools import partial
+from itertools import count
 
 import cereal.messaging as messaging
 from selfdrive.swaglog import cloudlog
 from selfdrive.boardd.boardd import can_list_to_can_capnp
 from panda.python.uds import CanClient, IsoTpMessage, FUNCTIONAL_ADDRS, get_rx_addr_for_tx_addr
 
+# boardd can run the query itself (isotpQuery/isotpResult), which saves a trip
+# through sendcan and can for every frame. boardd acknowledges a query when it
+# starts it, until then it's resent every NATIVE_RESEND_INTERVAL. If boardd
+# doesn't acknowledge within NATIVE_START_TIMEOUT, or doesn't answer in time, the
+# query runs here instead, and so do the ones in the next NATIVE_BACKOFF seconds.
+NATIVE_START_TIMEOUT = 0.5
+NATIVE_REPLY_MARGIN = 0.5
+NATIVE_RESEND_INTERVAL = 0.05
+NATIVE_BACKOFF = 10.
+native_retry_time = 0.
+native_socks = None
+# ids from another process don't line up with the last one boardd answered
+native_ids = count(random.getrandbits(31))
+
+
+def get_native_socks():
+  global native_socks
+  if native_socks is None:
+    native_socks = (messaging.pub_sock('isotpQuery'), messaging.sub_sock('isotpResult', timeout=10))
+  return native_socks
+
 
 class IsoTpParallelQuery():
-  def __init__(self, sendcan, logcan, bus, addrs, request, response, functional_addr=False, debug=False):
+  def __init__(self, sendcan, logcan, bus, addrs, request, response, functional_addr=False, debug=False, native=True):
     self.sendcan = sendcan
     self.logcan = logcan
     self.bus = bus
@@ -17,6 +40,7 @@ class IsoTpParallelQuery():
     self.response = response
     self.debug = debug
     self.functional_addr = functional_addr
+    self.native = native
 
     self.real_addrs = []
     for a in addrs:
@@ -70,7 +94,61 @@ class IsoTpParallelQuery():
     messaging.drain_sock(self.logcan)
     self.msg_buffer = defaultdict(list)
 
+  def _get_data_native(self, timeout):
+    """Run the query in boardd, returns None if boardd didn't answer"""
+    global native_retry_time
+    query_sock, result_sock = get_native_socks()
+    messaging.drain_sock(result_sock)
+
+    query_id = next(native_ids) & 0xFFFFFFFF
+    msg = messaging.new_message('isotpQuery')
+    msg.isotpQuery.id = query_id
+    msg.isotpQuery.bus = self.bus
+    addrs = msg.isotpQuery.init('addrs', len(self.real_addrs))
+    for i, (addr, sub_addr) in enumerate(self.real_addrs):
+      addrs[i].address = addr
+      addrs[i].subAddress = sub_addr or 0
+    msg.isotpQuery.requests = self.request
+    msg.isotpQuery.responses = self.response
+    msg.isotpQuery.timeout = timeout
+    dat = msg.to_bytes()
+    query_sock.send(dat)
+
+    # Either socket may still be connecting on the first query, so it's sent
+    # again until boardd says it started, and again once the answer is overdue.
+    # boardd answers a repeated id with the result it already has instead of
+    # running it again.
+    deadline = time.time() + NATIVE_START_TIMEOUT
+    resend_time = time.time() + NATIVE_RESEND_INTERVAL
+    started = False
+    while time.time() < deadline:
+      if time.time() > resend_time:
+        query_sock.send(dat)
+        resend_time = time.time() + NATIVE_RESEND_INTERVAL
+
+      result = messaging.recv_sock(result_sock, wait=True)
+      if result is None or result.isotpResult.id != query_id:
+        continue
+      if result.isotpResult.started:
+        if not started:
+          started = True
+          resend_time = time.time() + timeout + NATIVE_RESEND_INTERVAL
+          deadline = time.time() + timeout + NATIVE_REPLY_MARGIN
+        continue
+      return {(r.address, r.subAddress or None): r.dat for r in result.isotpResult.results}
+
+    cloudlog.warning(f"boardd didn't answer iso-tp query, running queries in python for {NATIVE_BACKOFF:.0f} s")
+    native_retry_time = time.monotonic() + NATIVE_BACKOFF
+    return None
+
   def get_data(self, timeout):
+    # functional addressing and debug prints are only done here
+    native = self.native and time.monotonic() >= native_retry_time
+    if native and not self.functional_addr and not self.debug:
+      results = self._get_data_native(timeout)
+      if results is not None:
+        return results
+
     self._drain_rx()
 
     # Create message objects
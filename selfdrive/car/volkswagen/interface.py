@@ -108,7 +108,7 @@ class CarInterface(CarInterfaceBase):
     self.CS.out = ret.as_reader()
     return self.CS.out
 
-  def apply(self, c):
+  def update_controls(self, c):
     can_sends = self.CC.update(c.enabled, self.CS, self.frame, c.actuators,
                    c.hudControl.visualAlert,
                    c.hudControl.audibleAlert,
@@ -116,3 +116,9 @@ class CarInterface(CarInterfaceBase):
                    c.hudControl.rightLaneVisible)
     self.frame += 1
     return can_sends
+
+  def apply(self, c):
+    return [self.CC.packer_pt.make_can_msg(*m) for m in self.update_controls(c)]
+
+  def apply_sendcan(self, c, valid):
+    return self.CC.packer_pt.make_sendcan(self.update_controls(c), valid)
@@ -1,7 +1,10 @@
 # CAN controls for MQB platform Volkswagen, Audi, Skoda and SEAT.
 # PQ35/PQ46/NMS, and any future MLB, to come later.
+#
+# Each message is returned as (name, bus, values, counter), the interface
+# packs a whole control cycle at once with CANPacker.make_sendcan.
 
-def create_mqb_steering_control(packer, bus, apply_steer, idx, lkas_enabled):
+def create_mqb_steering_control(bus, apply_steer, idx, lkas_enabled):
   values = {
     "SET_ME_0X3": 0x3,
     "Assist_Torque": abs(apply_steer),
@@ -13,9 +16,9 @@ def create_mqb_steering_control(packer, bus, apply_steer, idx, lkas_enabled):
     "SET_ME_0XFE": 0xFE,
     "SET_ME_0X07": 0x07,
   }
-  return packer.make_can_msg("HCA_01", bus, values, idx)
+  return ("HCA_01", bus, values, idx)
 
-def create_mqb_hud_control(packer, bus, hca_enabled, steering_pressed, hud_alert, leftLaneVisible, rightLaneVisible):
+def create_mqb_hud_control(bus, hca_enabled, steering_pressed, hud_alert, leftLaneVisible, rightLaneVisible):
 
   if hca_enabled:
     leftlanehud = 3 if leftLaneVisible else 1
@@ -32,9 +35,9 @@ def create_mqb_hud_control(packer, bus, hca_enabled, steering_pressed, hud_alert
     "Right_Lane_Status": rightlanehud,
     "Alert_Message": hud_alert,
   }
-  return packer.make_can_msg("LDW_02", bus, values)
+  return ("LDW_02", bus, values, -1)
 
-def create_mqb_acc_buttons_control(packer, bus, buttonStatesToSend, CS, idx):
+def create_mqb_acc_buttons_control(bus, buttonStatesToSend, CS, idx):
   values = {
     "GRA_Hauptschalter": CS.graHauptschalter,
     "GRA_Abbrechen": buttonStatesToSend["cancel"],
@@ -48,4 +51,4 @@ def create_mqb_acc_buttons_control(packer, bus, buttonStatesToSend, CS, idx):
     "GRA_Tip_Stufe_2": CS.graTipStufe2,
     "GRA_ButtonTypeInfo": CS.graButtonTypeInfo
   }
-  return packer.make_can_msg("GRA_ACC_01", bus, values, idx)
+  return ("GRA_ACC_01", bus, values, idx)
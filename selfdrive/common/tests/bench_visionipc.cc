@@ -0,0 +1,254 @@
+// Compares frame latency and cost of the two VisionIPC protocols: a packet
+// over the socket for every acquire and release, and the v2 shared memory
+// ring. A forked server plays camerad, it publishes frames at --fps (0 is as
+// fast as the client takes them) and stamps each with the time it was sent.
+// The client is visionstream_get itself, it reports how long after the stamp
+// each frame arrived and what both sides spent doing it.
+//
+// It binds the vision socket, so don't run it next to camerad.
+//
+// usage: bench_visionipc [--frames 400] [--fps 20] [--work 0]
+//   --work us the client spends on each frame before getting the next one
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "common/ipc.h"
+#include "common/timing.h"
+#include "common/visionipc.h"
+
+#define NUM_BUFS 8
+#define BUF_LEN (1164*874*3/2)
+
+struct Hist {
+  // 1 us buckets up to 10 ms, the rest in the last one
+  static const int N = 10000;
+  uint64_t buckets[N + 1] = {};
+  uint64_t count = 0, max = 0;
+
+  void add(uint64_t us) {
+    buckets[us < N ? us : N]++;
+    count++;
+    if (us > max) max = us;
+  }
+  uint64_t percentile(double p) const {
+    uint64_t target = p * count, seen = 0;
+    for (int i = 0; i <= N; i++) {
+      seen += buckets[i];
+      if (seen > target) return i;
+    }
+    return max;
+  }
+};
+
+static double tv_seconds(const struct timeval &tv) {
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static int alloc_buf() {
+  char path[64];
+  snprintf(path, sizeof(path), "/dev/shm/bench_visionipc_%d", getpid());
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  assert(fd >= 0);
+  unlink(path);
+  int err = ftruncate(fd, BUF_LEN);
+  assert(err == 0);
+  return fd;
+}
+
+// the parts of camerad's client thread that matter here, for one stream
+static void server(int sock, bool use_ring, int fps) {
+  int fd = accept(sock, NULL, NULL);
+  assert(fd >= 0);
+
+  VisionPacket p;
+  int err = vipc_recv(fd, &p);
+  assert(err > 0 && p.type == VIPC_STREAM_SUBSCRIBE);
+
+  VisionPacket rep = {
+    .type = VIPC_STREAM_BUFS,
+    .d = { .stream_bufs = {
+      .type = p.d.stream_sub.type,
+      .width = 1164, .height = 874, .stride = 1164,
+      .buf_len = BUF_LEN,
+    }, },
+  };
+  rep.num_fds = NUM_BUFS;
+  for (int i = 0; i < NUM_BUFS; i++) rep.fds[i] = alloc_buf();
+  vipc_send(fd, &rep);
+
+  VisionRingState ring = {};
+  if (p.d.stream_sub.ring) {
+    VisionPacket ring_rep = { .type = VIPC_STREAM_RING };
+    if (use_ring && vipc_ring_create(&ring) == 0) {
+      ring_rep.num_fds = VIPC_RING_FDS;
+      ring_rep.fds[0] = ring.shm_fd;
+      ring_rep.fds[1] = ring.acq_efd;
+      ring_rep.fds[2] = ring.rel_efd;
+    }
+    vipc_send(fd, &ring_rep);
+  }
+
+  int refcnt[NUM_BUFS] = {};
+  int outstanding = 0, next_buf = 0;
+  uint32_t frame_id = 0;
+  uint64_t next_frame = nanos_since_boot();
+  auto release = [&](int idx) {
+    refcnt[idx]--;
+    outstanding--;
+  };
+  auto release_ring = [&]() {
+    int idx;
+    while ((idx = vipc_ring_pop_release(&ring)) >= 0) release(idx);
+  };
+
+  while (true) {
+    if (ring.ring) {
+      release_ring();
+      if (outstanding >= 2) {
+        vipc_ring_want_release(&ring);
+        release_ring();
+      }
+    }
+    bool capped = outstanding >= 2;
+
+    uint64_t now = nanos_since_boot();
+    if (!capped && (fps == 0 || now >= next_frame)) {
+      while (refcnt[next_buf] > 0) next_buf = (next_buf + 1) % NUM_BUFS;
+      int idx = next_buf;
+      refcnt[idx]++;
+      outstanding++;
+      next_frame += fps ? 1000000000ULL / fps : 0;
+
+      VisionPacket acq = {
+        .type = VIPC_STREAM_ACQUIRE,
+        .d = { .stream_acq = { .type = p.d.stream_sub.type, .idx = idx }, },
+      };
+      acq.d.stream_acq.extra.frame_id = frame_id++;
+      acq.d.stream_acq.extra.timestamp_eof = nanos_since_boot();
+      if (ring.ring) {
+        vipc_ring_push_acquire(&ring, idx, &acq.d.stream_acq.extra);
+      } else if (vipc_send(fd, &acq) <= 0) {
+        break;
+      }
+      continue;
+    }
+
+    struct pollfd polls[2] = {
+      { .fd = fd, .events = POLLIN },
+      { .fd = ring.ring && capped ? ring.rel_efd : -1, .events = POLLIN },
+    };
+    struct timespec timeout = {0, 0};
+    if (!capped && next_frame > now) {
+      timeout.tv_sec = (next_frame - now) / 1000000000ULL;
+      timeout.tv_nsec = (next_frame - now) % 1000000000ULL;
+    }
+    int ret = ppoll(polls, 2, capped ? NULL : &timeout, NULL);
+    if (ret < 0 && errno == EINTR) continue;
+    assert(ret >= 0);
+
+    if (polls[0].revents) {
+      VisionPacket rp;
+      if (vipc_recv(fd, &rp) <= 0) break;
+      assert(rp.type == VIPC_STREAM_RELEASE);
+      release(rp.d.stream_rel.idx);
+    }
+    if (polls[1].revents) {
+      uint64_t cnt;
+      ssize_t n = read(ring.rel_efd, &cnt, sizeof(cnt));
+      assert(n == sizeof(cnt));
+    }
+  }
+
+  if (ring.ring) vipc_ring_destroy(&ring);
+  close(fd);
+}
+
+static void run(const char* name, bool use_ring, int frames, int fps, int work_us) {
+  int sock = ipc_bind(VIPC_SOCKET_PATH);
+  assert(sock >= 0);
+
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    server(sock, use_ring, fps);
+    _exit(0);
+  }
+  close(sock);
+
+  VisionStream stream;
+  VisionStreamBufs buf_info;
+  int err = visionstream_init(&stream, VISION_STREAM_YUV, false, &buf_info);
+  assert(err == 0);
+  assert((stream.ring.ring != NULL) == use_ring);
+
+  struct rusage ru_start, ru_end;
+  getrusage(RUSAGE_SELF, &ru_start);
+  uint64_t start = nanos_since_boot();
+
+  Hist hist;
+  uint32_t last_frame_id = 0;
+  int skipped = 0;
+  for (int i = 0; i < frames; i++) {
+    VIPCBufExtra extra;
+    VIPCBuf* buf = visionstream_get(&stream, &extra);
+    assert(buf != NULL);
+    hist.add((nanos_since_boot() - extra.timestamp_eof) / 1000);
+    if (i > 0 && extra.frame_id != last_frame_id + 1) skipped++;
+    last_frame_id = extra.frame_id;
+
+    if (work_us > 0) {
+      uint64_t until = nanos_since_boot() + work_us * 1000ULL;
+      while (nanos_since_boot() < until) {}
+    }
+  }
+
+  double secs = (nanos_since_boot() - start) * 1e-9;
+  getrusage(RUSAGE_SELF, &ru_end);
+  visionstream_destroy(&stream);
+
+  struct rusage ru_server;
+  wait4(pid, NULL, 0, &ru_server);
+  unlink(VIPC_SOCKET_PATH);
+
+  double client_cpu = tv_seconds(ru_end.ru_utime) + tv_seconds(ru_end.ru_stime)
+                    - tv_seconds(ru_start.ru_utime) - tv_seconds(ru_start.ru_stime);
+  double server_cpu = tv_seconds(ru_server.ru_utime) + tv_seconds(ru_server.ru_stime);
+  long client_switches = ru_end.ru_nvcsw - ru_start.ru_nvcsw;
+
+  printf("%-7s %6.0f fps  latency p50 %4lu us  p99 %5lu us  max %6lu us  skipped %d\n", name,
+         frames / secs, (unsigned long)hist.percentile(0.5), (unsigned long)hist.percentile(0.99),
+         (unsigned long)hist.max, skipped);
+  printf("%-7s cpu per frame: client %5.1f us  server %5.1f us, client waits %.2f per frame\n", "",
+         client_cpu / frames * 1e6 - work_us, server_cpu / frames * 1e6,
+         (double)client_switches / frames);
+}
+
+int main(int argc, char** argv) {
+  int frames = 400, fps = 20, work_us = 0;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "--frames") == 0) frames = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--fps") == 0) fps = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--work") == 0) work_us = atoi(argv[i + 1]);
+  }
+
+  int fd = vipc_connect();
+  if (fd >= 0) {
+    printf("something is serving %s already, is camerad running?\n", VIPC_SOCKET_PATH);
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  run("socket", false, frames, fps, work_us);
+  run("ring", true, frames, fps, work_us);
+  return 0;
+}
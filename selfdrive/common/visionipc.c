@@ -6,9 +6,14 @@
 #include <assert.h>
 #include <errno.h>
 
+#include <poll.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
 
 #include "ipc.h"
 
@@ -69,13 +74,169 @@ void vipc_bufs_load(VIPCBuf *bufs, const VisionStreamBufs *stream_bufs,
   }
 }
 
+static void ring_map(VisionRingState *r) {
+  r->ring = mmap(NULL, sizeof(VisionRing), PROT_READ | PROT_WRITE, MAP_SHARED, r->shm_fd, 0);
+  if (r->ring == MAP_FAILED) r->ring = NULL;
+}
+
+int vipc_ring_create(VisionRingState *r) {
+  memset(r, 0, sizeof(*r));
+  r->shm_fd = r->acq_efd = r->rel_efd = -1;
+#if defined(__linux__) && defined(SYS_memfd_create)
+  // memfd_create isn't wrapped everywhere, 1 is MFD_CLOEXEC
+  r->shm_fd = syscall(SYS_memfd_create, "visionipc_ring", 1);
+  if (r->shm_fd >= 0 && ftruncate(r->shm_fd, sizeof(VisionRing)) == 0) {
+    ring_map(r);
+  }
+  r->acq_efd = eventfd(0, EFD_CLOEXEC);
+  r->rel_efd = eventfd(0, EFD_CLOEXEC);
+#endif
+  if (r->ring == NULL || r->acq_efd < 0 || r->rel_efd < 0) {
+    vipc_ring_destroy(r);
+    return -1;
+  }
+  // the memfd starts out zeroed, that's an empty ring
+  return 0;
+}
+
+int vipc_ring_load(VisionRingState *r, const int *fds) {
+  memset(r, 0, sizeof(*r));
+  r->shm_fd = fds[0];
+  r->acq_efd = fds[1];
+  r->rel_efd = fds[2];
+  ring_map(r);
+  if (r->ring == NULL) {
+    vipc_ring_destroy(r);
+    return -1;
+  }
+  return 0;
+}
+
+void vipc_ring_destroy(VisionRingState *r) {
+  if (r->ring) munmap(r->ring, sizeof(VisionRing));
+  if (r->shm_fd >= 0) close(r->shm_fd);
+  if (r->acq_efd >= 0) close(r->acq_efd);
+  if (r->rel_efd >= 0) close(r->rel_efd);
+  memset(r, 0, sizeof(*r));
+  r->shm_fd = r->acq_efd = r->rel_efd = -1;
+}
+
+// The heads, tails and wanted flags are all seq_cst: a side that sets its
+// wanted flag and then finds the ring empty, and the other side that pushes
+// and then finds the flag clear, can't both happen.
+static void ring_signal(int *wanted, int efd) {
+  if (__atomic_exchange_n(wanted, 0, __ATOMIC_SEQ_CST)) {
+    uint64_t one = 1;
+    ssize_t err = write(efd, &one, sizeof(one));
+    assert(err == sizeof(one));
+  }
+}
+
+void vipc_ring_push_acquire(VisionRingState *r, int idx, const VIPCBufExtra *extra) {
+  VisionRing *ring = r->ring;
+  uint32_t head = ring->acq_head;
+  assert(head - __atomic_load_n(&ring->acq_tail, __ATOMIC_SEQ_CST) < VIPC_RING_SIZE);
+  ring->acq[head % VIPC_RING_SIZE].idx = idx;
+  ring->acq[head % VIPC_RING_SIZE].extra = *extra;
+  __atomic_store_n(&ring->acq_head, head + 1, __ATOMIC_SEQ_CST);
+  ring_signal(&ring->acq_wanted, r->acq_efd);
+}
+
+int vipc_ring_pop_release(VisionRingState *r) {
+  VisionRing *ring = r->ring;
+  uint32_t tail = ring->rel_tail;
+  if (tail == __atomic_load_n(&ring->rel_head, __ATOMIC_SEQ_CST)) return -1;
+  int idx = ring->rel[tail % VIPC_RING_SIZE];
+  __atomic_store_n(&ring->rel_tail, tail + 1, __ATOMIC_SEQ_CST);
+  return idx;
+}
+
+void vipc_ring_want_release(VisionRingState *r) {
+  __atomic_store_n(&r->ring->rel_wanted, 1, __ATOMIC_SEQ_CST);
+}
+
+bool vipc_ring_pop_acquire(VisionRingState *r, int *idx, VIPCBufExtra *extra) {
+  VisionRing *ring = r->ring;
+  uint32_t tail = ring->acq_tail;
+  if (tail == __atomic_load_n(&ring->acq_head, __ATOMIC_SEQ_CST)) return false;
+  *idx = ring->acq[tail % VIPC_RING_SIZE].idx;
+  if (extra) *extra = ring->acq[tail % VIPC_RING_SIZE].extra;
+  __atomic_store_n(&ring->acq_tail, tail + 1, __ATOMIC_SEQ_CST);
+  return true;
+}
+
+void vipc_ring_want_acquire(VisionRingState *r) {
+  __atomic_store_n(&r->ring->acq_wanted, 1, __ATOMIC_SEQ_CST);
+}
+
+void vipc_ring_push_release(VisionRingState *r, int idx) {
+  // a short spin, it only ever contends with a visionstream_release_buf
+  while (__atomic_test_and_set(&r->push_lock, __ATOMIC_ACQUIRE)) {}
+
+  VisionRing *ring = r->ring;
+  uint32_t head = ring->rel_head;
+  assert(head - __atomic_load_n(&ring->rel_tail, __ATOMIC_SEQ_CST) < VIPC_RING_SIZE);
+  ring->rel[head % VIPC_RING_SIZE] = idx;
+  __atomic_store_n(&ring->rel_head, head + 1, __ATOMIC_SEQ_CST);
+
+  __atomic_clear(&r->push_lock, __ATOMIC_RELEASE);
+  ring_signal(&ring->rel_wanted, r->rel_efd);
+}
+
+// waits for the next acquire on the ring, false if the server went away
+static bool ring_get(VisionStream *s, int *idx, VIPCBufExtra *extra) {
+  while (!vipc_ring_pop_acquire(&s->ring, idx, extra)) {
+    vipc_ring_want_acquire(&s->ring);
+    if (vipc_ring_pop_acquire(&s->ring, idx, extra)) break;
+
+    // the socket only becomes readable when the server closes it
+    struct pollfd polls[2] = {
+      { .fd = s->ring.acq_efd, .events = POLLIN },
+      { .fd = s->ipc_fd, .events = POLLIN },
+    };
+    int ret = poll(polls, 2, -1);
+    if (ret < 0) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      return false;
+    }
+    if (polls[1].revents) return false;
+    if (polls[0].revents) {
+      uint64_t cnt;
+      ssize_t err = read(s->ring.acq_efd, &cnt, sizeof(cnt));
+      assert(err == sizeof(cnt));
+    }
+  }
+  return true;
+}
+
+static void release_idx(VisionStream *s, int idx) {
+  if (s->ring.ring) {
+    vipc_ring_push_release(&s->ring, idx);
+    return;
+  }
+  VisionPacket rep = {
+    .type = VIPC_STREAM_RELEASE,
+    .d = { .stream_rel = {
+      .type = s->bufs_info.type,
+      .idx = idx,
+    }}
+  };
+  vipc_send(s->ipc_fd, &rep);
+}
+
 
 int visionstream_init(VisionStream *s, VisionStreamType type, bool tbuffer, VisionStreamBufs *out_bufs_info) {
+  return visionstream_init2(s, type, tbuffer, 0, out_bufs_info);
+}
+
+int visionstream_init2(VisionStream *s, VisionStreamType type, bool tbuffer, int hold_bufs,
+                       VisionStreamBufs *out_bufs_info) {
   int err;
 
   memset(s, 0, sizeof(*s));
 
   s->last_idx = -1;
+  s->ring.shm_fd = s->ring.acq_efd = s->ring.rel_efd = -1;
 
   s->ipc_fd = vipc_connect();
   if (s->ipc_fd < 0) return -1;
@@ -85,6 +246,8 @@ int visionstream_init(VisionStream *s, VisionStreamType type, bool tbuffer, Visi
     .d = { .stream_sub = {
       .type = type,
       .tbuffer = tbuffer,
+      .hold_bufs = hold_bufs,
+      .ring = true,
     }, },
   };
   err = vipc_send(s->ipc_fd, &p);
@@ -112,6 +275,17 @@ int visionstream_init(VisionStream *s, VisionStreamType type, bool tbuffer, Visi
 
   vipc_bufs_load(s->bufs, &rp.d.stream_bufs, s->num_bufs, rp.fds);
 
+  // no fds, the server can't do the ring and the stream stays on packets
+  err = vipc_recv(s->ipc_fd, &rp);
+  if (err <= 0) {
+    visionstream_destroy(s);
+    return -1;
+  }
+  assert(rp.type == VIPC_STREAM_RING);
+  if (rp.num_fds == VIPC_RING_FDS) {
+    vipc_ring_load(&s->ring, rp.fds);
+  }
+
   if (out_bufs_info) {
     *out_bufs_info = s->bufs_info;
   }
@@ -120,16 +294,8 @@ int visionstream_init(VisionStream *s, VisionStreamType type, bool tbuffer, Visi
 }
 
 void visionstream_release(VisionStream *s) {
-  int err;
   if (s->last_idx >= 0) {
-    VisionPacket rep = {
-      .type = VIPC_STREAM_RELEASE,
-      .d = { .stream_rel = {
-        .type = s->last_type,
-        .idx = s->last_idx,
-      }}
-    };
-    err = vipc_send(s->ipc_fd, &rep);
+    release_idx(s, s->last_idx);
     s->last_idx = -1;
   }
 }
@@ -137,51 +303,66 @@ void visionstream_release(VisionStream *s) {
 VIPCBuf* visionstream_get(VisionStream *s, VIPCBufExtra *out_extra) {
   int err;
 
-  VisionPacket rp;
-  err = vipc_recv(s->ipc_fd, &rp);
-  if (err <= 0) {
-    return NULL;
-  }
-  assert(rp.type == VIPC_STREAM_ACQUIRE);
-
-  if (s->last_idx >= 0) {
-    VisionPacket rep = {
-      .type = VIPC_STREAM_RELEASE,
-      .d = { .stream_rel = {
-        .type = s->last_type,
-        .idx = s->last_idx,
-      }}
-    };
-    err = vipc_send(s->ipc_fd, &rep);
+  int idx;
+  VIPCBufExtra extra;
+  if (s->ring.ring) {
+    if (!ring_get(s, &idx, &extra)) {
+      return NULL;
+    }
+    if (s->last_idx >= 0) {
+      vipc_ring_push_release(&s->ring, s->last_idx);
+    }
+  } else {
+    VisionPacket rp;
+    err = vipc_recv(s->ipc_fd, &rp);
     if (err <= 0) {
       return NULL;
     }
+    assert(rp.type == VIPC_STREAM_ACQUIRE);
+    idx = rp.d.stream_acq.idx;
+    extra = rp.d.stream_acq.extra;
+
+    if (s->last_idx >= 0) {
+      VisionPacket rep = {
+        .type = VIPC_STREAM_RELEASE,
+        .d = { .stream_rel = {
+          .type = s->last_type,
+          .idx = s->last_idx,
+        }}
+      };
+      err = vipc_send(s->ipc_fd, &rep);
+      if (err <= 0) {
+        return NULL;
+      }
+    }
   }
 
-  s->last_type = rp.d.stream_acq.type;
-  s->last_idx = rp.d.stream_acq.idx;
+  s->last_type = s->bufs_info.type;
+  s->last_idx = idx;
   assert(s->last_idx < s->num_bufs);
 
   if (out_extra) {
-    *out_extra = rp.d.stream_acq.extra;
+    *out_extra = extra;
   }
 
   return &s->bufs[s->last_idx];
 }
 
-void visionstream_destroy(VisionStream *s) {
-  int err;
+int visionstream_hold(VisionStream *s) {
+  int idx = s->last_idx;
+  s->last_idx = -1;
+  return idx;
+}
 
-  if (s->last_idx >= 0) {
-    VisionPacket rep = {
-      .type = VIPC_STREAM_RELEASE,
-      .d = { .stream_rel = {
-        .type = s->last_type,
-        .idx = s->last_idx,
-      }}
-    };
-    err = vipc_send(s->ipc_fd, &rep);
-    s->last_idx = -1;
+void visionstream_release_buf(VisionStream *s, int idx) {
+  if (idx < 0) return;
+  release_idx(s, idx);
+}
+
+void visionstream_destroy(VisionStream *s) {
+  visionstream_release(s);
+  if (s->ring.ring) {
+    vipc_ring_destroy(&s->ring);
   }
 
   for (int i=0; i<s->num_bufs; i++) {
@@ -193,4 +374,7 @@ void visionstream_destroy(VisionStream *s) {
   }
   if (s->bufs) free(s->bufs);
   if (s->ipc_fd >= 0) close(s->ipc_fd);
+  s->bufs = NULL;
+  s->num_bufs = 0;
+  s->ipc_fd = -1;
 }
@@ -18,6 +18,7 @@ typedef enum VisionIPCPacketType {
   VIPC_STREAM_BUFS,
   VIPC_STREAM_ACQUIRE,
   VIPC_STREAM_RELEASE,
+  VIPC_STREAM_RING,
 } VisionIPCPacketType;
 
 typedef enum VisionStreamType {
@@ -65,6 +66,8 @@ typedef union VisionPacketData {
   struct {
     VisionStreamType type;
     bool tbuffer;
+    int hold_bufs;
+    bool ring;
   } stream_sub;
   VisionStreamBufs stream_bufs;
   struct {
@@ -97,7 +100,55 @@ typedef struct VIPCBuf {
 void vipc_bufs_load(VIPCBuf *bufs, const VisionStreamBufs *stream_bufs,
                      int num_fds, const int* fds);
 
-
+// v2 protocol. After subscribing with .ring set, acquires and releases go
+// through a ring in shared memory instead of a packet each over the socket.
+// The server answers the subscribe with a VIPC_STREAM_RING carrying the
+// ring's fd and two eventfds, one for each direction, or no fds if it can't
+// make one and the stream stays on packets. The eventfds are only written
+// when the other side is waiting on them, so a client that keeps up with the
+// camera gets and releases frames without a syscall.
+#define VIPC_RING_SIZE 32  // power of two, more than the buffers a client can have out
+#define VIPC_RING_FDS 3
+
+typedef struct VisionRingEntry {
+  int idx;
+  VIPCBufExtra extra;
+} VisionRingEntry;
+
+// single producer single consumer both ways, the heads and tails only grow
+typedef struct VisionRing {
+  // server to client
+  uint32_t acq_head, acq_tail;
+  int acq_wanted;  // the client is waiting for acq_efd
+  VisionRingEntry acq[VIPC_RING_SIZE];
+
+  // client to server
+  uint32_t rel_head, rel_tail;
+  int rel_wanted;  // the server is waiting for rel_efd
+  int rel[VIPC_RING_SIZE];
+} VisionRing;
+
+typedef struct VisionRingState {
+  VisionRing *ring;  // NULL when the stream is on packets
+  int shm_fd, acq_efd, rel_efd;
+  int push_lock;     // client side, releases can come from more than one thread
+} VisionRingState;
+
+// server side
+int vipc_ring_create(VisionRingState *r);
+void vipc_ring_push_acquire(VisionRingState *r, int idx, const VIPCBufExtra *extra);
+int vipc_ring_pop_release(VisionRingState *r);
+// the next release writes rel_efd
+void vipc_ring_want_release(VisionRingState *r);
+
+// client side
+int vipc_ring_load(VisionRingState *r, const int *fds);
+bool vipc_ring_pop_acquire(VisionRingState *r, int *idx, VIPCBufExtra *extra);
+// the next acquire writes acq_efd
+void vipc_ring_want_acquire(VisionRingState *r);
+void vipc_ring_push_release(VisionRingState *r, int idx);
+
+void vipc_ring_destroy(VisionRingState *r);
 
 typedef struct VisionStream {
   int ipc_fd;
@@ -106,11 +157,20 @@ typedef struct VisionStream {
   int num_bufs;
   VisionStreamBufs bufs_info;
   VIPCBuf *bufs;
+  VisionRingState ring;
 } VisionStream;
 
 int visionstream_init(VisionStream *s, VisionStreamType type, bool tbuffer, VisionStreamBufs *out_bufs_info);
+// hold_bufs is how many buffers the client keeps with visionstream_hold at most,
+// the server doesn't stop sending until that many more are out
+int visionstream_init2(VisionStream *s, VisionStreamType type, bool tbuffer, int hold_bufs,
+                       VisionStreamBufs *out_bufs_info);
 void visionstream_release(VisionStream *s);
 VIPCBuf* visionstream_get(VisionStream *s, VIPCBufExtra *out_extra);
+// keeps the buffer visionstream_get returned last past the next get, it goes
+// back with visionstream_release_buf. That may be called from another thread.
+int visionstream_hold(VisionStream *s);
+void visionstream_release_buf(VisionStream *s, int idx);
 void visionstream_destroy(VisionStream *s);
 
 #ifdef __cplusplus
@@ -174,6 +174,7 @@ void encoder_init(EncoderState *s, const char* filename, int width, int height,
   s->width = width;
   s->height = height;
   s->fps = fps;
+  s->bitrate = bitrate;
   mutex_init_reentrant(&s->lock);
 
   if (!h265) {
@@ -389,57 +390,8 @@ static void handle_out_buf(EncoderState *s, OMX_BUFFERHEADERTYPE *out_buf) {
   int err;
   uint8_t *buf_data = out_buf->pBuffer + out_buf->nOffset;
 
-  if (out_buf->nFlags & OMX_BUFFERFLAG_CODECCONFIG) {
-    if (s->codec_config_len < out_buf->nFilledLen) {
-      s->codec_config = realloc(s->codec_config, out_buf->nFilledLen);
-    }
-    s->codec_config_len = out_buf->nFilledLen;
-    memcpy(s->codec_config, buf_data, out_buf->nFilledLen);
-  }
-
-  if (s->of) {
-    //printf("write %d flags 0x%x\n", out_buf->nFilledLen, out_buf->nFlags);
-    fwrite(buf_data, out_buf->nFilledLen, 1, s->of);
-  }
-
-  if (s->remuxing) {
-    if (!s->wrote_codec_config && s->codec_config_len > 0) {
-      if (s->codec_ctx->extradata_size < s->codec_config_len) {
-        s->codec_ctx->extradata = realloc(s->codec_ctx->extradata, s->codec_config_len + AV_INPUT_BUFFER_PADDING_SIZE);
-      }
-      s->codec_ctx->extradata_size = s->codec_config_len;
-      memcpy(s->codec_ctx->extradata, s->codec_config, s->codec_config_len);
-      memset(s->codec_ctx->extradata + s->codec_ctx->extradata_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
-
-      err = avcodec_parameters_from_context(s->out_stream->codecpar, s->codec_ctx);
-      assert(err >= 0);
-      err = avformat_write_header(s->ofmt_ctx, NULL);
-      assert(err >= 0);
-
-      s->wrote_codec_config = true;
-    }
-
-    if (out_buf->nTimeStamp > 0) {
-      // input timestamps are in microseconds
-      AVRational in_timebase = {1, 1000000};
-
-      AVPacket pkt;
-      av_init_packet(&pkt);
-      pkt.data = buf_data;
-      pkt.size = out_buf->nFilledLen;
-      pkt.pts = pkt.dts = av_rescale_q_rnd(out_buf->nTimeStamp, in_timebase, s->ofmt_ctx->streams[0]->time_base, AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
-      pkt.duration = av_rescale_q(50*1000, in_timebase, s->ofmt_ctx->streams[0]->time_base);
-
-      if (out_buf->nFlags & OMX_BUFFERFLAG_SYNCFRAME) {
-        pkt.flags |= AV_PKT_FLAG_KEY;
-      }
-
-      err = av_write_frame(s->ofmt_ctx, &pkt);
-      if (err < 0) { LOGW("ts encoder write issue"); }
-
-      av_free_packet(&pkt);
-    }
-  }
+  encoder_write_output(s, buf_data, out_buf->nFilledLen, out_buf->nTimeStamp,
+                       out_buf->nFlags & OMX_BUFFERFLAG_CODECCONFIG, out_buf->nFlags & OMX_BUFFERFLAG_SYNCFRAME);
 
   // give omx back the buffer
   err = OMX_FillThisBuffer(s->handle, out_buf);
@@ -543,62 +495,6 @@ int encoder_encode_frame(EncoderState *s,
   return ret;
 }
 
-void encoder_open(EncoderState *s, const char* path) {
-  int err;
-
-  pthread_mutex_lock(&s->lock);
-
-  snprintf(s->vid_path, sizeof(s->vid_path), "%s/%s", path, s->filename);
-  LOGD("encoder_open %s remuxing:%d", s->vid_path, s->remuxing);
-
-  if (s->remuxing) {
-    avformat_alloc_output_context2(&s->ofmt_ctx, NULL, NULL, s->vid_path);
-    assert(s->ofmt_ctx);
-
-#ifdef QCOM2
-    s->ofmt_ctx->oformat->flags = AVFMT_TS_NONSTRICT;
-#endif
-    s->out_stream = avformat_new_stream(s->ofmt_ctx, NULL);
-    assert(s->out_stream);
-
-    // set codec correctly
-    av_register_all();
-
-    AVCodec *codec = NULL;
-    codec = avcodec_find_encoder(AV_CODEC_ID_H264);
-    assert(codec);
-
-    s->codec_ctx = avcodec_alloc_context3(codec);
-    assert(s->codec_ctx);
-    s->codec_ctx->width = s->width;
-    s->codec_ctx->height = s->height;
-    s->codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
-    s->codec_ctx->time_base = (AVRational){ 1, s->fps };
-
-    err = avio_open(&s->ofmt_ctx->pb, s->vid_path, AVIO_FLAG_WRITE);
-    assert(err >= 0);
-
-    s->wrote_codec_config = false;
-  } else {
-    s->of = fopen(s->vid_path, "wb");
-    assert(s->of);
-    if (s->codec_config_len > 0) {
-      fwrite(s->codec_config, s->codec_config_len, 1, s->of);
-    }
-  }
-
-  // create camera lock file
-  snprintf(s->lock_path, sizeof(s->lock_path), "%s/%s.lock", path, s->filename);
-  int lock_fd = open(s->lock_path, O_RDWR | O_CREAT, 0777);
-  assert(lock_fd >= 0);
-  close(lock_fd);
-
-  s->open = true;
-  s->counter = 0;
-
-  pthread_mutex_unlock(&s->lock);
-}
-
 void encoder_close(EncoderState *s) {
   int err;
 
@@ -629,38 +525,13 @@ void encoder_close(EncoderState *s) {
       s->dirty = false;
     }
 
-    if (s->remuxing) {
-      av_write_trailer(s->ofmt_ctx);
-      avcodec_free_context(&s->codec_ctx);
-      avio_closep(&s->ofmt_ctx->pb);
-      avformat_free_context(s->ofmt_ctx);
-    } else {
-      fclose(s->of);
-    }
-    unlink(s->lock_path);
+    encoder_close_output(s);
   }
   s->open = false;
 
   pthread_mutex_unlock(&s->lock);
 }
 
-void encoder_rotate(EncoderState *s, const char* new_path, int new_segment) {
-  pthread_mutex_lock(&s->lock);
-  snprintf(s->next_path, sizeof(s->next_path), "%s", new_path);
-  s->next_segment = new_segment;
-  if (s->open) {
-    if (s->next_segment == -1) {
-      s->closing = true;
-    } else {
-      s->rotating = true;
-    }
-  } else {
-    s->segment = s->next_segment;
-    s->opening = true;
-  }
-  pthread_mutex_unlock(&s->lock);
-}
-
 void encoder_destroy(EncoderState *s) {
   int err;
 
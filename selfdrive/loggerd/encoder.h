@@ -7,7 +7,11 @@
 
 #include <pthread.h>
 
+#ifdef ENCODER_SW
+#include <libavcodec/avcodec.h>
+#else
 #include <OMX_Component.h>
+#endif
 #include <libavformat/avformat.h>
 
 #include "common/cqueue.h"
@@ -20,6 +24,7 @@ extern "C" {
 typedef struct EncoderState {
   pthread_mutex_t lock;
   int width, height, fps;
+  int bitrate;
   const char* path;
   char vid_path[1024];
   char lock_path[1024];
@@ -41,6 +46,13 @@ typedef struct EncoderState {
   uint8_t *codec_config;
   bool wrote_codec_config;
 
+#ifdef ENCODER_SW
+  // libavcodec software encoder, for PCs
+  bool h265;
+  AVCodecContext *enc_ctx;
+  AVFrame *frame;
+  AVPacket *pkt;
+#else
   pthread_mutex_t state_lock;
   pthread_cond_t state_cv;
   OMX_STATETYPE state;
@@ -55,6 +67,7 @@ typedef struct EncoderState {
 
   Queue free_in;
   Queue done_out;
+#endif
 
   AVFormatContext *ofmt_ctx;
   AVCodecContext *codec_ctx;
@@ -75,6 +88,10 @@ void encoder_rotate(EncoderState *s, const char* new_path, int new_segment);
 void encoder_close(EncoderState *s);
 void encoder_destroy(EncoderState *s);
 
+// encoder_output.c, shared by the backends. timestamp is in microseconds.
+void encoder_write_output(EncoderState *s, uint8_t *data, size_t len, int64_t timestamp, bool codec_config, bool keyframe);
+void encoder_close_output(EncoderState *s);
+
 #ifdef __cplusplus
 }
 #endif
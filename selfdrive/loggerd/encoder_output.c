@@ -0,0 +1,161 @@
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <pthread.h>
+
+#include "common/swaglog.h"
+
+#include "encoder.h"
+#include "segment_writer.h"
+
+// The segment files, the same for every encoder backend: raw hevc, or the
+// remuxed ts for h264.
+
+// a minute of video at the target bitrate is preallocated, the file is trimmed on close
+#define ENCODER_PREALLOC_SECONDS 60
+
+void encoder_write_output(EncoderState *s, uint8_t *data, size_t len, int64_t timestamp, bool codec_config, bool keyframe) {
+  int err;
+
+  if (codec_config) {
+    if (s->codec_config_len < len) {
+      s->codec_config = realloc(s->codec_config, len);
+    }
+    s->codec_config_len = len;
+    memcpy(s->codec_config, data, len);
+  }
+
+  if (s->of) {
+    fwrite(data, len, 1, s->of);
+  }
+
+  if (s->remuxing) {
+    if (!s->wrote_codec_config && s->codec_config_len > 0) {
+      if (s->codec_ctx->extradata_size < s->codec_config_len) {
+        s->codec_ctx->extradata = realloc(s->codec_ctx->extradata, s->codec_config_len + AV_INPUT_BUFFER_PADDING_SIZE);
+      }
+      s->codec_ctx->extradata_size = s->codec_config_len;
+      memcpy(s->codec_ctx->extradata, s->codec_config, s->codec_config_len);
+      memset(s->codec_ctx->extradata + s->codec_ctx->extradata_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+      err = avcodec_parameters_from_context(s->out_stream->codecpar, s->codec_ctx);
+      assert(err >= 0);
+      err = avformat_write_header(s->ofmt_ctx, NULL);
+      assert(err >= 0);
+
+      s->wrote_codec_config = true;
+    }
+
+    if (timestamp > 0) {
+      // input timestamps are in microseconds
+      AVRational in_timebase = {1, 1000000};
+
+      AVPacket pkt;
+      av_init_packet(&pkt);
+      pkt.data = data;
+      pkt.size = len;
+      pkt.pts = pkt.dts = av_rescale_q_rnd(timestamp, in_timebase, s->ofmt_ctx->streams[0]->time_base, AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
+      pkt.duration = av_rescale_q(50*1000, in_timebase, s->ofmt_ctx->streams[0]->time_base);
+
+      if (keyframe) {
+        pkt.flags |= AV_PKT_FLAG_KEY;
+      }
+
+      err = av_write_frame(s->ofmt_ctx, &pkt);
+      if (err < 0) { LOGW("ts encoder write issue"); }
+
+      av_free_packet(&pkt);
+    }
+  }
+}
+
+void encoder_open(EncoderState *s, const char* path) {
+  int err;
+
+  pthread_mutex_lock(&s->lock);
+
+  snprintf(s->vid_path, sizeof(s->vid_path), "%s/%s", path, s->filename);
+  LOGD("encoder_open %s remuxing:%d", s->vid_path, s->remuxing);
+
+  if (s->remuxing) {
+    avformat_alloc_output_context2(&s->ofmt_ctx, NULL, NULL, s->vid_path);
+    assert(s->ofmt_ctx);
+
+#ifdef QCOM2
+    s->ofmt_ctx->oformat->flags = AVFMT_TS_NONSTRICT;
+#endif
+    s->out_stream = avformat_new_stream(s->ofmt_ctx, NULL);
+    assert(s->out_stream);
+
+    // set codec correctly
+    av_register_all();
+
+    AVCodec *codec = NULL;
+    codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+    assert(codec);
+
+    s->codec_ctx = avcodec_alloc_context3(codec);
+    assert(s->codec_ctx);
+    s->codec_ctx->width = s->width;
+    s->codec_ctx->height = s->height;
+    s->codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    s->codec_ctx->time_base = (AVRational){ 1, s->fps };
+
+    err = avio_open(&s->ofmt_ctx->pb, s->vid_path, AVIO_FLAG_WRITE);
+    assert(err >= 0);
+
+    s->wrote_codec_config = false;
+  } else {
+    s->of = segment_file_open(s->vid_path, (size_t)s->bitrate / 8 * ENCODER_PREALLOC_SECONDS);
+    assert(s->of);
+    if (s->codec_config_len > 0) {
+      fwrite(s->codec_config, s->codec_config_len, 1, s->of);
+    }
+  }
+
+  // create camera lock file
+  snprintf(s->lock_path, sizeof(s->lock_path), "%s/%s.lock", path, s->filename);
+  int lock_fd = open(s->lock_path, O_RDWR | O_CREAT, 0777);
+  assert(lock_fd >= 0);
+  close(lock_fd);
+
+  s->open = true;
+  s->counter = 0;
+
+  pthread_mutex_unlock(&s->lock);
+}
+
+void encoder_close_output(EncoderState *s) {
+  if (s->remuxing) {
+    av_write_trailer(s->ofmt_ctx);
+    avcodec_free_context(&s->codec_ctx);
+    avio_closep(&s->ofmt_ctx->pb);
+    avformat_free_context(s->ofmt_ctx);
+  } else {
+    fclose(s->of);
+  }
+  unlink(s->lock_path);
+}
+
+void encoder_rotate(EncoderState *s, const char* new_path, int new_segment) {
+  pthread_mutex_lock(&s->lock);
+  snprintf(s->next_path, sizeof(s->next_path), "%s", new_path);
+  s->next_segment = new_segment;
+  if (s->open) {
+    if (s->next_segment == -1) {
+      s->closing = true;
+    } else {
+      s->rotating = true;
+    }
+  } else {
+    s->segment = s->next_segment;
+    s->opening = true;
+  }
+  pthread_mutex_unlock(&s->lock);
+}
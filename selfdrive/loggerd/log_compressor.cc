@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <bzlib.h>
+#ifdef LOGGER_ZSTD
+#include <zstd.h>
+#endif
+#ifdef LOGGER_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "log_compressor.h"
+#include "parallel_bz2.h"
+
+// lz4 takes its input in pieces of at most this, so the output buffer has a fixed bound
+#define LZ4_CHUNK (64*1024)
+
+struct LogCompressor {
+  LogCodec codec;
+  int level;
+  FILE* f;
+  bool error;
+
+  size_t block_size;
+  LogBlockCallback block_cb;
+  void* block_ctx;
+  uint32_t block;
+  uint64_t block_start, block_in;  // where the block began in the file and what went in so far
+  uint64_t written;
+
+  BZFILE* bz;
+  ParallelBz2* pbz;
+#ifdef LOGGER_ZSTD
+  ZSTD_CCtx* zstd;
+#endif
+#ifdef LOGGER_LZ4
+  LZ4F_cctx* lz4;
+#endif
+  uint8_t* out;
+  size_t out_size;
+};
+
+bool log_codec_parse(const char* s, LogCompressorConfig* cfg) {
+  char name[16] = {0};
+  int level = 0, threads = 0;
+  if (sscanf(s, "%15[^:]:%d:%d", name, &level, &threads) < 1) return false;
+
+  if (strcmp(name, "bz2") == 0 || strcmp(name, "bzip2") == 0) {
+    cfg->codec = LOG_CODEC_BZ2;
+#ifdef LOGGER_ZSTD
+  } else if (strcmp(name, "zstd") == 0 || strcmp(name, "zst") == 0) {
+    cfg->codec = LOG_CODEC_ZSTD;
+#endif
+#ifdef LOGGER_LZ4
+  } else if (strcmp(name, "lz4") == 0) {
+    cfg->codec = LOG_CODEC_LZ4;
+#endif
+  } else {
+    return false;
+  }
+  cfg->level = level;
+  cfg->threads = threads;
+  return true;
+}
+
+const char* log_codec_ext(LogCodec codec) {
+  switch (codec) {
+  case LOG_CODEC_ZSTD: return "zst";
+  case LOG_CODEC_LZ4: return "lz4";
+  default: return "bz2";
+  }
+}
+
+#if defined(LOGGER_ZSTD) || defined(LOGGER_LZ4)
+static bool write_out(LogCompressor* c, const void* data, size_t size) {
+  if (size > 0 && fwrite(data, 1, size, c->f) != size) {
+    c->error = true;
+  }
+  c->written += size;
+  return !c->error;
+}
+#endif
+
+#ifdef LOGGER_LZ4
+static void lz4_prefs(LogCompressor* c, LZ4F_preferences_t* prefs) {
+  memset(prefs, 0, sizeof(*prefs));
+  prefs->compressionLevel = c->level;
+  prefs->frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+}
+#endif
+
+// starts the stream or frame every block is on its own
+static bool begin_block(LogCompressor* c) {
+  switch (c->codec) {
+  case LOG_CODEC_BZ2: {
+    int bzerror;
+    c->bz = BZ2_bzWriteOpen(&bzerror, c->f, c->level > 0 ? c->level : 9, 0, 30);
+    return bzerror == BZ_OK;
+  }
+#ifdef LOGGER_LZ4
+  case LOG_CODEC_LZ4: {
+    LZ4F_preferences_t prefs;
+    lz4_prefs(c, &prefs);
+    size_t n = LZ4F_compressBegin(c->lz4, c->out, c->out_size, &prefs);
+    return !LZ4F_isError(n) && write_out(c, c->out, n);
+  }
+#endif
+  default:
+    // a zstd frame starts with the first write after the last one ended
+    return true;
+  }
+}
+
+// finishes the current stream or frame and reports the block
+static bool end_block(LogCompressor* c) {
+  switch (c->codec) {
+  case LOG_CODEC_BZ2: {
+    if (c->bz == NULL) break;
+    int bzerror;
+    unsigned int in_lo, in_hi, out_lo, out_hi;
+    BZ2_bzWriteClose64(&bzerror, c->bz, c->error, &in_lo, &in_hi, &out_lo, &out_hi);
+    c->bz = NULL;
+    if (bzerror != BZ_OK) c->error = true;
+    c->written += ((uint64_t)out_hi << 32) | out_lo;
+    break;
+  }
+#ifdef LOGGER_ZSTD
+  case LOG_CODEC_ZSTD: {
+    size_t remaining = 1;
+    while (!c->error && remaining != 0) {
+      ZSTD_inBuffer in = {NULL, 0, 0};
+      ZSTD_outBuffer out = {c->out, c->out_size, 0};
+      remaining = ZSTD_compressStream2(c->zstd, &out, &in, ZSTD_e_end);
+      if (ZSTD_isError(remaining)) c->error = true;
+      else write_out(c, c->out, out.pos);
+    }
+    break;
+  }
+#endif
+#ifdef LOGGER_LZ4
+  case LOG_CODEC_LZ4: {
+    if (c->error) break;
+    size_t n = LZ4F_compressEnd(c->lz4, c->out, c->out_size, NULL);
+    if (LZ4F_isError(n)) c->error = true;
+    else write_out(c, c->out, n);
+    break;
+  }
+#endif
+  default:
+    break;
+  }
+
+  if (c->block_cb && !c->error) c->block_cb(c->block_ctx, c->block_start, c->written - c->block_start, c->block_in);
+  c->block_start = c->written;
+  c->block_in = 0;
+  return !c->error;
+}
+
+LogCompressor* log_compressor_open(FILE* f, const LogCompressorConfig* cfg, size_t block_size,
+                                   LogBlockCallback block_cb, void* block_ctx) {
+  LogCompressor* c = (LogCompressor*)calloc(1, sizeof(LogCompressor));
+  if (c == NULL) return NULL;
+  c->codec = cfg->codec;
+  c->level = cfg->level;
+  c->f = f;
+  c->block_size = block_size;
+  c->block_cb = block_cb;
+  c->block_ctx = block_ctx;
+
+  switch (cfg->codec) {
+  case LOG_CODEC_BZ2:
+    if (cfg->threads != 0) {
+      c->pbz = parallel_bz2_open(f, cfg->level > 0 ? cfg->level : 9, cfg->threads, block_cb, block_ctx);
+      if (c->pbz == NULL) goto fail;
+      return c;
+    }
+    break;
+#ifdef LOGGER_ZSTD
+  case LOG_CODEC_ZSTD:
+    c->zstd = ZSTD_createCCtx();
+    if (c->zstd == NULL) goto fail;
+    if (ZSTD_isError(ZSTD_CCtx_setParameter(c->zstd, ZSTD_c_compressionLevel, cfg->level > 0 ? cfg->level : ZSTD_CLEVEL_DEFAULT))) goto fail;
+    // libzstd without multithreading support refuses workers, it still works single threaded
+    if (cfg->threads != 0) {
+      ZSTD_CCtx_setParameter(c->zstd, ZSTD_c_nbWorkers, cfg->threads > 0 ? cfg->threads : sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    c->out_size = ZSTD_CStreamOutSize();
+    c->out = (uint8_t*)malloc(c->out_size);
+    if (c->out == NULL) goto fail;
+    break;
+#endif
+#ifdef LOGGER_LZ4
+  case LOG_CODEC_LZ4: {
+    LZ4F_preferences_t prefs;
+    lz4_prefs(c, &prefs);
+    if (LZ4F_isError(LZ4F_createCompressionContext(&c->lz4, LZ4F_VERSION))) goto fail;
+    c->out_size = LZ4F_compressBound(LZ4_CHUNK, &prefs);
+    if (c->out_size < LZ4F_HEADER_SIZE_MAX) c->out_size = LZ4F_HEADER_SIZE_MAX;
+    c->out = (uint8_t*)malloc(c->out_size);
+    if (c->out == NULL) goto fail;
+    break;
+  }
+#endif
+  default:
+    goto fail;
+  }
+
+  if (begin_block(c)) return c;
+
+fail:
+  c->error = true;
+  log_compressor_close(c);
+  return NULL;
+}
+
+int log_compressor_write(LogCompressor* c, const void* data, size_t size) {
+  if (c->error) return -1;
+
+  if (c->pbz) {
+    if (parallel_bz2_write(c->pbz, data, size) != 0) c->error = true;
+    return c->error ? -1 : 0;
+  }
+
+  if (c->block_size > 0 && c->block_in > 0 && c->block_in + size > c->block_size) {
+    if (!end_block(c) || !begin_block(c)) {
+      c->error = true;
+      return -1;
+    }
+    c->block++;
+  }
+  c->block_in += size;
+
+  switch (c->codec) {
+  case LOG_CODEC_BZ2: {
+    int bzerror;
+    BZ2_bzWrite(&bzerror, c->bz, (void*)data, size);
+    if (bzerror != BZ_OK) c->error = true;
+    break;
+  }
+#ifdef LOGGER_ZSTD
+  case LOG_CODEC_ZSTD: {
+    ZSTD_inBuffer in = {data, size, 0};
+    while (in.pos < in.size) {
+      ZSTD_outBuffer out = {c->out, c->out_size, 0};
+      if (ZSTD_isError(ZSTD_compressStream2(c->zstd, &out, &in, ZSTD_e_continue)) || !write_out(c, c->out, out.pos)) {
+        c->error = true;
+        break;
+      }
+    }
+    break;
+  }
+#endif
+#ifdef LOGGER_LZ4
+  case LOG_CODEC_LZ4: {
+    const uint8_t* p = (const uint8_t*)data;
+    while (size > 0) {
+      size_t len = size < LZ4_CHUNK ? size : LZ4_CHUNK;
+      size_t n = LZ4F_compressUpdate(c->lz4, c->out, c->out_size, p, len, NULL);
+      if (LZ4F_isError(n) || !write_out(c, c->out, n)) {
+        c->error = true;
+        break;
+      }
+      p += len;
+      size -= len;
+    }
+    break;
+  }
+#endif
+  default:
+    c->error = true;
+    break;
+  }
+  return c->error ? -1 : 0;
+}
+
+uint32_t log_compressor_block(LogCompressor* c) {
+  return c->pbz ? parallel_bz2_block(c->pbz) : c->block;
+}
+
+int log_compressor_close(LogCompressor* c) {
+  if (c->pbz) {
+    if (parallel_bz2_close(c->pbz) != 0) c->error = true;
+  } else {
+    // the last block, even if it's empty so the file is never left without a stream
+    end_block(c);
+  }
+#ifdef LOGGER_ZSTD
+  if (c->zstd) ZSTD_freeCCtx(c->zstd);
+#endif
+#ifdef LOGGER_LZ4
+  if (c->lz4) LZ4F_freeCompressionContext(c->lz4);
+#endif
+
+  int ret = c->error ? -1 : 0;
+  free(c->out);
+  free(c);
+  return ret;
+}
@@ -0,0 +1,57 @@
+#ifndef LOG_COMPRESSOR_H
+#define LOG_COMPRESSOR_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Streaming compression for the rlog and qlog. bzip2 is always there, zstd
+// and lz4 only if loggerd was built with LOGGER_ZSTD and LOGGER_LZ4. bzip2
+// with threads is parallel_bz2.h, its output is still one .bz2 file.
+
+typedef enum LogCodec {
+  LOG_CODEC_BZ2,
+  LOG_CODEC_ZSTD,
+  LOG_CODEC_LZ4,
+} LogCodec;
+
+typedef struct LogCompressorConfig {
+  LogCodec codec;
+  int level;    // 0 picks the codec's default, bzip2 defaults to 9 like it always was
+  int threads;  // worker threads, 0 compresses in the writing thread and -1 uses every core
+} LogCompressorConfig;
+
+typedef struct LogCompressor LogCompressor;
+
+// Called in order for every block once it's in the file: where it starts,
+// how long it is there and how much input went into it.
+typedef void (*LogBlockCallback)(void* ctx, uint64_t offset, uint64_t size, uint64_t raw_size);
+
+// "bz2", "bz2:9:-1", "zstd:3" or "zstd:19:2" (codec:level:threads). Returns false for
+// unknown codecs and ones this build doesn't have.
+bool log_codec_parse(const char* s, LogCompressorConfig* cfg);
+// file extension without the dot
+const char* log_codec_ext(LogCodec codec);
+
+// Writes the compressed stream to f, which is left open on close. The
+// stream is cut into blocks of about block_size bytes of input, never in the
+// middle of a write, that each decode on their own: concatenated bzip2
+// streams or zstd/lz4 frames. block_size 0 writes one stream, parallel
+// bzip2 always cuts its own level * 100 kB blocks. block_cb can be NULL.
+LogCompressor* log_compressor_open(FILE* f, const LogCompressorConfig* cfg, size_t block_size,
+                                   LogBlockCallback block_cb, void* block_ctx);
+int log_compressor_write(LogCompressor* c, const void* data, size_t size);
+// the block the last write went into, counting from 0
+uint32_t log_compressor_block(LogCompressor* c);
+// finishes the stream and frees c, returns -1 if anything failed on the way
+int log_compressor_close(LogCompressor* c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
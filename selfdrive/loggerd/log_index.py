@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+# Reads the .idx side-car loggerd writes next to every rlog and qlog (see
+# LoggerIndexHeader in logger.h) and decompresses only the blocks a reader
+# asks for.
+#
+# usage: log_index.py rlog.bz2 [--start mono_ns] [--end mono_ns] [--services can,carState]
+import argparse
+import bz2
+import struct
+from collections import namedtuple
+
+from cereal import log
+
+INDEX_MAGIC = 0x5844494C
+HEADER = struct.Struct("<IHHII")
+BLOCK = struct.Struct("<QQQQQQII4Q")
+CODECS = ["bz2", "zstd", "lz4"]
+
+# union members in discriminant order, the bit numbers of LoggerIndexBlock.services
+SERVICES = list(log.Event.schema.union_fields)
+
+IndexBlock = namedtuple("IndexBlock", ["offset", "size", "raw_offset", "raw_size",
+                                       "min_mono_time", "max_mono_time", "events", "services"])
+
+
+def read_index(log_path):
+  with open(log_path + ".idx", "rb") as f:
+    dat = f.read()
+
+  magic, version, codec, num_blocks, block_len = HEADER.unpack_from(dat, 0)
+  if magic != INDEX_MAGIC:
+    raise ValueError(f"{log_path}.idx is not a log index")
+
+  blocks = []
+  for i in range(num_blocks):
+    b = BLOCK.unpack_from(dat, HEADER.size + i * block_len)
+    services = {SERVICES[n] for n in range(min(len(SERVICES), 256)) if (b[8 + n // 64] >> (n % 64)) & 1}
+    blocks.append(IndexBlock(*b[:7], services))
+  return CODECS[codec], blocks
+
+
+def decompress(codec, dat):
+  if codec == "bz2":
+    return bz2.decompress(dat)
+  elif codec == "zstd":
+    import zstandard
+    return zstandard.ZstdDecompressor().decompressobj().decompress(dat)
+  elif codec == "lz4":
+    import lz4.frame
+    return lz4.frame.decompress(dat)
+  raise ValueError(f"unknown codec {codec}")
+
+
+def select_blocks(blocks, start=None, end=None, services=None):
+  for b in blocks:
+    if b.events == 0:
+      continue
+    if start is not None and b.max_mono_time < start:
+      continue
+    if end is not None and b.min_mono_time > end:
+      continue
+    if services is not None and not (b.services & set(services)):
+      continue
+    yield b
+
+
+def read_range(log_path, start=None, end=None, services=None):
+  """Events from the blocks that can hold something in [start, end] from
+  services, the caller still filters the events themselves."""
+  codec, blocks = read_index(log_path)
+  events = []
+  with open(log_path, "rb") as f:
+    for b in select_blocks(blocks, start, end, services):
+      f.seek(b.offset)
+      events += log.Event.read_multiple_bytes(decompress(codec, f.read(b.size)))
+  return events
+
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser(description="show the index of a log and read parts of it")
+  parser.add_argument("log")
+  parser.add_argument("--start", type=int)
+  parser.add_argument("--end", type=int)
+  parser.add_argument("--services", type=lambda s: s.split(","))
+  args = parser.parse_args()
+
+  codec, blocks = read_index(args.log)
+  selected = list(select_blocks(blocks, args.start, args.end, args.services))
+  print(f"{codec}, {len(blocks)} blocks, {len(selected)} selected")
+  for b in selected:
+    print(f"{b.offset:10d} {b.size:8d} {b.min_mono_time:>20d} {b.max_mono_time:>20d} {b.events:6d} {','.join(sorted(b.services))}")
@@ -11,12 +11,140 @@
 #include <sys/stat.h>
 
 #include <pthread.h>
-#include <bzlib.h>
 #include "messaging.hpp"
 
 #include "common/swaglog.h"
+#include "common/util.h"
 
 #include "logger.h"
+#include "segment_writer.h"
+
+// records in the write-behind queue, each one a header followed by the
+// message, padded so the next header stays aligned
+enum {
+  QUEUE_LOG,       // message for the rlog
+  QUEUE_LOG_QLOG,  // message for the rlog and the qlog
+  QUEUE_ROTATE,    // switch the writer to h, everything before it goes to the old segment
+  QUEUE_WRAP,      // rest of the ring is unused, continue at the start
+};
+
+// LoggerState.next_state, the segment the opener thread prepares
+enum {
+  NEXT_NONE,
+  NEXT_WANTED,   // next_part should be opened in next_root
+  NEXT_OPENING,
+  NEXT_READY,    // next_handle is open, or NULL if that failed
+};
+
+typedef struct QueueRecord {
+  uint32_t type;
+  uint32_t size;
+  LoggerHandle* h;
+} QueueRecord;
+
+#define QUEUE_ALIGN 8
+#define QUEUE_RECORD_LEN(size) ((sizeof(QueueRecord) + (size) + QUEUE_ALIGN - 1) & ~(size_t)(QUEUE_ALIGN - 1))
+
+static bool queue_push(LoggerState *s, uint32_t type, LoggerHandle *h, const uint8_t* data, size_t data_size, bool wait) {
+  size_t len = QUEUE_RECORD_LEN(data_size);
+
+  pthread_mutex_lock(&s->queue_lock);
+  while (true) {
+    if (s->queue_used == 0) {
+      s->queue_head = s->queue_tail = 0;
+    }
+    // a record never wraps, the end of the ring is skipped if it doesn't fit there
+    size_t waste = (s->queue_size - s->queue_head < len) ? s->queue_size - s->queue_head : 0;
+    if (len <= s->queue_size && s->queue_used + waste + len <= s->queue_size) {
+      if (waste >= sizeof(QueueRecord)) {
+        QueueRecord *wrap = (QueueRecord*)(s->queue + s->queue_head);
+        wrap->type = QUEUE_WRAP;
+      }
+      if (waste > 0) s->queue_head = 0;
+      s->queue_used += waste;
+      break;
+    }
+    if (!wait || len > s->queue_size || s->queue_exit) {
+      s->queue_stats.dropped_msgs++;
+      s->queue_stats.dropped_bytes += data_size;
+      pthread_mutex_unlock(&s->queue_lock);
+      LOGE_100("logger queue full, dropped %zu bytes", data_size);
+      return false;
+    }
+    pthread_cond_wait(&s->queue_space_cv, &s->queue_lock);
+  }
+
+  QueueRecord *rec = (QueueRecord*)(s->queue + s->queue_head);
+  rec->type = type;
+  rec->size = data_size;
+  rec->h = h;
+  if (data_size > 0) {
+    memcpy(rec + 1, data, data_size);
+  }
+  s->queue_head = (s->queue_head + len) % s->queue_size;
+  s->queue_used += len;
+
+  LoggerQueueStats *st = &s->queue_stats;
+  st->msgs++;
+  st->bytes += data_size;
+  st->depth_msgs++;
+  st->depth_bytes += data_size;
+  if (st->depth_bytes > st->max_depth_bytes) st->max_depth_bytes = st->depth_bytes;
+
+  pthread_cond_signal(&s->queue_cv);
+  pthread_mutex_unlock(&s->queue_lock);
+  return true;
+}
+
+static void* logger_writer_thread(void *arg) {
+  LoggerState *s = (LoggerState*)arg;
+  set_thread_name("loggerd_writer");
+
+  pthread_mutex_lock(&s->queue_lock);
+  while (true) {
+    while (s->queue_used == 0 && !s->queue_exit) {
+      pthread_cond_wait(&s->queue_cv, &s->queue_lock);
+    }
+    if (s->queue_used == 0) break;
+
+    // skip the unused end of the ring
+    size_t waste = s->queue_size - s->queue_tail;
+    if (waste < sizeof(QueueRecord) || ((QueueRecord*)(s->queue + s->queue_tail))->type == QUEUE_WRAP) {
+      s->queue_tail = 0;
+      s->queue_used -= waste;
+      continue;
+    }
+
+    // the producer doesn't touch a record until it's released below,
+    // so it can be compressed straight from the ring without the lock
+    QueueRecord *rec = (QueueRecord*)(s->queue + s->queue_tail);
+    pthread_mutex_unlock(&s->queue_lock);
+
+    if (rec->type == QUEUE_ROTATE) {
+      if (s->writer_handle) {
+        lh_close(s->writer_handle);
+      }
+      s->writer_handle = rec->h;
+    } else if (s->writer_handle) {
+      lh_log(s->writer_handle, (uint8_t*)(rec + 1), rec->size, rec->type == QUEUE_LOG_QLOG);
+    }
+
+    pthread_mutex_lock(&s->queue_lock);
+    size_t len = QUEUE_RECORD_LEN(rec->size);
+    s->queue_tail = (s->queue_tail + len) % s->queue_size;
+    s->queue_used -= len;
+    s->queue_stats.depth_msgs--;
+    s->queue_stats.depth_bytes -= rec->size;
+    pthread_cond_broadcast(&s->queue_space_cv);
+  }
+  pthread_mutex_unlock(&s->queue_lock);
+
+  if (s->writer_handle) {
+    lh_close(s->writer_handle);
+    s->writer_handle = NULL;
+  }
+  return NULL;
+}
 
 static void log_sentinel(LoggerState *s, cereal::Sentinel::SentinelType type) {
   MessageBuilder msg;
@@ -24,7 +152,12 @@ static void log_sentinel(LoggerState *s, cereal::Sentinel::SentinelType type) {
   sen.setType(type);
   auto bytes = msg.toBytes();
 
-  logger_log(s, bytes.begin(), bytes.size(), true);
+  if (s->queue) {
+    // segment boundaries are never dropped
+    queue_push(s, QUEUE_LOG_QLOG, NULL, bytes.begin(), bytes.size(), true);
+  } else {
+    logger_log(s, bytes.begin(), bytes.size(), true);
+  }
 }
 
 static int mkpath(char* file_path) {
@@ -43,7 +176,10 @@ static int mkpath(char* file_path) {
   return 0;
 }
 
-void logger_init(LoggerState *s, const char* log_name, const uint8_t* init_data, size_t init_data_len, bool has_qlog) {
+static void* logger_opener_thread(void *arg);
+
+void logger_init(LoggerState *s, const char* log_name, const uint8_t* init_data, size_t init_data_len, bool has_qlog,
+                 size_t queue_size, LoggerQueuePolicy queue_policy) {
   memset(s, 0, sizeof(*s));
   if (init_data) {
     s->init_data = (uint8_t*)malloc(init_data_len);
@@ -55,9 +191,13 @@ void logger_init(LoggerState *s, const char* log_name, const uint8_t* init_data,
   umask(0);
 
   pthread_mutex_init(&s->lock, NULL);
+  for (int i=0; i<LOGGER_MAX_HANDLES; i++) {
+    pthread_mutex_init(&s->handles[i].lock, NULL);
+  }
 
   s->part = -1;
   s->has_qlog = has_qlog;
+  s->log_codec = s->qlog_codec = (LogCompressorConfig){.codec = LOG_CODEC_BZ2, .level = 9, .threads = 0};
 
   time_t rawtime = time(NULL);
   struct tm timeinfo;
@@ -66,84 +206,279 @@ void logger_init(LoggerState *s, const char* log_name, const uint8_t* init_data,
   strftime(s->route_name, sizeof(s->route_name),
            "%Y-%m-%d--%H-%M-%S", &timeinfo);
   snprintf(s->log_name, sizeof(s->log_name), "%s", log_name);
+
+  if (queue_size > 0) {
+    s->queue_size = (queue_size + QUEUE_ALIGN - 1) & ~(size_t)(QUEUE_ALIGN - 1);
+    s->queue = (uint8_t*)malloc(s->queue_size);
+    assert(s->queue);
+    s->queue_policy = queue_policy;
+    pthread_mutex_init(&s->queue_lock, NULL);
+    pthread_cond_init(&s->queue_cv, NULL);
+    pthread_cond_init(&s->queue_space_cv, NULL);
+    int err = pthread_create(&s->writer_thread, NULL, logger_writer_thread, s);
+    assert(err == 0);
+
+    pthread_cond_init(&s->opener_cv, NULL);
+    err = pthread_create(&s->opener_thread, NULL, logger_opener_thread, s);
+    assert(err == 0);
+    s->opener_started = true;
+  }
 }
 
-static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
-  int err;
+void logger_set_codec(LoggerState *s, const LogCompressorConfig* log_codec, const LogCompressorConfig* qlog_codec) {
+  pthread_mutex_lock(&s->lock);
+  s->log_codec = *log_codec;
+  s->qlog_codec = *qlog_codec;
+  if (s->next_state == NEXT_OPENING || s->next_state == NEXT_READY) {
+    // a segment opened ahead may have the old codec, it's reopened at the rotation
+    s->next_part = -1;
+  }
+  pthread_mutex_unlock(&s->lock);
+}
 
+// logMonoTime and the union member of an event, without copying it if it's aligned
+static bool event_info(const uint8_t* data, size_t data_size, uint64_t* mono_time, uint16_t* which) {
+  size_t words = data_size / sizeof(capnp::word);
+  if (words == 0) return false;
+
+  kj::Array<capnp::word> copy;
+  const capnp::word* ptr = (const capnp::word*)data;
+  if ((uintptr_t)data % alignof(capnp::word) != 0) {
+    copy = kj::heapArray<capnp::word>(words);
+    memcpy(copy.begin(), data, words * sizeof(capnp::word));
+    ptr = copy.begin();
+  }
+  capnp::FlatArrayMessageReader msg(kj::ArrayPtr<const capnp::word>(ptr, words));
+  cereal::Event::Reader event = msg.getRoot<cereal::Event>();
+  *mono_time = event.getLogMonoTime();
+  *which = (uint16_t)event.which();
+  return true;
+}
+
+static void index_init(LoggerIndex* idx, const char* log_path, LogCodec codec) {
+  memset(idx, 0, sizeof(*idx));
+  snprintf(idx->path, sizeof(idx->path), "%s.idx", log_path);
+  idx->codec = codec;
+}
+
+static LoggerIndexBlock* index_block(LoggerIndex* idx, uint32_t n) {
+  while (n >= idx->len) {
+    if (idx->len == idx->cap) {
+      uint32_t cap = idx->cap ? idx->cap * 2 : 64;
+      LoggerIndexBlock* blocks = (LoggerIndexBlock*)realloc(idx->blocks, cap * sizeof(LoggerIndexBlock));
+      if (blocks == NULL) return NULL;
+      idx->blocks = blocks;
+      idx->cap = cap;
+    }
+    LoggerIndexBlock* b = &idx->blocks[idx->len++];
+    memset(b, 0, sizeof(*b));
+    b->min_mono_time = UINT64_MAX;
+  }
+  return &idx->blocks[n];
+}
+
+static void index_event(LoggerIndex* idx, uint32_t block, uint64_t mono_time, uint16_t which) {
+  LoggerIndexBlock* b = index_block(idx, block);
+  if (b == NULL) return;
+  if (mono_time < b->min_mono_time) b->min_mono_time = mono_time;
+  if (mono_time > b->max_mono_time) b->max_mono_time = mono_time;
+  if (which < LOGGER_INDEX_SERVICE_WORDS * 64) b->services[which / 64] |= 1ULL << (which % 64);
+  b->events++;
+}
+
+// LogBlockCallback, blocks come in order
+static void index_block_done(void* ctx, uint64_t offset, uint64_t size, uint64_t raw_size) {
+  LoggerIndex* idx = (LoggerIndex*)ctx;
+  LoggerIndexBlock* b = index_block(idx, idx->done);
+  if (b == NULL) return;
+  b->offset = offset;
+  b->size = size;
+  b->raw_offset = idx->raw_offset;
+  b->raw_size = raw_size;
+  idx->raw_offset += raw_size;
+  idx->done++;
+}
+
+static void index_close(LoggerIndex* idx, bool write) {
+  if (write) {
+    FILE* f = fopen(idx->path, "wb");
+    if (f != NULL) {
+      LoggerIndexHeader header = {
+        .magic = LOGGER_INDEX_MAGIC,
+        .version = LOGGER_INDEX_VERSION,
+        .codec = (uint16_t)idx->codec,
+        .num_blocks = idx->done,
+        .block_len = sizeof(LoggerIndexBlock),
+      };
+      bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+      ok = ok && fwrite(idx->blocks, sizeof(LoggerIndexBlock), idx->done, f) == idx->done;
+      ok = (fclose(f) == 0) && ok;
+      if (!ok) LOGE("failed to write %s", idx->path);
+    } else {
+      LOGE("failed to open %s", idx->path);
+    }
+  }
+  free(idx->blocks);
+  idx->blocks = NULL;
+  idx->len = idx->cap = idx->done = 0;
+}
+
+static int log_indexed(LogCompressor* c, LoggerIndex* idx, const uint8_t* data, size_t data_size,
+                       bool has_info, uint64_t mono_time, uint16_t which) {
+  int err = log_compressor_write(c, data, data_size);
+  if (has_info) {
+    index_event(idx, log_compressor_block(c), mono_time, which);
+  }
+  return err;
+}
+
+// closes a handle that never got any messages and removes its segment again
+static void lh_discard(LoggerHandle* h) {
+  pthread_mutex_lock(&h->lock);
+  if (h->log_comp) {
+    log_compressor_close(h->log_comp);
+    h->log_comp = NULL;
+  }
+  if (h->qlog_comp) {
+    log_compressor_close(h->qlog_comp);
+    h->qlog_comp = NULL;
+  }
+  index_close(&h->log_index, false);
+  index_close(&h->qlog_index, false);
+  if (h->qlog_file) {
+    fclose(h->qlog_file);
+    h->qlog_file = NULL;
+    unlink(h->qlog_path);
+  }
+  if (h->log_file) {
+    fclose(h->log_file);
+    h->log_file = NULL;
+    unlink(h->log_path);
+  }
+  unlink(h->lock_path);
+  rmdir(h->segment_path);
+  h->refcnt = 0;
+  pthread_mutex_unlock(&h->lock);
+}
+
+static LoggerHandle* logger_open(LoggerState *s, const char* root_path, int part) {
   LoggerHandle *h = NULL;
-  for (int i=0; i<LOGGER_MAX_HANDLES; i++) {
+  LogCompressorConfig log_codec, qlog_codec;
+
+  // the handle is reserved under the lock, the slow part runs without it
+  pthread_mutex_lock(&s->lock);
+  for (int i=0; i<LOGGER_MAX_HANDLES && !h; i++) {
+    pthread_mutex_lock(&s->handles[i].lock);
     if (s->handles[i].refcnt == 0) {
       h = &s->handles[i];
-      break;
+      h->refcnt = 1;
     }
+    pthread_mutex_unlock(&s->handles[i].lock);
   }
+  log_codec = s->log_codec;
+  qlog_codec = s->qlog_codec;
+  pthread_mutex_unlock(&s->lock);
   assert(h);
 
   snprintf(h->segment_path, sizeof(h->segment_path),
-          "%s/%s--%d", root_path, s->route_name, s->part);
+          "%s/%s--%d", root_path, s->route_name, part);
 
-  snprintf(h->log_path, sizeof(h->log_path), "%s/%s.bz2", h->segment_path, s->log_name);
-  snprintf(h->qlog_path, sizeof(h->qlog_path), "%s/qlog.bz2", h->segment_path);
+  snprintf(h->log_path, sizeof(h->log_path), "%s/%s.%s", h->segment_path, s->log_name, log_codec_ext(log_codec.codec));
+  snprintf(h->qlog_path, sizeof(h->qlog_path), "%s/qlog.%s", h->segment_path, log_codec_ext(qlog_codec.codec));
   snprintf(h->lock_path, sizeof(h->lock_path), "%s.lock", h->log_path);
 
-  err = mkpath(h->log_path);
-  if (err) return NULL;
+  FILE* lock_file = NULL;
+  if (mkpath(h->log_path) != 0) goto fail;
 
-  FILE* lock_file = fopen(h->lock_path, "wb");
-  if (lock_file == NULL) return NULL;
+  lock_file = fopen(h->lock_path, "wb");
+  if (lock_file == NULL) goto fail;
   fclose(lock_file);
 
-  h->log_file = fopen(h->log_path, "wb");
+  h->log_file = segment_file_open(h->log_path, LOGGER_LOG_PREALLOC);
   if (h->log_file == NULL) goto fail;
 
   if (s->has_qlog) {
-    h->qlog_file = fopen(h->qlog_path, "wb");
+    h->qlog_file = segment_file_open(h->qlog_path, LOGGER_QLOG_PREALLOC);
     if (h->qlog_file == NULL) goto fail;
   }
 
-  int bzerror;
-  h->bz_file = BZ2_bzWriteOpen(&bzerror, h->log_file, 9, 0, 30);
-  if (bzerror != BZ_OK) goto fail;
+  index_init(&h->log_index, h->log_path, log_codec.codec);
+  h->log_comp = log_compressor_open(h->log_file, &log_codec, LOGGER_INDEX_BLOCK_SIZE, index_block_done, &h->log_index);
+  if (h->log_comp == NULL) goto fail;
 
   if (s->has_qlog) {
-    h->bz_qlog = BZ2_bzWriteOpen(&bzerror, h->qlog_file, 9, 0, 30);
-    if (bzerror != BZ_OK) goto fail;
+    index_init(&h->qlog_index, h->qlog_path, qlog_codec.codec);
+    h->qlog_comp = log_compressor_open(h->qlog_file, &qlog_codec, LOGGER_INDEX_BLOCK_SIZE, index_block_done, &h->qlog_index);
+    if (h->qlog_comp == NULL) goto fail;
   }
 
   if (s->init_data) {
-    BZ2_bzWrite(&bzerror, h->bz_file, s->init_data, s->init_data_len);
-    if (bzerror != BZ_OK) goto fail;
+    uint64_t mono_time = 0;
+    uint16_t which = 0;
+    bool has_info = event_info(s->init_data, s->init_data_len, &mono_time, &which);
+    if (log_indexed(h->log_comp, &h->log_index, s->init_data, s->init_data_len, has_info, mono_time, which) != 0) goto fail;
 
     if (s->has_qlog) {
       // init data goes in the qlog too
-      BZ2_bzWrite(&bzerror, h->bz_qlog, s->init_data, s->init_data_len);
-      if (bzerror != BZ_OK) goto fail;
+      if (log_indexed(h->qlog_comp, &h->qlog_index, s->init_data, s->init_data_len, has_info, mono_time, which) != 0) goto fail;
     }
   }
 
-  pthread_mutex_init(&h->lock, NULL);
-  h->refcnt++;
   return h;
 fail:
   LOGE("logger failed to open files");
-  if (h->bz_file) {
-    BZ2_bzWriteClose(&bzerror, h->bz_file, 0, NULL, NULL);
-    h->bz_file = NULL;
-  }
-  if (h->bz_qlog) {
-    BZ2_bzWriteClose(&bzerror, h->bz_qlog, 0, NULL, NULL);
-    h->bz_qlog = NULL;
+  lh_discard(h);
+  return NULL;
+}
+
+// opens the segment after the current one while it's still being written,
+// so logger_next only has to swap handles
+static void* logger_opener_thread(void *arg) {
+  LoggerState *s = (LoggerState*)arg;
+  set_thread_name("loggerd_opener");
+
+  pthread_mutex_lock(&s->lock);
+  while (true) {
+    while (s->next_state != NEXT_WANTED && !s->opener_exit) {
+      pthread_cond_wait(&s->opener_cv, &s->lock);
+    }
+    if (s->opener_exit) break;
+
+    s->next_state = NEXT_OPENING;
+    int part = s->next_part;
+    char root_path[sizeof(s->next_root)];
+    snprintf(root_path, sizeof(root_path), "%s", s->next_root);
+    pthread_mutex_unlock(&s->lock);
+
+    LoggerHandle* h = logger_open(s, root_path, part);
+
+    pthread_mutex_lock(&s->lock);
+    s->next_handle = h;
+    s->next_state = NEXT_READY;
+    pthread_cond_broadcast(&s->opener_cv);
   }
-  if (h->qlog_file) {
-    fclose(h->qlog_file);
-    h->qlog_file = NULL;
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+// the opened handle for part in root_path if there is one, called with the lock
+// held. One that was opened for anything else goes in stale.
+static LoggerHandle* take_next(LoggerState *s, const char* root_path, int part, LoggerHandle** stale) {
+  while (s->next_state == NEXT_OPENING) {
+    pthread_cond_wait(&s->opener_cv, &s->lock);
   }
-  if (h->log_file) {
-    fclose(h->log_file);
-    h->log_file = NULL;
+
+  LoggerHandle* h = NULL;
+  if (s->next_state == NEXT_READY && s->next_handle) {
+    if (s->next_part == part && strcmp(s->next_root, root_path) == 0) {
+      h = s->next_handle;
+    } else {
+      *stale = s->next_handle;
+    }
   }
-  return NULL;
+  s->next_state = NEXT_NONE;
+  s->next_handle = NULL;
+  return h;
 }
 
 int logger_next(LoggerState *s, const char* root_path,
@@ -153,28 +488,50 @@ int logger_next(LoggerState *s, const char* root_path,
   if (!is_start_of_route) log_sentinel(s, cereal::Sentinel::SentinelType::END_OF_SEGMENT);
 
   pthread_mutex_lock(&s->lock);
-  s->part++;
+  int part = ++s->part;
+  LoggerHandle* stale = NULL;
+  LoggerHandle* next_h = s->opener_started ? take_next(s, root_path, part, &stale) : NULL;
+  pthread_mutex_unlock(&s->lock);
 
-  LoggerHandle* next_h = logger_open(s, root_path);
+  if (stale) {
+    lh_discard(stale);
+  }
   if (!next_h) {
-    pthread_mutex_unlock(&s->lock);
-    return -1;
+    // nothing opened ahead, the first segment or the opener was too slow
+    next_h = logger_open(s, root_path, part);
+    if (!next_h) return -1;
   }
 
-  if (s->cur_handle) {
-    lh_close(s->cur_handle);
-  }
+  pthread_mutex_lock(&s->lock);
+  LoggerHandle* prev_h = s->cur_handle;
   s->cur_handle = next_h;
 
+  if (s->opener_started) {
+    s->next_part = part + 1;
+    snprintf(s->next_root, sizeof(s->next_root), "%s", root_path);
+    s->next_state = NEXT_WANTED;
+    pthread_cond_signal(&s->opener_cv);
+  }
+
   if (out_segment_path) {
     snprintf(out_segment_path, out_segment_path_len, "%s", next_h->segment_path);
   }
   if (out_part) {
-    *out_part = s->part;
+    *out_part = part;
   }
 
   pthread_mutex_unlock(&s->lock);
 
+  // The marker can wait for room in a full queue, so it's pushed without the
+  // lock the encoders take in logger_get_handle. Only this thread logs, nothing
+  // is queued between the swap and the marker.
+  if (s->queue) {
+    // the writer closes the old handle once it's done with what was queued for it
+    queue_push(s, QUEUE_ROTATE, next_h, NULL, 0, true);
+  } else if (prev_h) {
+    lh_close(prev_h);
+  }
+
   log_sentinel(s, is_start_of_route ? cereal::Sentinel::SentinelType::START_OF_ROUTE : cereal::Sentinel::SentinelType::START_OF_SEGMENT);
   return 0;
 }
@@ -192,6 +549,11 @@ LoggerHandle* logger_get_handle(LoggerState *s) {
 }
 
 void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog) {
+  if (s->queue) {
+    queue_push(s, in_qlog ? QUEUE_LOG_QLOG : QUEUE_LOG, NULL, data, data_size, s->queue_policy == LOGGER_QUEUE_BLOCK);
+    return;
+  }
+
   pthread_mutex_lock(&s->lock);
   if (s->cur_handle) {
     lh_log(s->cur_handle, data, data_size, in_qlog);
@@ -200,24 +562,80 @@ void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog) {
 }
 
 void logger_close(LoggerState *s) {
+  if (s->opener_started) {
+    pthread_mutex_lock(&s->lock);
+    s->opener_exit = true;
+    pthread_cond_signal(&s->opener_cv);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->opener_thread, NULL);
+    pthread_cond_destroy(&s->opener_cv);
+    s->opener_started = false;
+
+    // the segment opened ahead was never used
+    if (s->next_handle) {
+      lh_discard(s->next_handle);
+      s->next_handle = NULL;
+    }
+  }
+
   log_sentinel(s, cereal::Sentinel::SentinelType::END_OF_ROUTE);
 
+  bool queued = s->queue != NULL;
+  if (queued) {
+    // the writer drains the queue and closes the last handle before it exits
+    pthread_mutex_lock(&s->queue_lock);
+    s->queue_exit = true;
+    pthread_cond_signal(&s->queue_cv);
+    pthread_cond_broadcast(&s->queue_space_cv);
+    pthread_mutex_unlock(&s->queue_lock);
+    pthread_join(s->writer_thread, NULL);
+
+    free(s->queue);
+    s->queue = NULL;
+    pthread_cond_destroy(&s->queue_space_cv);
+    pthread_cond_destroy(&s->queue_cv);
+    pthread_mutex_destroy(&s->queue_lock);
+  }
+
   pthread_mutex_lock(&s->lock);
   free(s->init_data);
-  if (s->cur_handle) {
+  if (s->cur_handle && !queued) {
     lh_close(s->cur_handle);
   }
   pthread_mutex_unlock(&s->lock);
+
+  for (int i=0; i<LOGGER_MAX_HANDLES; i++) {
+    pthread_mutex_destroy(&s->handles[i].lock);
+  }
+}
+
+void logger_queue_stats(LoggerState *s, LoggerQueueStats *stats, bool reset) {
+  if (!s->queue) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+
+  pthread_mutex_lock(&s->queue_lock);
+  *stats = s->queue_stats;
+  if (reset) {
+    LoggerQueueStats *st = &s->queue_stats;
+    st->msgs = st->bytes = 0;
+    st->dropped_msgs = st->dropped_bytes = 0;
+    st->max_depth_bytes = st->depth_bytes;
+  }
+  pthread_mutex_unlock(&s->queue_lock);
 }
 
 void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog) {
   pthread_mutex_lock(&h->lock);
   assert(h->refcnt > 0);
-  int bzerror;
-  BZ2_bzWrite(&bzerror, h->bz_file, data, data_size);
+  uint64_t mono_time = 0;
+  uint16_t which = 0;
+  bool has_info = event_info(data, data_size, &mono_time, &which);
+  log_indexed(h->log_comp, &h->log_index, data, data_size, has_info, mono_time, which);
 
-  if (in_qlog && h->bz_qlog != NULL) {
-    BZ2_bzWrite(&bzerror, h->bz_qlog, data, data_size);
+  if (in_qlog && h->qlog_comp != NULL) {
+    log_indexed(h->qlog_comp, &h->qlog_index, data, data_size, has_info, mono_time, which);
   }
   pthread_mutex_unlock(&h->lock);
 }
@@ -227,15 +645,16 @@ void lh_close(LoggerHandle* h) {
   assert(h->refcnt > 0);
   h->refcnt--;
   if (h->refcnt == 0) {
-    if (h->bz_file){
-      int bzerror;
-      BZ2_bzWriteClose(&bzerror, h->bz_file, 0, NULL, NULL);
-      h->bz_file = NULL;
+    // the last blocks are reported on close, the index is written after them
+    if (h->log_comp) {
+      if (log_compressor_close(h->log_comp) != 0) LOGE("failed to write %s", h->log_path);
+      h->log_comp = NULL;
+      index_close(&h->log_index, true);
     }
-    if (h->bz_qlog){
-      int bzerror;
-      BZ2_bzWriteClose(&bzerror, h->bz_qlog, 0, NULL, NULL);
-      h->bz_qlog = NULL;
+    if (h->qlog_comp) {
+      if (log_compressor_close(h->qlog_comp) != 0) LOGE("failed to write %s", h->qlog_path);
+      h->qlog_comp = NULL;
+      index_close(&h->qlog_index, true);
     }
     if (h->qlog_file) {
       fclose(h->qlog_file);
@@ -244,9 +663,6 @@ void lh_close(LoggerHandle* h) {
     fclose(h->log_file);
     h->log_file = NULL;
     unlink(h->lock_path);
-    pthread_mutex_unlock(&h->lock);
-    pthread_mutex_destroy(&h->lock);
-    return;
   }
   pthread_mutex_unlock(&h->lock);
 }
@@ -4,7 +4,8 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <pthread.h>
-#include <bzlib.h>
+
+#include "log_compressor.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -12,6 +13,58 @@ extern "C" {
 
 #define LOGGER_MAX_HANDLES 16
 
+// what logger_log does when the write-behind queue is full
+typedef enum LoggerQueuePolicy {
+  LOGGER_QUEUE_DROP,   // drop the message, the caller never waits on the writer
+  LOGGER_QUEUE_BLOCK,  // wait for the writer to make room
+} LoggerQueuePolicy;
+
+typedef struct LoggerQueueStats {
+  uint64_t msgs, bytes;                  // queued since the last reset
+  uint64_t dropped_msgs, dropped_bytes;  // didn't fit since the last reset
+  size_t depth_msgs, depth_bytes;        // waiting for the writer right now
+  size_t max_depth_bytes;                // high watermark since the last reset
+} LoggerQueueStats;
+
+// preallocated for a segment's compressed logs, trimmed to what was written on close
+#define LOGGER_LOG_PREALLOC (32*1024*1024)
+#define LOGGER_QLOG_PREALLOC (2*1024*1024)
+
+// Side-car index next to every log, <log>.idx: a LoggerIndexHeader followed
+// by one LoggerIndexBlock per compressed block, little endian. Each block
+// decodes on its own, so a reader can seek to the ones with the time range
+// or services it wants. Written when the log is closed.
+#define LOGGER_INDEX_MAGIC 0x5844494CU  // "LIDX"
+#define LOGGER_INDEX_VERSION 1
+#define LOGGER_INDEX_BLOCK_SIZE 900000  // of input, a level 9 bzip2 block like parallel bzip2 cuts
+#define LOGGER_INDEX_SERVICE_WORDS 4
+
+typedef struct LoggerIndexHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t codec;       // LogCodec
+  uint32_t num_blocks;
+  uint32_t block_len;   // sizeof(LoggerIndexBlock), newer fields go at the end
+} LoggerIndexHeader;
+
+typedef struct LoggerIndexBlock {
+  uint64_t offset, size;                  // in the compressed file
+  uint64_t raw_offset, raw_size;          // in the decompressed stream
+  uint64_t min_mono_time, max_mono_time;  // events aren't strictly in logMonoTime order
+  uint32_t events;
+  uint32_t reserved;
+  uint64_t services[LOGGER_INDEX_SERVICE_WORDS];  // bit n is set if Event::which() == n is in the block
+} LoggerIndexBlock;
+
+typedef struct LoggerIndex {
+  char path[4096];
+  LogCodec codec;
+  LoggerIndexBlock* blocks;
+  uint32_t len, cap;
+  uint32_t done;  // blocks the compressor has written out
+  uint64_t raw_offset;
+} LoggerIndex;
+
 typedef struct LoggerHandle {
   pthread_mutex_t lock;
   int refcnt;
@@ -19,11 +72,13 @@ typedef struct LoggerHandle {
   char log_path[4096];
   char lock_path[4096];
   FILE* log_file;
-  BZFILE* bz_file;
+  LogCompressor* log_comp;
+  LoggerIndex log_index;
 
   FILE* qlog_file;
   char qlog_path[4096];
-  BZFILE* bz_qlog;
+  LogCompressor* qlog_comp;
+  LoggerIndex qlog_index;
 } LoggerHandle;
 
 typedef struct LoggerState {
@@ -36,18 +91,50 @@ typedef struct LoggerState {
   char route_name[64];
   char log_name[64];
   bool has_qlog;
+  LogCompressorConfig log_codec, qlog_codec;
 
   LoggerHandle handles[LOGGER_MAX_HANDLES];
   LoggerHandle* cur_handle;
+
+  // write-behind queue: logger_log only copies the message into a ring and
+  // the writer thread compresses it. NULL if everything is written inline.
+  uint8_t* queue;
+  size_t queue_size;
+  size_t queue_head, queue_tail, queue_used;
+  LoggerQueuePolicy queue_policy;
+  bool queue_exit;
+  pthread_mutex_t queue_lock;
+  pthread_cond_t queue_cv;        // writer waits for messages
+  pthread_cond_t queue_space_cv;  // blocked logger_log calls wait for room
+  pthread_t writer_thread;
+  LoggerHandle* writer_handle;    // lags behind cur_handle until the writer gets to the rotation
+  LoggerQueueStats queue_stats;
+
+  // with the queue, the opener thread opens the files and compressors of the
+  // next segment while the current one is written, logger_next only swaps
+  // handles. The fields below are under lock.
+  bool opener_started, opener_exit;
+  pthread_t opener_thread;
+  pthread_cond_t opener_cv;
+  int next_state;
+  int next_part;
+  char next_root[4096];
+  LoggerHandle* next_handle;
 } LoggerState;
 
-void logger_init(LoggerState *s, const char* log_name, const uint8_t* init_data, size_t init_data_len, bool has_qlog);
+// queue_size 0 compresses and writes in the calling thread and opens every
+// segment at its rotation
+void logger_init(LoggerState *s, const char* log_name, const uint8_t* init_data, size_t init_data_len, bool has_qlog,
+                 size_t queue_size, LoggerQueuePolicy queue_policy);
+// takes effect from the next segment on
+void logger_set_codec(LoggerState *s, const LogCompressorConfig* log_codec, const LogCompressorConfig* qlog_codec);
 int logger_next(LoggerState *s, const char* root_path,
                             char* out_segment_path, size_t out_segment_path_len,
                             int* out_part);
 LoggerHandle* logger_get_handle(LoggerState *s);
 void logger_close(LoggerState *s);
 void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog);
+void logger_queue_stats(LoggerState *s, LoggerQueueStats *stats, bool reset);
 
 void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog);
 void lh_close(LoggerHandle* h);
@@ -17,6 +17,7 @@
 #include <fstream>
 #include <streambuf>
 #include <thread>
+#include <deque>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
@@ -36,11 +37,12 @@
 #include "common/util.h"
 #include "camerad/cameras/camera_common.h"
 #include "logger.h"
+#include "segment_writer.h"
 #include "messaging.hpp"
 #include "services.h"
 
-#if !(defined(QCOM) || defined(QCOM2))
-// no encoder on PC
+#if !(defined(QCOM) || defined(QCOM2)) && !defined(ENCODER_SW)
+// no encoder on PC, unless it's built with the software one (scons --sw-encoder)
 #define DISABLE_ENCODER
 #endif
 
@@ -110,6 +112,8 @@ LogCameraInfo cameras_logged[LOG_CAMERA_ID_MAX] = {
 
 #define LOG_ROOT "/data/media/0/realdata"
 
+#define LOGGER_QUEUE_MB 64 // about a minute of uncompressed rlog
+
 #define RAW_CLIP_LENGTH 100 // 5 seconds at 20fps
 #define RAW_CLIP_FREQUENCY (randrange(61, 8*60)) // once every ~4 minutes
 
@@ -131,11 +135,10 @@ static void set_do_exit(int sig) {
 
 class RotateState {
 public:
-  SubSocket* fpkt_sock;
   uint32_t stream_frame_id, log_frame_id, last_rotate_frame_id;
   bool enabled, should_rotate, initialized;
 
-  RotateState() : fpkt_sock(nullptr), stream_frame_id(0), log_frame_id(0),
+  RotateState() : stream_frame_id(0), log_frame_id(0),
                   last_rotate_frame_id(UINT32_MAX), enabled(false), should_rotate(false), initialized(false) {};
 
   void waitLogThread() {
@@ -180,6 +183,54 @@ private:
   std::condition_variable cv;
 };
 
+// Lines the encoder threads up at a rotation. They rotate one after the other
+// in the order they started and wait for each other before and after closing
+// the old segment's files. Every wait returns once loggerd is exiting.
+class RotateBarrier {
+public:
+  void waitTurn(int idx) {
+    std::unique_lock<std::mutex> lk(lock);
+    cv.wait(lk, [&] { return turn == idx || do_exit; });
+  }
+
+  void passTurn(int num) {
+    std::unique_lock<std::mutex> lk(lock);
+    turn = (turn + 1) % num;
+    cv.notify_all();
+  }
+
+  // blocks until num threads arrived
+  void arrive(int num) {
+    std::unique_lock<std::mutex> lk(lock);
+    int gen = generation;
+    if (++arrived >= num) {
+      arrived = 0;
+      generation++;
+      cv.notify_all();
+      return;
+    }
+    cv.wait(lk, [&] { return gen != generation || do_exit; });
+  }
+
+  void cancelWait() {
+    std::unique_lock<std::mutex> lk(lock);
+    cv.notify_all();
+  }
+
+private:
+  int turn = 0, arrived = 0, generation = 0;
+  std::mutex lock;
+  std::condition_variable cv;
+};
+
+// what the main loop needs to know about a socket, resolved when subscribing
+struct SocketState {
+  SubSocket* sock;
+  int qlog_counter;  // the message goes in the qlog when this is 0
+  int qlog_freq;     // every qlog_freq-th message, -1 for none
+  int fpkt_id;       // camera it carries the frame packets of, -1 if none
+};
+
 struct LoggerdState {
   Context *ctx;
   LoggerState logger;
@@ -187,9 +238,7 @@ struct LoggerdState {
   int rotate_segment;
   pthread_mutex_t rotate_lock;
   int num_encoder;
-  std::atomic<int> rotate_seq_id;
-  std::atomic<int> should_close;
-  std::atomic<int> finish_close;
+  RotateBarrier rotate_barrier;
 
   RotateState rotate_state[LOG_CAMERA_ID_MAX-1];
 };
@@ -236,7 +285,9 @@ void encoder_thread(RotateState *rotate_state, bool raw_clips, int cam_idx) {
 
   while (!do_exit) {
     VisionStreamBufs buf_info;
-    int err = visionstream_init(&stream, cameras_logged[cam_idx].stream_type, false, &buf_info);
+    // the raw logger's queue holds buffers of the stream
+    int err = visionstream_init2(&stream, cameras_logged[cam_idx].stream_type, false,
+                                 raw_clips ? RAW_LOGGER_QUEUE : 0, &buf_info);
     if (err != 0) {
       LOGD("visionstream connect fail");
       usleep(100000);
@@ -270,9 +321,11 @@ void encoder_thread(RotateState *rotate_state, bool raw_clips, int cam_idx) {
     double rawlogger_start_time = seconds_since_boot()+RAW_CLIP_FREQUENCY;
     int rawlogger_clip_cnt = 0;
     RawLogger *rawlogger = NULL;
+    // frame ids of the frames queued on the rawlogger, in order
+    std::deque<uint32_t> raw_frame_ids;
 
     if (raw_clips) {
-      rawlogger = new RawLogger("prcamera", buf_info.width, buf_info.height, MAIN_FPS);
+      rawlogger = new RawLogger("prcamera", buf_info.width, buf_info.height, MAIN_FPS, &stream);
     }
 
     while (!do_exit) {
@@ -304,10 +357,10 @@ void encoder_thread(RotateState *rotate_state, bool raw_clips, int cam_idx) {
             rotate_state->last_rotate_frame_id = extra.frame_id - 1;
             rotate_state->initialized = true;
           }
-          while (s.rotate_seq_id != my_idx && !do_exit) { usleep(1000); }
+          s.rotate_barrier.waitTurn(my_idx);
           LOGW("camera %d rotate encoder to %s.", cam_idx, s.segment_path);
           encoder_rotate(&encoder, s.segment_path, s.rotate_segment);
-          s.rotate_seq_id = (my_idx + 1) % s.num_encoder;
+          s.rotate_barrier.passTurn(s.num_encoder);
           if (has_encoder_alt) {
             encoder_rotate(&encoder_alt, s.segment_path, s.rotate_segment);
           }
@@ -320,15 +373,9 @@ void encoder_thread(RotateState *rotate_state, bool raw_clips, int cam_idx) {
           }
           lh = logger_get_handle(&s.logger);
 
-          pthread_mutex_lock(&s.rotate_lock);
-          s.should_close += 1;
-          pthread_mutex_unlock(&s.rotate_lock);
-
-          while(s.should_close > 0 && s.should_close < s.num_encoder && !do_exit) { usleep(1000); }
+          s.rotate_barrier.arrive(s.num_encoder);
 
           pthread_mutex_lock(&s.rotate_lock);
-          s.should_close = s.should_close == s.num_encoder ? 1 - s.num_encoder : s.should_close + 1;
-
           encoder_close(&encoder);
           encoder_open(&encoder, encoder.next_path);
           encoder.segment = encoder.next_segment;
@@ -339,11 +386,9 @@ void encoder_thread(RotateState *rotate_state, bool raw_clips, int cam_idx) {
             encoder_alt.segment = encoder_alt.next_segment;
             encoder_alt.rotating = false;
           }
-          s.finish_close += 1;
           pthread_mutex_unlock(&s.rotate_lock);
 
-          while(s.finish_close > 0 && s.finish_close < s.num_encoder && !do_exit) { usleep(1000); }
-          s.finish_close = 0;
+          s.rotate_barrier.arrive(s.num_encoder);
 
           rotate_state->finish_rotate();
         }
@@ -398,26 +443,14 @@ void encoder_thread(RotateState *rotate_state, bool raw_clips, int cam_idx) {
         if (ts > rawlogger_start_time) {
           // encode raw if in clip
           int out_segment = -1;
-          int out_id = rawlogger->LogFrame(cnt, y, u, v, &out_segment);
+          if (rawlogger->LogFrame(cnt, y, u, v, &out_segment) >= 0) {
+            raw_frame_ids.push_back(extra.frame_id);
+          }
 
           if (rawlogger_clip_cnt == 0) {
             LOG("starting raw clip in seg %d", out_segment);
           }
 
-          // publish encode index
-          MessageBuilder msg;
-          auto eidx = msg.initEvent().initEncodeIdx();
-          eidx.setFrameId(extra.frame_id);
-          eidx.setType(cereal::EncodeIndex::Type::FULL_LOSSLESS_CLIP);
-          eidx.setEncodeId(cnt);
-          eidx.setSegmentNum(out_segment);
-          eidx.setSegmentId(out_id);
-
-          auto bytes = msg.toBytes();
-          if (lh) {
-            lh_log(lh, bytes.begin(), bytes.size(), false);
-          }
-
           // close rawlogger if clip ended
           rawlogger_clip_cnt++;
           if (rawlogger_clip_cnt >= RAW_CLIP_LENGTH) {
@@ -426,7 +459,32 @@ void encoder_thread(RotateState *rotate_state, bool raw_clips, int cam_idx) {
             rawlogger_clip_cnt = 0;
             rawlogger_start_time = ts+RAW_CLIP_FREQUENCY;
 
-            LOG("ending raw clip in seg %d, next in %.1f sec", out_segment, rawlogger_start_time-ts);
+            RawLogger::Stats raw_stats = rawlogger->GetStats();
+            LOG("ending raw clip in seg %d, next in %.1f sec, %llu frames %llu dropped %llu failed in total",
+                out_segment, rawlogger_start_time-ts,
+                (unsigned long long)raw_stats.frames, (unsigned long long)raw_stats.dropped,
+                (unsigned long long)raw_stats.failed);
+          }
+        }
+
+        // publish encode index once the frame is written, a dropped or failed frame isn't in the clip
+        for (const RawLogger::Encoded &e : rawlogger->TakeEncoded()) {
+          assert(!raw_frame_ids.empty());
+          uint32_t frame_id = raw_frame_ids.front();
+          raw_frame_ids.pop_front();
+          if (e.segment_id < 0) continue;
+
+          MessageBuilder msg;
+          auto eidx = msg.initEvent().initEncodeIdx();
+          eidx.setFrameId(frame_id);
+          eidx.setType(cereal::EncodeIndex::Type::FULL_LOSSLESS_CLIP);
+          eidx.setEncodeId(e.ts);
+          eidx.setSegmentNum(e.segment);
+          eidx.setSegmentId(e.segment_id);
+
+          auto bytes = msg.toBytes();
+          if (lh) {
+            lh_log(lh, bytes.begin(), bytes.size(), false);
           }
         }
       }
@@ -566,7 +624,7 @@ static void bootlog() {
   {
     auto words = gen_init_data();
     auto bytes = words.asBytes();
-    logger_init(&s.logger, "bootlog", bytes.begin(), bytes.size(), false);
+    logger_init(&s.logger, "bootlog", bytes.begin(), bytes.size(), false, 0, LOGGER_QUEUE_DROP);
   }
 
   err = logger_next(&s.logger, LOG_ROOT, s.segment_path, sizeof(s.segment_path), &s.rotate_segment);
@@ -611,6 +669,10 @@ int main(int argc, char** argv) {
   if (getenv("LOGGERD_TEST")) {
     segment_length = atoi(getenv("LOGGERD_SEGMENT_LENGTH"));
   }
+  // compression runs behind a queue so polling never waits on it, by default
+  // whatever doesn't fit is dropped and counted instead of lapping the msgq rings
+  size_t queue_mb = getenv("LOGGERD_QUEUE_MB") ? atoi(getenv("LOGGERD_QUEUE_MB")) : LOGGER_QUEUE_MB;
+  LoggerQueuePolicy queue_policy = getenv("LOGGERD_QUEUE_BLOCK") ? LOGGER_QUEUE_BLOCK : LOGGER_QUEUE_DROP;
   bool record_front = true;
 #ifndef QCOM2
   record_front = Params().read_db_bool("RecordFront");
@@ -626,10 +688,8 @@ int main(int argc, char** argv) {
 
   // subscribe to all services
 
-  std::vector<SubSocket*> socks;
-
-  std::map<SubSocket*, int> qlog_counter;
-  std::map<SubSocket*, int> qlog_freqs;
+  // in the order they're registered with the poller
+  std::vector<SocketState> socks;
 
   for (const auto& it : services) {
     std::string name = it.name;
@@ -638,35 +698,57 @@ int main(int argc, char** argv) {
       SubSocket * sock = SubSocket::create(s.ctx, name);
       assert(sock != NULL);
       poller->registerSocket(sock);
-      socks.push_back(sock);
 
+      SocketState ss = {
+        .sock = sock,
+        .qlog_counter = (it.decimation == -1) ? -1 : 0,
+        .qlog_freq = it.decimation,
+        .fpkt_id = -1,
+      };
       for (int cid=0;cid<=MAX_CAM_IDX;cid++) {
-        if (name == cameras_logged[cid].frame_packet_name) { s.rotate_state[cid].fpkt_sock = sock; }
+        if (name == cameras_logged[cid].frame_packet_name) { ss.fpkt_id = cid; }
       }
-
-      qlog_counter[sock] = (it.decimation == -1) ? -1 : 0;
-      qlog_freqs[sock] = it.decimation;
+      socks.push_back(ss);
     }
   }
 
   {
     auto words = gen_init_data();
     auto bytes = words.asBytes();
-    logger_init(&s.logger, "rlog", bytes.begin(), bytes.size(), true);
+    logger_init(&s.logger, "rlog", bytes.begin(), bytes.size(), true, queue_mb * 1024 * 1024, queue_policy);
   }
 
-  s.rotate_seq_id = 0;
-  s.should_close = 0;
-  s.finish_close = 0;
+  // e.g. LOGGERD_RLOG_CODEC=zstd:3:2 (codec:level:threads), bz2 level 9 by default.
+  // The rlog is compressed in blocks on every core, the qlog is too small to bother.
+  LogCompressorConfig rlog_codec = s.logger.log_codec, qlog_codec = s.logger.qlog_codec;
+  rlog_codec.threads = -1;
+  const char* rlog_codec_env = getenv("LOGGERD_RLOG_CODEC");
+  const char* qlog_codec_env = getenv("LOGGERD_QLOG_CODEC");
+  if (rlog_codec_env && !log_codec_parse(rlog_codec_env, &rlog_codec)) {
+    LOGE("unsupported rlog codec %s, using bz2", rlog_codec_env);
+  }
+  if (qlog_codec_env && !log_codec_parse(qlog_codec_env, &qlog_codec)) {
+    LOGE("unsupported qlog codec %s, using bz2", qlog_codec_env);
+  }
+  logger_set_codec(&s.logger, &rlog_codec, &qlog_codec);
+
   s.num_encoder = 0;
   pthread_mutex_init(&s.rotate_lock, NULL);
 #ifndef DISABLE_ENCODER
+  bool record_video = true;
+#ifdef ENCODER_SW
+  // software encoding takes a few cores, a PC only records video when asked to
+  record_video = getenv("LOGGERD_SW_ENCODER") != NULL;
+#endif
   // rear camera
-  std::thread encoder_thread_handle(encoder_thread, &s.rotate_state[LOG_CAMERA_ID_FCAMERA], false, LOG_CAMERA_ID_FCAMERA);
-  s.rotate_state[LOG_CAMERA_ID_FCAMERA].enabled = true;
+  std::thread encoder_thread_handle;
+  if (record_video) {
+    encoder_thread_handle = std::thread(encoder_thread, &s.rotate_state[LOG_CAMERA_ID_FCAMERA], false, LOG_CAMERA_ID_FCAMERA);
+    s.rotate_state[LOG_CAMERA_ID_FCAMERA].enabled = true;
+  }
   // front camera
   std::thread front_encoder_thread_handle;
-  if (record_front) {
+  if (record_video && record_front) {
     front_encoder_thread_handle = std::thread(encoder_thread, &s.rotate_state[LOG_CAMERA_ID_DCAMERA], false, LOG_CAMERA_ID_DCAMERA);
     s.rotate_state[LOG_CAMERA_ID_DCAMERA].enabled = true;
   }
@@ -685,7 +767,14 @@ int main(int argc, char** argv) {
   double last_rotate_tms = millis_since_boot();
   double last_camera_seen_tms = millis_since_boot();
   while (!do_exit) {
+   // the poller returns the ready sockets in the order they were registered,
+   // so they're found by moving a cursor along socks instead of a lookup
+   size_t cur = 0;
    for (auto sock : poller->poll(100 * 1000)) {
+     for (size_t n = 0; socks[cur].sock != sock && n < socks.size(); n++) {
+       cur = (cur + 1) % socks.size();
+     }
+     SocketState &ss = socks[cur];
      Message * last_msg = nullptr;
       while (true) {
         Message * msg = sock->receive(true);
@@ -695,22 +784,17 @@ int main(int argc, char** argv) {
         delete last_msg;
         last_msg = msg;
 
-        logger_log(&s.logger, (uint8_t*)msg->getData(), msg->getSize(), qlog_counter[sock] == 0);
+        logger_log(&s.logger, (uint8_t*)msg->getData(), msg->getSize(), ss.qlog_counter == 0);
 
-        if (qlog_counter[sock] != -1) {
-          //printf("%p: %d/%d\n", socks[i], qlog_counter[socks[i]], qlog_freqs[socks[i]]);
-          qlog_counter[sock]++;
-          qlog_counter[sock] %= qlog_freqs[sock];
+        if (ss.qlog_counter != -1) {
+          if (++ss.qlog_counter == ss.qlog_freq) ss.qlog_counter = 0;
         }
         bytes_count += msg->getSize();
         msg_count++;
       }
 
       if (last_msg) {
-        int fpkt_id = -1;
-        for (int cid=0;cid<=MAX_CAM_IDX;cid++) {
-          if (sock == s.rotate_state[cid].fpkt_sock) {fpkt_id=cid; break;}
-        }
+        int fpkt_id = ss.fpkt_id;
         if (fpkt_id>=0) {
           // track camera frames to sync to encoder
           // only process last frame
@@ -773,6 +857,21 @@ int main(int argc, char** argv) {
       if (s.logger.part == 0) { LOGW("logging to %s", s.segment_path); }
       LOGW("rotated to %s", s.segment_path);
 
+      LoggerQueueStats qs;
+      logger_queue_stats(&s.logger, &qs, true);
+      if (qs.dropped_msgs > 0) {
+        LOGE("logger queue dropped %" PRIu64 " messages, %" PRIu64 " bytes", qs.dropped_msgs, qs.dropped_bytes);
+      }
+      LOGW("logger queue: %" PRIu64 " messages, %" PRIu64 " bytes, depth %zu messages %zu bytes, max %zu bytes",
+           qs.msgs, qs.bytes, qs.depth_msgs, qs.depth_bytes, qs.max_depth_bytes);
+
+      SegmentWriterStats ws;
+      segment_writer_stats(&ws, true);
+      LOGW("segment writes: %" PRIu64 " bytes, %" PRIu64 " direct %" PRIu64 " buffered files, "
+           "chunk latency p50 < %" PRIu64 " us, p99 < %" PRIu64 " us, max %" PRIu64 " us",
+           ws.bytes, ws.direct_files, ws.buffered_files, latency_hist_percentile(&ws.latency, 0.5),
+           latency_hist_percentile(&ws.latency, 0.99), ws.latency.max_us);
+
       // rotate the encoders
       for (int cid=0;cid<=MAX_CAM_IDX;cid++) { s.rotate_state[cid].rotate(); }
       pthread_mutex_unlock(&s.rotate_lock);
@@ -785,22 +884,25 @@ int main(int argc, char** argv) {
 
   LOGW("joining threads");
   for (int cid=0;cid<=MAX_CAM_IDX;cid++) { s.rotate_state[cid].cancelWait(); }
+  s.rotate_barrier.cancelWait();
 
 #ifndef DISABLE_ENCODER
 #ifdef QCOM2
   wide_encoder_thread_handle.join();
 #endif
-  if (record_front) {
+  if (front_encoder_thread_handle.joinable()) {
     front_encoder_thread_handle.join();
   }
-  encoder_thread_handle.join();
+  if (encoder_thread_handle.joinable()) {
+    encoder_thread_handle.join();
+  }
   LOGW("encoder joined");
 #endif
 
   logger_close(&s.logger);
 
-  for (auto s : socks){
-    delete s;
+  for (auto &ss : socks){
+    delete ss.sock;
   }
 
   delete poller;
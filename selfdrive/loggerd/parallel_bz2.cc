@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <bzlib.h>
+
+#include "common/util.h"
+
+#include "parallel_bz2.h"
+
+// below the rest of loggerd, the workers get what's left of the cpu
+#define PARALLEL_BZ2_NICE 10
+
+enum {
+  BLOCK_FREE,     // the writer fills it
+  BLOCK_PENDING,  // waiting for a worker
+  BLOCK_BUSY,     // a worker compresses it
+  BLOCK_DONE,     // waiting to be written in order
+};
+
+typedef struct Bz2Block {
+  int state;
+  uint8_t* in;
+  size_t in_len, in_cap;
+  char* out;
+  unsigned int out_len, out_cap;
+  bool error;
+} Bz2Block;
+
+struct ParallelBz2 {
+  FILE* f;
+  int level;
+  size_t block_size;
+  bool error;
+
+  void (*block_cb)(void* ctx, uint64_t offset, uint64_t size, uint64_t raw_size);
+  void* block_ctx;
+  uint64_t written;
+  uint32_t submitted;
+
+  // ring of blocks, head is the oldest of the queued ones that aren't written
+  // yet and fill the one being filled. Only the writer moves head and fill.
+  Bz2Block* blocks;
+  int num_blocks;
+  int head, fill, queued;
+
+  pthread_t* workers;
+  int num_workers;
+  bool exit;
+  pthread_mutex_t lock;
+  pthread_cond_t work_cv;  // a block is pending or the workers should exit
+  pthread_cond_t done_cv;  // a block is done
+};
+
+static void* worker_thread(void* arg) {
+  ParallelBz2* p = (ParallelBz2*)arg;
+  set_thread_name("loggerd_bz2");
+#ifdef __linux__
+  // on linux the nice value is per thread
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), PARALLEL_BZ2_NICE);
+#endif
+
+  pthread_mutex_lock(&p->lock);
+  while (true) {
+    // oldest pending block first, the writer waits on it
+    Bz2Block* b = NULL;
+    for (int i = 0; i < p->num_blocks && b == NULL; i++) {
+      Bz2Block* cand = &p->blocks[(p->head + i) % p->num_blocks];
+      if (cand->state == BLOCK_PENDING) b = cand;
+    }
+    if (b == NULL) {
+      if (p->exit) break;
+      pthread_cond_wait(&p->work_cv, &p->lock);
+      continue;
+    }
+    b->state = BLOCK_BUSY;
+    pthread_mutex_unlock(&p->lock);
+
+    // worst case bzip2 growth is 1% plus 600 bytes
+    unsigned int cap = b->in_len + b->in_len / 100 + 600;
+    if (b->out_cap < cap) {
+      free(b->out);
+      b->out = (char*)malloc(cap);
+      b->out_cap = b->out ? cap : 0;
+    }
+    b->out_len = b->out_cap;
+    b->error = b->out == NULL ||
+               BZ2_bzBuffToBuffCompress(b->out, &b->out_len, (char*)b->in, b->in_len, p->level, 0, 30) != BZ_OK;
+
+    pthread_mutex_lock(&p->lock);
+    b->state = BLOCK_DONE;
+    pthread_cond_broadcast(&p->done_cv);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+// writes the finished blocks at the head in order, called with the lock held
+static void write_done(ParallelBz2* p) {
+  while (p->queued > 0 && p->blocks[p->head].state == BLOCK_DONE) {
+    Bz2Block* b = &p->blocks[p->head];
+    pthread_mutex_unlock(&p->lock);
+    if (b->error || fwrite(b->out, 1, b->out_len, p->f) != b->out_len) {
+      p->error = true;
+    }
+    if (p->block_cb) p->block_cb(p->block_ctx, p->written, b->out_len, b->in_len);
+    p->written += b->out_len;
+    pthread_mutex_lock(&p->lock);
+    b->in_len = 0;
+    b->state = BLOCK_FREE;
+    p->head = (p->head + 1) % p->num_blocks;
+    p->queued--;
+  }
+}
+
+// hands the block being filled to the workers and waits until the next one is free
+static void submit(ParallelBz2* p) {
+  pthread_mutex_lock(&p->lock);
+  p->blocks[p->fill].state = BLOCK_PENDING;
+  pthread_cond_signal(&p->work_cv);
+  p->fill = (p->fill + 1) % p->num_blocks;
+  p->queued++;
+  p->submitted++;
+
+  while (true) {
+    write_done(p);
+    if (p->blocks[p->fill].state == BLOCK_FREE) break;
+    pthread_cond_wait(&p->done_cv, &p->lock);
+  }
+  pthread_mutex_unlock(&p->lock);
+}
+
+ParallelBz2* parallel_bz2_open(FILE* f, int level, int threads,
+                               void (*block_cb)(void* ctx, uint64_t offset, uint64_t size, uint64_t raw_size), void* block_ctx) {
+  ParallelBz2* p = (ParallelBz2*)calloc(1, sizeof(ParallelBz2));
+  if (p == NULL) return NULL;
+  p->f = f;
+  p->block_cb = block_cb;
+  p->block_ctx = block_ctx;
+  p->level = (level >= 1 && level <= 9) ? level : 9;
+  p->block_size = p->level * 100000;
+
+  if (threads <= 0) {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) threads = 1;
+  }
+  // two blocks per worker keeps them busy while the writer fills the next one
+  p->num_workers = threads;
+  p->num_blocks = threads * 2 + 1;
+  p->blocks = (Bz2Block*)calloc(p->num_blocks, sizeof(Bz2Block));
+  p->workers = (pthread_t*)calloc(p->num_workers, sizeof(pthread_t));
+  if (p->blocks == NULL || p->workers == NULL) {
+    free(p->blocks);
+    free(p->workers);
+    free(p);
+    return NULL;
+  }
+
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->work_cv, NULL);
+  pthread_cond_init(&p->done_cv, NULL);
+  for (int i = 0; i < p->num_workers; i++) {
+    if (pthread_create(&p->workers[i], NULL, worker_thread, p) != 0) {
+      p->num_workers = i;
+      p->error = true;
+      parallel_bz2_close(p);
+      return NULL;
+    }
+  }
+  return p;
+}
+
+int parallel_bz2_write(ParallelBz2* p, const void* data, size_t size) {
+  Bz2Block* b = &p->blocks[p->fill];
+  if (b->in_len > 0 && b->in_len + size > p->block_size) {
+    submit(p);
+    b = &p->blocks[p->fill];
+  }
+
+  // a block only goes over the size for a single write bigger than it
+  size_t need = b->in_len + size;
+  if (need > b->in_cap) {
+    size_t cap = need > p->block_size ? need : p->block_size;
+    uint8_t* in = (uint8_t*)realloc(b->in, cap);
+    if (in == NULL) {
+      p->error = true;
+      return -1;
+    }
+    b->in = in;
+    b->in_cap = cap;
+  }
+  memcpy(b->in + b->in_len, data, size);
+  b->in_len += size;
+  return p->error ? -1 : 0;
+}
+
+uint32_t parallel_bz2_block(ParallelBz2* p) {
+  return p->submitted;
+}
+
+int parallel_bz2_close(ParallelBz2* p) {
+  if (p->blocks[p->fill].in_len > 0) {
+    submit(p);
+  }
+
+  pthread_mutex_lock(&p->lock);
+  while (true) {
+    write_done(p);
+    if (p->queued == 0) break;
+    pthread_cond_wait(&p->done_cv, &p->lock);
+  }
+  p->exit = true;
+  pthread_cond_broadcast(&p->work_cv);
+  pthread_mutex_unlock(&p->lock);
+
+  for (int i = 0; i < p->num_workers; i++) {
+    pthread_join(p->workers[i], NULL);
+  }
+  pthread_cond_destroy(&p->done_cv);
+  pthread_cond_destroy(&p->work_cv);
+  pthread_mutex_destroy(&p->lock);
+
+  int ret = p->error ? -1 : 0;
+  for (int i = 0; i < p->num_blocks; i++) {
+    free(p->blocks[i].in);
+    free(p->blocks[i].out);
+  }
+  free(p->blocks);
+  free(p->workers);
+  free(p);
+  return ret;
+}
@@ -0,0 +1,35 @@
+#ifndef PARALLEL_BZ2_H
+#define PARALLEL_BZ2_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// pbzip2-style bzip2 writer. The input is cut into blocks of level * 100 kB,
+// never in the middle of a write, and every block is compressed as its own
+// bzip2 stream on a pool of worker threads. The streams are written in order,
+// which is still a valid .bz2 file that bzip2 and python's bz2 read as one.
+//
+// The workers run niced, so they only take the cores nothing else wants.
+
+typedef struct ParallelBz2 ParallelBz2;
+
+// block_cb gets every stream once it's written, like LogBlockCallback in log_compressor.h
+ParallelBz2* parallel_bz2_open(FILE* f, int level, int threads,
+                               void (*block_cb)(void* ctx, uint64_t offset, uint64_t size, uint64_t raw_size), void* block_ctx);
+// data is kept together in one block, so each event can be decoded from its stream alone
+int parallel_bz2_write(ParallelBz2* p, const void* data, size_t size);
+// the block the last write went into, counting from 0
+uint32_t parallel_bz2_block(ParallelBz2* p);
+// waits for the workers, writes what's left and frees p, f is left open
+int parallel_bz2_close(ParallelBz2* p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -16,21 +16,22 @@ extern "C" {
 }
 
 #include "common/swaglog.h"
+#include "common/util.h"
 #include "common/utilpp.h"
 
 #include "raw_logger.h"
 
-RawLogger::RawLogger(const std::string &afilename, int awidth, int aheight, int afps)
+RawLogger::RawLogger(const std::string &afilename, int awidth, int aheight, int afps, VisionStream *astream)
   : filename(afilename),
     width(awidth),
     height(aheight),
-    fps(afps) {
+    fps(afps),
+    vision_stream(astream) {
 
   int err = 0;
 
   av_register_all();
-  codec = avcodec_find_encoder(AV_CODEC_ID_FFVHUFF);
-  // codec = avcodec_find_encoder(AV_CODEC_ID_FFV1);
+  codec = avcodec_find_encoder(AV_CODEC_ID_FFV1);
   assert(codec);
 
   codec_ctx = avcodec_alloc_context3(codec);
@@ -39,10 +40,14 @@ RawLogger::RawLogger(const std::string &afilename, int awidth, int aheight, int
   codec_ctx->height = height;
   codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
 
-  // codec_ctx->thread_count = 2;
+  // slices are coded in parallel, ffv1 only has them from version 3 on
+  codec_ctx->level = 3;
+  codec_ctx->slices = RAW_LOGGER_SLICES;
+  codec_ctx->thread_count = RAW_LOGGER_SLICES;
+  codec_ctx->thread_type = FF_THREAD_SLICE;
 
-  // ffv1enc doesn't respect AV_PICTURE_TYPE_I. make every frame a key frame for now.
-  // codec_ctx->gop_size = 0;
+  // ffv1enc doesn't respect AV_PICTURE_TYPE_I. make every frame a key frame.
+  codec_ctx->gop_size = 1;
 
   codec_ctx->time_base = (AVRational){ 1, fps };
 
@@ -57,19 +62,123 @@ RawLogger::RawLogger(const std::string &afilename, int awidth, int aheight, int
   frame->linesize[0] = width;
   frame->linesize[1] = width/2;
   frame->linesize[2] = width/2;
+
+  thread = std::thread(&RawLogger::Run, this);
 }
 
 RawLogger::~RawLogger() {
+  {
+    std::lock_guard<std::mutex> guard(queue_lock);
+    stopping = true;
+  }
+  queue_cv.notify_one();
+  // everything queued is still written
+  thread.join();
+  DoClose();
+
   av_frame_free(&frame);
   avcodec_close(codec_ctx);
   av_free(codec_ctx);
 }
 
+void RawLogger::Push(Cmd cmd) {
+  {
+    std::lock_guard<std::mutex> guard(queue_lock);
+    queue.push_back(std::move(cmd));
+  }
+  queue_cv.notify_one();
+}
+
 void RawLogger::Open(const std::string &path) {
-  int err = 0;
+  std::lock_guard<std::recursive_mutex> guard(lock);
+
+  Push({.type = Cmd::OPEN, .path = path});
+  is_open = true;
+}
 
+void RawLogger::Close() {
   std::lock_guard<std::recursive_mutex> guard(lock);
 
+  if (!is_open) return;
+
+  Push({.type = Cmd::CLOSE});
+  is_open = false;
+}
+
+int RawLogger::ProcessFrame(uint64_t ts, const uint8_t *y_ptr, const uint8_t *u_ptr, const uint8_t *v_ptr) {
+  {
+    std::lock_guard<std::mutex> guard(queue_lock);
+    if (queued_frames >= RAW_LOGGER_QUEUE) {
+      stats.dropped++;
+      return -1;
+    }
+    queued_frames++;
+    queue.push_back({.type = Cmd::FRAME, .ts = ts, .y_ptr = y_ptr, .u_ptr = u_ptr, .v_ptr = v_ptr,
+                     .buf_idx = visionstream_hold(vision_stream), .segment = segment});
+  }
+  queue_cv.notify_one();
+
+  // queued, the id comes from TakeEncoded once it's written
+  return 0;
+}
+
+RawLogger::Stats RawLogger::GetStats() {
+  std::lock_guard<std::mutex> guard(queue_lock);
+  return stats;
+}
+
+std::vector<RawLogger::Encoded> RawLogger::TakeEncoded() {
+  std::vector<Encoded> ret;
+  std::lock_guard<std::mutex> guard(queue_lock);
+  ret.swap(encoded);
+  return ret;
+}
+
+void RawLogger::Run() {
+  set_thread_name("loggerd_raw");
+
+  std::unique_lock<std::mutex> lk(queue_lock);
+  while (true) {
+    queue_cv.wait(lk, [&] { return stopping || !queue.empty(); });
+    if (queue.empty()) break;
+
+    Cmd cmd = std::move(queue.front());
+    queue.pop_front();
+    lk.unlock();
+
+    bool ok = true;
+    int segment_id = -1;
+    switch (cmd.type) {
+    case Cmd::OPEN:
+      DoClose();
+      DoOpen(cmd.path);
+      break;
+    case Cmd::CLOSE:
+      DoClose();
+      break;
+    case Cmd::FRAME:
+      segment_id = Encode(cmd);
+      ok = segment_id >= 0;
+      visionstream_release_buf(vision_stream, cmd.buf_idx);
+      break;
+    }
+
+    lk.lock();
+    if (cmd.type == Cmd::FRAME) {
+      queued_frames--;
+      encoded.push_back({.ts = cmd.ts, .segment = cmd.segment, .segment_id = segment_id});
+      if (ok) {
+        stats.frames++;
+      } else {
+        stats.failed++;
+      }
+    }
+  }
+}
+
+void RawLogger::DoOpen(const std::string &path) {
+  int err = 0;
+
   vid_path = util::string_format("%s/%s.mkv", path.c_str(), filename.c_str());
 
   // create camera lock file
@@ -101,16 +210,14 @@ void RawLogger::Open(const std::string &path) {
   err = avformat_write_header(format_ctx, NULL);
   assert(err >= 0);
 
-  is_open = true;
+  writing = true;
   counter = 0;
 }
 
-void RawLogger::Close() {
+void RawLogger::DoClose() {
   int err = 0;
 
-  std::lock_guard<std::recursive_mutex> guard(lock);
-
-  if (!is_open) return;
+  if (!writing) return;
 
   err = av_write_trailer(format_ctx);
   assert(err == 0);
@@ -124,10 +231,12 @@ void RawLogger::Close() {
   format_ctx = NULL;
 
   unlink(lock_path.c_str());
-  is_open = false;
+  writing = false;
 }
 
-int RawLogger::ProcessFrame(uint64_t ts, const uint8_t *y_ptr, const uint8_t *u_ptr, const uint8_t *v_ptr) {
+int RawLogger::Encode(const Cmd &cmd) {
+  if (!writing) return -1;
+
   int err = 0;
 
   AVPacket pkt;
@@ -135,10 +244,10 @@ int RawLogger::ProcessFrame(uint64_t ts, const uint8_t *y_ptr, const uint8_t *u_
   pkt.data = NULL;
   pkt.size = 0;
 
-  frame->data[0] = (uint8_t*)y_ptr;
-  frame->data[1] = (uint8_t*)u_ptr;
-  frame->data[2] = (uint8_t*)v_ptr;
-  frame->pts = ts;
+  frame->data[0] = (uint8_t*)cmd.y_ptr;
+  frame->data[1] = (uint8_t*)cmd.u_ptr;
+  frame->data[2] = (uint8_t*)cmd.v_ptr;
+  frame->pts = cmd.ts;
 
   int ret = counter;
 
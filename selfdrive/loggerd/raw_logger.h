@@ -6,6 +6,8 @@
 
 #include <string>
 #include <vector>
+#include <deque>
+#include <thread>
 #include <mutex>
 #include <condition_variable>
 
@@ -15,22 +17,80 @@ extern "C" {
 #include <libavformat/avformat.h>
 }
 
+#include "common/visionipc.h"
+
 #include "frame_logger.h"
 
+// ffv1 slices, it takes 4, 6, 9, 12...
+#define RAW_LOGGER_SLICES 4
+// frames waiting to be encoded, each one holds a buffer of the vision stream
+#define RAW_LOGGER_QUEUE 8
+
+// Encodes raw clips on its own thread, so the camera's encoder thread only
+// queues the frames. LogFrame takes the buffer visionstream_get last returned
+// on the stream and keeps it until it's encoded. When the queue is full the
+// frame is dropped and LogFrame returns -1.
+//
+// A queued frame only gets its id in the file once it's written, TakeEncoded
+// returns them in the order the frames were queued.
 class RawLogger : public FrameLogger {
 public:
-  RawLogger(const std::string &filename, int awidth, int aheight, int afps);
+  struct Stats {
+    uint64_t frames, dropped, failed;
+  };
+
+  struct Encoded {
+    uint64_t ts;      // what the frame was logged with
+    int segment;
+    int segment_id;   // -1 if it isn't in the clip
+  };
+
+  RawLogger(const std::string &filename, int awidth, int aheight, int afps, VisionStream *astream);
   ~RawLogger();
 
   int ProcessFrame(uint64_t ts, const uint8_t *y_ptr, const uint8_t *u_ptr, const uint8_t *v_ptr);
   void Open(const std::string &path);
   void Close();
 
+  // totals since the logger was created
+  Stats GetStats();
+  // the frames done since the last call
+  std::vector<Encoded> TakeEncoded();
+
 private:
+  struct Cmd {
+    enum Type { OPEN, CLOSE, FRAME } type;
+    std::string path;
+    uint64_t ts;
+    const uint8_t *y_ptr, *u_ptr, *v_ptr;
+    int buf_idx;
+    int segment;
+  };
+
+  void Push(Cmd cmd);
+  void Run();
+  void DoOpen(const std::string &path);
+  void DoClose();
+  // the frame's id in the file, -1 if it isn't written
+  int Encode(const Cmd &cmd);
+
   std::string filename;
   int width, height, fps;
-  int counter = 0;
+  VisionStream *vision_stream;
 
+  // the caller's side
+  std::mutex queue_lock;
+  std::condition_variable queue_cv;
+  std::deque<Cmd> queue;
+  int queued_frames = 0;
+  bool stopping = false;
+  Stats stats = {};
+  std::vector<Encoded> encoded;
+  std::thread thread;
+
+  // the thread's side
+  bool writing = false;
+  int counter = 0;
   AVCodec *codec = NULL;
   AVCodecContext *codec_ctx = NULL;
 
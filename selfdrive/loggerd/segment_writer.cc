@@ -0,0 +1,369 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <linux/falloc.h>
+#endif
+
+#include "common/timing.h"
+#include "common/util.h"
+
+#include "segment_writer.h"
+
+typedef struct SegmentWriter SegmentWriter;
+
+typedef struct Chunk {
+  uint8_t* data;
+  size_t len;
+  size_t carry;     // bytes at the start the chunk before already wrote
+  uint64_t offset;  // where data goes in the file, aligned
+  uint64_t since;   // when it got its first new byte
+  SegmentWriter* w;
+  struct Chunk* next;  // in the pool or the I/O queue
+} Chunk;
+
+struct SegmentWriter {
+  int fd;
+  bool direct;
+  bool error;
+  uint64_t size;  // what the caller wrote
+  int pending;    // chunks queued for the I/O thread
+
+  // the caller's side
+  Chunk* fill;  // being filled, NULL until there's something to write
+  // O_DIRECT writes whole blocks, the end of a chunk that doesn't fill its
+  // last block starts the next chunk and is written again with it
+  uint8_t tail[SEGMENT_WRITER_ALIGN];
+  size_t tail_len;
+  uint64_t next_offset;
+
+  // the I/O thread's side, the last chunk pushed through the page cache
+  uint64_t prev_offset, prev_len;
+};
+
+// one I/O thread and chunk pool for every file in the process
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_work_cv = PTHREAD_COND_INITIALIZER;  // a chunk is queued
+static pthread_cond_t io_done_cv = PTHREAD_COND_INITIALIZER;  // a chunk is back in the pool
+static bool io_running = false;
+static Chunk *io_head = NULL, *io_tail = NULL;
+static Chunk* pool = NULL;
+static int pool_allocated = 0;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static SegmentWriterStats stats;
+
+void latency_hist_add(LatencyHist* h, uint64_t us) {
+  int b = 0;
+  while (b < LATENCY_HIST_BUCKETS - 1 && us >= (1ULL << b)) b++;
+  h->buckets[b]++;
+  h->count++;
+  if (us > h->max_us) h->max_us = us;
+}
+
+uint64_t latency_hist_percentile(const LatencyHist* h, double p) {
+  if (h->count == 0) return 0;
+  uint64_t target = (uint64_t)ceil(p * h->count);
+  if (target == 0) target = 1;
+
+  uint64_t seen = 0;
+  for (int b = 0; b < LATENCY_HIST_BUCKETS - 1; b++) {
+    seen += h->buckets[b];
+    if (seen >= target) return 1ULL << b;
+  }
+  return h->max_us;
+}
+
+void segment_writer_stats(SegmentWriterStats* out, bool reset) {
+  pthread_mutex_lock(&stats_lock);
+  *out = stats;
+  if (reset) memset(&stats, 0, sizeof(stats));
+  pthread_mutex_unlock(&stats_lock);
+}
+
+// called on the I/O thread only
+static bool write_chunk(SegmentWriter* w, Chunk* c) {
+  uint64_t start = nanos_since_boot();
+
+  // O_DIRECT only takes aligned lengths, the padding of the last chunk is truncated on close
+  size_t len = c->len;
+  if (w->direct) {
+    len = (c->len + SEGMENT_WRITER_ALIGN - 1) & ~(size_t)(SEGMENT_WRITER_ALIGN - 1);
+    memset(c->data + c->len, 0, len - c->len);
+  }
+
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pwrite(w->fd, c->data + done, len - done, c->offset + done);
+    if (n < 0 && errno == EINTR) continue;
+#ifdef __linux__
+    if (n < 0 && errno == EINVAL && w->direct && done == 0) {
+      // some filesystems take O_DIRECT at open and refuse it on write
+      fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT);
+      w->direct = false;
+      len = c->len;
+      continue;
+    }
+#endif
+    if (n <= 0) return false;
+    done += n;
+  }
+
+#ifdef __linux__
+  if (!w->direct) {
+    // start the writeback of this chunk now instead of whenever the kernel
+    // gets to it, and wait for the one before to drop it from the cache
+    sync_file_range(w->fd, c->offset, len, SYNC_FILE_RANGE_WRITE);
+    if (w->prev_len > 0) {
+      sync_file_range(w->fd, w->prev_offset, w->prev_len,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+      posix_fadvise(w->fd, w->prev_offset, w->prev_len, POSIX_FADV_DONTNEED);
+    }
+    w->prev_offset = c->offset;
+    w->prev_len = len;
+  }
+#endif
+
+  pthread_mutex_lock(&stats_lock);
+  stats.bytes += c->len - c->carry;
+  latency_hist_add(&stats.latency, (nanos_since_boot() - start) / 1000);
+  pthread_mutex_unlock(&stats_lock);
+  return true;
+}
+
+static void* io_thread(void* arg) {
+  (void)arg;
+  set_thread_name("loggerd_io");
+
+  pthread_mutex_lock(&io_lock);
+  while (true) {
+    while (io_head == NULL) {
+      pthread_cond_wait(&io_work_cv, &io_lock);
+    }
+    Chunk* c = io_head;
+    io_head = c->next;
+    if (io_head == NULL) io_tail = NULL;
+    SegmentWriter* w = c->w;
+    bool error = w->error;
+    pthread_mutex_unlock(&io_lock);
+
+    bool ok = error || write_chunk(w, c);
+
+    pthread_mutex_lock(&io_lock);
+    if (!ok) w->error = true;
+    w->pending--;
+    c->next = pool;
+    pool = c;
+    pthread_cond_broadcast(&io_done_cv);
+  }
+  return NULL;
+}
+
+static bool io_start() {
+  pthread_mutex_lock(&io_lock);
+  if (!io_running) {
+    pthread_t thread;
+    io_running = pthread_create(&thread, NULL, io_thread, NULL) == 0;
+    if (io_running) pthread_detach(thread);
+  }
+  bool ok = io_running;
+  pthread_mutex_unlock(&io_lock);
+  return ok;
+}
+
+// a chunk from the pool to fill, waits while all of them are with the I/O thread
+static Chunk* start_chunk(SegmentWriter* w) {
+  pthread_mutex_lock(&io_lock);
+  Chunk* c = NULL;
+  while (true) {
+    if (pool) {
+      c = pool;
+      pool = c->next;
+      break;
+    }
+    if (pool_allocated < SEGMENT_WRITER_POOL) {
+      c = (Chunk*)calloc(1, sizeof(Chunk));
+      if (c && posix_memalign((void**)&c->data, SEGMENT_WRITER_ALIGN, SEGMENT_WRITER_CHUNK) != 0) {
+        free(c);
+        c = NULL;
+      }
+      if (c) pool_allocated++;
+      break;
+    }
+    pthread_cond_wait(&io_done_cv, &io_lock);
+  }
+  pthread_mutex_unlock(&io_lock);
+  if (c == NULL) return NULL;
+
+  c->w = w;
+  c->next = NULL;
+  c->offset = w->next_offset;
+  memcpy(c->data, w->tail, w->tail_len);
+  c->len = c->carry = w->tail_len;
+  w->fill = c;
+  return c;
+}
+
+// hands the chunk being filled to the I/O thread
+static bool submit(SegmentWriter* w) {
+  Chunk* c = w->fill;
+  w->fill = NULL;
+
+  size_t whole = c->len & ~(size_t)(SEGMENT_WRITER_ALIGN - 1);
+  w->next_offset = c->offset + whole;
+  w->tail_len = c->len - whole;
+  memcpy(w->tail, c->data + whole, w->tail_len);
+
+  pthread_mutex_lock(&io_lock);
+  if (io_tail) {
+    io_tail->next = c;
+  } else {
+    io_head = c;
+  }
+  io_tail = c;
+  w->pending++;
+  pthread_cond_signal(&io_work_cv);
+  bool ok = !w->error;
+  pthread_mutex_unlock(&io_lock);
+  return ok;
+}
+
+static int segment_writer_close(SegmentWriter* w) {
+  bool ok = true;
+  if (w->fill && w->fill->len > w->fill->carry) {
+    ok = submit(w);
+  }
+
+  pthread_mutex_lock(&io_lock);
+  if (w->fill) {
+    // nothing new in it
+    w->fill->next = pool;
+    pool = w->fill;
+    w->fill = NULL;
+    pthread_cond_broadcast(&io_done_cv);
+  }
+  while (w->pending > 0) {
+    pthread_cond_wait(&io_done_cv, &io_lock);
+  }
+  ok = !w->error && ok;
+  pthread_mutex_unlock(&io_lock);
+
+  // also gives back what was preallocated past the end
+  ok = ftruncate(w->fd, w->size) == 0 && ok;
+  ok = close(w->fd) == 0 && ok;
+
+  pthread_mutex_lock(&stats_lock);
+  if (w->direct) {
+    stats.direct_files++;
+  } else {
+    stats.buffered_files++;
+  }
+  pthread_mutex_unlock(&stats_lock);
+
+  free(w);
+  return ok ? 0 : -1;
+}
+
+static SegmentWriter* segment_writer_open(const char* path, size_t expected_size) {
+  if (!io_start()) return NULL;
+
+#ifdef __linux__
+  bool direct = true;
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0666);
+  if (fd < 0 && errno == EINVAL) {
+    direct = false;
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  }
+  if (fd < 0) return NULL;
+
+  if (expected_size > 0) {
+    // the size stays at what's written, not every filesystem can do this and that's fine
+    fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, expected_size);
+  }
+#else
+  // macOS, buffered and not preallocated, the I/O thread still takes the stalls
+  (void)expected_size;
+  bool direct = false;
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) return NULL;
+#endif
+
+  SegmentWriter* w = (SegmentWriter*)calloc(1, sizeof(SegmentWriter));
+  if (w == NULL) {
+    close(fd);
+    return NULL;
+  }
+  w->fd = fd;
+  w->direct = direct;
+  return w;
+}
+
+static int segment_writer_write(SegmentWriter* w, const void* data, size_t size) {
+  const uint8_t* p = (const uint8_t*)data;
+  while (size > 0) {
+    Chunk* c = w->fill ? w->fill : start_chunk(w);
+    if (c == NULL) return -1;
+    if (c->len == c->carry) c->since = nanos_since_boot();
+
+    size_t n = SEGMENT_WRITER_CHUNK - c->len;
+    if (n > size) n = size;
+    memcpy(c->data + c->len, p, n);
+    c->len += n;
+    w->size += n;
+    p += n;
+    size -= n;
+
+    if (c->len == SEGMENT_WRITER_CHUNK && !submit(w)) return -1;
+  }
+
+  // don't keep a slow file's data in memory for long
+  if (w->fill && nanos_since_boot() - w->fill->since > SEGMENT_WRITER_FLUSH_MS * 1000000ULL) {
+    if (!submit(w)) return -1;
+  }
+  return 0;
+}
+
+// stdio on top of the writer, so the compressors and the encoder keep their FILE*.
+// It's unbuffered, the chunks are the buffer.
+#if defined(__ANDROID__) || defined(__APPLE__)
+static int cookie_write(void* cookie, const char* buf, int size) {
+  return segment_writer_write((SegmentWriter*)cookie, buf, size) == 0 ? size : -1;
+}
+
+static int cookie_close(void* cookie) {
+  return segment_writer_close((SegmentWriter*)cookie);
+}
+#else
+static ssize_t cookie_write(void* cookie, const char* buf, size_t size) {
+  return segment_writer_write((SegmentWriter*)cookie, buf, size) == 0 ? size : 0;
+}
+
+static int cookie_close(void* cookie) {
+  return segment_writer_close((SegmentWriter*)cookie) == 0 ? 0 : EOF;
+}
+#endif
+
+FILE* segment_file_open(const char* path, size_t expected_size) {
+  SegmentWriter* w = segment_writer_open(path, expected_size);
+  if (w == NULL) return NULL;
+
+#if defined(__ANDROID__) || defined(__APPLE__)
+  FILE* f = funopen(w, NULL, cookie_write, NULL, cookie_close);
+#else
+  cookie_io_functions_t io = {.read = NULL, .write = cookie_write, .seek = NULL, .close = cookie_close};
+  FILE* f = fopencookie(w, "w", io);
+#endif
+  if (f == NULL) {
+    segment_writer_close(w);
+    return NULL;
+  }
+  setvbuf(f, NULL, _IONBF, 0);
+  return f;
+}
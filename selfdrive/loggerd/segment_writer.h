@@ -0,0 +1,58 @@
+#ifndef SEGMENT_WRITER_H
+#define SEGMENT_WRITER_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Writes segment files without letting page cache writeback stall the caller.
+// The file is fallocated to its expected size up front, the data is gathered
+// into aligned chunks and one I/O thread writes the chunks of every file with
+// O_DIRECT. Where O_DIRECT isn't supported (tmpfs, some fuse mounts) it writes
+// through the page cache instead and pushes every chunk out right away, so no
+// file ever has more than a couple of chunks dirty.
+//
+// The chunks come from a pool shared by all files, a writer only blocks when
+// the whole pool is waiting for the disk. A chunk that has held data for
+// SEGMENT_WRITER_FLUSH_MS is written on the next write even if it isn't full,
+// so a slow file like the qlog still reaches the disk every few seconds.
+
+#define SEGMENT_WRITER_ALIGN 4096
+#define SEGMENT_WRITER_CHUNK (256*1024)
+#define SEGMENT_WRITER_POOL 32
+#define SEGMENT_WRITER_FLUSH_MS 2000
+
+// bucket i counts latencies below 2^i us, the last one everything above
+#define LATENCY_HIST_BUCKETS 24
+
+typedef struct LatencyHist {
+  uint64_t count;
+  uint64_t max_us;
+  uint64_t buckets[LATENCY_HIST_BUCKETS];
+} LatencyHist;
+
+void latency_hist_add(LatencyHist* h, uint64_t us);
+// upper bound in us of the bucket the p-th fraction falls in, 0 if it's empty
+uint64_t latency_hist_percentile(const LatencyHist* h, double p);
+
+typedef struct SegmentWriterStats {
+  uint64_t bytes;
+  uint64_t direct_files, buffered_files;
+  LatencyHist latency;  // of every chunk written to the disk
+} SegmentWriterStats;
+
+// expected_size is only preallocated, the file ends up as long as what was written
+FILE* segment_file_open(const char* path, size_t expected_size);
+// totals of all segment files in the process
+void segment_writer_stats(SegmentWriterStats* stats, bool reset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
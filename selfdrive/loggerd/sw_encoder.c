@@ -0,0 +1,219 @@
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include <pthread.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+
+#include <libyuv.h>
+
+#include "common/mutex.h"
+#include "common/swaglog.h"
+
+#include "encoder.h"
+
+// encoder.h on libavcodec instead of OMX, so the camera to loggerd path runs
+// on a PC. x265 for the hevc streams and x264 for qcamera, tuned for latency
+// like the hardware encoder: no B-frames and no lookahead, every frame is
+// written before encoder_encode_frame returns. The output goes through the
+// same raw hevc and ts remux code as the OMX encoder's.
+//
+// LOGGERD_SW_PRESET is the x264/x265 preset, ultrafast by default, and
+// LOGGERD_SW_THREADS the threads of each encoder, 0 lets libavcodec pick.
+
+static void open_codec(EncoderState *s) {
+  const char* name = s->h265 ? "libx265" : "libx264";
+  AVCodec *codec = avcodec_find_encoder_by_name(name);
+  if (codec == NULL) {
+    LOGW("%s not available, using the default encoder", name);
+    codec = avcodec_find_encoder(s->h265 ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264);
+  }
+  assert(codec);
+
+  s->enc_ctx = avcodec_alloc_context3(codec);
+  assert(s->enc_ctx);
+  s->enc_ctx->width = s->width;
+  s->enc_ctx->height = s->height;
+  s->enc_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+  // frame timestamps are in microseconds, like OMX_TICKS
+  s->enc_ctx->time_base = (AVRational){ 1, 1000000 };
+  s->enc_ctx->framerate = (AVRational){ s->fps, 1 };
+  s->enc_ctx->bit_rate = s->bitrate;
+  s->enc_ctx->max_b_frames = 0;
+  // the OMX encoder's h264 has an I frame every 16, hevc gets one a second
+  s->enc_ctx->gop_size = s->h265 ? s->fps : 16;
+  // parameter sets come once as the codec config, every segment file starts with them
+  s->enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+  const char* threads = getenv("LOGGERD_SW_THREADS");
+  s->enc_ctx->thread_count = threads ? atoi(threads) : 0;
+  s->enc_ctx->thread_type = FF_THREAD_SLICE | FF_THREAD_FRAME;
+
+  const char* preset = getenv("LOGGERD_SW_PRESET");
+  av_opt_set(s->enc_ctx->priv_data, "preset", preset ? preset : "ultrafast", 0);
+  av_opt_set(s->enc_ctx->priv_data, "tune", "zerolatency", 0);
+
+  int err = avcodec_open2(s->enc_ctx, codec, NULL);
+  assert(err >= 0);
+
+  if (s->enc_ctx->extradata_size > 0) {
+    if (s->codec_config_len < (size_t)s->enc_ctx->extradata_size) {
+      s->codec_config = realloc(s->codec_config, s->enc_ctx->extradata_size);
+    }
+    s->codec_config_len = s->enc_ctx->extradata_size;
+    memcpy(s->codec_config, s->enc_ctx->extradata, s->codec_config_len);
+  }
+}
+
+static void drain_packets(EncoderState *s) {
+  while (avcodec_receive_packet(s->enc_ctx, s->pkt) == 0) {
+    encoder_write_output(s, s->pkt->data, s->pkt->size, s->pkt->pts,
+                         false, s->pkt->flags & AV_PKT_FLAG_KEY);
+    av_packet_unref(s->pkt);
+  }
+}
+
+void encoder_init(EncoderState *s, const char* filename, int width, int height, int fps, int bitrate, bool h265, bool downscale) {
+  memset(s, 0, sizeof(*s));
+  s->filename = filename;
+  s->width = width;
+  s->height = height;
+  s->fps = fps;
+  s->bitrate = bitrate;
+  s->h265 = h265;
+  mutex_init_reentrant(&s->lock);
+
+  if (!h265) {
+    s->remuxing = true;
+  }
+
+  if (downscale) {
+    s->downscale = true;
+    s->y_ptr2 = malloc(s->width*s->height);
+    s->u_ptr2 = malloc(s->width*s->height/4);
+    s->v_ptr2 = malloc(s->width*s->height/4);
+  }
+
+  s->segment = -1;
+
+  av_register_all();
+
+  s->frame = av_frame_alloc();
+  assert(s->frame);
+  s->frame->format = AV_PIX_FMT_YUV420P;
+  s->frame->width = s->width;
+  s->frame->height = s->height;
+
+  s->pkt = av_packet_alloc();
+  assert(s->pkt);
+
+  open_codec(s);
+}
+
+int encoder_encode_frame(EncoderState *s,
+                         const uint8_t *y_ptr, const uint8_t *u_ptr, const uint8_t *v_ptr,
+                         int in_width, int in_height,
+                         int *frame_segment, VIPCBufExtra *extra) {
+  pthread_mutex_lock(&s->lock);
+
+  if (s->opening) {
+    encoder_open(s, s->next_path);
+    s->opening = false;
+  }
+
+  if (!s->open) {
+    pthread_mutex_unlock(&s->lock);
+    return -1;
+  }
+
+  int ret = s->counter;
+
+  if (s->downscale) {
+    I420Scale(y_ptr, in_width,
+              u_ptr, in_width/2,
+              v_ptr, in_width/2,
+              in_width, in_height,
+              s->y_ptr2, s->width,
+              s->u_ptr2, s->width/2,
+              s->v_ptr2, s->width/2,
+              s->width, s->height,
+              kFilterNone);
+    y_ptr = s->y_ptr2;
+    u_ptr = s->u_ptr2;
+    v_ptr = s->v_ptr2;
+  }
+
+  // the frame isn't refcounted, libavcodec copies whatever it keeps of it
+  s->frame->data[0] = (uint8_t*)y_ptr;
+  s->frame->data[1] = (uint8_t*)u_ptr;
+  s->frame->data[2] = (uint8_t*)v_ptr;
+  s->frame->linesize[0] = s->width;
+  s->frame->linesize[1] = s->width/2;
+  s->frame->linesize[2] = s->width/2;
+  s->frame->pts = extra->timestamp_eof/1000LL;
+
+  int err = avcodec_send_frame(s->enc_ctx, s->frame);
+  if (err < 0) {
+    LOGE("sw encoder failed to encode frame %d", s->counter);
+  } else {
+    drain_packets(s);
+  }
+
+  s->dirty = true;
+
+  s->counter++;
+
+  if (frame_segment) {
+    *frame_segment = s->segment;
+  }
+
+  if (s->closing) {
+    encoder_close(s);
+    s->closing = false;
+  }
+
+  pthread_mutex_unlock(&s->lock);
+  return ret;
+}
+
+void encoder_close(EncoderState *s) {
+  pthread_mutex_lock(&s->lock);
+
+  if (s->open) {
+    if (s->dirty) {
+      // whatever the encoder still holds goes in this segment, the next one
+      // starts on a fresh encoder
+      avcodec_send_frame(s->enc_ctx, NULL);
+      drain_packets(s);
+      avcodec_free_context(&s->enc_ctx);
+      open_codec(s);
+      s->dirty = false;
+    }
+
+    encoder_close_output(s);
+  }
+  s->open = false;
+
+  pthread_mutex_unlock(&s->lock);
+}
+
+void encoder_destroy(EncoderState *s) {
+  assert(!s->open);
+
+  avcodec_free_context(&s->enc_ctx);
+  av_frame_free(&s->frame);
+  av_packet_free(&s->pkt);
+  free(s->codec_config);
+
+  if (s->downscale) {
+    free(s->y_ptr2);
+    free(s->u_ptr2);
+    free(s->v_ptr2);
+  }
+}
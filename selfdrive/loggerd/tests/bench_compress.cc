@@ -0,0 +1,248 @@
+// Compresses recorded logs with every codec log_compressor.h has and reports
+// compression speed, decompression speed and ratio, to pick the rlog and
+// qlog defaults (LOGGERD_RLOG_CODEC and LOGGERD_QLOG_CODEC in loggerd).
+//
+// Logs are fed in one event at a time like lh_log does. Inputs can be raw or
+// already compressed with any codec this build has, by extension.
+//
+// Like loggerd the stream is cut into independent blocks for the index,
+// --block-size 0 compresses everything as one stream.
+//
+// usage: bench_compress [--codecs bz2:9,zstd:3,zstd:3:2,lz4] [--block-size n] [--repeat n] rlog.bz2...
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <time.h>
+
+#include <bzlib.h>
+#ifdef LOGGER_ZSTD
+#include <zstd.h>
+#endif
+#ifdef LOGGER_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "../log_compressor.h"
+#include "../logger.h"
+
+#define DEFAULT_CODECS "bz2:9,bz2:9:-1,bz2:1,zstd:1,zstd:3,zstd:9,zstd:19,zstd:3:2,lz4:0,lz4:9"
+
+static double seconds() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static bool ends_with(const std::string &s, const char *suffix) {
+  size_t n = strlen(suffix);
+  return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+// decodes a whole stream
+static bool decompress(LogCodec codec, const std::string &in, std::string &out) {
+  out.clear();
+  std::vector<char> buf(1 << 20);
+
+  if (codec == LOG_CODEC_BZ2) {
+    // concatenated streams are valid bzip2 too
+    size_t pos = 0;
+    while (pos < in.size()) {
+      bz_stream strm = {};
+      if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK) return false;
+      strm.next_in = (char*)in.data() + pos;
+      strm.avail_in = in.size() - pos;
+      int ret = BZ_OK;
+      while (ret == BZ_OK) {
+        strm.next_out = buf.data();
+        strm.avail_out = buf.size();
+        ret = BZ2_bzDecompress(&strm);
+        out.append(buf.data(), buf.size() - strm.avail_out);
+      }
+      pos = in.size() - strm.avail_in;
+      BZ2_bzDecompressEnd(&strm);
+      if (ret != BZ_STREAM_END) return false;
+    }
+    return true;
+  }
+#ifdef LOGGER_ZSTD
+  if (codec == LOG_CODEC_ZSTD) {
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    ZSTD_inBuffer zin = {in.data(), in.size(), 0};
+    size_t ret = 0;
+    while (zin.pos < zin.size) {
+      ZSTD_outBuffer zout = {buf.data(), buf.size(), 0};
+      ret = ZSTD_decompressStream(dctx, &zout, &zin);
+      if (ZSTD_isError(ret)) break;
+      out.append(buf.data(), zout.pos);
+    }
+    ZSTD_freeDCtx(dctx);
+    return !ZSTD_isError(ret) && ret == 0;
+  }
+#endif
+#ifdef LOGGER_LZ4
+  if (codec == LOG_CODEC_LZ4) {
+    LZ4F_dctx *dctx;
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) return false;
+    // one frame per block
+    size_t pos = 0, ret = 0;
+    while (pos < in.size()) {
+      size_t dst_size = buf.size(), src_size = in.size() - pos;
+      ret = LZ4F_decompress(dctx, buf.data(), &dst_size, in.data() + pos, &src_size, NULL);
+      if (LZ4F_isError(ret)) break;
+      out.append(buf.data(), dst_size);
+      pos += src_size;
+    }
+    LZ4F_freeDecompressionContext(dctx);
+    return ret == 0;
+  }
+#endif
+  return false;
+}
+
+static bool load(const char *path, std::string &out) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    perror(path);
+    return false;
+  }
+  std::string raw;
+  char buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) raw.append(buf, n);
+  fclose(f);
+
+  std::string name = path;
+  const char *codec = ends_with(name, ".bz2") ? "bz2" :
+                      ends_with(name, ".zst") ? "zstd" :
+                      ends_with(name, ".lz4") ? "lz4" : NULL;
+  if (codec == NULL) {
+    out += raw;
+    return true;
+  }
+
+  LogCompressorConfig cfg = {};
+  if (!log_codec_parse(codec, &cfg)) {
+    fprintf(stderr, "%s: %s isn't in this build\n", path, codec);
+    return false;
+  }
+  std::string dec;
+  if (!decompress(cfg.codec, raw, dec)) {
+    fprintf(stderr, "%s: can't decompress\n", path);
+    return false;
+  }
+  out += dec;
+  return true;
+}
+
+// event sizes from the capnp stream framing, falls back to fixed pieces
+static std::vector<size_t> split_events(const std::string &dat) {
+  std::vector<size_t> sizes;
+  size_t pos = 0;
+  while (pos + 8 <= dat.size()) {
+    uint32_t segs;
+    memcpy(&segs, dat.data() + pos, 4);
+    segs += 1;
+    size_t header = ((4 + segs * 4) + 7) & ~(size_t)7;
+    if (segs > 512 || pos + header > dat.size()) break;
+    size_t size = header;
+    for (uint32_t i = 0; i < segs; i++) {
+      uint32_t words;
+      memcpy(&words, dat.data() + pos + 4 + i * 4, 4);
+      size += (size_t)words * 8;
+    }
+    if (pos + size > dat.size()) break;
+    sizes.push_back(size);
+    pos += size;
+  }
+  while (pos < dat.size()) {
+    size_t size = std::min(dat.size() - pos, (size_t)4096);
+    sizes.push_back(size);
+    pos += size;
+  }
+  return sizes;
+}
+
+int main(int argc, char *argv[]) {
+  std::string codecs = DEFAULT_CODECS;
+  int repeat = 1;
+  size_t block_size = LOGGER_INDEX_BLOCK_SIZE;
+  std::string dat;
+  int files = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--codecs") == 0 && i + 1 < argc) {
+      codecs = argv[++i];
+    } else if (strcmp(argv[i], "--block-size") == 0 && i + 1 < argc) {
+      block_size = strtoul(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+      repeat = std::max(atoi(argv[++i]), 1);
+    } else if (argv[i][0] != '-') {
+      if (!load(argv[i], dat)) return 1;
+      files++;
+    } else {
+      fprintf(stderr, "usage: %s [--codecs %s] [--block-size n] [--repeat n] rlog...\n", argv[0], DEFAULT_CODECS);
+      return 1;
+    }
+  }
+  if (files == 0 || dat.empty()) {
+    fprintf(stderr, "usage: %s [--codecs %s] [--block-size n] [--repeat n] rlog...\n", argv[0], DEFAULT_CODECS);
+    return 1;
+  }
+
+  std::vector<size_t> events = split_events(dat);
+  printf("%zu bytes in %zu events from %d files\n\n", dat.size(), events.size(), files);
+  printf("%-12s %12s %8s %10s %10s\n", "codec", "compressed", "ratio", "comp MB/s", "dec MB/s");
+
+  char *tok_state = NULL;
+  for (char *tok = strtok_r(&codecs[0], ",", &tok_state); tok != NULL; tok = strtok_r(NULL, ",", &tok_state)) {
+    LogCompressorConfig cfg = {};
+    if (!log_codec_parse(tok, &cfg)) {
+      printf("%-12s not in this build\n", tok);
+      continue;
+    }
+
+    // best of repeat runs, the minimum is the least disturbed one
+    double comp_time = 1e9, dec_time = 1e9;
+    std::string out;
+    bool ok = true;
+    for (int r = 0; r < repeat && ok; r++) {
+      char *mem = NULL;
+      size_t mem_size = 0;
+      FILE *f = open_memstream(&mem, &mem_size);
+
+      double t = seconds();
+      LogCompressor *c = log_compressor_open(f, &cfg, block_size, NULL, NULL);
+      ok = c != NULL;
+      size_t pos = 0;
+      for (size_t i = 0; ok && i < events.size(); i++) {
+        ok = log_compressor_write(c, dat.data() + pos, events[i]) == 0;
+        pos += events[i];
+      }
+      if (c != NULL) ok = (log_compressor_close(c) == 0) && ok;
+      fclose(f);
+      comp_time = std::min(comp_time, seconds() - t);
+      out.assign(mem, mem_size);
+      free(mem);
+
+      std::string dec;
+      t = seconds();
+      ok = ok && decompress(cfg.codec, out, dec);
+      dec_time = std::min(dec_time, seconds() - t);
+      ok = ok && dec == dat;
+    }
+    if (!ok) {
+      printf("%-12s failed\n", tok);
+      continue;
+    }
+
+    double mb = dat.size() / 1e6;
+    printf("%-12s %12zu %8.2f %10.1f %10.1f\n", tok, out.size(), (double)dat.size() / out.size(),
+           mb / comp_time, mb / dec_time);
+  }
+  return 0;
+}
@@ -0,0 +1,135 @@
+// Runs frames through the software encoder the way loggerd's encoder thread
+// does, rotating every --seg frames, and reports the encode throughput, the
+// time each encoder_encode_frame takes and the CPU used. The frames are raw
+// I420 replayed from a file, e.g. decoded from a logged fcamera.hevc with
+//   ffmpeg -i fcamera.hevc -f rawvideo -pix_fmt yuv420p frames.yuv
+// or a synthetic moving pattern without --input.
+//
+// usage: bench_encoder <dir> [--input frames.yuv] [--width 1164] [--height 874]
+//                      [--frames 1200] [--seg 1200] [--fps 20] [--h264] [--realtime]
+//   LOGGERD_SW_PRESET and LOGGERD_SW_THREADS pick the x264/x265 settings
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include <string>
+#include <vector>
+
+#include "common/timing.h"
+
+#include "../encoder.h"
+#include "../segment_writer.h"
+
+static double cpu_seconds() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    printf("usage: %s <dir> [--input frames.yuv] [--width 1164] [--height 874] [--frames 1200] [--seg 1200] [--fps 20] [--h264] [--realtime]\n", argv[0]);
+    return 1;
+  }
+  const char* input = NULL;
+  int width = 1164, height = 874, frames = 1200, seg = 1200, fps = 20;
+  bool h265 = true, realtime = false;
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--h264") == 0) h265 = false;
+    else if (strcmp(argv[i], "--realtime") == 0) realtime = true;
+    else if (i + 1 >= argc) break;
+    else if (strcmp(argv[i], "--input") == 0) input = argv[++i];
+    else if (strcmp(argv[i], "--width") == 0) width = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--height") == 0) height = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--frames") == 0) frames = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--seg") == 0) seg = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--fps") == 0) fps = atoi(argv[++i]);
+  }
+  std::string dir = argv[1];
+
+  size_t frame_size = width * height * 3 / 2;
+  std::vector<uint8_t> buf(frame_size);
+  FILE* in = NULL;
+  if (input) {
+    in = fopen(input, "rb");
+    if (in == NULL) {
+      perror(input);
+      return 1;
+    }
+  }
+
+  EncoderState encoder;
+  encoder_init(&encoder, h265 ? "fcamera.hevc" : "qcamera.ts", width, height, fps,
+               h265 ? 5000000 : 128000, h265, false);
+
+  int segment = 0;
+  std::string path = dir + "/bench_encoder--0";
+  mkdir(path.c_str(), 0777);
+  encoder_rotate(&encoder, path.c_str(), segment);
+
+  LatencyHist hist = {};
+  uint64_t start = nanos_since_boot();
+  double cpu_start = cpu_seconds();
+  for (int i = 0; i < frames; i++) {
+    if (in) {
+      if (fread(buf.data(), 1, frame_size, in) != frame_size) {
+        // loop the replay
+        rewind(in);
+        if (fread(buf.data(), 1, frame_size, in) != frame_size) {
+          printf("%s is shorter than a frame\n", input);
+          return 1;
+        }
+      }
+    } else {
+      for (int y = 0; y < height; y++) {
+        memset(&buf[y * width], (y + i * 4) & 0xff, width);
+      }
+      memset(&buf[width * height], 128, width * height / 2);
+    }
+
+    if (i > 0 && i % seg == 0) {
+      // what loggerd's encoder thread does between segments
+      segment++;
+      path = dir + "/bench_encoder--" + std::to_string(segment);
+      mkdir(path.c_str(), 0777);
+      encoder_rotate(&encoder, path.c_str(), segment);
+      encoder_close(&encoder);
+      encoder_open(&encoder, encoder.next_path);
+      encoder.segment = encoder.next_segment;
+      encoder.rotating = false;
+    }
+
+    if (realtime) {
+      uint64_t due = start + (uint64_t)i * 1000000000ULL / fps;
+      uint64_t now = nanos_since_boot();
+      if (due > now) usleep((due - now) / 1000);
+    }
+
+    VIPCBufExtra extra = {};
+    extra.frame_id = i;
+    extra.timestamp_eof = start + (uint64_t)i * 1000000000ULL / fps;
+    const uint8_t* y = buf.data();
+    const uint8_t* u = y + width * height;
+    const uint8_t* v = u + width * height / 4;
+
+    uint64_t t = nanos_since_boot();
+    encoder_encode_frame(&encoder, y, u, v, width, height, NULL, &extra);
+    latency_hist_add(&hist, (nanos_since_boot() - t) / 1000);
+  }
+  encoder_close(&encoder);
+  double secs = (nanos_since_boot() - start) * 1e-9;
+  double cpu = cpu_seconds() - cpu_start;
+  encoder_destroy(&encoder);
+  if (in) fclose(in);
+
+  printf("%s %dx%d, %d frames in %d segments\n", h265 ? "hevc" : "h264", width, height, frames, segment + 1);
+  printf("%.1f fps, %.2f cores\n", frames / secs, cpu / secs);
+  printf("encode     p50 < %6lu us  p99 < %6lu us  max %7lu us\n",
+         (unsigned long)latency_hist_percentile(&hist, 0.5),
+         (unsigned long)latency_hist_percentile(&hist, 0.99),
+         (unsigned long)hist.max_us);
+  return 0;
+}
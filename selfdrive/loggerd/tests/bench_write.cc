@@ -0,0 +1,92 @@
+// Compares how long the caller waits on fwrite to a plain stdio file and to
+// a segment_file_open file while writing at a steady rate, like the encoder
+// and the log writer do. The plain file stalls whenever page cache
+// writeback catches up with it.
+//
+// usage: bench_write <dir> [--mb 256] [--rate 20] [--piece 64]
+//   --rate MB/s written, 0 writes as fast as possible
+//   --piece kB per fwrite
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "common/timing.h"
+
+#include "../segment_writer.h"
+
+static void print_hist(const char* name, const LatencyHist* h) {
+  printf("%-10s %8lu writes  p50 < %6lu us  p99 < %6lu us  p99.9 < %6lu us  max %7lu us\n", name,
+         (unsigned long)h->count,
+         (unsigned long)latency_hist_percentile(h, 0.5),
+         (unsigned long)latency_hist_percentile(h, 0.99),
+         (unsigned long)latency_hist_percentile(h, 0.999),
+         (unsigned long)h->max_us);
+}
+
+static void run(const char* name, const std::string& path, bool segment, size_t total, size_t piece, double rate) {
+  std::vector<uint8_t> buf(piece);
+  for (size_t i = 0; i < piece; i++) buf[i] = rand();
+
+  FILE* f = segment ? segment_file_open(path.c_str(), total) : fopen(path.c_str(), "wb");
+  if (f == NULL) {
+    perror(path.c_str());
+    exit(1);
+  }
+
+  LatencyHist hist = {};
+  uint64_t start = nanos_since_boot();
+  for (size_t written = 0; written < total; written += piece) {
+    if (rate > 0) {
+      // keep to the rate, a stall is made up for by writing faster afterwards
+      uint64_t due = start + (uint64_t)(written / (rate * 1e6) * 1e9);
+      uint64_t now = nanos_since_boot();
+      if (due > now) usleep((due - now) / 1000);
+    }
+    uint64_t t = nanos_since_boot();
+    if (fwrite(buf.data(), 1, piece, f) != piece) {
+      printf("%s: write failed\n", name);
+      exit(1);
+    }
+    latency_hist_add(&hist, (nanos_since_boot() - t) / 1000);
+  }
+  uint64_t t = nanos_since_boot();
+  if (fclose(f) != 0) {
+    printf("%s: close failed\n", name);
+    exit(1);
+  }
+  uint64_t close_us = (nanos_since_boot() - t) / 1000;
+  double secs = (nanos_since_boot() - start) * 1e-9;
+
+  print_hist(name, &hist);
+  printf("%-10s %.1f MB/s, close %lu us\n", "", total / secs / 1e6, (unsigned long)close_us);
+  unlink(path.c_str());
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    printf("usage: %s <dir> [--mb 256] [--rate 20] [--piece 64]\n", argv[0]);
+    return 1;
+  }
+  size_t mb = 256, piece_kb = 64;
+  double rate = 20;
+  for (int i = 2; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "--mb") == 0) mb = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--rate") == 0) rate = atof(argv[i + 1]);
+    else if (strcmp(argv[i], "--piece") == 0) piece_kb = atoi(argv[i + 1]);
+  }
+  size_t total = mb * 1024 * 1024, piece = piece_kb * 1024;
+  std::string dir = argv[1];
+
+  run("stdio", dir + "/bench_write_stdio", false, total, piece, rate);
+  run("segment", dir + "/bench_write_segment", true, total, piece, rate);
+
+  SegmentWriterStats st;
+  segment_writer_stats(&st, false);
+  printf("segment writer: %s\n", st.direct_files ? "O_DIRECT" : "buffered, O_DIRECT not supported here");
+  print_hist("disk", &st.latency);
+  return 0;
+}
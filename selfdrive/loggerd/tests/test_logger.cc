@@ -0,0 +1,304 @@
+// Writes routes through logger_init/logger_next/logger_log with every codec
+// this build has, inline and through the write-behind queue, and reads them
+// back: the rlog and qlog of every segment decode to the events logged into
+// it, and every block in their .idx decodes on its own to its slice of the
+// stream, with an event count, time bounds and services matching the events
+// in that slice.
+//
+// usage: test_logger [codec ...], defaults to bz2, bz2:9:2, zstd:3 and lz4
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <bzlib.h>
+#ifdef LOGGER_ZSTD
+#include <zstd.h>
+#endif
+#ifdef LOGGER_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "messaging.hpp"
+
+#include "../log_compressor.h"
+#include "../logger.h"
+
+#define SEGMENTS 3
+#define EVENTS_PER_SEGMENT 3000  // a few index blocks worth
+#define QUEUE_SIZE (1 << 20)
+
+struct LoggedEvent {
+  uint64_t mono_time;
+  uint16_t which;
+  std::string data;
+};
+
+struct Segment {
+  std::string path;
+  std::vector<LoggedEvent> rlog, qlog;
+};
+
+#define CHECK(cond, ...) \
+  if (!(cond)) { \
+    printf(__VA_ARGS__); \
+    printf("\n"); \
+    return false; \
+  }
+
+static bool read_file(const std::string &path, std::string &out) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f) return false;
+  char buf[1 << 16];
+  size_t n;
+  out.clear();
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    out.append(buf, n);
+  }
+  fclose(f);
+  return true;
+}
+
+// decodes a whole stream, concatenated blocks included
+static bool decompress(LogCodec codec, const std::string &in, std::string &out) {
+  out.clear();
+  std::vector<char> buf(1 << 20);
+
+  if (codec == LOG_CODEC_BZ2) {
+    size_t pos = 0;
+    while (pos < in.size()) {
+      bz_stream strm = {};
+      if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK) return false;
+      strm.next_in = (char*)in.data() + pos;
+      strm.avail_in = in.size() - pos;
+      int ret = BZ_OK;
+      while (ret == BZ_OK) {
+        strm.next_out = buf.data();
+        strm.avail_out = buf.size();
+        ret = BZ2_bzDecompress(&strm);
+        out.append(buf.data(), buf.size() - strm.avail_out);
+      }
+      pos = in.size() - strm.avail_in;
+      BZ2_bzDecompressEnd(&strm);
+      if (ret != BZ_STREAM_END) return false;
+    }
+    return true;
+  }
+#ifdef LOGGER_ZSTD
+  if (codec == LOG_CODEC_ZSTD) {
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    ZSTD_inBuffer zin = {in.data(), in.size(), 0};
+    size_t ret = 0;
+    bool more = zin.size > 0;
+    while (more) {
+      ZSTD_outBuffer zout = {buf.data(), buf.size(), 0};
+      ret = ZSTD_decompressStream(dctx, &zout, &zin);
+      if (ZSTD_isError(ret)) break;
+      out.append(buf.data(), zout.pos);
+      more = zin.pos < zin.size || zout.pos == zout.size;
+    }
+    ZSTD_freeDCtx(dctx);
+    return !ZSTD_isError(ret) && ret == 0;
+  }
+#endif
+#ifdef LOGGER_LZ4
+  if (codec == LOG_CODEC_LZ4) {
+    LZ4F_dctx *dctx;
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) return false;
+    size_t pos = 0, ret = 0;
+    bool more = in.size() > 0;
+    while (more) {
+      size_t dst_size = buf.size(), src_size = in.size() - pos;
+      ret = LZ4F_decompress(dctx, buf.data(), &dst_size, in.data() + pos, &src_size, NULL);
+      if (LZ4F_isError(ret)) break;
+      out.append(buf.data(), dst_size);
+      pos += src_size;
+      more = pos < in.size() || dst_size == buf.size();
+    }
+    LZ4F_freeDecompressionContext(dctx);
+    return ret == 0;
+  }
+#endif
+  return false;
+}
+
+// splits a decoded stream back into its events
+static bool parse_events(const std::string &raw, std::vector<LoggedEvent> &events) {
+  CHECK(raw.size() % sizeof(capnp::word) == 0, "stream of %zu bytes isn't whole words", raw.size());
+
+  // copied, so the words are aligned for the reader
+  kj::Array<capnp::word> words = kj::heapArray<capnp::word>(raw.size() / sizeof(capnp::word));
+  memcpy(words.begin(), raw.data(), raw.size());
+
+  kj::ArrayPtr<const capnp::word> rest(words.begin(), words.size());
+  while (rest.size() > 0) {
+    capnp::FlatArrayMessageReader reader(rest);
+    cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+    size_t len = (reader.getEnd() - rest.begin()) * sizeof(capnp::word);
+    events.push_back({event.getLogMonoTime(), (uint16_t)event.which(),
+                      std::string((const char*)rest.begin(), len)});
+    rest = kj::arrayPtr(reader.getEnd(), rest.end());
+  }
+  return true;
+}
+
+static bool check_log(const std::string &log_path, LogCodec codec, const std::vector<LoggedEvent> &logged) {
+  std::string comp, idx, raw;
+  CHECK(read_file(log_path, comp), "%s: missing", log_path.c_str());
+  CHECK(read_file(log_path + ".idx", idx), "%s.idx: missing", log_path.c_str());
+  CHECK(decompress(codec, comp, raw), "%s: doesn't decode", log_path.c_str());
+
+  // what went in comes out, in order, between the init data and the sentinels
+  std::vector<LoggedEvent> events;
+  if (!parse_events(raw, events)) return false;
+  size_t n = 0;
+  for (const auto &e : events) {
+    if (e.which == cereal::Event::INIT_DATA || e.which == cereal::Event::SENTINEL) continue;
+    CHECK(n < logged.size(), "%s: more events than were logged", log_path.c_str());
+    CHECK(e.data == logged[n].data, "%s: event %zu differs from the one logged", log_path.c_str(), n);
+    n++;
+  }
+  CHECK(n == logged.size(), "%s: %zu of %zu events", log_path.c_str(), n, logged.size());
+
+  LoggerIndexHeader header;
+  CHECK(idx.size() >= sizeof(header), "%s.idx: short", log_path.c_str());
+  memcpy(&header, idx.data(), sizeof(header));
+  CHECK(header.magic == LOGGER_INDEX_MAGIC && header.version == LOGGER_INDEX_VERSION,
+        "%s.idx: bad header", log_path.c_str());
+  CHECK(header.codec == codec, "%s.idx: codec %d, want %d", log_path.c_str(), header.codec, codec);
+  CHECK(header.block_len == sizeof(LoggerIndexBlock), "%s.idx: block_len %u", log_path.c_str(), header.block_len);
+  CHECK(idx.size() == sizeof(header) + (size_t)header.num_blocks * header.block_len,
+        "%s.idx: %zu bytes for %u blocks", log_path.c_str(), idx.size(), header.num_blocks);
+  CHECK(header.num_blocks > 0, "%s.idx: no blocks", log_path.c_str());
+
+  uint64_t offset = 0, raw_offset = 0;
+  for (uint32_t i = 0; i < header.num_blocks; i++) {
+    LoggerIndexBlock b;
+    memcpy(&b, idx.data() + sizeof(header) + i * header.block_len, sizeof(b));
+    CHECK(b.offset == offset && b.raw_offset == raw_offset, "%s.idx: block %u isn't where the last one ended",
+          log_path.c_str(), i);
+    CHECK(b.offset + b.size <= comp.size() && b.raw_offset + b.raw_size <= raw.size(),
+          "%s.idx: block %u runs past the end", log_path.c_str(), i);
+
+    std::string block_raw;
+    CHECK(decompress(codec, comp.substr(b.offset, b.size), block_raw), "%s: block %u doesn't decode on its own",
+          log_path.c_str(), i);
+    CHECK(block_raw == raw.substr(b.raw_offset, b.raw_size), "%s: block %u isn't its slice of the stream",
+          log_path.c_str(), i);
+
+    std::vector<LoggedEvent> block_events;
+    if (!parse_events(block_raw, block_events)) return false;
+    uint64_t min_mono_time = UINT64_MAX, max_mono_time = 0;
+    uint64_t services[LOGGER_INDEX_SERVICE_WORDS] = {};
+    for (const auto &e : block_events) {
+      min_mono_time = std::min(min_mono_time, e.mono_time);
+      max_mono_time = std::max(max_mono_time, e.mono_time);
+      if (e.which < LOGGER_INDEX_SERVICE_WORDS * 64) services[e.which / 64] |= 1ULL << (e.which % 64);
+    }
+    CHECK(b.events == block_events.size(), "%s.idx: block %u has %u events, decodes to %zu",
+          log_path.c_str(), i, b.events, block_events.size());
+    CHECK(b.min_mono_time == min_mono_time && b.max_mono_time == max_mono_time,
+          "%s.idx: block %u times [%llu, %llu], events are in [%llu, %llu]", log_path.c_str(), i,
+          (unsigned long long)b.min_mono_time, (unsigned long long)b.max_mono_time,
+          (unsigned long long)min_mono_time, (unsigned long long)max_mono_time);
+    CHECK(memcmp(b.services, services, sizeof(services)) == 0, "%s.idx: block %u services differ",
+          log_path.c_str(), i);
+
+    offset += b.size;
+    raw_offset += b.raw_size;
+  }
+  CHECK(offset == comp.size() && raw_offset == raw.size(), "%s.idx: blocks don't cover the log", log_path.c_str());
+  return true;
+}
+
+static LoggedEvent make_event(int i, uint64_t mono_time) {
+  MessageBuilder msg;
+  auto event = msg.initEvent();
+  // events reach loggerd slightly out of logMonoTime order
+  event.setLogMonoTime(i % 5 == 0 ? mono_time - 3000000 : mono_time);
+  if (i % 3 == 0) {
+    event.initCarState().setVEgo(i * 0.01);
+  } else {
+    // from a few bytes to a few kB, so blocks end at different events
+    std::string text(16 + (i * 7919) % 4000, 'a' + i % 26);
+    event.setLogMessage(text.c_str());
+  }
+  auto bytes = msg.toBytes();
+  return {event.getLogMonoTime(), (uint16_t)event.which(), std::string((const char*)bytes.begin(), bytes.size())};
+}
+
+static bool test_route(const char *codec_str, size_t queue_size, const std::string &root) {
+  LogCompressorConfig cfg;
+  if (!log_codec_parse(codec_str, &cfg)) {
+    printf("%s: not in this build, skipped\n", codec_str);
+    return true;
+  }
+
+  MessageBuilder init_msg;
+  init_msg.initEvent().initInitData();
+  auto init_bytes = init_msg.toBytes();
+
+  LoggerState s;
+  logger_init(&s, "rlog", init_bytes.begin(), init_bytes.size(), true, queue_size, LOGGER_QUEUE_BLOCK);
+  logger_set_codec(&s, &cfg, &cfg);
+
+  std::vector<Segment> segments;
+  uint64_t mono_time = 1000000000ULL;
+  for (int seg = 0; seg < SEGMENTS; seg++) {
+    char segment_path[4096];
+    int part;
+    CHECK(logger_next(&s, root.c_str(), segment_path, sizeof(segment_path), &part) == 0,
+          "%s: logger_next failed", codec_str);
+    CHECK(part == seg, "%s: part %d, want %d", codec_str, part, seg);
+
+    segments.push_back({segment_path});
+    for (int i = 0; i < EVENTS_PER_SEGMENT; i++) {
+      mono_time += 10000000;
+      LoggedEvent e = make_event(i, mono_time);
+      bool in_qlog = i % 10 == 0;
+      logger_log(&s, (uint8_t*)e.data.data(), e.data.size(), in_qlog);
+      if (in_qlog) segments.back().qlog.push_back(e);
+      segments.back().rlog.push_back(e);
+    }
+  }
+  logger_close(&s);
+
+  for (const auto &seg : segments) {
+    std::string ext = log_codec_ext(cfg.codec);
+    if (!check_log(seg.path + "/rlog." + ext, cfg.codec, seg.rlog)) return false;
+    if (!check_log(seg.path + "/qlog." + ext, cfg.codec, seg.qlog)) return false;
+  }
+  printf("%-10s queue %7zu: %d segments ok\n", codec_str, queue_size, SEGMENTS);
+  return true;
+}
+
+int main(int argc, char** argv) {
+  std::vector<const char*> codecs = {"bz2", "bz2:9:2", "zstd:3", "lz4"};
+  if (argc > 1) {
+    codecs.assign(argv + 1, argv + argc);
+  }
+
+  char tmp[] = "/tmp/test_logger_XXXXXX";
+  if (!mkdtemp(tmp)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  bool ok = true;
+  for (const char *codec : codecs) {
+    for (size_t queue_size : {(size_t)0, (size_t)QUEUE_SIZE}) {
+      std::string root = std::string(tmp) + "/" + codec + "_" + std::to_string(queue_size);
+      ok = test_route(codec, queue_size, root) && ok;
+    }
+  }
+
+  std::string rm = std::string("rm -rf ") + tmp;
+  if (system(rm.c_str()) != 0) {
+    printf("couldn't remove %s\n", tmp);
+  }
+  printf(ok ? "all logs ok\n" : "FAILED\n");
+  return ok ? 0 : 1;
+}
@@ -82,8 +82,15 @@ class Uploader():
     self.last_resp = None
     self.last_exc = None
 
-    self.immediate_priority = {"qlog.bz2": 0, "qcamera.ts": 1}
-    self.high_priority = {"rlog.bz2": 0, "fcamera.hevc": 1, "dcamera.hevc": 2, "ecamera.hevc": 3}
+    # the logs are .bz2, .zst or .lz4 depending on what loggerd compresses them with,
+    # the .idx side-car of a log goes right after it
+    self.immediate_priority = {"qcamera.ts": 2}
+    self.high_priority = {"fcamera.hevc": 2, "dcamera.hevc": 3, "ecamera.hevc": 4}
+    for ext in ["bz2", "zst", "lz4"]:
+      self.immediate_priority["qlog." + ext] = 0
+      self.immediate_priority["qlog." + ext + ".idx"] = 1
+      self.high_priority["rlog." + ext] = 0
+      self.high_priority["rlog." + ext + ".idx"] = 1
 
   def get_upload_sort(self, name):
     if name in self.immediate_priority:
@@ -133,7 +140,7 @@ class Uploader():
 
       # then upload other files
       for name, key, fn in upload_files:
-        if not name.endswith('.lock') and not name.endswith(".tmp"):
+        if not name.endswith('.lock') and not name.endswith(".tmp") and not name.endswith(".idx"):
           return (key, fn)
 
     return None